@@ -13,6 +13,28 @@ ORG 0x7C00
 ; define KERNEL_SECTORS (defined externally by makefile, since the size of the kernel cannot be known until after compilation)
 %include "bin/kernel_sectors.inc"
 
+; the kernel's framebuffer console has no VGA text mode to draw its characters, so we save the BIOS's 8x16 font pointer (segment:offset) here
+; this is in the free conventional memory right after the BIOS data area
+%define BIOS_FONT_POINTER_ADDRESS 0x500
+
+; boot timeline (see kernel/boot_timeline.h): we record the TSC at the end of each phase in a fixed table, which the kernel reports on
+; this is in the same free conventional memory, after the font pointer. the slot #s must match boot_timeline.h
+%define BOOT_TIMELINE_ADDRESS 0x600
+%define BOOT_PHASE_FIRMWARE 0
+%define BOOT_PHASE_A20 1
+%define BOOT_PHASE_PROTECTED_MODE 2
+%define BOOT_PHASE_KERNEL_LOAD 3
+
+; the ATA sector count register is only 8 bits, so the kernel gets read in chunks of at most this many sectors
+%define ATA_MAX_SECTORS_PER_READ 128
+
+; stores the TSC in a phase's slot (clobbers eax & edx)
+%macro record_boot_phase 1
+    rdtsc
+    mov [BOOT_TIMELINE_ADDRESS + (%1) * 8], eax
+    mov [BOOT_TIMELINE_ADDRESS + (%1) * 8 + 4], edx
+%endmacro
+
 ; in protected mode, we'll use gdt_entry_1 for code, and gdt_entry_2 for data
 ; these are the offsets into the GDT
 %define CODE_SEG 0x08
@@ -31,12 +53,25 @@ boot16:
     mov fs, ax ; (OS's generally use this for thread-specific memory) = 0
     mov gs, ax ; (same here) = 0
 
+    ; the firmware is done (ds is 0 now, so we can write to the timeline)
+    record_boot_phase BOOT_PHASE_FIRMWARE
+
     ; setup our stack
     mov ax, STACK_ADDRESS
     mov sp, ax
     
+    ; get the VGA BIOS's 8x16 font (int 0x10 returns it in es:bp)
+    mov ax, 0x1130
+    mov bh, 6
+    int 0x10
+    mov [BIOS_FONT_POINTER_ADDRESS], bp
+    mov [BIOS_FONT_POINTER_ADDRESS + 2], es
+    xor ax, ax
+    mov es, ax
+
     ; enable the A20 physical line so we have access to all memory
     call enable_a20_line
+    record_boot_phase BOOT_PHASE_A20
 
     ; load GDT into the GDTR (global descriptor table register), so that protected mode will know where to find it
     lgdt[gdt_descriptor] 
@@ -108,6 +143,7 @@ boot32:
     mov fs, ax
     mov gs, ax
     mov ss, ax
+    record_boot_phase BOOT_PHASE_PROTECTED_MODE
 
     ; print 'P' character, so we know we've entered protected mode OK
     mov ebx,0xb8000    ; The video address
@@ -120,20 +156,34 @@ boot32:
     mov ecx, KERNEL_SECTORS
     mov edi, KERNEL_ADDRESS
     call ata_lba_read ; loads kernel into memory
+    record_boot_phase BOOT_PHASE_KERNEL_LOAD
 
     ; jump to kernel, along with arguments from the bootloader
     push KERNEL_SECTORS ; # of sectors that the kernel takes up (a 32-bit int since this is 32-bit code)
     jmp KERNEL_ADDRESS ; jump to kernel
 
+; reads ecx sectors, starting at LBA eax, into edi. each read command covers 1 chunk of up to ATA_MAX_SECTORS_PER_READ sectors
 ata_lba_read:
-    ; send the highest 8 bits of the LBA to the HD controller
     mov ebx, eax ; backup LBA (logical block address)
+    mov esi, ecx ; total # of sectors left to read
+
+.next_chunk:
+    ; this chunk's # of sectors
+    mov ecx, esi
+    cmp ecx, ATA_MAX_SECTORS_PER_READ
+    jbe .send_command
+    mov ecx, ATA_MAX_SECTORS_PER_READ
+.send_command:
+    sub esi, ecx
+
+    ; send the highest 8 bits of the LBA to the HD controller
+    mov eax, ebx
     shr eax, 24
     or eax, 0xE0 ; select the master drive
     mov dx, 0x1F6 ; this is the port that use to talk to the HD controller
     out dx, al ; set port
     
-    ; send the total sectors to read to port 0x1F2
+    ; send the chunk's sectors to read to port 0x1F2
     mov eax, ecx 
     mov dx, 0x1F2
     out dx, al
@@ -154,13 +204,14 @@ ata_lba_read:
     mov eax, ebx ; restor the backup LBA
     shr eax, 16
     out dx, al
+    add ebx, ecx ; the next chunk starts right after this one
 
     ; ???
     mov dx, 0x1F7
     mov al, 0x20
     out dx, al
 
-    ; read all sectors into memory
+    ; read all of the chunk's sectors into memory
 .next_sector:
     push ecx
 
@@ -178,7 +229,9 @@ ata_lba_read:
     pop ecx ; restore ecx (total # of sectors to read)
     loop .next_sector ; loop while decrementing ecx
 
-    ; done
+    ; on to the next chunk, if there are any sectors left
+    test esi, esi
+    jnz .next_chunk
     ret
 
 ; string table
@@ -0,0 +1,56 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "boot_timeline.h"
+#include "drivers/vga_text.h" // for printing
+#include "interrupt/timer.h" // for the TSC frequency
+#include "process/cpu.h"
+#include "main.h" // for panic
+
+typedef struct phase {
+    const char *name;
+    uint64_t end; // TSC
+} phase_t;
+
+static const char *asm_phase_names[BOOT_PHASE_ASM_COUNT] = { "firmware", "a20", "protected_mode", "kernel_load", "kernel_entry", "long_mode" };
+static phase_t phases[BOOT_TIMELINE_MAX_PHASES];
+static size_t phase_count;
+
+// must be the 1st thing main does. records the boot sector's & start.asm's phases, and then "main" (i.e. start64 up to main)
+void boot_timeline_init() {
+    volatile uint64_t *asm_timestamps = (volatile uint64_t*)BOOT_TIMELINE_ADDRESS;
+    for( size_t i = 0; i < BOOT_PHASE_ASM_COUNT; i++ ) phases[i] = (phase_t){ .name = asm_phase_names[i], .end = asm_timestamps[i] };
+    phase_count = BOOT_PHASE_ASM_COUNT;
+    boot_timeline_mark( "main" );
+}
+
+// ends a phase of the kernel's startup (the BSP is the only CPU that calls this, so it needs no lock)
+void boot_timeline_mark( const char *phase ) {
+    if( phase_count == BOOT_TIMELINE_MAX_PHASES ) panic( "boot_timeline_mark: too many phases\n" );
+    phases[phase_count++] = (phase_t){ .name = phase, .end = cpu_read_timestamp() };
+}
+
+// every phase ran on the BSP, so its TSC never goes backwards
+void boot_timeline_run_tests() {
+    for( size_t i = 1; i < phase_count; i++ ) {
+        if( phases[i].end < phases[i - 1].end ) panic( "boot_timeline_run_tests: phase ended before the phase before it\n" );
+    }
+    if( 0 == phases[BOOT_PHASE_FIRMWARE].end ) panic( "boot_timeline_run_tests: boot sector didn't record its phases\n" );
+}
+
+// call after timer_init. the report is a line per phase, "boot_timeline phase=<name> cycles=<tsc cycles> microseconds=<n>", and then
+// "boot_timeline total_cycles=<tsc cycles> total_microseconds=<n>"
+void boot_timeline_print() {
+    uint64_t frequency = timer_get_frequency(), start = 0;
+    for( size_t i = 0; i < phase_count; i++ ) {
+        uint64_t cycles = phases[i].end - start;
+        vga_text_print( "boot_timeline phase=", 0x17 );
+        vga_text_print( phases[i].name, 0x17 );
+        vga_text_print_stat( " cycles=", cycles );
+        vga_text_print_stat( " microseconds=", cycles * 1000000 / frequency );
+        vga_text_print( "\n", 0x17 );
+        start = phases[i].end;
+    }
+    vga_text_print_stat( "boot_timeline total_cycles=", start );
+    vga_text_print_stat( " total_microseconds=", start * 1000000 / frequency );
+    vga_text_print( "\n", 0x17 );
+}
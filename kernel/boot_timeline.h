@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// TSC timestamps of each boot phase, from the boot sector to the main loop, for finding where startup time goes
+// the boot sector & start.asm can't call into the kernel, so they store their timestamps in a fixed table in low memory (one 64-bit slot
+// per phase, w/ the slot #s below), which boot_timeline_init copies. each phase lasts from the end of the phase before it, and the
+// 1st phase ("firmware") lasts from reset (when the TSC is 0) until the boot sector runs
+#define BOOT_TIMELINE_ADDRESS 0x600 // must match boot.asm & start.asm (free conventional memory, after the BIOS font pointer)
+#define BOOT_PHASE_FIRMWARE 0 // reset to boot sector
+#define BOOT_PHASE_A20 1 // real mode setup (the BIOS font & A20)
+#define BOOT_PHASE_PROTECTED_MODE 2
+#define BOOT_PHASE_KERNEL_LOAD 3 // reading the kernel from disk w/ ata_lba_read
+#define BOOT_PHASE_KERNEL_ENTRY 4
+#define BOOT_PHASE_LONG_MODE 5 // the boot pagemap & the switch to long mode
+#define BOOT_PHASE_ASM_COUNT 6
+#define BOOT_TIMELINE_MAX_PHASES 64
+
+void boot_timeline_init();
+void boot_timeline_mark( const char *phase );
+void boot_timeline_run_tests();
+void boot_timeline_print();
@@ -1,13 +1,28 @@
 #include "buffer.h"
 
+// rep stosq/movsq are fast on modern CPUs (which move whole cache lines at a time internally)
+// note: these rely on the direction flag being clear, which the System V ABI guarantees on function entry
 void buffer_set_qwords( uint64_t *buffer, uint64_t value, size_t count ) {
-    while( count > 0 ) {
-        *buffer = value;
-        buffer++;
-        count--;
-    }
+    asm volatile( "rep stosq" : "+D" (buffer), "+c" (count) : "a" (value) : "memory" );
 }
 
 void buffer_clear_qwords( uint64_t *buffer, size_t count ) { 
     buffer_set_qwords( buffer, 0, count );
 }
+
+// like buffer_clear_qwords, but w/ non-temporal stores (movnti), which go around the cache, so clearing memory that won't be read
+// for a while doesn't evict anything. movnti only uses general-purpose registers, so this is fine w/ interrupts enabled
+void buffer_stream_clear_qwords( uint64_t *buffer, size_t count ) {
+    if( 0 == count ) return;
+    asm volatile(
+        "1: movnti %[zero], (%[buffer])\n\t"
+        "add $8, %[buffer]\n\t"
+        "dec %[count]\n\t"
+        "jnz 1b\n\t"
+        "sfence" // non-temporal stores are weakly ordered, so make them visible before anyone else can get the memory
+        : [buffer] "+r" (buffer), [count] "+r" (count) : [zero] "r" ((uint64_t)0) : "memory" );
+}
+
+void buffer_copy_qwords( uint64_t *destination, const uint64_t *source, size_t count ) {
+    asm volatile( "rep movsq" : "+D" (destination), "+S" (source), "+c" (count) :: "memory" );
+}
@@ -5,3 +5,12 @@
 
 void buffer_set_qwords( uint64_t *buffer, uint64_t value, size_t count );
 void buffer_clear_qwords( uint64_t *buffer, size_t count );
+void buffer_stream_clear_qwords( uint64_t *buffer, size_t count );
+void buffer_copy_qwords( uint64_t *destination, const uint64_t *source, size_t count );
+
+// SSE2 (see buffer_simd.asm): rows must be 16-byte aligned & a multiple of 16 bytes long, and callers must have interrupts disabled
+// (XMM registers aren't saved on interrupts). they preserve the XMM registers they use, so they're safe to call while user code's
+// SSE state is live, but not from code that's itself using SSE
+void buffer_simd_copy_rectangle( void *destination, size_t destination_stride, const void *source, size_t source_stride, size_t row_size, size_t rows );
+void buffer_simd_stream_rectangle( void *destination, size_t destination_stride, const void *source, size_t source_stride, size_t row_size, size_t rows );
+void buffer_simd_fill_rectangle( void *destination, size_t stride, uint32_t value, size_t row_size, size_t rows );
@@ -0,0 +1,118 @@
+; tell linker to put this into the assembly section
+section .asm
+
+; 64-bit code
+[BITS 64]
+
+; exports
+global buffer_simd_copy_rectangle
+global buffer_simd_stream_rectangle
+global buffer_simd_fill_rectangle
+
+; SSE2 rectangle operations, for blitting into & out of the framebuffer console's back buffer
+; every row must be 16-byte aligned, and row sizes must be a multiple of 16 bytes (the inner loop moves 64 bytes at a time, w/ a 16-byte tail)
+; nothing saves XMM registers on interrupts or context switches (see cpu_enable_sse), so callers must keep interrupts disabled, &
+; these save the XMM registers they use on the stack & restore them before returning, so whatever user code had in them survives
+; (e.g. when a syscall or an interrupt prints to the console)
+
+; saves xmm0-xmm3 below the return address
+%macro SAVE_XMM0_3 0
+    sub rsp, 64
+    movdqu [rsp], xmm0
+    movdqu [rsp + 16], xmm1
+    movdqu [rsp + 32], xmm2
+    movdqu [rsp + 48], xmm3
+%endmacro
+
+%macro RESTORE_XMM0_3 0
+    movdqu xmm0, [rsp]
+    movdqu xmm1, [rsp + 16]
+    movdqu xmm2, [rsp + 32]
+    movdqu xmm3, [rsp + 48]
+    add rsp, 64
+%endmacro
+
+; copies rows front-to-back & first-to-last, so overlapping copies work as long as the destination is below the source (e.g. scrolling up)
+; %1 = name, %2 = store instruction
+%macro COPY_RECTANGLE 2
+; void %1( void *destination, size_t destination_stride, const void *source, size_t source_stride, size_t row_size, size_t rows )
+%1:
+    SAVE_XMM0_3
+    test r9, r9
+    jz %%done
+    mov r10, r8
+    and r10, ~63 ; part of the row that the 64-byte loop handles
+%%next_row:
+    xor eax, eax ; offset into the row
+%%block:
+    cmp rax, r10
+    jae %%tail
+    movdqa xmm0, [rdx + rax]
+    movdqa xmm1, [rdx + rax + 16]
+    movdqa xmm2, [rdx + rax + 32]
+    movdqa xmm3, [rdx + rax + 48]
+    %2 [rdi + rax], xmm0
+    %2 [rdi + rax + 16], xmm1
+    %2 [rdi + rax + 32], xmm2
+    %2 [rdi + rax + 48], xmm3
+    add rax, 64
+    jmp %%block
+%%tail:
+    cmp rax, r8
+    jae %%row_done
+    movdqa xmm0, [rdx + rax]
+    %2 [rdi + rax], xmm0
+    add rax, 16
+    jmp %%tail
+%%row_done:
+    add rdi, rsi
+    add rdx, rcx
+    dec r9
+    jnz %%next_row
+%%done:
+    sfence ; non-temporal stores are weakly ordered, so make them visible before we return (harmless for regular stores)
+    RESTORE_XMM0_3
+    ret
+%endmacro
+
+; regular stores, for copies that stay in cacheable memory (e.g. glyphs into the back buffer, scrolling the back buffer)
+COPY_RECTANGLE buffer_simd_copy_rectangle, movdqa
+
+; non-temporal stores, for copies to memory that we won't read back (e.g. flushing the back buffer to the write-combining framebuffer)
+COPY_RECTANGLE buffer_simd_stream_rectangle, movntdq
+
+; void buffer_simd_fill_rectangle( void *destination, size_t stride, uint32_t value, size_t row_size, size_t rows )
+buffer_simd_fill_rectangle:
+    sub rsp, 16 ; save xmm0
+    movdqu [rsp], xmm0
+    test r8, r8
+    jz .done
+    movd xmm0, edx
+    pshufd xmm0, xmm0, 0 ; broadcast the 32-bit value to all 4 lanes
+    mov r10, rcx
+    and r10, ~63
+.next_row:
+    xor eax, eax
+.block:
+    cmp rax, r10
+    jae .tail
+    movdqa [rdi + rax], xmm0
+    movdqa [rdi + rax + 16], xmm0
+    movdqa [rdi + rax + 32], xmm0
+    movdqa [rdi + rax + 48], xmm0
+    add rax, 64
+    jmp .block
+.tail:
+    cmp rax, rcx
+    jae .row_done
+    movdqa [rdi + rax], xmm0
+    add rax, 16
+    jmp .tail
+.row_done:
+    add rdi, rsi
+    dec r8
+    jnz .next_row
+.done:
+    movdqu xmm0, [rsp]
+    add rsp, 16
+    ret
@@ -1,15 +1,18 @@
 #include <stdbool.h>
 #include "string.h"
 #include "../main.h"
+#include "../process/cpu.h" // for per-CPU buffers
 
 // temporary buffer just enough to hold a 64-bit integer (up to 19 digits), plus a sign and a null terminator
+// there's 1 per CPU, so CPUs don't clobber each other's results (but an interrupt handler on the same CPU still can)
 #define TEMP_LENGTH 21
-static char temp[TEMP_LENGTH];
+static char temps[CPU_MAX_COUNT][TEMP_LENGTH];
 
 char *string_from_int64( int64_t n ) {
     // always treat integers as negative (b/c range of negative integers is 1 greater than positive integers)
     bool is_positive = n >= 0;
     if( is_positive ) n = -n;
+    char *temp = temps[cpu_get_index()];
 
     // write null terminator
     temp[TEMP_LENGTH - 1] = 0;
@@ -0,0 +1,390 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "acpi.h"
+#include "../buffer/string.h" // for printing
+#include "../drivers/vga_text.h" // "
+#include "../process/cpu.h" // for the tests
+#include "../main.h" // for panic
+
+#define ACPI_MAX_ADDRESS 0x40000000 // the boot pagemap only maps the 1st GB, so tables above it are out of reach
+#define EBDA_SEGMENT_ADDRESS 0x40E // the BIOS data area holds the extended BIOS data area's real mode segment here
+#define EBDA_SEARCH_SIZE 0x400 // the RSDP is in the EBDA's 1st KB...
+#define BIOS_AREA_START 0xE0000 // ...or in the BIOS's read-only area
+#define BIOS_AREA_END 0x100000
+#define RSDP_ALIGNMENT 16
+#define RSDP_V1_SIZE 20
+
+// entry types
+#define MADT_LOCAL_APIC 0
+#define MADT_IO_APIC 1
+#define MADT_INTERRUPT_OVERRIDE 2
+#define MADT_LOCAL_X2APIC 9
+#define SRAT_LOCAL_APIC 0
+#define SRAT_MEMORY 1
+#define SRAT_LOCAL_X2APIC 2
+
+#define MADT_CPU_ENABLED (1 << 0)
+#define MADT_CPU_ONLINE_CAPABLE (1 << 1) // disabled, but may be enabled later (i.e. hot-pluggable), so we don't count it
+#define SRAT_ENABLED (1 << 0)
+
+typedef struct rsdp {
+    char signature[8]; // "RSD PTR "
+    uint8_t checksum; // covers the 1st 20 bytes (i.e. the ACPI 1.0 structure)
+    char oem_id[6];
+    uint8_t revision; // 0 for ACPI 1.0, 2 for ACPI 2.0+ (which adds the XSDT)
+    uint32_t rsdt_address;
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum; // covers all of it
+    uint8_t reserved[3];
+} __attribute__((packed)) rsdp_t;
+
+typedef struct sdt_header {
+    char signature[4];
+    uint32_t length; // including the header
+    uint8_t revision, checksum;
+    char oem_id[6], oem_table_id[8];
+    uint32_t oem_revision, creator_id, creator_revision;
+} __attribute__((packed)) sdt_header_t;
+
+// the MADT & SRAT are a fixed part followed by variable-length entries, which all start w/ this
+typedef struct entry_header {
+    uint8_t type, length;
+} __attribute__((packed)) entry_header_t;
+
+typedef struct madt {
+    sdt_header_t header;
+    uint32_t local_apic_address, flags;
+} __attribute__((packed)) madt_t;
+
+typedef struct madt_local_apic {
+    entry_header_t header;
+    uint8_t processor_id, apic_id;
+    uint32_t flags;
+} __attribute__((packed)) madt_local_apic_t;
+
+typedef struct madt_io_apic {
+    entry_header_t header;
+    uint8_t id, reserved;
+    uint32_t address, gsi_base;
+} __attribute__((packed)) madt_io_apic_t;
+
+typedef struct madt_interrupt_override {
+    entry_header_t header;
+    uint8_t bus, irq; // bus is always 0 (ISA)
+    uint32_t gsi;
+    uint16_t flags;
+} __attribute__((packed)) madt_interrupt_override_t;
+
+typedef struct madt_local_x2apic {
+    entry_header_t header;
+    uint16_t reserved;
+    uint32_t apic_id, flags, processor_uid;
+} __attribute__((packed)) madt_local_x2apic_t;
+
+typedef struct srat {
+    sdt_header_t header;
+    uint32_t reserved1;
+    uint64_t reserved2;
+} __attribute__((packed)) srat_t;
+
+typedef struct srat_local_apic {
+    entry_header_t header;
+    uint8_t domain_low, apic_id; // the domain is split, since ACPI 1.0 only had 8 bits for it
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t domain_high[3];
+    uint32_t clock_domain;
+} __attribute__((packed)) srat_local_apic_t;
+
+typedef struct srat_memory {
+    entry_header_t header;
+    uint32_t domain;
+    uint16_t reserved1;
+    uint64_t base, length;
+    uint32_t reserved2, flags;
+    uint64_t reserved3;
+} __attribute__((packed)) srat_memory_t;
+
+typedef struct srat_local_x2apic {
+    entry_header_t header;
+    uint16_t reserved1;
+    uint32_t domain, apic_id, flags, clock_domain, reserved2;
+} __attribute__((packed)) srat_local_x2apic_t;
+
+typedef struct slit {
+    sdt_header_t header;
+    uint64_t locality_count;
+    uint8_t distances[]; // locality_count x locality_count, indexed by proximity domain
+} __attribute__((packed)) slit_t;
+
+static bool present;
+static uint32_t cpu_apic_ids[ACPI_MAX_CPUS];
+static size_t cpu_count;
+static acpi_io_apic_t io_apics[ACPI_MAX_IO_APICS];
+static size_t io_apic_count;
+static uint32_t isa_irq_gsis[ACPI_ISA_IRQ_COUNT];
+static uint16_t isa_irq_flags[ACPI_ISA_IRQ_COUNT];
+
+// nodes are numbered densely, in the order the SRAT mentions their proximity domains
+static uint32_t node_domains[ACPI_MAX_NODES];
+static size_t node_count;
+static uint8_t node_by_apic_id[ACPI_MAX_CPUS];
+static uint8_t distances[ACPI_MAX_NODES][ACPI_MAX_NODES];
+static acpi_memory_range_t memory_ranges[ACPI_MAX_MEMORY_RANGES];
+static size_t memory_range_count;
+
+static bool is_reachable( uint64_t address, uint64_t size ) {
+    return 0 != address && address < ACPI_MAX_ADDRESS && size <= ACPI_MAX_ADDRESS - address;
+}
+
+static bool has_valid_checksum( const void *data, size_t size ) {
+    uint8_t sum = 0;
+    for( size_t i = 0; i < size; i++ ) sum+= ((const uint8_t*)data)[i];
+    return 0 == sum;
+}
+
+static bool has_signature( const char *signature, const char *expected, size_t size ) {
+    for( size_t i = 0; i < size; i++ ) {
+        if( signature[i] != expected[i] ) return false;
+    }
+    return true;
+}
+
+static rsdp_t *search_for_rsdp( uint64_t start, uint64_t end ) {
+    for( uint64_t address = start; address + sizeof( rsdp_t ) <= end; address+= RSDP_ALIGNMENT ) {
+        rsdp_t *rsdp = (rsdp_t*)address;
+        if( !has_signature( rsdp->signature, "RSD PTR ", 8 ) || !has_valid_checksum( rsdp, RSDP_V1_SIZE ) ) continue;
+        if( rsdp->revision >= 2 && !has_valid_checksum( rsdp, rsdp->length ) ) continue;
+        return rsdp;
+    }
+    return NULL;
+}
+
+static rsdp_t *find_rsdp() {
+    uint64_t ebda = (uint64_t)*(volatile uint16_t*)EBDA_SEGMENT_ADDRESS << 4;
+    rsdp_t *rsdp = 0 != ebda ? search_for_rsdp( ebda, ebda + EBDA_SEARCH_SIZE ) : NULL;
+    return NULL != rsdp ? rsdp : search_for_rsdp( BIOS_AREA_START, BIOS_AREA_END );
+}
+
+// returns NULL if the table is out of reach or corrupt
+static sdt_header_t *get_table( uint64_t address ) {
+    if( !is_reachable( address, sizeof( sdt_header_t ) ) ) return NULL;
+    sdt_header_t *header = (sdt_header_t*)address;
+    if( header->length < sizeof( sdt_header_t ) || !is_reachable( address, header->length ) ) return NULL;
+    return has_valid_checksum( header, header->length ) ? header : NULL;
+}
+
+// searches the XSDT (or the RSDT, before ACPI 2.0), whose entries are 64-bit (or 32-bit) table addresses after the header
+static sdt_header_t *find_table( rsdp_t *rsdp, const char *signature ) {
+    bool extended = rsdp->revision >= 2 && NULL != get_table( rsdp->xsdt_address );
+    sdt_header_t *root = get_table( extended ? rsdp->xsdt_address : rsdp->rsdt_address );
+    if( NULL == root ) return NULL;
+    size_t entry_size = extended ? sizeof( uint64_t ) : sizeof( uint32_t ), count = (root->length - sizeof( sdt_header_t )) / entry_size;
+    uint8_t *entries = (uint8_t*)(root + 1);
+    for( size_t i = 0; i < count; i++ ) {
+        uint64_t address = extended ? *(uint64_t*)(entries + i * entry_size) : *(uint32_t*)(entries + i * entry_size);
+        sdt_header_t *table = get_table( address );
+        if( NULL != table && has_signature( table->signature, signature, 4 ) ) return table;
+    }
+    return NULL;
+}
+
+// calls visit on each of the table's entries, which start at offset
+static void for_each_entry( sdt_header_t *table, size_t offset, void (*visit)( entry_header_t *entry ) ) {
+    uint8_t *entry = (uint8_t*)table + offset, *end = (uint8_t*)table + table->length;
+    while( entry + sizeof( entry_header_t ) <= end ) {
+        entry_header_t *header = (entry_header_t*)entry;
+        if( header->length < sizeof( entry_header_t ) || entry + header->length > end ) return; // corrupt
+        visit( header );
+        entry+= header->length;
+    }
+}
+
+static void add_cpu( uint32_t apic_id ) {
+    if( cpu_count < ACPI_MAX_CPUS ) cpu_apic_ids[cpu_count] = apic_id;
+    cpu_count++;
+}
+
+static void visit_madt_entry( entry_header_t *entry ) {
+    if( MADT_LOCAL_APIC == entry->type && entry->length >= sizeof( madt_local_apic_t ) ) {
+        madt_local_apic_t *cpu = (madt_local_apic_t*)entry;
+        if( cpu->flags & MADT_CPU_ENABLED ) add_cpu( cpu->apic_id );
+    } else if( MADT_LOCAL_X2APIC == entry->type && entry->length >= sizeof( madt_local_x2apic_t ) ) {
+        madt_local_x2apic_t *cpu = (madt_local_x2apic_t*)entry;
+        if( cpu->flags & MADT_CPU_ENABLED ) add_cpu( cpu->apic_id );
+    } else if( MADT_IO_APIC == entry->type && entry->length >= sizeof( madt_io_apic_t ) && io_apic_count < ACPI_MAX_IO_APICS ) {
+        madt_io_apic_t *io_apic = (madt_io_apic_t*)entry;
+        io_apics[io_apic_count++] = (acpi_io_apic_t){ .id = io_apic->id, .address = io_apic->address, .gsi_base = io_apic->gsi_base };
+    } else if( MADT_INTERRUPT_OVERRIDE == entry->type && entry->length >= sizeof( madt_interrupt_override_t ) ) {
+        madt_interrupt_override_t *override = (madt_interrupt_override_t*)entry;
+        if( override->irq < ACPI_ISA_IRQ_COUNT ) {
+            isa_irq_gsis[override->irq] = override->gsi;
+            isa_irq_flags[override->irq] = override->flags;
+        }
+    }
+}
+
+// returns the node for a proximity domain, adding it if it's new
+static size_t get_node( uint32_t domain ) {
+    for( size_t i = 0; i < node_count; i++ ) {
+        if( node_domains[i] == domain ) return i;
+    }
+    if( node_count == ACPI_MAX_NODES ) return 0;
+    node_domains[node_count] = domain;
+    return node_count++;
+}
+
+static void visit_srat_entry( entry_header_t *entry ) {
+    if( SRAT_LOCAL_APIC == entry->type && entry->length >= sizeof( srat_local_apic_t ) ) {
+        srat_local_apic_t *cpu = (srat_local_apic_t*)entry;
+        uint32_t domain = cpu->domain_low | (cpu->domain_high[0] << 8) | (cpu->domain_high[1] << 16) | ((uint32_t)cpu->domain_high[2] << 24);
+        if( cpu->flags & SRAT_ENABLED ) node_by_apic_id[cpu->apic_id] = get_node( domain );
+    } else if( SRAT_LOCAL_X2APIC == entry->type && entry->length >= sizeof( srat_local_x2apic_t ) ) {
+        srat_local_x2apic_t *cpu = (srat_local_x2apic_t*)entry;
+        if( (cpu->flags & SRAT_ENABLED) && cpu->apic_id < ACPI_MAX_CPUS ) node_by_apic_id[cpu->apic_id] = get_node( cpu->domain );
+    } else if( SRAT_MEMORY == entry->type && entry->length >= sizeof( srat_memory_t ) ) {
+        srat_memory_t *memory = (srat_memory_t*)entry;
+        if( !(memory->flags & SRAT_ENABLED) || 0 == memory->length || memory_range_count == ACPI_MAX_MEMORY_RANGES ) return;
+        memory_ranges[memory_range_count++] = (acpi_memory_range_t){
+            .start = memory->base, .end = memory->base + memory->length, .node = get_node( memory->domain )
+        };
+    }
+}
+
+static void parse_slit( slit_t *slit ) {
+    uint64_t count = slit->locality_count;
+    if( sizeof( slit_t ) + count * count > slit->header.length ) return; // corrupt
+    for( size_t from = 0; from < node_count; from++ ) {
+        for( size_t to = 0; to < node_count; to++ ) {
+            if( node_domains[from] < count && node_domains[to] < count ) distances[from][to] = slit->distances[node_domains[from] * count + node_domains[to]];
+        }
+    }
+}
+
+// call before the page allocator hands out any memory (which may hold the tables), while the boot pagemap still maps the 1st GB
+void acpi_init() {
+    // defaults for a machine w/o ACPI: 1 node, & ISA IRQs wired straight to the same GSIs
+    for( size_t i = 0; i < ACPI_ISA_IRQ_COUNT; i++ ) isa_irq_gsis[i] = i;
+    for( size_t from = 0; from < ACPI_MAX_NODES; from++ ) {
+        for( size_t to = 0; to < ACPI_MAX_NODES; to++ ) distances[from][to] = from == to ? ACPI_LOCAL_DISTANCE : ACPI_REMOTE_DISTANCE;
+    }
+    node_count = 1;
+
+    rsdp_t *rsdp = find_rsdp();
+    if( NULL == rsdp ) {
+        vga_text_print( "acpi: no tables found\n", 0x17 );
+        return;
+    }
+    present = true;
+
+    sdt_header_t *madt = find_table( rsdp, "APIC" );
+    if( NULL != madt ) for_each_entry( madt, sizeof( madt_t ), visit_madt_entry );
+
+    // the SRAT numbers the nodes, so the SLIT must come after it
+    sdt_header_t *srat = find_table( rsdp, "SRAT" );
+    if( NULL != srat ) {
+        node_count = 0;
+        for_each_entry( srat, sizeof( srat_t ), visit_srat_entry );
+        if( 0 == node_count ) node_count = 1;
+        sdt_header_t *slit = find_table( rsdp, "SLIT" );
+        if( NULL != slit ) parse_slit( (slit_t*)slit );
+    }
+
+    vga_text_print( "acpi: ", 0x17 );
+    vga_text_print( string_from_int64( (int64_t)cpu_count ), 0x17 );
+    vga_text_print( " CPUs, ", 0x17 );
+    vga_text_print( string_from_int64( (int64_t)io_apic_count ), 0x17 );
+    vga_text_print( " IO-APICs, ", 0x17 );
+    vga_text_print( string_from_int64( (int64_t)node_count ), 0x17 );
+    vga_text_print( " NUMA nodes\n", 0x17 );
+}
+
+bool acpi_is_present() {
+    return present;
+}
+
+// # of enabled CPUs in the MADT (0 w/o ACPI), which may be more than CPU_MAX_COUNT
+size_t acpi_get_cpu_count() {
+    return cpu_count;
+}
+
+uint32_t acpi_get_cpu_apic_id( size_t index ) {
+    return cpu_apic_ids[index];
+}
+
+// CPUs that the SRAT doesn't mention are on node 0
+size_t acpi_get_cpu_node( uint32_t apic_id ) {
+    return apic_id < ACPI_MAX_CPUS ? node_by_apic_id[apic_id] : 0;
+}
+
+size_t acpi_get_io_apic_count() {
+    return io_apic_count;
+}
+
+const acpi_io_apic_t *acpi_get_io_apic( size_t index ) {
+    return &io_apics[index];
+}
+
+// the GSI that an ISA IRQ is wired to, & its override flags (0 means the ISA defaults: active high & edge-triggered)
+uint32_t acpi_get_isa_irq_gsi( uint8_t irq, uint16_t *flags ) {
+    if( NULL != flags ) *flags = irq < ACPI_ISA_IRQ_COUNT ? isa_irq_flags[irq] : 0;
+    return irq < ACPI_ISA_IRQ_COUNT ? isa_irq_gsis[irq] : irq;
+}
+
+// always at least 1
+size_t acpi_get_node_count() {
+    return node_count;
+}
+
+size_t acpi_get_distance( size_t from_node, size_t to_node ) {
+    return distances[from_node][to_node];
+}
+
+// enabled SRAT memory ranges (none w/o an SRAT, in which case all memory is on node 0)
+size_t acpi_get_memory_range_count() {
+    return memory_range_count;
+}
+
+const acpi_memory_range_t *acpi_get_memory_range( size_t index ) {
+    return &memory_ranges[index];
+}
+
+static bool is_listed_cpu( uint32_t apic_id ) {
+    for( size_t i = 0; i < cpu_count && i < ACPI_MAX_CPUS; i++ ) {
+        if( cpu_apic_ids[i] == apic_id ) return true;
+    }
+    return false;
+}
+
+// call after smp_init, so every CPU is online
+void acpi_run_tests() {
+    // every CPU that came up is one the MADT told us about
+    if( present && 0 != cpu_count ) {
+        if( cpu_count < cpu_get_count() ) panic( "acpi_run_tests: more CPUs came up than the MADT lists\n" );
+        for( size_t i = 0; i < CPU_MAX_COUNT; i++ ) {
+            if( cpu_is_online( i ) && !is_listed_cpu( cpu_get_apic_id( i ) ) ) panic( "acpi_run_tests: online CPU is missing from the MADT\n" );
+        }
+    }
+
+    // every node is closest to itself, & every CPU is on a node
+    if( 0 == node_count || node_count > ACPI_MAX_NODES ) panic( "acpi_run_tests: bad node count\n" );
+    for( size_t from = 0; from < node_count; from++ ) {
+        if( ACPI_LOCAL_DISTANCE != distances[from][from] ) panic( "acpi_run_tests: node's distance to itself isn't 10\n" );
+        for( size_t to = 0; to < node_count; to++ ) {
+            if( distances[from][to] < ACPI_LOCAL_DISTANCE ) panic( "acpi_run_tests: remote node is closer than the local one\n" );
+        }
+    }
+    for( size_t i = 0; i < CPU_MAX_COUNT; i++ ) {
+        if( cpu_is_online( i ) && acpi_get_cpu_node( cpu_get_apic_id( i ) ) >= node_count ) panic( "acpi_run_tests: CPU is on a bad node\n" );
+    }
+
+    // memory ranges don't overlap
+    for( size_t i = 0; i < memory_range_count; i++ ) {
+        if( memory_ranges[i].node >= node_count ) panic( "acpi_run_tests: memory is on a bad node\n" );
+        for( size_t j = i + 1; j < memory_range_count; j++ ) {
+            if( memory_ranges[i].start < memory_ranges[j].end && memory_ranges[j].start < memory_ranges[i].end ) panic( "acpi_run_tests: memory ranges overlap\n" );
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// machine topology from the firmware's ACPI tables: the MADT lists the CPUs & IO-APICs, the SRAT assigns CPUs & memory ranges to
+// NUMA nodes (the ACPI spec calls them proximity domains), and the SLIT gives the relative cost of accessing each node from each other
+// node. everything is copied out during acpi_init, since the tables live in RAM that the page allocator later hands out
+// w/o ACPI (or w/o an SRAT), the machine is a single node that holds all of memory
+#define ACPI_MAX_CPUS 256 // xAPIC IDs are 8 bits
+#define ACPI_MAX_IO_APICS 8
+#define ACPI_MAX_NODES 8 // proximity domains past this are folded into node 0
+#define ACPI_MAX_MEMORY_RANGES 16
+#define ACPI_ISA_IRQ_COUNT 16
+
+// SLIT distances: a node's distance to itself is always 10, so 20 means twice as slow
+#define ACPI_LOCAL_DISTANCE 10
+#define ACPI_REMOTE_DISTANCE 20 // the default for every other node, w/o a SLIT
+
+// interrupt source override flags (polarity in bits 0-1, trigger mode in bits 2-3)
+#define ACPI_IRQ_POLARITY_MASK 0x3
+#define ACPI_IRQ_POLARITY_ACTIVE_LOW 0x3
+#define ACPI_IRQ_TRIGGER_MASK 0xC
+#define ACPI_IRQ_TRIGGER_LEVEL 0xC
+
+typedef struct acpi_io_apic {
+    uint32_t id;
+    uint32_t address; // physical address of the registers
+    uint32_t gsi_base; // 1st global system interrupt (i.e. IO-APIC input #0)
+} acpi_io_apic_t;
+
+typedef struct acpi_memory_range {
+    uint64_t start, end; // physical addresses (end is exclusive)
+    size_t node;
+} acpi_memory_range_t;
+
+void acpi_init();
+bool acpi_is_present();
+size_t acpi_get_cpu_count();
+uint32_t acpi_get_cpu_apic_id( size_t index );
+size_t acpi_get_cpu_node( uint32_t apic_id );
+size_t acpi_get_io_apic_count();
+const acpi_io_apic_t *acpi_get_io_apic( size_t index );
+uint32_t acpi_get_isa_irq_gsi( uint8_t irq, uint16_t *flags );
+size_t acpi_get_node_count();
+size_t acpi_get_distance( size_t from_node, size_t to_node );
+size_t acpi_get_memory_range_count();
+const acpi_memory_range_t *acpi_get_memory_range( size_t index );
+void acpi_run_tests();
@@ -0,0 +1,163 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../interrupt/io.h"
+#include "../memory/paging.h"
+#include "../memory/kernel_heap.h"
+#include "../memory/hash_table.h" // for hash_table_hash_uint64
+#include "../buffer/buffer.h"
+#include "pci.h"
+#include "framebuffer.h"
+
+// Bochs VBE extensions ("DISPI"), see https://wiki.osdev.org/Bochs_VBE_Extensions
+#define DISPI_INDEX_PORT 0x1CE
+#define DISPI_DATA_PORT 0x1CF
+#define DISPI_INDEX_ID 0
+#define DISPI_INDEX_XRES 1
+#define DISPI_INDEX_YRES 2
+#define DISPI_INDEX_BPP 3
+#define DISPI_INDEX_ENABLE 4
+#define DISPI_ID_MINIMUM 0xB0C0
+#define DISPI_ID_MAXIMUM 0xB0CF
+#define DISPI_ENABLED 0x01
+#define DISPI_LFB_ENABLED 0x40
+#define DISPI_BPP 32
+
+// the display adapter's 1st BAR is the framebuffer
+#define BOCHS_DISPLAY_VENDOR_ID 0x1234
+#define BOCHS_DISPLAY_DEVICE_ID 0x1111
+
+#define BIOS_FONT_POINTER_ADDRESS 0x500 // must match boot/boot.asm
+#define PITCH (FRAMEBUFFER_WIDTH * sizeof( uint32_t ))
+#define FRAMEBUFFER_SIZE (PITCH * FRAMEBUFFER_HEIGHT)
+#define GLYPH_CACHE_LENGTH 1024 // must be a power of 2
+#define GLYPH_EMPTY 0xFFFFFFFF
+
+// a character pre-rendered in one color combination, so drawing it is just a 16-row blit
+typedef struct glyph {
+    uint32_t key; // (attribute << 8) | character, or GLYPH_EMPTY
+    uint32_t pixels[FRAMEBUFFER_GLYPH_HEIGHT][FRAMEBUFFER_GLYPH_WIDTH] __attribute__((aligned(16)));
+} glyph_t;
+
+// the 16 VGA text mode colors, as 0x00RRGGBB
+static const uint32_t palette[16] = {
+    0x000000, 0x0000AA, 0x00AA00, 0x00AAAA, 0xAA0000, 0xAA00AA, 0xAA5500, 0xAAAAAA,
+    0x555555, 0x5555FF, 0x55FF55, 0x55FFFF, 0xFF5555, 0xFF55FF, 0xFFFF55, 0xFFFFFF
+};
+
+// globals
+static bool enabled;
+static uint32_t *framebuffer; // write-combining, so we never read it, & only write it in whole rows of the dirty rectangle
+static uint32_t *back_buffer; // everything draws here first
+static const uint8_t *font; // 16 bytes per character, 1 bit per pixel w/ the leftmost pixel in the top bit
+static glyph_t *glyph_cache; // direct-mapped, since the same few color combinations get used over & over
+static struct { size_t left, top, right, bottom; } dirty; // part of the back buffer that the framebuffer doesn't have yet (empty if left >= right)
+
+static uint16_t dispi_read( uint16_t index ) {
+    io_write_word( DISPI_INDEX_PORT, index );
+    return io_read_word( DISPI_DATA_PORT );
+}
+
+static void dispi_write( uint16_t index, uint16_t value ) {
+    io_write_word( DISPI_INDEX_PORT, index );
+    io_write_word( DISPI_DATA_PORT, value );
+}
+
+static void mark_dirty( size_t left, size_t top, size_t width, size_t height ) {
+    if( dirty.left >= dirty.right ) {
+        dirty.left = left;
+        dirty.top = top;
+        dirty.right = left + width;
+        dirty.bottom = top + height;
+        return;
+    }
+    if( left < dirty.left ) dirty.left = left;
+    if( top < dirty.top ) dirty.top = top;
+    if( left + width > dirty.right ) dirty.right = left + width;
+    if( top + height > dirty.bottom ) dirty.bottom = top + height;
+}
+
+static glyph_t *get_glyph( uint8_t character, uint8_t attribute ) {
+    // hit
+    uint32_t key = ((uint32_t)attribute << 8) | character;
+    glyph_t *glyph = &glyph_cache[hash_table_hash_uint64( key ) & (GLYPH_CACHE_LENGTH - 1)];
+    if( key == glyph->key ) return glyph;
+
+    // miss: render the character over whatever was cached here
+    uint32_t foreground = palette[attribute & 0xF], background = palette[(attribute >> 4) & 0xF];
+    const uint8_t *bitmap = &font[character * FRAMEBUFFER_GLYPH_HEIGHT];
+    for( size_t y = 0; y < FRAMEBUFFER_GLYPH_HEIGHT; y++ ) {
+        for( size_t x = 0; x < FRAMEBUFFER_GLYPH_WIDTH; x++ ) {
+            glyph->pixels[y][x] = (bitmap[y] & (0x80 >> x)) ? foreground : background;
+        }
+    }
+    glyph->key = key;
+    return glyph;
+}
+
+// returns false (& leaves the display in VGA text mode) if there's no Bochs/QEMU display adapter
+bool framebuffer_init() {
+    // find the display adapter
+    pci_device_t device;
+    if( !pci_find_device( BOCHS_DISPLAY_VENDOR_ID, BOCHS_DISPLAY_DEVICE_ID, &device ) ) return false;
+    uint16_t id = dispi_read( DISPI_INDEX_ID );
+    if( id < DISPI_ID_MINIMUM || id > DISPI_ID_MAXIMUM ) return false;
+
+    // find the BIOS font, which the bootloader saved as a real mode segment:offset
+    volatile uint16_t *font_pointer = (uint16_t*)BIOS_FONT_POINTER_ADDRESS;
+    font = (const uint8_t*)(((size_t)font_pointer[1] << 4) + font_pointer[0]);
+    if( NULL == font ) return false;
+
+    // allocate the back buffer & the glyph cache
+    back_buffer = kernel_heap_alloc_aligned( FRAMEBUFFER_SIZE, 64 );
+    kernel_heap_tag( back_buffer, KERNEL_HEAP_TAG_FRAMEBUFFER );
+    glyph_cache = kernel_heap_alloc_aligned( GLYPH_CACHE_LENGTH * sizeof( glyph_t ), 64 );
+    kernel_heap_tag( glyph_cache, KERNEL_HEAP_TAG_FRAMEBUFFER );
+    for( size_t i = 0; i < GLYPH_CACHE_LENGTH; i++ ) glyph_cache[i].key = GLYPH_EMPTY;
+
+    // map the framebuffer
+    framebuffer = (uint32_t*)pci_get_bar_address( &device, 0 );
+    paging_map_write_combining( framebuffer, FRAMEBUFFER_SIZE );
+
+    // switch modes (the adapter must be disabled while we do)
+    dispi_write( DISPI_INDEX_ENABLE, 0 );
+    dispi_write( DISPI_INDEX_XRES, FRAMEBUFFER_WIDTH );
+    dispi_write( DISPI_INDEX_YRES, FRAMEBUFFER_HEIGHT );
+    dispi_write( DISPI_INDEX_BPP, DISPI_BPP );
+    dispi_write( DISPI_INDEX_ENABLE, DISPI_ENABLED | DISPI_LFB_ENABLED );
+    enabled = true;
+    return true;
+}
+
+bool framebuffer_is_enabled() {
+    return enabled;
+}
+
+void framebuffer_draw_glyph( size_t column, size_t row, char character, uint8_t attribute ) {
+    glyph_t *glyph = get_glyph( (uint8_t)character, attribute );
+    size_t x = column * FRAMEBUFFER_GLYPH_WIDTH, y = row * FRAMEBUFFER_GLYPH_HEIGHT;
+    buffer_simd_copy_rectangle( &back_buffer[y * FRAMEBUFFER_WIDTH + x], PITCH, glyph->pixels, sizeof( glyph->pixels[0] ), sizeof( glyph->pixels[0] ), FRAMEBUFFER_GLYPH_HEIGHT );
+    mark_dirty( x, y, FRAMEBUFFER_GLYPH_WIDTH, FRAMEBUFFER_GLYPH_HEIGHT );
+}
+
+// moves everything up by 1 row of text, & blanks the bottom row w/ the attribute's background color
+void framebuffer_scroll( uint8_t attribute ) {
+    size_t height = FRAMEBUFFER_HEIGHT - FRAMEBUFFER_GLYPH_HEIGHT;
+    buffer_simd_copy_rectangle( back_buffer, PITCH, &back_buffer[FRAMEBUFFER_GLYPH_HEIGHT * FRAMEBUFFER_WIDTH], PITCH, PITCH, height );
+    buffer_simd_fill_rectangle( &back_buffer[height * FRAMEBUFFER_WIDTH], PITCH, palette[(attribute >> 4) & 0xF], PITCH, FRAMEBUFFER_GLYPH_HEIGHT );
+    mark_dirty( 0, 0, FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT );
+}
+
+void framebuffer_clear( uint8_t attribute ) {
+    buffer_simd_fill_rectangle( back_buffer, PITCH, palette[(attribute >> 4) & 0xF], PITCH, FRAMEBUFFER_HEIGHT );
+    mark_dirty( 0, 0, FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT );
+}
+
+// copies the dirty rectangle to the screen
+// glyphs are 8 pixels wide, so the rectangle's rows are always whole 16-byte chunks
+void framebuffer_flush() {
+    if( dirty.left >= dirty.right ) return;
+    size_t offset = dirty.top * FRAMEBUFFER_WIDTH + dirty.left;
+    buffer_simd_stream_rectangle( &framebuffer[offset], PITCH, &back_buffer[offset], PITCH, (dirty.right - dirty.left) * sizeof( uint32_t ), dirty.bottom - dirty.top );
+    dirty.left = dirty.right = 0;
+}
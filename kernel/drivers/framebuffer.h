@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// linear framebuffer console on the Bochs/QEMU display adapter (qemu's default "-vga std"), w/ text cells the size of VGA text mode's 8x16 glyphs
+// callers must serialize access & keep interrupts disabled (vga_text does both w/ its irqsave lock)
+#define FRAMEBUFFER_WIDTH 1024
+#define FRAMEBUFFER_HEIGHT 768
+#define FRAMEBUFFER_GLYPH_WIDTH 8
+#define FRAMEBUFFER_GLYPH_HEIGHT 16
+#define FRAMEBUFFER_COLUMNS (FRAMEBUFFER_WIDTH / FRAMEBUFFER_GLYPH_WIDTH)
+#define FRAMEBUFFER_ROWS (FRAMEBUFFER_HEIGHT / FRAMEBUFFER_GLYPH_HEIGHT)
+
+bool framebuffer_init();
+bool framebuffer_is_enabled();
+void framebuffer_draw_glyph( size_t column, size_t row, char character, uint8_t attribute );
+void framebuffer_scroll( uint8_t attribute );
+void framebuffer_clear( uint8_t attribute );
+void framebuffer_flush();
@@ -0,0 +1,75 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../interrupt/io.h"
+#include "../sync/spinlock.h"
+#include "pci.h"
+
+// legacy configuration mechanism #1, see https://wiki.osdev.org/PCI
+#define PCI_CONFIG_ADDRESS_PORT 0xCF8
+#define PCI_CONFIG_DATA_PORT 0xCFC
+#define PCI_CONFIG_ENABLE (1 << 31)
+#define PCI_BUS_COUNT 256
+#define PCI_SLOT_COUNT 32
+#define PCI_FUNCTION_COUNT 8
+#define PCI_NO_DEVICE 0xFFFF
+#define PCI_BAR_IO (1 << 0)
+#define PCI_BAR_TYPE_MASK (3 << 1)
+#define PCI_BAR_TYPE_64 (2 << 1)
+
+static ticket_lock_t lock; // irqsave: the address & data ports must be used in pairs (zero-initialized, so it works before anything else runs)
+
+static uint32_t read_config( uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset ) {
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    io_write_dword( PCI_CONFIG_ADDRESS_PORT, PCI_CONFIG_ENABLE | (bus << 16) | (slot << 11) | (function << 8) | (offset & 0xFC) );
+    uint32_t value = io_read_dword( PCI_CONFIG_DATA_PORT );
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+    return value;
+}
+
+uint32_t pci_read_config( pci_device_t *device, uint8_t offset ) {
+    return read_config( device->bus, device->slot, device->function, offset );
+}
+
+void pci_write_config( pci_device_t *device, uint8_t offset, uint32_t value ) {
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    io_write_dword( PCI_CONFIG_ADDRESS_PORT, PCI_CONFIG_ENABLE | (device->bus << 16) | (device->slot << 11) | (device->function << 8) | (offset & 0xFC) );
+    io_write_dword( PCI_CONFIG_DATA_PORT, value );
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+}
+
+// brute-force scan of every bus (probes functions 0-7 of multi-function devices, & only function 0 of the rest)
+// returns false if there's no such device
+bool pci_find_device( uint16_t vendor_id, uint16_t device_id, pci_device_t *device ) {
+    for( size_t bus = 0; bus < PCI_BUS_COUNT; bus++ ) {
+        for( size_t slot = 0; slot < PCI_SLOT_COUNT; slot++ ) {
+            if( PCI_NO_DEVICE == (read_config( bus, slot, 0, PCI_CONFIG_VENDOR_ID ) & 0xFFFF) ) continue;
+            bool multi_function = 0 != (read_config( bus, slot, 0, PCI_CONFIG_HEADER_TYPE ) & (0x80 << 16));
+            for( size_t function = 0; function < (multi_function ? PCI_FUNCTION_COUNT : 1); function++ ) {
+                uint32_t id = read_config( bus, slot, function, PCI_CONFIG_VENDOR_ID );
+                if( (id & 0xFFFF) != vendor_id || (id >> 16) != device_id ) continue;
+                device->bus = bus;
+                device->slot = slot;
+                device->function = function;
+                device->vendor_id = vendor_id;
+                device->device_id = device_id;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool pci_bar_is_io( pci_device_t *device, size_t bar ) {
+    return 0 != (pci_read_config( device, PCI_CONFIG_BAR0 + 4 * bar ) & PCI_BAR_IO);
+}
+
+// returns the physical address (or I/O port) that the firmware assigned to the BAR
+// 64-bit memory BARs take up 2 slots, so 'bar' must be the lower one
+uint64_t pci_get_bar_address( pci_device_t *device, size_t bar ) {
+    uint32_t low = pci_read_config( device, PCI_CONFIG_BAR0 + 4 * bar );
+    if( low & PCI_BAR_IO ) return low & ~(uint32_t)3;
+    uint64_t address = low & ~(uint32_t)0xF;
+    if( PCI_BAR_TYPE_64 == (low & PCI_BAR_TYPE_MASK) ) address|= (uint64_t)pci_read_config( device, PCI_CONFIG_BAR0 + 4 * (bar + 1) ) << 32;
+    return address;
+}
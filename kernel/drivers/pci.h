@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// configuration space registers (offsets into the 256-byte header)
+#define PCI_CONFIG_VENDOR_ID 0x00 // low 16 bits: vendor, high 16 bits: device
+#define PCI_CONFIG_COMMAND 0x04 // low 16 bits: command, high 16 bits: status
+#define PCI_CONFIG_HEADER_TYPE 0x0C // bits 16-23 (bit 23 = multi-function device)
+#define PCI_CONFIG_BAR0 0x10
+#define PCI_CONFIG_INTERRUPT_LINE 0x3C // low 8 bits: the PIC IRQ that the firmware routed the device's INTx to
+
+#define PCI_COMMAND_IO_SPACE (1 << 0)
+#define PCI_COMMAND_MEMORY_SPACE (1 << 1)
+#define PCI_COMMAND_BUS_MASTER (1 << 2)
+
+typedef struct pci_device {
+    uint8_t bus, slot, function;
+    uint16_t vendor_id, device_id;
+} pci_device_t;
+
+uint32_t pci_read_config( pci_device_t *device, uint8_t offset );
+void pci_write_config( pci_device_t *device, uint8_t offset, uint32_t value );
+bool pci_find_device( uint16_t vendor_id, uint16_t device_id, pci_device_t *device );
+uint64_t pci_get_bar_address( pci_device_t *device, size_t bar );
+bool pci_bar_is_io( pci_device_t *device, size_t bar );
@@ -3,6 +3,7 @@
 #include <stdbool.h>
 #include "../interrupt/io.h"
 #include "../interrupt/interrupt_table.h"
+#include "../interrupt/softirq.h"
 #include "vga_text.h" // for debug output
 #include "../main.h" // for panic
 #include "ps2_keyboard.h"
@@ -41,13 +42,8 @@ static char scancode_to_char( uint8_t scancode, bool capslock ) {
     return c + 32 * (!capslock & (c >= 'A') & (c <= 'Z'));
 }
 
-static void key_state_handler( uint64_t interrupt ) {
-    // read scancode
-    uint8_t scancode = io_read_byte( PS2_DATA_PORT );
-
-    // read unused byte
-    io_read_byte( PS2_DATA_PORT );
-
+// bottom half: runs w/ interrupts enabled
+static void key_state_work( uint64_t scancode ) {
     // if the key was released: just ignore it
     if( KEY_RELEASED_MASK & scancode ) return;
 
@@ -64,6 +60,18 @@ static void key_state_handler( uint64_t interrupt ) {
     vga_char_print( c, 0x17 );
 }
 
+// top half: just takes the scancode off the device, and defers the rest
+static void key_state_handler( uint64_t interrupt ) {
+    // read scancode
+    uint8_t scancode = io_read_byte( PS2_DATA_PORT );
+
+    // read unused byte
+    io_read_byte( PS2_DATA_PORT );
+
+    // a full queue means we drop the keypress, which is all we could do anyway
+    softirq_queue( key_state_work, scancode );
+}
+
 void ps2_keyboard_init() {
     // set interrupt to handle keypress
     interrupt_table_set_handler( KEY_STATE_INTERRUPT, (interrupt_handler*)key_state_handler );
@@ -1,11 +1,17 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "../buffer/buffer.h"
 #include "../buffer/string.h"
+#include "../sync/spinlock.h"
+#include "../interrupt/timer.h" // for the benchmark
+#include "framebuffer.h"
+#include "vga_text.h"
 
 #define VGA_WIDTH 80
 #define VGA_HEIGHT 25
 #define VGA_SIZE (VGA_WIDTH * VGA_HEIGHT)
+#define BENCHMARK_LINES 2000
 
 typedef struct vga_text_cell {
     char character, attribute; // ascii character, top 3 bits for background, bottom 4 bits for foreground
@@ -14,6 +20,9 @@ typedef struct vga_text_cell {
 // globals
 static vga_text_cell *vga_text = (vga_text_cell*)0xB8000;
 static uint32_t terminal_x = 0, terminal_y = 0;
+static uint32_t terminal_width = VGA_WIDTH, terminal_height = VGA_HEIGHT;
+static bool use_framebuffer; // once set, every cell goes to the framebuffer console instead of VGA text memory
+static ticket_lock_t lock; // irqsave, since interrupt handlers print (zero-initialized, so it works before anything else runs)
 
 static vga_text_cell make_cell( char character, char attribute ) {
     vga_text_cell result;
@@ -23,7 +32,25 @@ static vga_text_cell make_cell( char character, char attribute ) {
 }
 
 static void set_cell( int x, int y, vga_text_cell cell ) {
-    vga_text[(y * VGA_WIDTH) + x] = cell;
+    if( use_framebuffer ) framebuffer_draw_glyph( x, y, cell.character, cell.attribute );
+    else vga_text[(y * VGA_WIDTH) + x] = cell;
+}
+
+// moves everything up a line, & blanks the bottom line
+static void scroll( char attribute ) {
+    if( use_framebuffer ) {
+        framebuffer_scroll( attribute );
+    } else {
+        buffer_copy_qwords( (uint64_t*)vga_text, (uint64_t*)&vga_text[VGA_WIDTH], (VGA_SIZE - VGA_WIDTH) * sizeof( vga_text_cell ) / sizeof( uint64_t ) );
+        for( int x = 0; x < VGA_WIDTH; x++ ) vga_text[VGA_SIZE - VGA_WIDTH + x] = make_cell( ' ', attribute );
+    }
+    terminal_y--;
+}
+
+static void new_line( char attribute ) {
+    terminal_x = 0;
+    terminal_y++;
+    if( terminal_y >= terminal_height ) scroll( attribute );
 }
 
 static void backspace() {
@@ -36,7 +63,7 @@ static void backspace() {
         terminal_y--;
 
         // and reset X position to the end of the prior line
-        terminal_x = VGA_WIDTH; // <-- TODO: not sure if this is right, or if we should look for first non-whitespace character?
+        terminal_x = terminal_width; // <-- TODO: not sure if this is right, or if we should look for first non-whitespace character?
     }
 
     // blank out the current position
@@ -45,7 +72,7 @@ static void backspace() {
 
 static void write_cell( vga_text_cell cell ) {
     // handle newline 
-    if( '\n' == cell.character ) { terminal_y++; terminal_x = 0; return; }
+    if( '\n' == cell.character ) { new_line( cell.attribute ); return; }
 
     // handle backspace
     if( 8 == cell.character ) { backspace(); return; }
@@ -53,25 +80,94 @@ static void write_cell( vga_text_cell cell ) {
     // handle regular character
     set_cell( terminal_x, terminal_y, cell );
     terminal_x++;
-    if( terminal_x >= VGA_WIDTH ) { terminal_x = 0; terminal_y++; }
+    if( terminal_x >= terminal_width ) new_line( cell.attribute );
+}
+
+// the framebuffer only gets updated once per call, for whatever changed
+static void flush() {
+    if( use_framebuffer ) framebuffer_flush();
 }
 
 void vga_char_print( char c, char color ) {
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
     write_cell( make_cell( c, color ) );
+    flush();
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
 }
 
 void vga_text_print( const char* str, char color ) {
     size_t len = string_length( str );
-    for( int i = 0; i < len; i++ ) vga_char_print( str[i], color );
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    for( int i = 0; i < len; i++ ) write_cell( make_cell( str[i], color ) );
+    flush();
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+}
+
+// prints "<name><value>" in the benchmarks' & stats' color, e.g. vga_text_print_stat( " cycles=", cycles ) for a result line's field
+void vga_text_print_stat( const char *name, uint64_t value ) {
+    vga_text_print( name, 0x17 );
+    vga_text_print( string_from_int64( (int64_t)value ), 0x17 );
+}
+
+// for panic, which may have fired while this CPU (or a CPU that will never let go) holds the lock, e.g. from inside vga_text_print
+// so this skips the lock: the message may interleave w/ another CPU's output, but it always gets out
+void vga_text_print_unlocked( const char* str, char color ) {
+    size_t len = string_length( str );
+    for( int i = 0; i < len; i++ ) write_cell( make_cell( str[i], color ) );
+    flush();
 }
 
 void vga_text_clear( char color ) {
     //
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
     terminal_x = terminal_y = 0;
 
     // 
-    vga_text_cell cell;
-    cell.attribute = color;
-    cell.character = ' ';
-    for( int i = 0; i < VGA_SIZE; i++ ) vga_text[i] = cell;
+    if( use_framebuffer ) {
+        framebuffer_clear( color );
+    } else {
+        vga_text_cell cell;
+        cell.attribute = color;
+        cell.character = ' ';
+        for( int i = 0; i < VGA_SIZE; i++ ) vga_text[i] = cell;
+    }
+    flush();
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+}
+
+// call once framebuffer_init succeeds: carries what's on the screen over to the framebuffer, which has more (& bigger) rows & columns
+void vga_text_use_framebuffer() {
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    use_framebuffer = true;
+    terminal_width = FRAMEBUFFER_COLUMNS;
+    terminal_height = FRAMEBUFFER_ROWS;
+    framebuffer_clear( vga_text[0].attribute );
+    for( int i = 0; i < VGA_SIZE; i++ ) set_cell( i % VGA_WIDTH, i / VGA_WIDTH, vga_text[i] );
+    flush();
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+}
+
+// prints lines of text through whichever path is active, so run it once w/ the framebuffer console & once w/o it to compare them
+void vga_text_run_benchmark() {
+    // every line is 1 glyph short of the screen width, so the newline (not wrapping) moves to the next line
+    char line[VGA_WIDTH];
+    for( int i = 0; i < VGA_WIDTH - 2; i++ ) line[i] = '!' + i;
+    line[VGA_WIDTH - 2] = '\n';
+    line[VGA_WIDTH - 1] = 0;
+
+    // every line scrolls the screen, so this includes scrolling
+    uint64_t start = timer_now();
+    for( int i = 0; i < BENCHMARK_LINES; i++ ) vga_text_print( line, 0x17 );
+    uint64_t ticks = timer_now() - start;
+    uint64_t glyphs = BENCHMARK_LINES * (VGA_WIDTH - 2);
+
+    vga_text_print( "vga_text_benchmark backend=", 0x17 );
+    vga_text_print( use_framebuffer ? "framebuffer" : "text", 0x17 );
+    vga_text_print( " glyphs=", 0x17 );
+    vga_text_print( string_from_int64( (int64_t)glyphs ), 0x17 );
+    vga_text_print( " ticks=", 0x17 );
+    vga_text_print( string_from_int64( (int64_t)ticks ), 0x17 );
+    vga_text_print( " glyphs_per_second=", 0x17 );
+    vga_text_print( string_from_int64( (int64_t)(glyphs * timer_get_frequency() / (0 == ticks ? 1 : ticks)) ), 0x17 );
+    vga_text_print( "\n", 0x17 );
 }
@@ -1,5 +1,11 @@
 #pragma once
 
+#include <stdint.h>
+
 void vga_char_print( char c, char color );
 void vga_text_print( const char* str, char color );
+void vga_text_print_stat( const char *name, uint64_t value );
+void vga_text_print_unlocked( const char* str, char color );
 void vga_text_clear( char color );
+void vga_text_use_framebuffer();
+void vga_text_run_benchmark();
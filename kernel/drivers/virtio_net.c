@@ -0,0 +1,314 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../interrupt/io.h"
+#include "../interrupt/interrupt_table.h"
+#include "../interrupt/irq.h"
+#include "../interrupt/softirq.h"
+#include "../memory/kernel_heap.h"
+#include "../sync/spinlock.h"
+#include "../net/net.h" // for net_receive
+#include "../main.h" // for panic
+#include "pci.h"
+#include "virtio_net.h"
+
+// the legacy interface of a transitional virtio device, which qemu provides by default for PCI (not PCIe) devices
+// see "Legacy Interfaces" in the virtio 1.0 spec: https://docs.oasis-open.org/virtio/virtio/v1.0/virtio-v1.0.html
+#define VIRTIO_VENDOR_ID 0x1AF4
+#define VIRTIO_NET_DEVICE_ID 0x1000
+
+// I/O port offsets from BAR0
+#define VIRTIO_REGISTER_DEVICE_FEATURES 0x00
+#define VIRTIO_REGISTER_GUEST_FEATURES 0x04
+#define VIRTIO_REGISTER_QUEUE_ADDRESS 0x08 // physical page #
+#define VIRTIO_REGISTER_QUEUE_SIZE 0x0C
+#define VIRTIO_REGISTER_QUEUE_SELECT 0x0E
+#define VIRTIO_REGISTER_QUEUE_NOTIFY 0x10
+#define VIRTIO_REGISTER_DEVICE_STATUS 0x12
+#define VIRTIO_REGISTER_ISR_STATUS 0x13 // reading it acknowledges the interrupt
+#define VIRTIO_NET_REGISTER_MAC 0x14 // device-specific config starts here when MSI-X is off
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 1
+#define VIRTIO_STATUS_DRIVER 2
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_ISR_QUEUE (1 << 0)
+
+// feature bits
+#define VIRTIO_NET_F_MAC (1 << 5)
+#define VIRTIO_F_RING_EVENT_IDX (1 << 29) // interrupt & notification thresholds, instead of on/off flags
+
+#define VIRTQ_DESCRIPTOR_F_NEXT 1
+#define VIRTQ_DESCRIPTOR_F_WRITE 2 // device writes (rather than reads) the buffer
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY 1
+#define VIRTQ_ALIGNMENT 4096
+
+#define RECEIVE_QUEUE 0
+#define TRANSMIT_QUEUE 1
+
+typedef struct virtq_descriptor {
+    uint64_t address;
+    uint32_t length;
+    uint16_t flags, next;
+} virtq_descriptor_t;
+
+// written by us, read by the device
+typedef struct virtq_avail {
+    uint16_t flags, index;
+    uint16_t ring[]; // followed by used_event
+} virtq_avail_t;
+
+typedef struct virtq_used_element {
+    uint32_t id, length; // id = head descriptor of the chain, length = bytes the device wrote
+} virtq_used_element_t;
+
+// written by the device, read by us
+typedef struct virtq_used {
+    uint16_t flags, index;
+    virtq_used_element_t ring[]; // followed by avail_event
+} virtq_used_t;
+
+// precedes every packet in both directions (this is the layout w/o mergeable receive buffers)
+typedef struct virtio_net_header {
+    uint8_t flags, gso_type;
+    uint16_t header_length, gso_size, checksum_start, checksum_offset;
+} virtio_net_header_t;
+
+// each slot is a chain of 2 descriptors (2 * slot & 2 * slot + 1): the slot's virtio header, then the packet buffer itself
+// so the device reads & writes packets where they are, w/o copying them
+typedef struct virtqueue {
+    uint16_t index, size, slot_count;
+    virtq_descriptor_t *descriptors;
+    volatile virtq_avail_t *avail;
+    volatile virtq_used_t *used;
+    volatile uint16_t *used_event, *avail_event; // w/ event-idx: the used index we want an interrupt after, & the avail index the device wants a notification after
+    uint16_t avail_index, last_used_index; // our side of the rings
+    virtio_net_header_t *headers;
+    packet_buffer_t **packets;
+    uint16_t *free_slots, free_slot_count;
+    ticket_lock_t lock; // irqsave
+} virtqueue_t;
+
+// globals
+static bool present;
+static uint16_t io_base;
+static uint8_t irq;
+static bool event_index;
+static uint8_t mac[VIRTIO_NET_MAC_LENGTH];
+static virtqueue_t receive_queue, transmit_queue;
+
+static size_t align_up( size_t x, size_t alignment ) {
+    return (x + alignment - 1) & ~(alignment - 1);
+}
+
+static void init_queue( virtqueue_t *queue, uint16_t index, const char *name ) {
+    // the device decides the size
+    io_write_word( io_base + VIRTIO_REGISTER_QUEUE_SELECT, index );
+    queue->index = index;
+    queue->size = io_read_word( io_base + VIRTIO_REGISTER_QUEUE_SIZE );
+    if( queue->size < 2 ) panic( "virtio_net: device has no queue\n" );
+    queue->slot_count = queue->size / 2;
+
+    // the legacy layout is 1 physically contiguous block: descriptors, then the avail ring, then the used ring on the next page
+    // (the kernel heap is identity mapped, so heap addresses are physical addresses)
+    size_t avail_offset = queue->size * sizeof( virtq_descriptor_t );
+    size_t used_offset = align_up( avail_offset + sizeof( virtq_avail_t ) + (queue->size + 1) * sizeof( uint16_t ), VIRTQ_ALIGNMENT );
+    size_t size = used_offset + align_up( sizeof( virtq_used_t ) + queue->size * sizeof( virtq_used_element_t ) + sizeof( uint16_t ), VIRTQ_ALIGNMENT );
+    uint8_t *memory = kernel_heap_alloc_aligned( size, VIRTQ_ALIGNMENT );
+    for( size_t i = 0; i < size; i++ ) memory[i] = 0;
+    kernel_heap_tag( memory, KERNEL_HEAP_TAG_NET );
+    queue->descriptors = (virtq_descriptor_t*)memory;
+    queue->avail = (virtq_avail_t*)(memory + avail_offset);
+    queue->used = (virtq_used_t*)(memory + used_offset);
+    queue->used_event = &queue->avail->ring[queue->size];
+    queue->avail_event = (uint16_t*)&queue->used->ring[queue->size];
+    queue->avail_index = queue->last_used_index = 0;
+
+    // per-slot headers & packets, & every slot starts out free
+    queue->headers = kernel_heap_alloc_zeroed( queue->slot_count * sizeof( virtio_net_header_t ) );
+    queue->packets = kernel_heap_alloc_zeroed( queue->slot_count * sizeof( packet_buffer_t* ) );
+    queue->free_slots = kernel_heap_alloc( queue->slot_count * sizeof( uint16_t ) );
+    for( uint16_t i = 0; i < queue->slot_count; i++ ) queue->free_slots[i] = queue->slot_count - 1 - i;
+    queue->free_slot_count = queue->slot_count;
+    ticket_lock_init( &queue->lock, name );
+
+    // tell the device where it is
+    io_write_dword( io_base + VIRTIO_REGISTER_QUEUE_ADDRESS, (uint32_t)((size_t)memory / VIRTQ_ALIGNMENT) );
+}
+
+// adds a packet to the avail ring (w/o notifying the device), or returns false if the ring is full
+static bool post( virtqueue_t *queue, packet_buffer_t *packet, bool device_writes ) {
+    if( 0 == queue->free_slot_count ) return false;
+    uint16_t slot = queue->free_slots[--queue->free_slot_count];
+    queue->packets[slot] = packet;
+
+    // header, then packet
+    virtq_descriptor_t *descriptor = &queue->descriptors[2 * slot];
+    uint16_t write = device_writes ? VIRTQ_DESCRIPTOR_F_WRITE : 0;
+    descriptor[0].address = (uint64_t)&queue->headers[slot];
+    descriptor[0].length = sizeof( virtio_net_header_t );
+    descriptor[0].flags = VIRTQ_DESCRIPTOR_F_NEXT | write;
+    descriptor[0].next = 2 * slot + 1;
+    descriptor[1].address = (uint64_t)packet->data;
+    descriptor[1].length = device_writes ? packet_buffer_get_capacity( packet ) : packet->length;
+    descriptor[1].flags = write;
+    descriptor[1].next = 0;
+
+    // the descriptors must be visible before the ring entry, & the ring entry before the index (x86 only needs the compiler to keep store order)
+    queue->avail->ring[queue->avail_index % queue->size] = 2 * slot;
+    __atomic_signal_fence( __ATOMIC_RELEASE );
+    queue->avail->index = ++queue->avail_index;
+    return true;
+}
+
+// notifies the device of everything posted since 'old_avail_index', unless it said it doesn't need to know yet
+static void kick( virtqueue_t *queue, uint16_t old_avail_index ) {
+    if( old_avail_index == queue->avail_index ) return;
+
+    // our index store must be visible before we read the device's threshold, which on x86 takes a full fence
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    bool notify;
+    if( event_index ) notify = (uint16_t)(queue->avail_index - *queue->avail_event - 1) < (uint16_t)(queue->avail_index - old_avail_index);
+    else notify = !(queue->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    if( notify ) io_write_word( io_base + VIRTIO_REGISTER_QUEUE_NOTIFY, queue->index );
+}
+
+// takes the next packet that the device is done with, or returns NULL if there isn't one
+static packet_buffer_t *reclaim( virtqueue_t *queue, uint32_t *length ) {
+    if( queue->last_used_index == queue->used->index ) return NULL;
+    __atomic_signal_fence( __ATOMIC_ACQUIRE ); // read the element after the index (x86 doesn't reorder loads w/ other loads)
+    volatile virtq_used_element_t *element = &queue->used->ring[queue->last_used_index % queue->size];
+    uint16_t slot = element->id / 2;
+    *length = element->length;
+    queue->last_used_index++;
+
+    packet_buffer_t *packet = queue->packets[slot];
+    queue->packets[slot] = NULL;
+    queue->free_slots[queue->free_slot_count++] = slot;
+    return packet;
+}
+
+// call w/ the receive queue's lock held
+static void refill_receive_queue() {
+    uint16_t old_avail_index = receive_queue.avail_index;
+    while( receive_queue.free_slot_count > 0 ) {
+        packet_buffer_t *packet = packet_buffer_alloc();
+        if( NULL == packet ) break; // we'll try again on the next poll
+        post( &receive_queue, packet, true );
+    }
+    kick( &receive_queue, old_avail_index );
+}
+
+// call w/ the transmit queue's lock held
+static void reclaim_transmitted() {
+    packet_buffer_t *packet;
+    uint32_t length;
+    while( NULL != (packet = reclaim( &transmit_queue, &length )) ) packet_buffer_free( packet );
+
+    // transmits get reclaimed whenever we send, so we never want an interrupt for them
+    // (at most slot_count packets are in flight, so the used index can't reach this)
+    *transmit_queue.used_event = transmit_queue.last_used_index + transmit_queue.slot_count;
+}
+
+// top half: just acknowledges the device
+static void interrupt_handler_virtio_net( uint64_t interrupt ) {
+    if( io_read_byte( io_base + VIRTIO_REGISTER_ISR_STATUS ) & VIRTIO_ISR_QUEUE ) softirq_raise( SOFTIRQ_INDEX_NET );
+}
+
+// bottom half
+static void net_softirq() {
+    virtio_net_poll();
+}
+
+// returns false if there's no virtio network device
+bool virtio_net_init() {
+    // find the device, & let it use its I/O ports & do DMA
+    pci_device_t device;
+    if( !pci_find_device( VIRTIO_VENDOR_ID, VIRTIO_NET_DEVICE_ID, &device ) ) return false;
+    if( !pci_bar_is_io( &device, 0 ) ) return false;
+    io_base = (uint16_t)pci_get_bar_address( &device, 0 );
+    pci_write_config( &device, PCI_CONFIG_COMMAND, pci_read_config( &device, PCI_CONFIG_COMMAND ) | PCI_COMMAND_IO_SPACE | PCI_COMMAND_BUS_MASTER );
+
+    // reset, then tell the device we know how to drive it
+    io_write_byte( io_base + VIRTIO_REGISTER_DEVICE_STATUS, 0 );
+    io_write_byte( io_base + VIRTIO_REGISTER_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE );
+    io_write_byte( io_base + VIRTIO_REGISTER_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER );
+
+    // negotiate features: we only want the MAC address & event-idx (so no checksum offload, segmentation offload, or mergeable buffers)
+    uint32_t features = io_read_dword( io_base + VIRTIO_REGISTER_DEVICE_FEATURES ) & (VIRTIO_NET_F_MAC | VIRTIO_F_RING_EVENT_IDX);
+    io_write_dword( io_base + VIRTIO_REGISTER_GUEST_FEATURES, features );
+    event_index = 0 != (features & VIRTIO_F_RING_EVENT_IDX);
+    for( size_t i = 0; i < VIRTIO_NET_MAC_LENGTH; i++ ) {
+        mac[i] = (features & VIRTIO_NET_F_MAC) ? io_read_byte( io_base + VIRTIO_NET_REGISTER_MAC + i ) : (i == 0 ? 0x02 : i); // 0x02 = locally administered
+    }
+
+    // set up the queues
+    init_queue( &receive_queue, RECEIVE_QUEUE, "virtio_net_receive" );
+    init_queue( &transmit_queue, TRANSMIT_QUEUE, "virtio_net_transmit" );
+    transmit_queue.avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT; // same as reclaim_transmitted's used_event, for devices w/o event-idx
+    *transmit_queue.used_event = transmit_queue.slot_count;
+
+    // handle the interrupt (this is a legacy INTx, routed through the PIC or the IO-APIC), & process its completions in a softirq
+    irq = pci_read_config( &device, PCI_CONFIG_INTERRUPT_LINE ) & 0xFF;
+    if( irq >= IRQ_COUNT ) panic( "virtio_net: device has no IRQ\n" );
+    softirq_set_handler( SOFTIRQ_INDEX_NET, net_softirq );
+    interrupt_table_set_handler( INTERRUPT_INDEX_IRQ( irq ), (interrupt_handler*)interrupt_handler_virtio_net );
+    irq_set_masked( irq, false );
+
+    // the device is live, so give it receive buffers
+    io_write_byte( io_base + VIRTIO_REGISTER_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK );
+    present = true;
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &receive_queue.lock );
+    refill_receive_queue();
+    ticket_lock_release_irqrestore( &receive_queue.lock, interrupts_were_enabled );
+    return true;
+}
+
+bool virtio_net_is_present() {
+    return present;
+}
+
+void virtio_net_get_mac( uint8_t *result ) {
+    for( size_t i = 0; i < VIRTIO_NET_MAC_LENGTH; i++ ) result[i] = mac[i];
+}
+
+// takes ownership of the packet, which the device reads in place
+// returns false (& frees the packet) if the ring is full
+bool virtio_net_transmit( packet_buffer_t *packet ) {
+    irq_note_consumer( irq ); // replies will arrive on this CPU, so steer the interrupt here
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &transmit_queue.lock );
+    reclaim_transmitted();
+    uint16_t old_avail_index = transmit_queue.avail_index;
+    bool posted = post( &transmit_queue, packet, false );
+    kick( &transmit_queue, old_avail_index );
+    ticket_lock_release_irqrestore( &transmit_queue.lock, interrupts_were_enabled );
+    if( !posted ) packet_buffer_free( packet );
+    return posted;
+}
+
+// hands received packets to the stack, & returns how many there were (this is the net softirq, but it can also be called to busy-poll)
+// w/ event-idx, the device doesn't interrupt again until we've caught up, so a burst of packets costs 1 interrupt
+size_t virtio_net_poll() {
+    size_t received = 0;
+    while( true ) {
+        // take the next packet
+        bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &receive_queue.lock );
+        uint32_t length;
+        packet_buffer_t *packet = reclaim( &receive_queue, &length );
+        if( NULL == packet ) {
+            // we've caught up, so ask for an interrupt on the next packet, then check again in case it already arrived
+            *receive_queue.used_event = receive_queue.last_used_index;
+            __atomic_thread_fence( __ATOMIC_SEQ_CST );
+            packet = reclaim( &receive_queue, &length );
+        }
+        if( NULL == packet || 0 == received % 16 ) refill_receive_queue(); // give buffers back in batches, so we kick less often
+        ticket_lock_release_irqrestore( &receive_queue.lock, interrupts_were_enabled );
+        if( NULL == packet ) break;
+
+        // hand it to the stack w/o the lock held (it may transmit a reply)
+        packet->length = length > sizeof( virtio_net_header_t ) ? length - sizeof( virtio_net_header_t ) : 0;
+        net_receive( packet );
+        received++;
+    }
+    return received;
+}
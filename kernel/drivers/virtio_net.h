@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../net/packet_buffer.h"
+
+// virtio network device (qemu's "-device virtio-net-pci"), see net.c for the protocols on top
+#define VIRTIO_NET_MAC_LENGTH 6
+
+bool virtio_net_init();
+bool virtio_net_is_present();
+void virtio_net_get_mac( uint8_t *mac );
+bool virtio_net_transmit( packet_buffer_t *packet );
+size_t virtio_net_poll();
@@ -0,0 +1,206 @@
+#include <stdbool.h>
+#include "clock.h"
+#include "timer.h"
+#include "../drivers/vga_text.h" // for printing
+#include "../memory/paging.h"
+#include "../process/cpu.h"
+#include "../process/process.h" // for the tests & benchmark
+#include "../process/syscall.h"
+#include "../process/task_pool.h" // for the tests
+#include "../sync/spinlock.h"
+#include "../main.h" // for panic
+
+// the whole page gets mapped into every process, so nothing else may share it
+static union {
+    clock_page_t page;
+    uint8_t padding[PAGE_SIZE];
+} shared __attribute__((aligned(PAGE_SIZE)));
+
+// serializes updates (readers never take it). irqsave, since an interrupt handler that reads the clock in the middle of an update
+// on the same CPU would wait forever for it to finish
+static ticket_lock_t update_lock;
+
+// test programs (see user_programs.asm)
+extern void user_program_clock();
+extern void user_program_clock_write();
+extern void user_program_clock_benchmark();
+extern uint64_t user_clock_results[4];
+extern uint64_t user_clock_benchmark_results[2];
+
+// rdtsc isn't ordered w/ loads, so w/o the lfence it could run before we've read the sequence #
+static uint64_t read_timestamp_ordered() {
+    asm volatile( "lfence" ::: "memory" );
+    return timer_now();
+}
+
+static uint64_t get_multiplier( uint64_t tsc_frequency ) {
+    return (1000000000ull << CLOCK_SHIFT) / tsc_frequency;
+}
+
+// the monotonic time at tsc, w/ the page's current parameters (optionally w/ the leftover fraction of a nanosecond)
+static uint64_t scale( clock_page_t *page, uint64_t tsc, uint64_t *fraction ) {
+    unsigned __int128 scaled = (unsigned __int128)(tsc - page->base_tsc) * page->multiplier + page->base_fraction;
+    if( NULL != fraction ) *fraction = (uint64_t)scaled & ((1ull << page->shift) - 1);
+    return page->base_nanoseconds + (uint64_t)(scaled >> page->shift);
+}
+
+// makes the sequence # odd, so readers retry until end_update
+static bool begin_update() {
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &update_lock );
+    __atomic_store_n( &shared.page.sequence, shared.page.sequence + 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE ); // the odd sequence # must be visible before any of the changes
+    return interrupts_were_enabled;
+}
+
+static void end_update( bool interrupts_were_enabled ) {
+    __atomic_store_n( &shared.page.sequence, shared.page.sequence + 1, __ATOMIC_RELEASE );
+    ticket_lock_release_irqrestore( &update_lock, interrupts_were_enabled );
+}
+
+// moves the base up to tsc, so the parameters can change w/o the clock jumping
+static void rebase( clock_page_t *page, uint64_t tsc ) {
+    uint64_t fraction, nanoseconds = scale( page, tsc, &fraction );
+    page->base_tsc = tsc;
+    page->base_nanoseconds = nanoseconds;
+    page->base_fraction = fraction;
+}
+
+// rdi = clock. returns the time in nanoseconds, or -1 for an unknown clock (processes should read the clock page instead, so this is
+// mostly a baseline for the benchmark)
+static uint64_t gettime_syscall_handler( uint64_t clock, uint64_t b, uint64_t c, uint64_t d, uint64_t e, uint64_t f ) {
+    return clock > CLOCK_REALTIME ? (uint64_t)-1 : clock_get_time( clock );
+}
+
+// call after timer_init & syscall_init
+void clock_init() {
+    ticket_lock_init( &update_lock, "clock" );
+    bool interrupts_were_enabled = begin_update();
+    clock_page_t *page = &shared.page;
+    page->shift = CLOCK_SHIFT;
+    page->multiplier = get_multiplier( timer_get_frequency() );
+    page->base_tsc = timer_now();
+    page->base_nanoseconds = 0;
+    page->base_fraction = 0;
+    page->realtime_offset = 0;
+    end_update( interrupts_were_enabled );
+    syscall_set_handler( SYSCALL_CLOCK_GETTIME, gettime_syscall_handler );
+}
+
+// the kernel address of the clock page, which processes map read-only @ PROCESS_CLOCK_ADDRESS
+void *clock_get_page() {
+    return &shared.page;
+}
+
+// the same seqlock read as user_clock_gettime, so it's safe from any CPU & from interrupt handlers
+uint64_t clock_get_time( size_t clock ) {
+    clock_page_t *page = &shared.page;
+    uint32_t sequence;
+    uint64_t nanoseconds;
+    do {
+        while( 0 != ((sequence = __atomic_load_n( &page->sequence, __ATOMIC_ACQUIRE )) & 1) ) cpu_pause();
+        nanoseconds = scale( page, read_timestamp_ordered(), NULL );
+        if( CLOCK_REALTIME == clock ) nanoseconds+= page->realtime_offset;
+        __atomic_thread_fence( __ATOMIC_ACQUIRE ); // the reads above must be done before we recheck the sequence #
+    } while( sequence != __atomic_load_n( &page->sequence, __ATOMIC_RELAXED ) );
+    return nanoseconds;
+}
+
+// nanoseconds is the wall-clock time right now
+void clock_set_realtime( uint64_t nanoseconds ) {
+    bool interrupts_were_enabled = begin_update();
+    shared.page.realtime_offset = nanoseconds - scale( &shared.page, timer_now(), NULL );
+    end_update( interrupts_were_enabled );
+}
+
+// for a better estimate of the TSC's frequency: the clock carries on from where it is, just at the new rate
+void clock_set_frequency( uint64_t tsc_frequency ) {
+    bool interrupts_were_enabled = begin_update();
+    rebase( &shared.page, timer_now() );
+    shared.page.multiplier = get_multiplier( tsc_frequency );
+    end_update( interrupts_were_enabled );
+}
+
+#define TEST_DELAY_MICROSECONDS 1000
+#define TEST_UPDATES 100000
+#define TEST_REALTIME 1000000000000000000ull // 2001-09-09, in nanoseconds since the epoch
+#define NANOSECONDS_PER_SECOND 1000000000ull
+
+static volatile bool test_updating;
+
+// alternates between 2 rates (0.1% apart), which changes every field of the page but the realtime offset
+static void keep_updating( void *argument ) {
+    uint64_t frequency = timer_get_frequency();
+    for( size_t i = 0; i < TEST_UPDATES; i++ ) clock_set_frequency( 0 == (i & 1) ? frequency + frequency / 1000 : frequency );
+    clock_set_frequency( frequency );
+    __atomic_store_n( &test_updating, false, __ATOMIC_RELEASE );
+}
+
+// call after clock_init, process_init & smp_init
+void clock_run_tests() {
+    // the monotonic clock keeps time w/ the TSC (to within 10%)
+    uint64_t start = clock_get_time( CLOCK_MONOTONIC );
+    timer_delay_microseconds( TEST_DELAY_MICROSECONDS );
+    uint64_t elapsed = clock_get_time( CLOCK_MONOTONIC ) - start;
+    if( elapsed < TEST_DELAY_MICROSECONDS * 900 || elapsed > TEST_DELAY_MICROSECONDS * 1100 ) panic( "clock_run_tests: monotonic clock is off\n" );
+
+    // setting the wall-clock time doesn't touch the monotonic clock
+    uint64_t realtime_offset = clock_get_time( CLOCK_REALTIME ) - clock_get_time( CLOCK_MONOTONIC );
+    clock_set_realtime( TEST_REALTIME );
+    uint64_t realtime = clock_get_time( CLOCK_REALTIME );
+    if( realtime < TEST_REALTIME || realtime - TEST_REALTIME > NANOSECONDS_PER_SECOND ) panic( "clock_run_tests: realtime clock wasn't set\n" );
+    if( clock_get_time( CLOCK_MONOTONIC ) < start + elapsed ) panic( "clock_run_tests: setting the realtime clock moved the monotonic clock\n" );
+
+    // ring 3 reads the page w/o a syscall, and gets the same clocks as the syscall
+    process_t *process = process_create_builtin( user_program_clock );
+    if( 0 != process_run( process ) ) panic( "clock_run_tests: clock process failed\n" );
+    uint64_t *results = process_get_image_data( process, user_clock_results );
+    if( results[0] > results[1] || results[1] > results[2] || results[2] - results[0] > NANOSECONDS_PER_SECOND ) {
+        panic( "clock_run_tests: user clock reads are out of order\n" );
+    }
+    if( results[3] < TEST_REALTIME || results[3] - TEST_REALTIME > NANOSECONDS_PER_SECOND ) panic( "clock_run_tests: user realtime clock is off\n" );
+    process_destroy( process );
+    clock_set_realtime( clock_get_time( CLOCK_MONOTONIC ) + realtime_offset );
+
+    // ...but it can't write to it
+    process = process_create_builtin( user_program_clock_write );
+    if( PROCESS_EXIT_CODE_SEGFAULT != process_run( process ) ) panic( "clock_run_tests: process wrote to the clock page\n" );
+    process_destroy( process );
+
+    // while another CPU keeps updating the page, readers never see a torn update (which would make time jump back or ahead)
+    if( cpu_get_count() > 1 ) {
+        task_t task;
+        test_updating = true;
+        task_pool_spawn( &task, keep_updating, NULL );
+        uint64_t previous = clock_get_time( CLOCK_MONOTONIC );
+        while( __atomic_load_n( &test_updating, __ATOMIC_ACQUIRE ) ) {
+            uint64_t now = clock_get_time( CLOCK_MONOTONIC );
+            if( now < previous ) panic( "clock_run_tests: time went backwards during an update\n" );
+            if( now - previous > NANOSECONDS_PER_SECOND / 100 ) panic( "clock_run_tests: time jumped ahead during an update\n" );
+            previous = now;
+        }
+        task_pool_join( &task );
+    }
+}
+
+#define BENCHMARK_ITERATIONS 100000 // must match user_programs.asm
+
+// cycles per monotonic clock read: in the kernel, in ring 3 from the clock page, and in ring 3 via a syscall
+// the result line is "clock_benchmark kernel_cycles=<n> user_cycles=<n> syscall_cycles=<n>"
+void clock_run_benchmark() {
+    volatile uint64_t sink;
+    uint64_t start = cpu_read_timestamp();
+    for( size_t i = 0; i < BENCHMARK_ITERATIONS; i++ ) sink = clock_get_time( CLOCK_MONOTONIC );
+    uint64_t kernel = (cpu_read_timestamp() - start) / BENCHMARK_ITERATIONS;
+    (void)sink;
+
+    process_t *process = process_create_builtin( user_program_clock_benchmark );
+    if( 0 != process_run( process ) ) panic( "clock_run_benchmark: benchmark process failed\n" );
+    uint64_t *results = process_get_image_data( process, user_clock_benchmark_results );
+    uint64_t user = results[0] / BENCHMARK_ITERATIONS, syscall = results[1] / BENCHMARK_ITERATIONS;
+    process_destroy( process );
+
+    vga_text_print_stat( "clock_benchmark kernel_cycles=", kernel );
+    vga_text_print_stat( " user_cycles=", user );
+    vga_text_print_stat( " syscall_cycles=", syscall );
+    vga_text_print( "\n", 0x17 );
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// clocks in nanoseconds, which processes read straight from a page that the kernel maps read-only into every process, w/o a syscall
+// (see user_clock_gettime in user_programs.asm). the page holds the TSC's scale & offset, and the kernel protects updates w/ a
+// seqlock: the sequence # is odd while an update is in progress, and readers retry if it was odd or changed during their read
+#define CLOCK_MONOTONIC 0 // time since boot
+#define CLOCK_REALTIME 1 // wall-clock time (the same as CLOCK_MONOTONIC until something sets it, since we have no RTC driver)
+#define CLOCK_SHIFT 32
+
+// time = base_nanoseconds + ((tsc - base_tsc) * multiplier + base_fraction) >> shift, plus realtime_offset for CLOCK_REALTIME
+// the product is 128 bits, so it never overflows. must match user_programs.asm
+typedef struct clock_page {
+    volatile uint32_t sequence;
+    uint32_t shift;
+    uint64_t multiplier; // nanoseconds per TSC cycle, in units of 2^-shift
+    uint64_t base_tsc;
+    uint64_t base_nanoseconds;
+    uint64_t base_fraction; // the part of a nanosecond at base_tsc, in units of 2^-shift (so an update never loses time)
+    uint64_t realtime_offset;
+} clock_page_t;
+
+void clock_init();
+void *clock_get_page();
+uint64_t clock_get_time( size_t clock );
+void clock_set_realtime( uint64_t nanoseconds );
+void clock_set_frequency( uint64_t tsc_frequency );
+void clock_run_tests();
+void clock_run_benchmark();
@@ -1,15 +1,23 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include "pic.h"
+#include "softirq.h"
+#include "timer.h" // for tickless idle
 #include "interrupt_table.h"
 #include "../buffer/buffer.h"
 #include "../buffer/string.h" // for printing integers
 #include "../drivers/vga_text.h" // for printing
 #include "../main.h" // for panic
+#include "../process/gdt.h" // for the kernel code selector
+#include "../sync/rcu.h" // for publishing handlers
 
-#define KERNEL_CODE_SELECTOR 0x08 // defined in boot.asm
 #define TRACE_UNHANDLED_INTERRUPTS
 
+// gate bits: Present = 1, DPL (descriptor privilege level) = 00 (ring 0) or 11 (ring 3), storage segment = 0 (must be 0 for interrupt &
+// trap gates), gate type = 1110 (interrupt gate)
+#define INTERRUPT_GATE_KERNEL 0x8E
+#define INTERRUPT_GATE_USER 0xEE
+
 typedef struct interrupt_table_descriptor {
     uint16_t interrupt_table_size_minus_1;
     uint64_t interrupt_table_location;
@@ -49,12 +57,23 @@ static void disable_interrupts() {
     asm( "cli\n" );
 }
 
+// for irqsave locks: disables interrupts & returns whether they were enabled, so that nested critical sections restore correctly
+bool interrupt_table_disable_interrupts() {
+    bool were_enabled = are_interrupts_enabled();
+    disable_interrupts();
+    return were_enabled;
+}
+
+void interrupt_table_restore_interrupts( bool were_enabled ) {
+    if( were_enabled ) enable_interrupts();
+}
+
 static void interrupt_table_set_wrapper( size_t i, void *interrupt_wrapper ) {
     // get entry pointer
     interrupt_table_entry_t *entry = &interrupt_table[i]; 
 
     // isr executes using the kernel code segment selector
-    entry->code_segment_selector = KERNEL_CODE_SELECTOR;
+    entry->code_segment_selector = GDT_KERNEL_CODE_SELECTOR;
 
     // set ISR (interrupt service routine) address
     uint64_t address = (uint64_t)interrupt_wrapper;
@@ -66,13 +85,26 @@ static void interrupt_table_set_wrapper( size_t i, void *interrupt_wrapper ) {
     entry->reserved_leave_as_0 = 0;
     entry->stack_table_offset = 0;
 
-    // bits: Present = 1, DPL (descriptor privilege level) = 11 (ring 3), storage segment = 0 (must be 0 for interrupt & trap gates), gate type = 11 (3 = interrupt gate), reserved = 0
-    entry->type_attribute_flags = 0xEE;
+    // only ring 0 can raise it w/ an int instruction (see interrupt_table_allow_user)
+    entry->type_attribute_flags = INTERRUPT_GATE_KERNEL;
+}
+
+// lets ring 3 raise an interrupt w/ an int instruction (e.g. the syscall interrupt). everything else stays DPL 0, so a user "int 14"
+// becomes a #GP instead of a page fault w/ no error code on the stack (or an EOI for an IRQ that never happened)
+void interrupt_table_allow_user( size_t i ) {
+    if( i >= INTERRUPT_TABLE_LENGTH ) panic( "interrupt_table_allow_user: invalid interrupt index\n" );
+    interrupt_table[i].type_attribute_flags = INTERRUPT_GATE_USER;
 }
 
-void interrupt_table_set_handler( size_t i, interrupt_handler *handler ) {
+// returns the prior handler
+interrupt_handler *interrupt_table_set_handler( size_t i, interrupt_handler *handler ) {
     if( i >= INTERRUPT_TABLE_LENGTH ) panic( "interrupt_table_set_handler: invalid interrupt index\n" );
-    interrupt_handlers[i] = handler;
+    interrupt_handler *prior_handler = interrupt_handlers[i];
+
+    // interrupt wrappers read handlers w/ interrupts disabled, which makes each dispatch an RCU read-side critical section
+    // so, to free anything the old handler uses, call rcu_synchronize after replacing it
+    rcu_assign_pointer( interrupt_handlers[i], handler );
+    return prior_handler;
 }
 
 // TODO: add a stack frame argument
@@ -85,7 +117,10 @@ static void trace_interrupt_handler( uint64_t interrupt ) {
     #endif
 }
 
-static void empty_interrupt_handler( uint64_t interrupt ) {}
+// the PIT's clock only runs until timer_init replaces it w/ the local APIC timer
+static void clock_handler( uint64_t interrupt ) {
+    rcu_note_clock_tick();
+}
 
 static void divide_by_zero_handler( uint64_t interrupt ) {
     panic( "divided by zero\n" );
@@ -141,7 +176,7 @@ void interrupt_table_init() {
     interrupt_table_set_handler( INTERRUPT_INDEX_DIVIDE_BY_ZERO, (interrupt_handler*)divide_by_zero_handler );
     interrupt_table_set_handler( INTERRUPT_INDEX_BREAKPOINT, (interrupt_handler*)breakpoint_handler_test );
     interrupt_table_set_handler( INTERRUPT_INDEX_INVALID_OPCODE, (interrupt_handler*)invalid_opcode_handler );
-    interrupt_table_set_handler( INTERRUPT_INDEX_CLOCK, (interrupt_handler*)empty_interrupt_handler );
+    interrupt_table_set_handler( INTERRUPT_INDEX_CLOCK, (interrupt_handler*)clock_handler );
 
     // load the interrupt table
     load_interrupt_table( &interrupt_table_descriptor );
@@ -160,6 +195,20 @@ void interrupt_table_init() {
     interrupt_table_set_handler( INTERRUPT_INDEX_BREAKPOINT, (interrupt_handler*)breakpoint_handler );
 }
 
+// application processors share the table, they just need to load it
+void interrupt_table_init_ap() {
+    load_interrupt_table( &interrupt_table_descriptor );
+}
+
 void interrupt_table_wait_for_interrupt() {
-    asm( "hlt" );
+    softirq_run(); // in case work was left behind while softirqs were disabled
+    rcu_quiescent_state(); // idle CPUs never hold RCU references
+
+    // stop the tick while we're halted
+    timer_enter_idle();
+    disable_interrupts();
+    rcu_enter_idle();
+    asm volatile( "sti; hlt" ::: "memory" ); // sti only takes effect after the next instruction, so no interrupt can slip in before hlt
+    rcu_exit_idle();
+    timer_exit_idle();
 }
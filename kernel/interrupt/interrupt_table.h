@@ -1,20 +1,33 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 // common interrupts
 #define INTERRUPT_INDEX_DIVIDE_BY_ZERO 0
 #define INTERRUPT_INDEX_BREAKPOINT 3
 #define INTERRUPT_INDEX_INVALID_OPCODE 6
+#define INTERRUPT_INDEX_GENERAL_PROTECTION 13
+#define INTERRUPT_INDEX_PAGE_FAULT 14
 #define INTERRUPT_INDEX_CLOCK 32
+#define INTERRUPT_INDEX_IRQ( irq ) (INTERRUPT_INDEX_CLOCK + (irq)) // 8259 PIC IRQs 0-15 (see pic.c)
+#define INTERRUPT_INDEX_TIMER 0xEF // local APIC timer (see timer.c)
+#define INTERRUPT_INDEX_WAKEUP 0xF0 // IPI that wakes a halted CPU (see task_pool.c)
+#define INTERRUPT_INDEX_TLB_SHOOTDOWN 0xF1 // IPI that invalidates another CPU's stale TLB entries (see tlb.c)
+#define INTERRUPT_INDEX_COROUTINE_WAKEUP 0xF2 // IPI that runs another CPU's coroutine executor (see coroutine.c)
+#define INTERRUPT_INDEX_SPURIOUS 0xFF // local APIC spurious interrupts
 
 // C interrupt handlers must be declared here, so our assembly code handlers can invoke them
 #define INTERRUPT_TABLE_LENGTH 256
-typedef void *(interrupt_handler)(uint64_t);
+typedef void *(interrupt_handler)(uint64_t, uint64_t, uint64_t); // interrupt #, error code (0 for interrupts that have no error code), interrupted code's CS
 extern interrupt_handler *c_interrupt_handlers[INTERRUPT_TABLE_LENGTH];
 
 // interrupt handler API
 void interrupt_table_init();
-void interrupt_table_set_handler( size_t i, interrupt_handler *handler );
+void interrupt_table_init_ap();
+interrupt_handler *interrupt_table_set_handler( size_t i, interrupt_handler *handler );
+void interrupt_table_allow_user( size_t i );
+bool interrupt_table_disable_interrupts();
+void interrupt_table_restore_interrupts( bool were_enabled );
 void interrupt_table_wait_for_interrupt();
@@ -6,6 +6,8 @@ section .asm
 
 ; imports
 extern interrupt_handlers
+extern softirq_on_interrupt_exit
+extern irq_end_of_interrupt
 
 ; exports
 global interrupt_wrappers
@@ -13,18 +15,22 @@ global interrupt_wrappers
 ; number of total interrupts in x86_64
 %define NUM_INTERRUPT_TABLE_ENTRIES 256
 
-; we need to send a signal to this port to tell the PIC that we've processed the IRQ
-; note: IRQ8_15 is daisy chained so doesn't need a separate acknowledgement
-%define PIC1_COMMAND_PORT 0x20
-%define PIC2_COMMAND_PORT 0xA0
-%define PIC_COMMAND_END_OF_INTERRUPT 0x20
+; IRQs (vectors 32-47) are acknowledged by irq_end_of_interrupt, which knows whether they came from the PIC or the IO-APIC (see irq.c)
+%define IRQ_VECTOR_START 32
+%define IRQ_VECTOR_END 48
 
 ; macro which builds an interrupt service routine
 ; TODO: note that we are NOT yet saving the SIMD registers, which could be clobbered by the interrupt handler
 ; ... we'll implement this later on
+; some CPU exceptions push an error code, so for every other interrupt we push a dummy one, which keeps the stack layout the same
+; the error code is passed as the 2nd arg to the interrupt handler, & the interrupted code's CS (whose low 2 bits are its ring) as the 3rd
+; IRQs are acknowledged after the handler runs, and then deferred work (see softirq.c) runs, w/ interrupts enabled
 %macro write_interrupt_wrapper 1
     global int%1 ; export this as int0, int1, int2, ...
     int%1: ; label
+        %if %1 != 8 && (%1 < 10 || %1 > 14) && %1 != 17 && %1 != 21 && %1 != 29 && %1 != 30
+        push 0 ; dummy error code
+        %endif
         push rax
         push rcx
         push rdx
@@ -34,12 +40,19 @@ global interrupt_wrappers
         push r9
         push r10
         push r11
+        sub rsp, 8 ; keep the stack 16-byte aligned for the C handler
+        cld ; C code expects the direction flag to be clear, but the interrupted code may have set it
         mov rdi, %1 ; interrupt # as 1st arg for interrupt handler
+        mov rsi, [rsp + 10 * 8] ; error code as 2nd arg for interrupt handler
+        mov rdx, [rsp + 12 * 8] ; interrupted code's CS as 3rd arg for interrupt handler
         call qword [interrupt_handlers + %1 * 8]
-        mov al, PIC_COMMAND_END_OF_INTERRUPT
-        out PIC1_COMMAND_PORT, al ; send EOI (end of interrupt) signal
-        mov al, PIC_COMMAND_END_OF_INTERRUPT
-        out PIC2_COMMAND_PORT, al ; send EOI (end of interrupt) signal
+        %if %1 >= IRQ_VECTOR_START && %1 < IRQ_VECTOR_END ; only IRQs need an EOI
+        mov rdi, %1 - IRQ_VECTOR_START ; IRQ #
+        call irq_end_of_interrupt
+        %endif
+        mov rdi, [rsp + 13 * 8] ; interrupted code's RFLAGS, so deferred work only runs if it had interrupts enabled
+        call softirq_on_interrupt_exit
+        add rsp, 8
         pop r11
         pop r10
         pop r9
@@ -49,6 +62,7 @@ global interrupt_wrappers
         pop rdx
         pop rcx
         pop rax
+        add rsp, 8 ; discard error code
         iretq
 %endmacro
 
@@ -9,3 +9,23 @@ uint8_t io_read_byte( uint16_t port ) { // see https://www.osdev.org/howtos/2/
 void io_write_byte( uint16_t port, uint8_t value ) {
     asm( "outb %%al, %%dx" :: "d" (port), "a" (value) );
 }
+
+uint16_t io_read_word( uint16_t port ) {
+    uint16_t ret;
+    asm volatile( "inw %%dx, %%ax" : "=a" (ret) : "d" (port) );
+    return ret;
+}
+
+void io_write_word( uint16_t port, uint16_t value ) {
+    asm volatile( "outw %%ax, %%dx" :: "d" (port), "a" (value) );
+}
+
+uint32_t io_read_dword( uint16_t port ) {
+    uint32_t ret;
+    asm volatile( "inl %%dx, %%eax" : "=a" (ret) : "d" (port) );
+    return ret;
+}
+
+void io_write_dword( uint16_t port, uint32_t value ) {
+    asm volatile( "outl %%eax, %%dx" :: "d" (port), "a" (value) );
+}
@@ -4,3 +4,7 @@
 
 uint8_t io_read_byte( uint16_t port );
 void io_write_byte( uint16_t port, uint8_t value );
+uint16_t io_read_word( uint16_t port );
+void io_write_word( uint16_t port, uint16_t value );
+uint32_t io_read_dword( uint16_t port );
+void io_write_dword( uint16_t port, uint32_t value );
@@ -0,0 +1,111 @@
+#include <stddef.h>
+#include "io_apic.h"
+#include "../drivers/acpi.h" // for the IO-APICs
+#include "../memory/paging.h" // for mapping the registers
+#include "../main.h" // for panic
+#include "../sync/spinlock.h"
+
+// registers are indirect: write the register # to the select register, then access it through the window
+#define IO_APIC_SELECT 0x00
+#define IO_APIC_WINDOW 0x10
+#define IO_APIC_VERSION 0x01 // bits 16-23: the # of the last redirection entry
+#define IO_APIC_REDIRECTION_TABLE 0x10 // entry n is 2 registers: the low half @ 0x10 + 2n, & the high half after it
+
+// redirection entry bits (low half), w/ fixed delivery & physical destination mode (both 0)
+#define IO_APIC_ENTRY_ACTIVE_LOW (1 << 13)
+#define IO_APIC_ENTRY_LEVEL (1 << 15)
+#define IO_APIC_ENTRY_MASKED (1 << 16)
+#define IO_APIC_DESTINATION_SHIFT 24 // in the high half
+
+typedef struct io_apic {
+    volatile uint32_t *registers;
+    uint32_t gsi_base, gsi_count;
+} io_apic_t;
+
+static io_apic_t io_apics[ACPI_MAX_IO_APICS];
+static size_t io_apic_count;
+static ticket_lock_t lock; // irqsave: the select & window registers must be used in pairs
+
+static uint32_t read_register( io_apic_t *io_apic, uint32_t index ) {
+    io_apic->registers[IO_APIC_SELECT / sizeof( uint32_t )] = index;
+    return io_apic->registers[IO_APIC_WINDOW / sizeof( uint32_t )];
+}
+
+static void write_register( io_apic_t *io_apic, uint32_t index, uint32_t value ) {
+    io_apic->registers[IO_APIC_SELECT / sizeof( uint32_t )] = index;
+    io_apic->registers[IO_APIC_WINDOW / sizeof( uint32_t )] = value;
+}
+
+// returns the IO-APIC that owns a GSI, & the GSI's redirection entry in it
+static io_apic_t *find( uint32_t gsi, uint32_t *entry ) {
+    for( size_t i = 0; i < io_apic_count; i++ ) {
+        io_apic_t *io_apic = &io_apics[i];
+        if( gsi < io_apic->gsi_base || gsi >= io_apic->gsi_base + io_apic->gsi_count ) continue;
+        *entry = IO_APIC_REDIRECTION_TABLE + 2 * (gsi - io_apic->gsi_base);
+        return io_apic;
+    }
+    panic( "io_apic: no IO-APIC has that GSI\n" );
+    return NULL;
+}
+
+// call after acpi_init & paging_init_kernel_pagemap. masks every input
+void io_apic_init() {
+    ticket_lock_init( &lock, "io_apic" );
+    io_apic_count = acpi_get_io_apic_count();
+    for( size_t i = 0; i < io_apic_count; i++ ) {
+        const acpi_io_apic_t *description = acpi_get_io_apic( i );
+        paging_map_mmio( (void*)(uint64_t)description->address, PAGE_SIZE );
+        io_apic_t *io_apic = &io_apics[i];
+        io_apic->registers = (volatile uint32_t*)(uint64_t)description->address;
+        io_apic->gsi_base = description->gsi_base;
+        io_apic->gsi_count = ((read_register( io_apic, IO_APIC_VERSION ) >> 16) & 0xFF) + 1;
+        for( uint32_t j = 0; j < io_apic->gsi_count; j++ ) write_register( io_apic, IO_APIC_REDIRECTION_TABLE + 2 * j, IO_APIC_ENTRY_MASKED );
+    }
+}
+
+bool io_apic_has_gsi( uint32_t gsi ) {
+    for( size_t i = 0; i < io_apic_count; i++ ) {
+        if( gsi >= io_apics[i].gsi_base && gsi < io_apics[i].gsi_base + io_apics[i].gsi_count ) return true;
+    }
+    return false;
+}
+
+// acpi_flags are the MADT's polarity & trigger mode (see acpi_get_isa_irq_gsi). the entry stays masked
+void io_apic_route( uint32_t gsi, uint8_t vector, uint16_t acpi_flags, uint32_t apic_id ) {
+    uint32_t entry, low = IO_APIC_ENTRY_MASKED | vector;
+    if( ACPI_IRQ_POLARITY_ACTIVE_LOW == (acpi_flags & ACPI_IRQ_POLARITY_MASK) ) low|= IO_APIC_ENTRY_ACTIVE_LOW;
+    if( ACPI_IRQ_TRIGGER_LEVEL == (acpi_flags & ACPI_IRQ_TRIGGER_MASK) ) low|= IO_APIC_ENTRY_LEVEL;
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    io_apic_t *io_apic = find( gsi, &entry );
+    write_register( io_apic, entry, IO_APIC_ENTRY_MASKED );
+    write_register( io_apic, entry + 1, apic_id << IO_APIC_DESTINATION_SHIFT );
+    write_register( io_apic, entry, low );
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+}
+
+void io_apic_set_masked( uint32_t gsi, bool masked ) {
+    uint32_t entry;
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    io_apic_t *io_apic = find( gsi, &entry );
+    uint32_t low = read_register( io_apic, entry );
+    write_register( io_apic, entry, masked ? low | IO_APIC_ENTRY_MASKED : low & ~IO_APIC_ENTRY_MASKED );
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+}
+
+// takes effect for the next interrupt (the destination is only read when the IO-APIC sends 1)
+void io_apic_set_destination( uint32_t gsi, uint32_t apic_id ) {
+    uint32_t entry;
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    io_apic_t *io_apic = find( gsi, &entry );
+    write_register( io_apic, entry + 1, apic_id << IO_APIC_DESTINATION_SHIFT );
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+}
+
+uint32_t io_apic_get_destination( uint32_t gsi ) {
+    uint32_t entry;
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    io_apic_t *io_apic = find( gsi, &entry );
+    uint32_t high = read_register( io_apic, entry + 1 );
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+    return high >> IO_APIC_DESTINATION_SHIFT;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// IO-APICs (see acpi.h for where they are), which deliver device interrupts to any CPU's local APIC, unlike the 8259 PIC (see pic.c)
+// each input (a global system interrupt, or GSI) has a redirection entry that picks its vector, its destination CPU (by APIC ID, in
+// physical mode), & how the line signals. entries start masked. irq.c decides what goes where
+void io_apic_init();
+bool io_apic_has_gsi( uint32_t gsi );
+void io_apic_route( uint32_t gsi, uint8_t vector, uint16_t acpi_flags, uint32_t apic_id );
+void io_apic_set_masked( uint32_t gsi, bool masked );
+void io_apic_set_destination( uint32_t gsi, uint32_t apic_id );
+uint32_t io_apic_get_destination( uint32_t gsi );
@@ -0,0 +1,306 @@
+#include <stddef.h>
+#include "irq.h"
+#include "interrupt_table.h"
+#include "io.h"
+#include "io_apic.h"
+#include "pic.h"
+#include "softirq.h"
+#include "timer.h"
+#include "../drivers/acpi.h" // for ISA IRQ routing & NUMA nodes
+#include "../drivers/vga_text.h" // for printing
+#include "../process/apic.h"
+#include "../process/cpu.h"
+#include "../main.h" // for panic
+#include "../sync/spinlock.h"
+
+#define NO_CPU CPU_MAX_COUNT
+#define CASCADE_IRQ 2 // links the 2nd PIC to the 1st, so it's never a device's IRQ (& the IO-APIC has no input for it)
+
+// the tests use the PIT's channel 0, which nothing else uses once timer_init has taken over (timer.c only uses channel 2)
+#define TEST_IRQ 0
+#define TEST_TIMEOUT_MICROSECONDS 100000
+#define PIT_CHANNEL_0_PORT 0x40
+#define PIT_COMMAND_PORT 0x43
+#define PIT_CHANNEL_0_RATE_GENERATOR 0x34 // channel 0, low byte then high byte, mode 2 (periodic), binary
+#define PIT_COUNT_1KHZ 1193
+
+// each CPU only counts the interrupts it takes, on cache lines of its own
+typedef struct irq_cpu {
+    uint64_t counts[IRQ_COUNT];
+} __attribute__((aligned(64))) irq_cpu_t;
+
+typedef struct irq {
+    bool routed; // has an IO-APIC input
+    uint32_t gsi;
+    uint16_t flags; // polarity & trigger mode, from the MADT
+    size_t cpu; // where the IO-APIC sends it
+    size_t consumer; // the CPU that consumes its completions (NO_CPU if no driver said)
+    uint64_t balanced_count; // its total count at the last balance
+} irq_t;
+
+static irq_cpu_t irq_cpus[CPU_MAX_COUNT];
+static irq_t irqs[IRQ_COUNT];
+static bool io_apic_enabled;
+static ticket_lock_t lock; // irqsave: protects the affinities
+static timer_t balance_timer;
+
+static bool is_routed( uint8_t irq ) {
+    return io_apic_enabled && irqs[irq].routed;
+}
+
+static uint64_t get_total_count( uint8_t irq ) {
+    uint64_t count = 0;
+    for( size_t cpu = 0; cpu < CPU_MAX_COUNT; cpu++ ) count+= irq_cpus[cpu].counts[irq];
+    return count;
+}
+
+static size_t get_node( size_t cpu ) {
+    return acpi_get_cpu_node( cpu_get_apic_id( cpu ) );
+}
+
+// lock must be held
+static void move( uint8_t irq, size_t cpu ) {
+    irqs[irq].cpu = cpu;
+    io_apic_set_destination( irqs[irq].gsi, cpu_get_apic_id( cpu ) );
+}
+
+// the least loaded CPU on a node that has room for rate w/o going past share, or else the least loaded CPU anywhere
+static size_t find_least_loaded( const uint64_t *loads, uint64_t cpus, size_t node, uint64_t rate, uint64_t share ) {
+    size_t best = NO_CPU, best_local = NO_CPU;
+    for( size_t cpu = 0; cpu < CPU_MAX_COUNT; cpu++ ) {
+        if( !(cpus & ((uint64_t)1 << cpu)) ) continue;
+        if( NO_CPU == best || loads[cpu] < loads[best] ) best = cpu;
+        if( get_node( cpu ) != node || loads[cpu] + rate > share ) continue;
+        if( NO_CPU == best_local || loads[cpu] < loads[best_local] ) best_local = cpu;
+    }
+    return NO_CPU != best_local ? best_local : best;
+}
+
+// picks a CPU (from the cpus bitmask, which mustn't be empty) for each IRQ, hottest 1st. an IRQ goes where it prefers to be (w/ its
+// consumer, or else where it is now), unless that would take the CPU past an even share of the total rate & some other CPU is less
+// loaded, in which case it goes to the least loaded CPU (on the same node, if one there has room)
+static void plan( const uint64_t *rates, const size_t *preferred, uint64_t cpus, size_t *assignment ) {
+    uint64_t loads[CPU_MAX_COUNT], total = 0;
+    for( size_t cpu = 0; cpu < CPU_MAX_COUNT; cpu++ ) loads[cpu] = 0;
+
+    // insertion sort, hottest 1st
+    size_t order[IRQ_COUNT];
+    for( size_t i = 0; i < IRQ_COUNT; i++ ) {
+        total+= rates[i];
+        size_t j = i;
+        for( ; j > 0 && rates[order[j - 1]] < rates[i]; j-- ) order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    size_t cpu_count = __builtin_popcountll( cpus );
+    uint64_t share = (total + cpu_count - 1) / cpu_count;
+    for( size_t i = 0; i < IRQ_COUNT; i++ ) {
+        size_t irq = order[i], cpu = preferred[irq];
+        if( NO_CPU == cpu || !(cpus & ((uint64_t)1 << cpu)) ) cpu = __builtin_ctzll( cpus );
+        if( loads[cpu] + rates[irq] > share ) {
+            size_t other = find_least_loaded( loads, cpus, get_node( cpu ), rates[irq], share );
+            if( loads[other] < loads[cpu] ) cpu = other;
+        }
+        assignment[irq] = cpu;
+        loads[cpu]+= rates[irq];
+    }
+}
+
+static void balance_work( uint64_t argument ) {
+    irq_balance();
+}
+
+static void balance( void *argument ) {
+    softirq_queue( balance_work, 0 ); // the IO-APIC's lock doesn't belong in the timer interrupt
+    timer_start( &balance_timer, balance_timer.deadline + timer_from_microseconds( IRQ_BALANCE_INTERVAL_MICROSECONDS ), balance, NULL );
+}
+
+// an override can move an ISA IRQ onto another IRQ's GSI (typically the PIT's IRQ 0 onto GSI 2), which leaves that IRQ w/o an input
+static bool is_overridden( uint8_t irq ) {
+    for( uint8_t other = 0; other < IRQ_COUNT; other++ ) {
+        if( other != irq && irqs[other].gsi == irqs[irq].gsi && irqs[other].gsi != other ) return true;
+    }
+    return false;
+}
+
+// call after acpi_init, apic_init, timer_init & smp_init. routes each ISA IRQ through the IO-APIC to this CPU (keeping the PIC's
+// masks), & starts the balancer. w/o an IO-APIC, IRQs stay on the PIC, where they're only counted
+void irq_init() {
+    ticket_lock_init( &lock, "irq" );
+    for( uint8_t irq = 0; irq < IRQ_COUNT; irq++ ) {
+        irqs[irq].gsi = acpi_get_isa_irq_gsi( irq, &irqs[irq].flags );
+        irqs[irq].consumer = NO_CPU;
+    }
+    if( 0 == acpi_get_io_apic_count() ) {
+        vga_text_print( "irq: no IO-APIC, so IRQs stay on the PIC\n", 0x17 );
+        return;
+    }
+    io_apic_init();
+
+    // nothing may arrive between the PIC's last IRQ & the IO-APIC's 1st, since the end of interrupt goes to one or the other
+    bool unmasked[IRQ_COUNT];
+    bool interrupts_were_enabled = interrupt_table_disable_interrupts();
+    for( uint8_t irq = 0; irq < IRQ_COUNT; irq++ ) {
+        irq_t *entry = &irqs[irq];
+        entry->routed = CASCADE_IRQ != irq && !is_overridden( irq ) && io_apic_has_gsi( entry->gsi );
+        entry->cpu = cpu_get_index();
+        unmasked[irq] = !pic_is_irq_masked( irq );
+        if( entry->routed ) io_apic_route( entry->gsi, INTERRUPT_INDEX_IRQ( irq ), entry->flags, cpu_get_apic_id( entry->cpu ) );
+    }
+    pic_disable_irqs();
+    io_apic_enabled = true;
+    for( uint8_t irq = 0; irq < IRQ_COUNT; irq++ ) {
+        if( is_routed( irq ) && unmasked[irq] ) io_apic_set_masked( irqs[irq].gsi, false );
+    }
+    interrupt_table_restore_interrupts( interrupts_were_enabled );
+
+    timer_start( &balance_timer, timer_now() + timer_from_microseconds( IRQ_BALANCE_INTERVAL_MICROSECONDS ), balance, NULL );
+}
+
+void irq_set_masked( uint8_t irq, bool masked ) {
+    if( irq >= IRQ_COUNT ) panic( "irq_set_masked: invalid IRQ\n" );
+    if( is_routed( irq ) ) io_apic_set_masked( irqs[irq].gsi, masked );
+    else if( !io_apic_enabled ) pic_set_irq_masked( irq, masked );
+}
+
+// called by the interrupt wrappers (see interrupt_wrappers.asm) once an IRQ's handler returns, & before its bottom half runs
+// (after the handler, so a level-triggered line that the handler just quieted doesn't fire again)
+void irq_end_of_interrupt( uint64_t irq ) {
+    irq_cpus[cpu_get_index()].counts[irq]++;
+    if( io_apic_enabled ) apic_send_eoi();
+    else pic_acknowledge_irq();
+}
+
+// moves an IRQ to an online CPU (until the balancer moves it again). IRQs on the PIC always go to the bootstrap CPU
+void irq_set_affinity( uint8_t irq, size_t cpu ) {
+    if( irq >= IRQ_COUNT || cpu >= CPU_MAX_COUNT || !cpu_is_online( cpu ) ) panic( "irq_set_affinity: invalid IRQ or CPU\n" );
+    if( !is_routed( irq ) ) return;
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    move( irq, cpu );
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+}
+
+// the CPU that takes the IRQ
+size_t irq_get_affinity( uint8_t irq ) {
+    return is_routed( irq ) ? irqs[irq].cpu : 0;
+}
+
+// call from the path that consumes an IRQ's completions (e.g. where a driver submits requests), so the balancer keeps the IRQ on the
+// executing CPU, & the completions stay in its cache
+void irq_note_consumer( uint8_t irq ) {
+    if( irq >= IRQ_COUNT ) return;
+    size_t cpu = cpu_get_index();
+    if( cpu != __atomic_load_n( &irqs[irq].consumer, __ATOMIC_RELAXED ) ) __atomic_store_n( &irqs[irq].consumer, cpu, __ATOMIC_RELAXED );
+}
+
+// # of times a CPU took an IRQ
+uint64_t irq_get_count( uint8_t irq, size_t cpu ) {
+    return irq_cpus[cpu].counts[irq];
+}
+
+// # of IRQs a CPU took
+uint64_t irq_get_cpu_count( size_t cpu ) {
+    uint64_t count = 0;
+    for( uint8_t irq = 0; irq < IRQ_COUNT; irq++ ) count+= irq_cpus[cpu].counts[irq];
+    return count;
+}
+
+// moves IRQs according to their rates since the last balance (see plan). the timer runs this in a softirq, once per interval
+void irq_balance() {
+    if( !io_apic_enabled ) return;
+    uint64_t rates[IRQ_COUNT], cpus = 0;
+    size_t preferred[IRQ_COUNT], assignment[IRQ_COUNT];
+    for( size_t cpu = 0; cpu < CPU_MAX_COUNT; cpu++ ) {
+        if( cpu_is_online( cpu ) ) cpus|= (uint64_t)1 << cpu;
+    }
+
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    for( uint8_t irq = 0; irq < IRQ_COUNT; irq++ ) {
+        uint64_t count = get_total_count( irq );
+        rates[irq] = is_routed( irq ) ? count - irqs[irq].balanced_count : 0;
+        irqs[irq].balanced_count = count;
+        size_t consumer = __atomic_load_n( &irqs[irq].consumer, __ATOMIC_RELAXED );
+        preferred[irq] = NO_CPU != consumer ? consumer : irqs[irq].cpu;
+    }
+    plan( rates, preferred, cpus, assignment );
+    for( uint8_t irq = 0; irq < IRQ_COUNT; irq++ ) {
+        if( is_routed( irq ) && assignment[irq] != irqs[irq].cpu ) move( irq, assignment[irq] );
+    }
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+}
+
+// a line per IRQ that has fired, "irq_stats irq=<n> cpu=<affinity> count=<total> rate=<count since the last balance>", & then a line
+// per online CPU, "irq_stats cpu=<n> count=<IRQs it took>"
+void irq_print_stats() {
+    for( uint8_t irq = 0; irq < IRQ_COUNT; irq++ ) {
+        uint64_t count = get_total_count( irq );
+        if( 0 == count ) continue;
+        vga_text_print_stat( "irq_stats irq=", irq );
+        vga_text_print_stat( " cpu=", irq_get_affinity( irq ) );
+        vga_text_print_stat( " count=", count );
+        vga_text_print_stat( " rate=", count - irqs[irq].balanced_count );
+        vga_text_print( "\n", 0x17 );
+    }
+    for( size_t cpu = 0; cpu < CPU_MAX_COUNT; cpu++ ) {
+        if( !cpu_is_online( cpu ) ) continue;
+        vga_text_print_stat( "irq_stats cpu=", cpu );
+        vga_text_print_stat( " count=", irq_get_cpu_count( cpu ) );
+        vga_text_print( "\n", 0x17 );
+    }
+}
+
+static void test_handler( uint64_t interrupt ) {}
+
+static void check_plan( const uint64_t *rates, const size_t *preferred, uint64_t cpus, size_t *assignment ) {
+    plan( rates, preferred, cpus, assignment );
+    for( size_t irq = 0; irq < IRQ_COUNT; irq++ ) {
+        if( !(cpus & ((uint64_t)1 << assignment[irq])) ) panic( "irq_run_tests: IRQ was assigned to a CPU that isn't in the set\n" );
+    }
+}
+
+// call after irq_init
+void irq_run_tests() {
+    // equally hot IRQs that all prefer 1 CPU get spread evenly, while cold IRQs stay put
+    uint64_t rates[IRQ_COUNT], loads[4] = { 0, 0, 0, 0 };
+    size_t preferred[IRQ_COUNT], assignment[IRQ_COUNT];
+    for( size_t irq = 0; irq < IRQ_COUNT; irq++ ) {
+        rates[irq] = irq < 4 ? 100 : 0;
+        preferred[irq] = irq < 4 ? 0 : 3;
+    }
+    check_plan( rates, preferred, 0xF, assignment );
+    for( size_t irq = 0; irq < 4; irq++ ) loads[assignment[irq]]+= rates[irq];
+    for( size_t cpu = 0; cpu < 4; cpu++ ) {
+        if( 100 != loads[cpu] ) panic( "irq_run_tests: hot IRQs weren't spread evenly\n" );
+    }
+    for( size_t irq = 4; irq < IRQ_COUNT; irq++ ) {
+        if( 3 != assignment[irq] ) panic( "irq_run_tests: cold IRQ was moved\n" );
+    }
+
+    // a hot IRQ stays w/ its consumer if moving it wouldn't even out the load, & a preferred CPU that's not in the set is replaced
+    for( size_t irq = 0; irq < IRQ_COUNT; irq++ ) rates[irq] = 0;
+    rates[5] = 1000;
+    preferred[5] = 2;
+    check_plan( rates, preferred, 0xF, assignment );
+    if( 2 != assignment[5] ) panic( "irq_run_tests: lone hot IRQ was moved away from its consumer\n" );
+    check_plan( rates, preferred, 0x3, assignment );
+
+    // every online CPU can take an IRQ: the PIT fires at 1 kHz while we route it to each in turn
+    if( !is_routed( TEST_IRQ ) ) return;
+    interrupt_handler *previous = interrupt_table_set_handler( INTERRUPT_INDEX_IRQ( TEST_IRQ ), (interrupt_handler*)test_handler );
+    io_write_byte( PIT_COMMAND_PORT, PIT_CHANNEL_0_RATE_GENERATOR );
+    io_write_byte( PIT_CHANNEL_0_PORT, (uint8_t)PIT_COUNT_1KHZ );
+    io_write_byte( PIT_CHANNEL_0_PORT, (uint8_t)(PIT_COUNT_1KHZ >> 8) );
+    size_t original = irq_get_affinity( TEST_IRQ );
+    for( size_t cpu = 0; cpu < CPU_MAX_COUNT; cpu++ ) {
+        if( !cpu_is_online( cpu ) ) continue;
+        irq_set_affinity( TEST_IRQ, cpu );
+        if( cpu != irq_get_affinity( TEST_IRQ ) || cpu_get_apic_id( cpu ) != io_apic_get_destination( irqs[TEST_IRQ].gsi ) ) panic( "irq_run_tests: affinity wasn't set\n" );
+        uint64_t count = irq_get_count( TEST_IRQ, cpu ), deadline = timer_now() + timer_from_microseconds( TEST_TIMEOUT_MICROSECONDS );
+        irq_set_masked( TEST_IRQ, false );
+        while( count == irq_get_count( TEST_IRQ, cpu ) && timer_now() < deadline ) cpu_pause();
+        irq_set_masked( TEST_IRQ, true );
+        if( count == irq_get_count( TEST_IRQ, cpu ) ) panic( "irq_run_tests: IRQ wasn't delivered to its CPU\n" );
+    }
+    irq_set_affinity( TEST_IRQ, original );
+    interrupt_table_set_handler( INTERRUPT_INDEX_IRQ( TEST_IRQ ), previous );
+}
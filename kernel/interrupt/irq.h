@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// device IRQs: ISA IRQs 0-15, which is also where the firmware routes PCI INTx lines (see pci.h). they start out on the 8259 PIC,
+// which only interrupts the bootstrap CPU. irq_init moves them to the IO-APIC (if there is one), & from then on a balancer runs once
+// per interval: it takes each IRQ's rate since the last run, & moves hot IRQs off of CPUs that have more than an even share of the
+// load. an IRQ's bottom half runs on the CPU that took it, so drivers can name the CPU that consumes their completions (see
+// irq_note_consumer), & the balancer keeps the IRQ there (or at least on its NUMA node) while that CPU isn't overloaded
+// note: the balancer's timer wakes the bootstrap CPU once per interval
+#define IRQ_COUNT 16
+#define IRQ_BALANCE_INTERVAL_MICROSECONDS 1000000
+
+void irq_init();
+void irq_set_masked( uint8_t irq, bool masked );
+void irq_end_of_interrupt( uint64_t irq );
+void irq_set_affinity( uint8_t irq, size_t cpu );
+size_t irq_get_affinity( uint8_t irq );
+void irq_note_consumer( uint8_t irq );
+uint64_t irq_get_count( uint8_t irq, size_t cpu );
+uint64_t irq_get_cpu_count( size_t cpu );
+void irq_balance();
+void irq_print_stats();
+void irq_run_tests();
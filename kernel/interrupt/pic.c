@@ -34,3 +34,14 @@ void pic_acknowledge_irq() {
     io_write_byte( PIC1_COMMAND_PORT, PIC_COMMAND_END_OF_INTERRUPT );
     io_write_byte( PIC2_COMMAND_PORT, PIC_COMMAND_END_OF_INTERRUPT );
 }
+
+// irq is 0-15. masking an IRQ on PIC2 leaves the cascade (IRQ 2) alone
+void pic_set_irq_masked( uint8_t irq, bool masked ) {
+    uint16_t port = irq < 8 ? PIC1_DATA_PORT : PIC2_DATA_PORT;
+    uint8_t bit = 1 << (irq & 7), mask = io_read_byte( port );
+    io_write_byte( port, masked ? mask | bit : mask & ~bit );
+}
+
+bool pic_is_irq_masked( uint8_t irq ) {
+    return 0 != (io_read_byte( irq < 8 ? PIC1_DATA_PORT : PIC2_DATA_PORT ) & (1 << (irq & 7)));
+}
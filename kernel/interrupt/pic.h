@@ -1,10 +1,13 @@
 #pragma once
 
-#pragma once
+#include <stdint.h>
+#include <stdbool.h>
 
-// note: we should be using APIC, but hey, we don't have all the time in the world for a hobby project, now do we?
+// note: only until irq_init moves the IRQs to the IO-APIC (see irq.h), or for good on machines that don't have one
 
 void pic_enable_irqs();
 void pic_disable_irqs();
 void pic_acknowledge_irq();
 void pic_remap_and_enable_irqs();
+void pic_set_irq_masked( uint8_t irq, bool masked );
+bool pic_is_irq_masked( uint8_t irq );
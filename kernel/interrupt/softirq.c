@@ -0,0 +1,156 @@
+#include <stddef.h>
+#include "softirq.h"
+#include "interrupt_table.h"
+#include "../process/cpu.h" // for per-CPU state
+#include "../main.h" // for panic
+
+#define INTERRUPT_FLAG (1 << 9)
+
+typedef struct softirq_work {
+    softirq_work_function *function;
+    uint64_t argument;
+} softirq_work_t;
+
+// only touched by its own CPU, so it just needs interrupts disabled, not locks
+typedef struct softirq_cpu {
+    softirq_work_t queue[SOFTIRQ_QUEUE_LENGTH];
+    size_t head, tail; // push @ head, pop @ tail
+    uint32_t raised; // bitmask of raised softirqs
+    uint32_t disable_count;
+    bool running;
+    uint64_t dropped; // work items lost b/c the queue was full
+} softirq_cpu_t;
+
+static softirq_cpu_t softirq_cpus[CPU_MAX_COUNT];
+static softirq_handler *softirq_handlers[SOFTIRQ_COUNT];
+
+void softirq_set_handler( uint32_t index, softirq_handler *handler ) {
+    if( index >= SOFTIRQ_COUNT ) panic( "softirq_set_handler: invalid softirq index\n" );
+    softirq_handlers[index] = handler;
+}
+
+void softirq_raise( uint32_t index ) {
+    if( index >= SOFTIRQ_COUNT ) panic( "softirq_raise: invalid softirq index\n" );
+    bool interrupts_were_enabled = interrupt_table_disable_interrupts();
+    softirq_cpus[cpu_get_index()].raised|= 1U << index;
+    interrupt_table_restore_interrupts( interrupts_were_enabled );
+}
+
+// returns false (and counts a drop) if the queue is full
+bool softirq_queue( softirq_work_function *function, uint64_t argument ) {
+    bool interrupts_were_enabled = interrupt_table_disable_interrupts();
+    softirq_cpu_t *cpu = &softirq_cpus[cpu_get_index()];
+    bool queued = cpu->head - cpu->tail < SOFTIRQ_QUEUE_LENGTH;
+    if( queued ) {
+        softirq_work_t *work = &cpu->queue[cpu->head++ & (SOFTIRQ_QUEUE_LENGTH - 1)];
+        work->function = function;
+        work->argument = argument;
+    } else {
+        cpu->dropped++;
+    }
+    interrupt_table_restore_interrupts( interrupts_were_enabled );
+    return queued;
+}
+
+void softirq_disable() {
+    bool interrupts_were_enabled = interrupt_table_disable_interrupts();
+    softirq_cpus[cpu_get_index()].disable_count++;
+    interrupt_table_restore_interrupts( interrupts_were_enabled );
+}
+
+// note: doesn't run pending work itself; that happens on the next interrupt exit or idle
+void softirq_enable() {
+    bool interrupts_were_enabled = interrupt_table_disable_interrupts();
+    softirq_cpu_t *cpu = &softirq_cpus[cpu_get_index()];
+    if( 0 == cpu->disable_count ) panic( "softirq_enable: softirqs are not disabled\n" );
+    cpu->disable_count--;
+    interrupt_table_restore_interrupts( interrupts_were_enabled );
+}
+
+// call w/ interrupts disabled. runs every pending softirq & work item w/ interrupts enabled, including any that get raised meanwhile
+static void drain( softirq_cpu_t *cpu ) {
+    cpu->running = true;
+    while( true ) {
+        // take a batch of softirqs
+        uint32_t raised = cpu->raised;
+        cpu->raised = 0;
+
+        // take 1 work item
+        softirq_work_t work = { NULL, 0 };
+        if( cpu->head != cpu->tail ) work = cpu->queue[cpu->tail++ & (SOFTIRQ_QUEUE_LENGTH - 1)];
+        if( 0 == raised && NULL == work.function ) break;
+
+        // run them w/ interrupts enabled
+        interrupt_table_restore_interrupts( true );
+        for( uint32_t i = 0; 0 != raised; i++, raised>>= 1 ) {
+            if( (raised & 1) && NULL != softirq_handlers[i] ) softirq_handlers[i]();
+        }
+        if( NULL != work.function ) work.function( work.argument );
+        interrupt_table_disable_interrupts();
+    }
+    cpu->running = false;
+}
+
+// runs pending bottom halves, unless they're disabled or we're already inside one
+void softirq_run() {
+    bool interrupts_were_enabled = interrupt_table_disable_interrupts();
+    softirq_cpu_t *cpu = &softirq_cpus[cpu_get_index()];
+    if( !cpu->running && 0 == cpu->disable_count ) drain( cpu );
+    interrupt_table_restore_interrupts( interrupts_were_enabled );
+}
+
+// called by the interrupt wrappers (w/ interrupts disabled) after the handler returns
+// if the interrupted code had interrupts disabled, then it's in a critical section, so the work waits for a later exit
+void softirq_on_interrupt_exit( uint64_t interrupted_flags ) {
+    if( !(interrupted_flags & INTERRUPT_FLAG) ) return;
+    softirq_cpu_t *cpu = &softirq_cpus[cpu_get_index()];
+    if( cpu->running || 0 != cpu->disable_count || (0 == cpu->raised && cpu->head == cpu->tail) ) return;
+    drain( cpu );
+}
+
+uint64_t softirq_get_dropped_count() {
+    return softirq_cpus[cpu_get_index()].dropped;
+}
+
+#define TEST_SOFTIRQ (SOFTIRQ_COUNT - 1)
+#define TEST_INTERRUPT 0x81
+
+static uint64_t test_sequence, test_softirq_runs;
+
+static void test_work( uint64_t argument ) {
+    if( test_sequence != argument ) panic( "softirq_run_tests: work items ran out of order\n" );
+    test_sequence++;
+}
+
+static void test_softirq() {
+    test_softirq_runs++;
+}
+
+// a top half: defers its work, which should run w/ interrupts enabled when the interrupt returns
+static void test_interrupt_handler( uint64_t interrupt ) {
+    softirq_queue( test_work, test_sequence );
+}
+
+// must run after interrupt_table_init, since it tests draining on interrupt exit
+void softirq_run_tests() {
+    // work items run in order, and raising a softirq repeatedly runs it once
+    softirq_set_handler( TEST_SOFTIRQ, test_softirq );
+    test_sequence = test_softirq_runs = 0;
+    softirq_disable();
+    for( uint64_t i = 0; i < 3; i++ ) softirq_queue( test_work, i );
+    softirq_raise( TEST_SOFTIRQ );
+    softirq_raise( TEST_SOFTIRQ );
+    softirq_run();
+    if( 0 != test_sequence || 0 != test_softirq_runs ) panic( "softirq_run_tests: work ran while softirqs were disabled\n" );
+    softirq_enable();
+    softirq_run();
+    if( 3 != test_sequence ) panic( "softirq_run_tests: work items didn't all run\n" );
+    if( 1 != test_softirq_runs ) panic( "softirq_run_tests: raised softirq didn't run exactly once\n" );
+    softirq_set_handler( TEST_SOFTIRQ, NULL );
+
+    // work queued by an interrupt handler runs before the interrupt returns to us
+    interrupt_handler *prior_handler = interrupt_table_set_handler( TEST_INTERRUPT, (interrupt_handler*)test_interrupt_handler );
+    asm volatile( "int %0" :: "i" (TEST_INTERRUPT) : "memory" );
+    if( 4 != test_sequence ) panic( "softirq_run_tests: work queued by an interrupt didn't run on interrupt exit\n" );
+    interrupt_table_set_handler( TEST_INTERRUPT, prior_handler );
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// bottom halves: interrupt handlers (top halves) run w/ interrupts disabled, so they should only acknowledge the device & defer the
+// rest of their work to here. deferred work runs w/ interrupts enabled, either on the way out of the outermost interrupt, or when idle
+// there are 2 kinds:
+// - softirqs: per-vector handlers that are raised by index; raising an already-raised softirq is free, so device completions get batched
+// - work items: a function + argument queued for a single run, in order, on the current CPU
+// note: bottom halves can interrupt any kernel code that runs w/ interrupts enabled, so data they share must use irqsave locks,
+// or be wrapped in softirq_disable/softirq_enable
+#define SOFTIRQ_COUNT 32
+#define SOFTIRQ_QUEUE_LENGTH 256 // work items per CPU, must be a power of 2
+
+// softirq indices
+#define SOFTIRQ_INDEX_NET 0 // network device completions (see virtio_net.c)
+#define SOFTIRQ_INDEX_COROUTINE 1 // runs this CPU's ready coroutines (see coroutine.c)
+
+typedef void (softirq_handler)();
+typedef void (softirq_work_function)( uint64_t argument );
+
+void softirq_set_handler( uint32_t index, softirq_handler *handler );
+void softirq_raise( uint32_t index );
+bool softirq_queue( softirq_work_function *function, uint64_t argument );
+void softirq_disable();
+void softirq_enable();
+void softirq_run();
+void softirq_on_interrupt_exit( uint64_t interrupted_flags );
+uint64_t softirq_get_dropped_count();
+void softirq_run_tests();
@@ -0,0 +1,254 @@
+#include <stddef.h>
+#include "timer.h"
+#include "interrupt_table.h"
+#include "io.h"
+#include "irq.h"
+#include "softirq.h"
+#include "../buffer/string.h" // for printing
+#include "../drivers/vga_text.h" // "
+#include "../process/apic.h"
+#include "../process/cpu.h"
+#include "../sync/rcu.h" // the tick provides quiescent states
+#include "../main.h" // for panic
+
+//#define REPORT_WAKEUPS // prints wakeups per second for every CPU, once a second (this costs the bootstrap CPU 1 wakeup/s)
+
+// PIT channel 2 is gated by port 0x61 & its output can be polled there, so we can time an interval w/o interrupts
+#define PIT_FREQUENCY 1193182
+#define PIT_CHANNEL_2_PORT 0x42
+#define PIT_COMMAND_PORT 0x43
+#define PIT_CHANNEL_2_GATE_PORT 0x61
+#define PIT_CHANNEL_2_GATE (1 << 0)
+#define PIT_SPEAKER (1 << 1)
+#define PIT_CHANNEL_2_OUTPUT (1 << 5)
+#define PIT_CHANNEL_2_ONE_SHOT 0xB0 // channel 2, low byte then high byte, mode 0 (interrupt on terminal count), binary
+#define PIT_IRQ 0
+#define CALIBRATION_MICROSECONDS 10000
+
+typedef struct timer_cpu {
+    rb_tree_t timers;
+    timer_t tick;
+    bool idle;
+    uint64_t wakeups, reported_wakeups;
+} timer_cpu_t;
+
+static timer_cpu_t timer_cpus[CPU_MAX_COUNT];
+static uint64_t tsc_frequency; // TSC cycles per second
+static uint64_t apic_ticks_per_tsc_cycle; // 32.32 fixed point
+static uint64_t tick_period;
+
+#define timer_deadline( timer ) ((timer)->deadline)
+#define compare_deadlines( a, b ) ((a) < (b) ? -1 : (a) > (b))
+RB_TREE_DEFINE( timer_tree, timer_t, node, uint64_t, timer_deadline, compare_deadlines )
+
+uint64_t timer_now() {
+    return cpu_read_timestamp();
+}
+
+uint64_t timer_get_frequency() {
+    return tsc_frequency;
+}
+
+uint64_t timer_from_microseconds( uint64_t microseconds ) {
+    return microseconds * (tsc_frequency / 1000000);
+}
+
+// busy-waits, so it works w/ interrupts disabled
+void timer_delay_microseconds( uint64_t microseconds ) {
+    uint64_t end = timer_now() + timer_from_microseconds( microseconds );
+    while( timer_now() < end ) cpu_pause();
+}
+
+// call w/ interrupts disabled. programs the APIC timer for the earliest deadline, or stops it if there's none
+static void program( timer_cpu_t *cpu ) {
+    rb_tree_node_t *first = rb_tree_first( &cpu->timers );
+    if( NULL == first ) {
+        apic_timer_stop();
+        return;
+    }
+
+    // cap the delay at 1 second to keep the fixed-point math in 64 bits (if the deadline is further out, we just wake up & reprogram)
+    uint64_t deadline = rb_tree_entry( first, timer_t, node )->deadline, now = timer_now();
+    uint64_t delay = deadline > now ? deadline - now : 0;
+    if( delay > tsc_frequency ) delay = tsc_frequency;
+    uint64_t count = (delay * apic_ticks_per_tsc_cycle) >> 32;
+    apic_timer_start( 0 == count ? 1 : (uint32_t)count, true );
+}
+
+// runs expired timers. the APIC timer may also fire early (for a cancelled timer) or late (for a deadline > 1 s away)
+static void timer_handler( uint64_t interrupt ) {
+    apic_send_eoi();
+    timer_cpu_t *cpu = &timer_cpus[cpu_get_index()];
+    rb_tree_node_t *first;
+    while( NULL != (first = rb_tree_first( &cpu->timers )) ) {
+        timer_t *timer = rb_tree_entry( first, timer_t, node );
+        if( timer->deadline > timer_now() ) break;
+        rb_tree_remove( &cpu->timers, first );
+        timer->pending = false;
+        timer->function( timer->argument );
+    }
+    program( cpu );
+}
+
+// the timer runs on the CPU that started it, & must be cancelled on that CPU too
+void timer_start( timer_t *timer, uint64_t deadline, timer_function *function, void *argument ) {
+    bool interrupts_were_enabled = interrupt_table_disable_interrupts();
+    timer_cpu_t *cpu = &timer_cpus[cpu_get_index()];
+    if( timer->pending ) rb_tree_remove( &cpu->timers, &timer->node );
+    timer->deadline = deadline;
+    timer->function = function;
+    timer->argument = argument;
+    timer->pending = true;
+    timer_tree_insert( &cpu->timers, timer );
+    if( &timer->node == rb_tree_first( &cpu->timers ) ) program( cpu );
+    interrupt_table_restore_interrupts( interrupts_were_enabled );
+}
+
+// the APIC timer stays programmed, so it may fire once for nothing
+void timer_cancel( timer_t *timer ) {
+    bool interrupts_were_enabled = interrupt_table_disable_interrupts();
+    if( timer->pending ) rb_tree_remove( &timer_cpus[cpu_get_index()].timers, &timer->node );
+    timer->pending = false;
+    interrupt_table_restore_interrupts( interrupts_were_enabled );
+}
+
+static void tick( void *argument ) {
+    timer_cpu_t *cpu = argument;
+    rcu_note_clock_tick();
+
+    // if we fell behind (e.g. interrupts were disabled for a while), skip the missed ticks rather than firing them back to back
+    uint64_t deadline = cpu->tick.deadline + tick_period, now = timer_now();
+    timer_start( &cpu->tick, deadline > now ? deadline : now + tick_period, tick, cpu );
+}
+
+// call before halting, w/ interrupts enabled: stops the tick, so that only real deadlines wake us
+void timer_enter_idle() {
+    if( 0 == tick_period ) return; // not initialized yet
+    timer_cpu_t *cpu = &timer_cpus[cpu_get_index()];
+    cpu->idle = true;
+    timer_cancel( &cpu->tick );
+}
+
+// call after halting: the CPU is busy again, so it gets its tick back
+void timer_exit_idle() {
+    if( 0 == tick_period ) return;
+    timer_cpu_t *cpu = &timer_cpus[cpu_get_index()];
+    if( !cpu->idle ) return;
+    cpu->idle = false;
+    cpu->wakeups++;
+    timer_start( &cpu->tick, timer_now() + tick_period, tick, cpu );
+}
+
+uint64_t timer_get_wakeups( size_t cpu_index ) {
+    return timer_cpus[cpu_index].wakeups;
+}
+
+// prints each CPU's wakeups since the last call
+void timer_print_wakeups() {
+    vga_text_print( "wakeups:", 0x17 );
+    for( size_t i = 0; i < CPU_MAX_COUNT; i++ ) {
+        if( !cpu_is_online( i ) ) continue;
+        timer_cpu_t *cpu = &timer_cpus[i];
+        uint64_t wakeups = cpu->wakeups;
+        vga_text_print( " cpu", 0x17 );
+        vga_text_print( string_from_int64( (int64_t)i ), 0x17 );
+        vga_text_print( "=", 0x17 );
+        vga_text_print( string_from_int64( (int64_t)(wakeups - cpu->reported_wakeups) ), 0x17 );
+        cpu->reported_wakeups = wakeups;
+    }
+    vga_text_print( "\n", 0x17 );
+}
+
+#ifdef REPORT_WAKEUPS
+static timer_t report_timer;
+
+static void report_work( uint64_t argument ) {
+    timer_print_wakeups();
+}
+
+static void report( void *argument ) {
+    softirq_queue( report_work, 0 ); // printing is too slow for the timer interrupt
+    timer_start( &report_timer, report_timer.deadline + tsc_frequency, report, NULL );
+}
+#endif
+
+// measures the TSC & APIC timer rates against the PIT
+static void calibrate() {
+    uint8_t gate = io_read_byte( PIT_CHANNEL_2_GATE_PORT ) & ~PIT_SPEAKER & ~PIT_CHANNEL_2_GATE;
+    io_write_byte( PIT_CHANNEL_2_GATE_PORT, gate );
+    io_write_byte( PIT_COMMAND_PORT, PIT_CHANNEL_2_ONE_SHOT );
+    uint16_t count = PIT_FREQUENCY / (1000000 / CALIBRATION_MICROSECONDS);
+    io_write_byte( PIT_CHANNEL_2_PORT, (uint8_t)count );
+    io_write_byte( PIT_CHANNEL_2_PORT, (uint8_t)(count >> 8) );
+
+    // raising the gate starts the countdown
+    apic_timer_start( 0xFFFFFFFF, false );
+    uint64_t tsc_start = timer_now();
+    io_write_byte( PIT_CHANNEL_2_GATE_PORT, gate | PIT_CHANNEL_2_GATE );
+    while( !(io_read_byte( PIT_CHANNEL_2_GATE_PORT ) & PIT_CHANNEL_2_OUTPUT) );
+    uint64_t tsc_cycles = timer_now() - tsc_start, apic_ticks = 0xFFFFFFFF - apic_timer_read();
+    apic_timer_stop();
+    io_write_byte( PIT_CHANNEL_2_GATE_PORT, gate );
+
+    if( 0 == tsc_cycles || 0 == apic_ticks ) panic( "timer_init: calibration failed\n" );
+    tsc_frequency = tsc_cycles * (1000000 / CALIBRATION_MICROSECONDS);
+    apic_ticks_per_tsc_cycle = (apic_ticks << 32) / tsc_cycles;
+}
+
+static void init_cpu() {
+    timer_cpu_t *cpu = &timer_cpus[cpu_get_index()];
+    rb_tree_init( &cpu->timers );
+    apic_timer_init( INTERRUPT_INDEX_TIMER );
+    timer_start( &cpu->tick, timer_now() + tick_period, tick, cpu );
+}
+
+// call after apic_init, w/ interrupts enabled. replaces the PIT's fixed-rate clock interrupt
+void timer_init() {
+    apic_timer_init( INTERRUPT_INDEX_TIMER );
+    calibrate();
+    tick_period = tsc_frequency / TIMER_TICK_HZ;
+    interrupt_table_set_handler( INTERRUPT_INDEX_TIMER, (interrupt_handler*)timer_handler );
+    irq_set_masked( PIT_IRQ, true );
+    init_cpu();
+
+    vga_text_print( "timer: TSC @ ", 0x17 );
+    vga_text_print( string_from_int64( (int64_t)(tsc_frequency / 1000000) ), 0x17 );
+    vga_text_print( " MHz\n", 0x17 );
+
+    #ifdef REPORT_WAKEUPS
+    timer_start( &report_timer, timer_now() + tsc_frequency, report, NULL );
+    #endif
+}
+
+// application processors reuse the bootstrap processor's calibration
+void timer_init_ap() {
+    init_cpu();
+}
+
+static volatile uint64_t test_sequence;
+
+static void test_timer( void *argument ) {
+    if( test_sequence != (uint64_t)argument ) panic( "timer_run_tests: timers fired out of order\n" );
+    test_sequence++;
+}
+
+static void test_cancelled_timer( void *argument ) {
+    panic( "timer_run_tests: cancelled timer fired\n" );
+}
+
+void timer_run_tests() {
+    // timers fire in deadline order, regardless of start order, & cancelled timers don't fire
+    timer_t timers[4];
+    for( size_t i = 0; i < 4; i++ ) timers[i].pending = false;
+    uint64_t now = timer_now();
+    test_sequence = 0;
+    timer_start( &timers[0], now + timer_from_microseconds( 3000 ), test_timer, (void*)2 );
+    timer_start( &timers[1], now + timer_from_microseconds( 1000 ), test_timer, (void*)0 );
+    timer_start( &timers[2], now + timer_from_microseconds( 2000 ), test_timer, (void*)1 );
+    timer_start( &timers[3], now + timer_from_microseconds( 1500 ), test_cancelled_timer, NULL );
+    timer_cancel( &timers[3] );
+
+    // idle until they've all fired (idling also exercises stopping & restarting the tick)
+    while( 3 != test_sequence ) interrupt_table_wait_for_interrupt();
+    if( timer_now() < now + timer_from_microseconds( 3000 ) ) panic( "timer_run_tests: timer fired early\n" );
+}
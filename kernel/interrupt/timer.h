@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "../memory/rb_tree.h"
+
+// tickless timers, on each CPU's local APIC timer in one-shot mode (the PIT is only used for calibration, then masked)
+// time is measured in TSC cycles. each CPU keeps its pending timers in a tree ordered by deadline, & programs the APIC timer for the
+// earliest one. while a CPU is busy it also gets a periodic tick (for RCU quiescent states), but the tick stops while the CPU idles,
+// so an idle CPU only wakes up for real deadlines & interrupts
+#define TIMER_TICK_HZ 100
+
+typedef void (timer_function)( void *argument );
+
+typedef struct timer {
+    rb_tree_node_t node;
+    uint64_t deadline; // TSC cycles
+    timer_function *function; // runs in the timer interrupt, so it must be short (defer longer work to a softirq)
+    void *argument;
+    bool pending;
+} timer_t;
+
+void timer_init();
+void timer_init_ap();
+uint64_t timer_now();
+uint64_t timer_get_frequency();
+uint64_t timer_from_microseconds( uint64_t microseconds );
+void timer_delay_microseconds( uint64_t microseconds );
+void timer_start( timer_t *timer, uint64_t deadline, timer_function *function, void *argument );
+void timer_cancel( timer_t *timer );
+void timer_enter_idle();
+void timer_exit_idle();
+uint64_t timer_get_wakeups( size_t cpu_index );
+void timer_print_wakeups();
+void timer_run_tests();
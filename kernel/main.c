@@ -2,24 +2,57 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "main.h"
+#include "boot_timeline.h"
 #include "buffer/string.h"
 #include "drivers/vga_text.h"
 #include "memory/paging.h"
 #include "memory/kernel_heap.h"
+#include "memory/arena.h"
+#include "memory/rb_tree.h"
+#include "memory/hash_table.h"
+#include "memory/page_allocator.h"
+#include "memory/tlb.h"
+#include "memory/memory_benchmark.h"
 #include "interrupt/interrupt_table.h"
+#include "interrupt/softirq.h"
+#include "interrupt/clock.h"
+#include "interrupt/timer.h"
+#include "interrupt/irq.h"
 #include "drivers/ps2_keyboard.h"
+#include "drivers/framebuffer.h"
+#include "drivers/acpi.h"
+#include "net/net.h"
+#include "process/cpu.h"
+#include "process/gdt.h"
+#include "process/syscall.h"
+#include "process/process.h"
+#include "process/channel.h"
+#include "process/elf.h"
+#include "process/apic.h"
+#include "process/smp.h"
+#include "process/task_pool.h"
+#include "process/coroutine.h"
+#include "sync/spinlock.h"
+#include "sync/rwlock.h"
+#include "sync/rcu.h"
+#include "sync/futex.h"
+
+//#define RUN_BENCHMARKS
+//#define FRAMEBUFFER_CONSOLE // 1024x768 linear framebuffer console (needs qemu's default "-vga std"), instead of 80x25 VGA text mode
 
 static void suspend() {
     while( true ) { asm ( "cli\n" "hlt\n" ); }
 }
 
 void panic( const char* details ) {
-    // print messages
+    // print messages w/ interrupts off (so no handler can spin on the console lock), & w/o the console lock, since we may have
+    // panicked while holding it
+    asm volatile( "cli" ::: "memory" );
     if( NULL != details ) {
-        vga_text_print( "System panic: ", 0x4F );
-        vga_text_print( details, 0x4F );
+        vga_text_print_unlocked( "System panic: ", 0x4F );
+        vga_text_print_unlocked( details, 0x4F );
     } else {
-        vga_text_print( "System panic!\n", 0x4F );
+        vga_text_print_unlocked( "System panic!\n", 0x4F );
     }
 
     // suspend CPU
@@ -27,24 +60,169 @@ void panic( const char* details ) {
 }
 
 void main() {
+    // record the boot sector's & start.asm's phases before anything else, so "main" only covers start64
+    boot_timeline_init();
+
     // clear background to blue, and display welcome message
     vga_text_clear( 0x17 );
     vga_text_print( "Welcome to the 64-bit kernel!\n", 0x17 );
+    boot_timeline_mark( "vga_text_clear" );
 
     // run string tests
     string_run_tests();
+    boot_timeline_mark( "string_run_tests" );
 
     // initialize the kernel heap (this also runs heap tests)
     kernel_heap_init();
+    boot_timeline_mark( "kernel_heap_init" );
+
+    // run arena & container tests (these are built on the kernel heap)
+    arena_run_tests();
+    rb_tree_run_tests();
+    hash_table_run_tests();
+    boot_timeline_mark( "container_tests" );
+
+    // put per-CPU caches in front of the kernel heap for small objects (after the tests above, which check the shared heap's stats)
+    kernel_heap_init_caches();
+    boot_timeline_mark( "kernel_heap_init_caches" );
+
+    // find the CPUs, IO-APICs & NUMA nodes in the firmware's ACPI tables (before the page allocator can hand out the memory they're in)
+    acpi_init();
+    boot_timeline_mark( "acpi_init" );
+
+    // initialize the physical page allocator, which owns the memory above the kernel heap (w/ a pool per NUMA node)
+    page_allocator_init();
+    boot_timeline_mark( "page_allocator_init" );
+
+    // replace the boot pagemap w/ one that we control
+    paging_init_kernel_pagemap();
+    boot_timeline_mark( "paging_init_kernel_pagemap" );
+
+    // let the kernel use SSE (for the framebuffer console's blits)
+    cpu_enable_sse();
+
+    // test the pre-zeroed page pool (which needs all of physical memory to be mapped)
+    page_allocator_run_tests();
+    boot_timeline_mark( "page_allocator_run_tests" );
+
+    // switch the console over to the framebuffer (this needs paging, to map the framebuffer)
+    #ifdef FRAMEBUFFER_CONSOLE
+    if( framebuffer_init() ) vga_text_use_framebuffer();
+    boot_timeline_mark( "framebuffer_init" );
+    #endif
+
+    // replace the boot GDT w/ one that supports ring 3
+    gdt_init();
+    boot_timeline_mark( "gdt_init" );
 
     // initialize the interrupt table
     interrupt_table_init();
+    boot_timeline_mark( "interrupt_table_init" );
+
+    // run lock tests (these check that irqsave locks restore the interrupt flag, so they need interrupts to be working)
+    spinlock_run_tests();
+    rwlock_run_tests();
+    rcu_run_tests();
+    boot_timeline_mark( "lock_tests" );
+
+    // test deferred interrupt work
+    softirq_run_tests();
+    boot_timeline_mark( "softirq_run_tests" );
+
+    // replace the PIT's fixed-rate clock w/ tickless local APIC timers
+    apic_init();
+    timer_init();
+    timer_run_tests();
+    boot_timeline_mark( "timer_init" );
+
+    // start the other CPUs, which become task pool workers
+    smp_init();
+    boot_timeline_mark( "smp_init" );
+    task_pool_run_tests();
+    boot_timeline_mark( "task_pool_run_tests" );
+
+    // check the ACPI topology against the CPUs that came up
+    acpi_run_tests();
+    boot_timeline_mark( "acpi_run_tests" );
+
+    // route IRQs through the IO-APIC, so they can be delivered to (& balanced across) every CPU
+    irq_init();
+    irq_run_tests();
+    boot_timeline_mark( "irq_init" );
+
+    // enable the per-CPU coroutine executors, which drive asynchronous driver code
+    coroutine_init();
+    coroutine_run_tests();
+    boot_timeline_mark( "coroutine_init" );
+
+    // enable TLB shootdowns, so CPUs can change mappings that other CPUs are using
+    tlb_init();
+    tlb_run_tests();
+    boot_timeline_mark( "tlb_init" );
+
+    // test huge-page promotion (which also promotes the kernel's identity map)
+    paging_run_tests();
+    boot_timeline_mark( "paging_run_tests" );
+
+    // enable syscalls, and then processes (this also runs ring 3 test programs)
+    syscall_init();
+    process_init();
+    boot_timeline_mark( "process_init" );
+
+    // enable IPC channels between processes
+    channel_init();
+    channel_run_tests();
+    boot_timeline_mark( "channel_init" );
+
+    // test the ELF loader
+    elf_run_tests();
+    boot_timeline_mark( "elf_run_tests" );
+
+    // enable futex wait queues for kernel code & processes
+    futex_init();
+    futex_run_tests();
+    boot_timeline_mark( "futex_init" );
+
+    // publish the clock page, which lets processes read the time w/o a syscall
+    clock_init();
+    clock_run_tests();
+    boot_timeline_mark( "clock_init" );
 
     // now that we have interrupts & IRQs working, we can enable the keyboard driver
     ps2_keyboard_init();
+    boot_timeline_mark( "ps2_keyboard_init" );
+
+    // bring up the network (the tests use loopback, so they run even w/o a network device)
+    net_init();
+    net_run_tests();
+    boot_timeline_mark( "net_init" );
+
+    // report where startup time went (everything from here on is benchmarks & the main loop)
+    boot_timeline_run_tests();
+    boot_timeline_print();
+
+    // run benchmarks
+    #ifdef RUN_BENCHMARKS
+    page_allocator_run_benchmark();
+    kernel_heap_run_benchmark();
+    syscall_run_benchmark();
+    task_pool_run_benchmark();
+    coroutine_run_benchmark();
+    vga_text_run_benchmark();
+    net_run_benchmark();
+    channel_run_benchmark();
+    elf_run_benchmark();
+    futex_run_benchmark();
+    tlb_run_benchmark();
+    clock_run_benchmark();
+    memory_benchmark_run( MEMORY_BENCHMARK_MIN_WORKING_SET, MEMORY_BENCHMARK_MAX_WORKING_SET );
+    irq_print_stats();
+    #endif
 
-    // main loop
+    // main loop: top up the pool of zeroed pages & promote fully populated kernel ranges to huge pages before going idle
     while( true ) {
+        page_allocator_fill_zeroed_pool();
+        paging_promote_huge_pages( paging_get_kernel_pagemap() );
         interrupt_table_wait_for_interrupt();
     }
 
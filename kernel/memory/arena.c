@@ -0,0 +1,93 @@
+#include <stdint.h>
+#include "arena.h"
+#include "kernel_heap.h"
+#include "../main.h" // for panic
+
+// align must be a power of 2 (or else undefined behavior)
+static size_t upalign( size_t value, size_t align ) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+void arena_init( arena_t *arena, size_t chunk_size ) {
+    arena->chunk = NULL;
+    arena->next = arena->end = NULL;
+    arena->chunk_size = chunk_size;
+}
+
+static void use_chunk( arena_t *arena, arena_chunk_t *chunk, void *next ) {
+    arena->chunk = chunk;
+    arena->next = next;
+    arena->end = NULL == chunk ? NULL : (void*)chunk + chunk->size;
+}
+
+// slow path: push a new chunk that's big enough for the object
+static void push_chunk( arena_t *arena, size_t object_size ) {
+    size_t chunk_size = sizeof( arena_chunk_t ) + object_size;
+    if( chunk_size < arena->chunk_size ) chunk_size = arena->chunk_size;
+    arena_chunk_t *chunk = kernel_heap_alloc( chunk_size );
+    if( NULL == chunk ) return;
+    kernel_heap_tag( chunk, KERNEL_HEAP_TAG_ARENA );
+    chunk->prior = arena->chunk;
+    chunk->size = chunk_size;
+    use_chunk( arena, chunk, (void*)chunk + sizeof( arena_chunk_t ) );
+}
+
+// objects are 8-byte aligned
+void *arena_alloc( arena_t *arena, size_t object_size ) {
+    object_size = upalign( object_size, sizeof( size_t ) );
+    if( (size_t)(arena->end - arena->next) < object_size ) {
+        push_chunk( arena, object_size );
+        if( (size_t)(arena->end - arena->next) < object_size ) return NULL;
+    }
+    void *object = arena->next;
+    arena->next+= object_size;
+    return object;
+}
+
+arena_mark_t arena_mark( arena_t *arena ) {
+    arena_mark_t mark = { arena->chunk, arena->next };
+    return mark;
+}
+
+// frees everything that was allocated after the mark
+void arena_rewind( arena_t *arena, arena_mark_t mark ) {
+    while( arena->chunk != mark.chunk ) {
+        if( NULL == arena->chunk ) panic( "arena_rewind: mark does not belong to this arena\n" );
+        arena_chunk_t *prior = arena->chunk->prior;
+        kernel_heap_free( arena->chunk );
+        arena->chunk = prior;
+    }
+    use_chunk( arena, mark.chunk, mark.next );
+}
+
+void arena_release( arena_t *arena ) {
+    arena_mark_t empty = { NULL, NULL };
+    arena_rewind( arena, empty );
+}
+
+void arena_run_tests() {
+    const freelist_heap_stats_t *stats = kernel_heap_get_stats();
+    size_t live_objects = stats->live_objects;
+    arena_t arena;
+    arena_init( &arena, 256 );
+
+    // consecutive allocations are adjacent
+    char *obj1 = arena_alloc( &arena, 3 ), *obj2 = arena_alloc( &arena, 8 );
+    if( obj2 != obj1 + 8 ) panic( "arena_run_tests: consecutive objects must be adjacent" );
+
+    // rewinding makes the arena hand out the same memory again, and frees chunks pushed after the mark
+    arena_mark_t mark = arena_mark( &arena );
+    char *obj3 = arena_alloc( &arena, 16 );
+    for( size_t i = 0; i < 64; i++ ) arena_alloc( &arena, 64 );
+    if( stats->live_objects <= live_objects + 1 ) panic( "arena_run_tests: arena must grow by pushing chunks" );
+    arena_rewind( &arena, mark );
+    if( live_objects + 1 != stats->live_objects ) panic( "arena_run_tests: rewind must free chunks pushed after the mark" );
+    if( obj3 != arena_alloc( &arena, 16 ) ) panic( "arena_run_tests: rewind must reuse memory after the mark" );
+
+    // objects bigger than a chunk get a chunk of their own
+    if( NULL == arena_alloc( &arena, 1000 ) ) panic( "arena_run_tests: failed to allocate an object bigger than a chunk" );
+
+    // releasing frees every chunk
+    arena_release( &arena );
+    if( live_objects != stats->live_objects ) panic( "arena_run_tests: release must free every chunk" );
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+
+// bump-pointer allocator for objects that all die together: allocation is a pointer increment, and there's no per-object free
+// memory comes from the kernel heap in chunks, which are only returned on rewind or release
+typedef struct arena_chunk {
+    struct arena_chunk *prior; // chunks form a stack, w/ the newest on top
+    size_t size; // includes this header
+} arena_chunk_t;
+
+typedef struct arena {
+    arena_chunk_t *chunk; // current chunk (NULL until the 1st allocation)
+    void *next, *end; // free space left in the current chunk
+    size_t chunk_size; // size of each new chunk (unless an allocation needs more)
+} arena_t;
+
+// a position in the arena, which can be rewound to later
+typedef struct arena_mark {
+    arena_chunk_t *chunk;
+    void *next;
+} arena_mark_t;
+
+void arena_init( arena_t *arena, size_t chunk_size );
+void *arena_alloc( arena_t *arena, size_t object_size );
+arena_mark_t arena_mark( arena_t *arena );
+void arena_rewind( arena_t *arena, arena_mark_t mark );
+void arena_release( arena_t *arena );
+void arena_run_tests();
@@ -17,3 +17,14 @@ circular_list_node_t *circular_list_pop_prior( circular_list_node_t *node );
 circular_list_node_t *circular_list_find( circular_list_node_t *start, bool (*match)(circular_list_node_t* node, void *closure), void *closure );
 size_t circular_list_length( circular_list_node_t *start );
 void circular_list_foreach( circular_list_node_t *start, void (*on_node)(circular_list_node_t *node, void *closure), void *closure );
+
+// inlinable alternatives to circular_list_find & circular_list_foreach, which avoid an indirect call per node
+#define circular_list_entry( node, type, member ) ((type*)((char*)(node) - offsetof( type, member )))
+
+// visits every node after start, stopping when it gets back to start (which is usually the root); 'break' works as expected
+#define circular_list_for_each( node, start ) \
+    for( circular_list_node_t *node = (start)->next; node != (start); node = node->next )
+
+// same, but the current node may be removed (or freed) while iterating
+#define circular_list_for_each_safe( node, start ) \
+    for( circular_list_node_t *node = (start)->next, *node##_next = node->next; node != (start); node = node##_next, node##_next = node->next )
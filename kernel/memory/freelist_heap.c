@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include "circular_list.h"
 #include "freelist_heap.h"
+#include "../buffer/buffer.h" // for copying & clearing objects
 #include "../buffer/string.h" // print freelist_heap_print
 #include "../drivers/vga_text.h" // "
 #include "../main.h" // for panic
@@ -25,30 +26,108 @@ typedef struct heap {
     free_block_t root;
 } heap_t;
 
+// used blocks keep their allocation-site tag in the top bits of their size
+#define TAG_SHIFT 48
+#define SIZE_MASK (((size_t)1 << TAG_SHIFT) - 1)
+
 // align must be a power of 2 (or else undefined behavior)
 static size_t upalign( size_t value, size_t align ) {
     return (value + align - 1) & ~(align - 1);
 }
 
+// the stats live at the end of the heap, rather than in its header, so that the heap's layout doesn't depend on the stats
+static size_t get_stats_offset( size_t heap_size ) {
+    return (heap_size - sizeof( freelist_heap_stats_t )) & ~(sizeof( size_t ) - 1);
+}
+
+static freelist_heap_stats_t *get_stats( heap_t *heap ) {
+    return (void*)heap + get_stats_offset( heap->size );
+}
+
+static size_t get_size_class( size_t size ) {
+    size_t size_class = 63 - __builtin_clzll( size | 1 );
+    return size_class < FREELIST_HEAP_SIZE_CLASSES ? size_class : FREELIST_HEAP_SIZE_CLASSES - 1;
+}
+
+static void count_free_block( freelist_heap_stats_t *stats, size_t size ) {
+    stats->free_bytes+= size;
+    stats->free_blocks++;
+    stats->free_block_histogram[get_size_class( size )]++;
+    if( size >= stats->largest_free_block ) {
+        stats->largest_free_block = size;
+        stats->largest_free_block_is_stale = false;
+    }
+}
+
+static void uncount_free_block( freelist_heap_stats_t *stats, size_t size ) {
+    stats->free_bytes-= size;
+    stats->free_blocks--;
+    stats->free_block_histogram[get_size_class( size )]--;
+
+    // if this was the largest block, we no longer know what the largest block is (freelist_heap_get_stats will find out)
+    if( size == stats->largest_free_block ) stats->largest_free_block_is_stale = true;
+}
+
+static void count_used_bytes( freelist_heap_stats_t *stats, int64_t size, size_t tag ) {
+    stats->bytes_in_use+= size;
+    stats->tag_bytes_in_use[tag]+= size;
+    if( stats->bytes_in_use > stats->peak_bytes_in_use ) stats->peak_bytes_in_use = stats->bytes_in_use;
+}
+
+static void count_used_block( freelist_heap_stats_t *stats, size_t size, size_t tag ) {
+    count_used_bytes( stats, (int64_t)size, tag );
+    stats->live_objects++;
+    stats->tag_live_objects[tag]++;
+}
+
+static void uncount_used_block( freelist_heap_stats_t *stats, size_t size, size_t tag ) {
+    count_used_bytes( stats, -(int64_t)size, tag );
+    stats->live_objects--;
+    stats->tag_live_objects[tag]--;
+}
+
+static size_t get_used_block_size( used_block_t *used_block ) {
+    return used_block->size & SIZE_MASK;
+}
+
+static size_t get_used_block_tag( used_block_t *used_block ) {
+    return used_block->size >> TAG_SHIFT;
+}
+
+static void set_used_block( used_block_t *used_block, size_t size, size_t tag ) {
+    used_block->size = size | (tag << TAG_SHIFT);
+}
+
 void freelist_heap_init( void *heap_start, size_t heap_size ) {
     // heap_start must be aligned with size_t
     if( (size_t)heap_start != upalign( (size_t)heap_start, sizeof( size_t ) ) ) {
         panic( "heap-start must 8-byte aligned\n" );
     }
 
+    // the heap must at least have room for its header & stats
+    if( heap_size < sizeof( heap_t ) + sizeof( freelist_heap_stats_t ) + sizeof( size_t ) ) {
+        panic( "freelist_heap_init: heap is too small\n" );
+    }
+
     // initialize heap
     heap_t *heap = (heap_t*)heap_start;
     heap->size = heap_size;
     heap->root.size = 0;
     circular_list_init( &heap->root.node );
 
+    // initialize stats
+    freelist_heap_stats_t *stats = get_stats( heap );
+    buffer_clear_qwords( (uint64_t*)stats, sizeof( freelist_heap_stats_t ) / sizeof( uint64_t ) );
+
     // check if we have enough space for 1st free block
-    if( heap_size < sizeof( heap_t ) + sizeof( free_block_t ) ) return;
+    size_t free_space_size = get_stats_offset( heap_size ) - sizeof( heap_t );
+    if( free_space_size < sizeof( free_block_t ) ) return;
 
     // insert first free block
     free_block_t *free_block = (free_block_t*)(heap_start + sizeof( heap_t ) );
     circular_list_insert_after( &heap->root.node, &free_block->node );
-    free_block->size = heap_size - sizeof( heap_t );
+    free_block->size = free_space_size;
+    count_free_block( stats, free_block->size );
 
     #ifdef TRACE
     vga_text_print( "freelist_heap_init: free_block @ ", 0x17 );
@@ -61,7 +140,7 @@ void freelist_heap_init( void *heap_start, size_t heap_size ) {
     #endif
 }
 
-static bool free_block_is_big_enough( node_t *free_block_node, void *min_free_block_size ) {
+static inline bool free_block_is_big_enough( node_t *free_block_node, size_t min_free_block_size ) {
     free_block_t *free_block = (free_block_t*)free_block_node;
 
     #ifdef TRACE
@@ -70,24 +149,37 @@ static bool free_block_is_big_enough( node_t *free_block_node, void *min_free_bl
     vga_text_print( " of size ", 0x17 );
     vga_text_print( string_from_int64( (int64_t)free_block->size ), 0x17 );
     vga_text_print( " vs min of ", 0x17 );
-    vga_text_print( string_from_int64( *(int64_t*)min_free_block_size ), 0x17 );
+    vga_text_print( string_from_int64( (int64_t)min_free_block_size ), 0x17 );
     vga_text_print( "\n", 0x17 );
     #endif
 
-    return free_block->size >= *(size_t*)min_free_block_size;
+    return free_block->size >= min_free_block_size;
 }
 
-void *freelist_heap_alloc( void *heap_start, size_t object_size ) {
+static size_t get_min_block_size( size_t object_size ) {
     // object_size must be aligned to pointer size
     object_size = upalign( object_size, sizeof( size_t ) );
 
     // define minimum block size
     size_t min_block_size = sizeof( used_block_t ) + object_size;
     if( min_block_size < sizeof( free_block_t ) ) min_block_size = sizeof( free_block_t );
+    return min_block_size;
+}
 
-    // see if we can find a free block that's big enough
+void *freelist_heap_alloc( void *heap_start, size_t object_size ) {
+    size_t min_block_size = get_min_block_size( object_size );
     heap_t *heap = (heap_t*)heap_start;
-    free_block_t *free_block = (free_block_t*)circular_list_find( &heap->root.node, free_block_is_big_enough, &min_block_size );
+    freelist_heap_stats_t *stats = get_stats( heap );
+    stats->request_histogram[get_size_class( object_size )]++;
+
+    // see if we can find a free block that's big enough
+    free_block_t *free_block = NULL;
+    circular_list_for_each( node, &heap->root.node ) {
+        if( free_block_is_big_enough( node, min_block_size ) ) {
+            free_block = (free_block_t*)node;
+            break;
+        }
+    }
     if( NULL == free_block ) {
         #ifdef PANIC_ON_OUT_OF_MEMORY
         panic( "freelist_heap_alloc: no sufficiently-large free blocks in heap\n" );
@@ -104,6 +196,7 @@ void *freelist_heap_alloc( void *heap_start, size_t object_size ) {
     #endif
 
     // if there's enough free space in the block: split it
+    uncount_free_block( stats, free_block->size );
     size_t free_space_size = free_block->size - min_block_size;
     if( free_space_size >= sizeof( free_block_t ) ) {
         // shrink block to its minimum size
@@ -112,6 +205,7 @@ void *freelist_heap_alloc( void *heap_start, size_t object_size ) {
         // initialize new free block right after this block
         free_block_t *new_free_block = (void*)free_block + min_block_size;
         new_free_block->size = free_space_size;
+        count_free_block( stats, free_space_size );
 
         // replace block with the new free block
         circular_list_replace( &free_block->node, &new_free_block->node );
@@ -120,43 +214,202 @@ void *freelist_heap_alloc( void *heap_start, size_t object_size ) {
         circular_list_remove( &free_block->node );
     }
 
-    // convert free_block into used_block
+    // convert free_block into used_block (which starts out untagged)
     used_block_t* used_block = (used_block_t*)free_block;
-    used_block->size = free_block->size;
+    set_used_block( used_block, free_block->size, 0 );
+    count_used_block( stats, free_block->size, 0 );
 
     // return pointer to the used block's data
     return (void*)used_block + sizeof( used_block_t );
 }
 
-static void try_merge_left( free_block_t *left, free_block_t *right ) {
+static void try_merge_left( freelist_heap_stats_t *stats, free_block_t *left, free_block_t *right ) {
     // blocks must be different and touching to be mergeable
     if( left == right || (void*)left + left->size != (void*)right ) return;
 
     // merge right block into left
+    uncount_free_block( stats, left->size );
+    uncount_free_block( stats, right->size );
     left->size+= right->size;
+    count_free_block( stats, left->size );
     circular_list_remove( &right->node );
 }
 
 void freelist_heap_free( void *heap_start, void* ptr ) {
     // get used block & block_size
+    heap_t *heap = (heap_t*)heap_start;
+    freelist_heap_stats_t *stats = get_stats( heap );
     used_block_t *used_block = (used_block_t*)(ptr - sizeof(used_block_t));
-    size_t block_size = used_block->size;
+    size_t block_size = get_used_block_size( used_block );
+    uncount_used_block( stats, block_size, get_used_block_tag( used_block ) );
 
     // turn this into a free block
     free_block_t *free_block = (free_block_t*)used_block;
     free_block->size = block_size;
+    count_free_block( stats, block_size );
 
     // insert into freelist at correct memory location
     // WARNING: this is an O(n) linear search across the heap (the most expensive operation we have in the freelist_heap)
-    heap_t *heap = (heap_t*)heap_start;
     node_t *root = &heap->root.node;
     node_t *node = root->next;
     while( node != root && (void*)node < (void*)free_block ) node = node->next;
     circular_list_insert_before( node, &free_block->node );
 
     // defragment heap by trying to merge this block with its right and left blocks
-    try_merge_left( free_block, (free_block_t*)node );
-    try_merge_left( (free_block_t*)free_block->node.prior, free_block );
+    try_merge_left( stats, free_block, (free_block_t*)node );
+    try_merge_left( stats, (free_block_t*)free_block->node.prior, free_block );
+}
+
+// alignment must be a power of 2
+void *freelist_heap_alloc_aligned( void *heap_start, size_t object_size, size_t alignment ) {
+    // every object is already pointer-aligned
+    if( alignment <= sizeof( size_t ) ) return freelist_heap_alloc( heap_start, object_size );
+    size_t min_block_size = get_min_block_size( object_size );
+    heap_t *heap = (heap_t*)heap_start;
+    freelist_heap_stats_t *stats = get_stats( heap );
+    stats->request_histogram[get_size_class( object_size )]++;
+
+    // search for a free block that has an aligned object address w/ enough room after it
+    node_t *root = &heap->root.node;
+    for( node_t *node = root->next; node != root; node = node->next ) {
+        free_block_t *free_block = (free_block_t*)node;
+        void *block_end = (void*)free_block + free_block->size;
+
+        // the padding before the object must either be empty, or big enough to stay behind as a free block
+        void *object = (void*)upalign( (size_t)free_block + sizeof( used_block_t ), alignment );
+        size_t padding;
+        while( 0 != (padding = object - sizeof( used_block_t ) - (void*)free_block) && padding < sizeof( free_block_t ) ) object+= alignment;
+        if( object - sizeof( used_block_t ) + min_block_size > block_end ) continue;
+
+        // shrink the free block down to the padding (it stays in the list where it was), or remove it if there's no padding
+        used_block_t *used_block = (used_block_t*)(object - sizeof( used_block_t ));
+        node_t *prior = node->prior;
+        uncount_free_block( stats, free_block->size );
+        if( padding > 0 ) {
+            free_block->size = padding;
+            count_free_block( stats, padding );
+            prior = node;
+        } else {
+            circular_list_remove( node );
+        }
+
+        // if there's enough free space after the object: split it off into a new free block
+        size_t block_size = block_end - (void*)used_block;
+        if( block_size - min_block_size >= sizeof( free_block_t ) ) {
+            free_block_t *new_free_block = (void*)used_block + min_block_size;
+            new_free_block->size = block_size - min_block_size;
+            count_free_block( stats, new_free_block->size );
+            circular_list_insert_after( prior, &new_free_block->node );
+            block_size = min_block_size;
+        }
+        set_used_block( used_block, block_size, 0 );
+        count_used_block( stats, block_size, 0 );
+        return object;
+    }
+
+    #ifdef PANIC_ON_OUT_OF_MEMORY
+    panic( "freelist_heap_alloc_aligned: no sufficiently-large free blocks in heap\n" );
+    #endif
+    return NULL;
+}
+
+void *freelist_heap_alloc_zeroed( void *heap_start, size_t object_size ) {
+    void *object = freelist_heap_alloc( heap_start, object_size );
+    if( NULL != object ) buffer_clear_qwords( object, upalign( object_size, sizeof( size_t ) ) / sizeof( uint64_t ) );
+    return object;
+}
+
+// resizes in place when possible: shrinking gives the tail back to the heap, and growing absorbs the free block right after this one
+// otherwise, falls back to alloc + copy + free
+void *freelist_heap_realloc( void *heap_start, void *object, size_t object_size ) {
+    if( NULL == object ) return freelist_heap_alloc( heap_start, object_size );
+    heap_t *heap = (heap_t*)heap_start;
+    freelist_heap_stats_t *stats = get_stats( heap );
+    used_block_t *used_block = (used_block_t*)(object - sizeof( used_block_t ));
+    size_t old_block_size = get_used_block_size( used_block ), tag = get_used_block_tag( used_block );
+    size_t min_block_size = get_min_block_size( object_size );
+
+    // shrink: if the tail is big enough to be a free block, free it (which also merges it w/ any free block after it)
+    if( min_block_size <= old_block_size ) {
+        size_t tail_size = old_block_size - min_block_size;
+        if( tail_size >= sizeof( free_block_t ) ) {
+            // the tail briefly becomes its own object, so that freeing it does the bookkeeping
+            used_block_t *tail = (void*)used_block + min_block_size;
+            set_used_block( tail, tail_size, tag );
+            set_used_block( used_block, min_block_size, tag );
+            stats->live_objects++;
+            stats->tag_live_objects[tag]++;
+            freelist_heap_free( heap_start, (void*)tail + sizeof( used_block_t ) );
+        }
+        return object;
+    }
+
+    // grow: find the free block right after this one (WARNING: O(n) linear search, same as freelist_heap_free)
+    node_t *root = &heap->root.node;
+    void *block_end = (void*)used_block + old_block_size;
+    node_t *node = root->next;
+    while( node != root && (void*)node < block_end ) node = node->next;
+    if( node != root && (void*)node == block_end && old_block_size + ((free_block_t*)node)->size >= min_block_size ) {
+        size_t block_size = old_block_size + ((free_block_t*)node)->size;
+        uncount_free_block( stats, ((free_block_t*)node)->size );
+        if( block_size - min_block_size >= sizeof( free_block_t ) ) {
+            // take what we need, and shift the rest of the free block up
+            free_block_t *new_free_block = (void*)used_block + min_block_size;
+            circular_list_replace( node, &new_free_block->node );
+            new_free_block->size = block_size - min_block_size;
+            count_free_block( stats, new_free_block->size );
+            block_size = min_block_size;
+        } else {
+            // take the whole free block
+            circular_list_remove( node );
+        }
+        set_used_block( used_block, block_size, tag );
+        count_used_bytes( stats, (int64_t)(block_size - old_block_size), tag );
+        return object;
+    }
+
+    // move (keeping the tag)
+    void *new_object = freelist_heap_alloc( heap_start, object_size );
+    if( NULL == new_object ) return NULL;
+    freelist_heap_tag( heap_start, new_object, tag );
+    buffer_copy_qwords( new_object, object, (old_block_size - sizeof( used_block_t )) / sizeof( uint64_t ) );
+    freelist_heap_free( heap_start, object );
+    return new_object;
+}
+
+// attributes an object (and any later reallocation of it) to an allocation-site tag
+void freelist_heap_tag( void *heap_start, void *object, size_t tag ) {
+    if( tag >= FREELIST_HEAP_TAGS ) panic( "freelist_heap_tag: invalid tag\n" );
+    freelist_heap_stats_t *stats = get_stats( (heap_t*)heap_start );
+    used_block_t *used_block = (used_block_t*)(object - sizeof( used_block_t ));
+    size_t block_size = get_used_block_size( used_block );
+    uncount_used_block( stats, block_size, get_used_block_tag( used_block ) );
+    set_used_block( used_block, block_size, tag );
+    count_used_block( stats, block_size, tag );
+}
+
+// the # of bytes the object may use, which is at least what was asked for (reads only the object's own header, so it needs no lock)
+size_t freelist_heap_get_object_size( void *object ) {
+    return get_used_block_size( (used_block_t*)(object - sizeof( used_block_t )) ) - sizeof( used_block_t );
+}
+
+// all counters are maintained by alloc & free, except for the largest free block, which only needs a rescan after the previous largest block was used
+const freelist_heap_stats_t *freelist_heap_get_stats( void *heap_start ) {
+    heap_t *heap = (heap_t*)heap_start;
+    freelist_heap_stats_t *stats = get_stats( heap );
+    if( stats->largest_free_block_is_stale ) {
+        size_t largest = 0;
+        node_t *root = &heap->root.node;
+        for( node_t *node = root->next; node != root; node = node->next ) {
+            if( ((free_block_t*)node)->size > largest ) largest = ((free_block_t*)node)->size;
+        }
+        stats->largest_free_block = largest;
+        stats->largest_free_block_is_stale = false;
+    }
+
+    // fragmentation is the fraction of free memory that isn't usable by the largest possible allocation
+    stats->fragmentation_permille = 0 == stats->free_bytes ? 0 : 1000 - (stats->largest_free_block * 1000) / stats->free_bytes;
+    return stats;
 }
 
 size_t freelist_heap_free_block_count( void *heap_start ) {
@@ -175,3 +428,35 @@ void freelist_heap_print( void *heap_start ) {
     heap_t *heap = (heap_t*)heap_start;
     circular_list_foreach( &heap->root.node, print_free_block, NULL );
 }
+
+static void print_histogram( const char *name, const size_t *histogram ) {
+    vga_text_print( name, 0x17 );
+    for( size_t i = 0; i < FREELIST_HEAP_SIZE_CLASSES; i++ ) {
+        if( 0 == histogram[i] ) continue;
+        vga_text_print_stat( " [", (size_t)1 << i );
+        vga_text_print_stat( "+:", histogram[i] );
+        vga_text_print( "]", 0x17 );
+    }
+    vga_text_print( "\n", 0x17 );
+}
+
+void freelist_heap_print_stats( void *heap_start ) {
+    const freelist_heap_stats_t *stats = freelist_heap_get_stats( heap_start );
+    vga_text_print_stat( "heap: in use ", stats->bytes_in_use );
+    vga_text_print_stat( " bytes in ", stats->live_objects );
+    vga_text_print_stat( " objects (peak ", stats->peak_bytes_in_use );
+    vga_text_print_stat( "), free ", stats->free_bytes );
+    vga_text_print_stat( " bytes in ", stats->free_blocks );
+    vga_text_print_stat( " blocks (largest ", stats->largest_free_block );
+    vga_text_print_stat( ", fragmentation ", stats->fragmentation_permille );
+    vga_text_print( "/1000)\n", 0x17 );
+    print_histogram( "requests by size:", stats->request_histogram );
+    print_histogram( "free blocks by size:", stats->free_block_histogram );
+    for( size_t i = 0; i < FREELIST_HEAP_TAGS; i++ ) {
+        if( 0 == stats->tag_live_objects[i] ) continue;
+        vga_text_print_stat( "tag ", i );
+        vga_text_print_stat( ": ", stats->tag_bytes_in_use[i] );
+        vga_text_print_stat( " bytes in ", stats->tag_live_objects[i] );
+        vga_text_print( " objects\n", 0x17 );
+    }
+}
@@ -1,9 +1,36 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdbool.h>
+
+#define FREELIST_HEAP_SIZE_CLASSES 32 // size class n holds sizes from 2^n up to 2^(n+1) - 1 (the last class also holds anything bigger)
+#define FREELIST_HEAP_TAGS 16 // allocation-site tags, for attributing memory to subsystems (tag 0 means untagged)
+
+// sizes are in bytes, and include block headers
+typedef struct freelist_heap_stats {
+    size_t bytes_in_use;
+    size_t peak_bytes_in_use;
+    size_t live_objects;
+    size_t free_bytes;
+    size_t free_blocks;
+    size_t largest_free_block;
+    bool largest_free_block_is_stale;
+    size_t fragmentation_permille;
+    size_t request_histogram[FREELIST_HEAP_SIZE_CLASSES]; // # of allocation requests (by requested size) since the heap was initialized
+    size_t free_block_histogram[FREELIST_HEAP_SIZE_CLASSES]; // current # of free blocks
+    size_t tag_bytes_in_use[FREELIST_HEAP_TAGS];
+    size_t tag_live_objects[FREELIST_HEAP_TAGS];
+} freelist_heap_stats_t;
 
 void freelist_heap_init( void *heap_start, size_t heap_size );
 void *freelist_heap_alloc( void *heap_start, size_t object_size );
+void *freelist_heap_alloc_aligned( void *heap_start, size_t object_size, size_t alignment );
+void *freelist_heap_alloc_zeroed( void *heap_start, size_t object_size );
+void *freelist_heap_realloc( void *heap_start, void *object, size_t object_size );
 void freelist_heap_free( void *heap_start, void *object );
+void freelist_heap_tag( void *heap_start, void *object, size_t tag );
+size_t freelist_heap_get_object_size( void *object );
+const freelist_heap_stats_t *freelist_heap_get_stats( void *heap_start );
 size_t freelist_heap_free_block_count( void *heap_start );
 void freelist_heap_print( void *heap_start );
+void freelist_heap_print_stats( void *heap_start );
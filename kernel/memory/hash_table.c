@@ -0,0 +1,49 @@
+#include "hash_table.h"
+
+typedef struct test_object {
+    uint64_t key;
+} test_object_t;
+
+#define test_object_key( object ) ((object)->key)
+#define test_equal( a, b ) ((a) == (b))
+HASH_TABLE_DEFINE( test_table, test_object_t, uint64_t, test_object_key, hash_table_hash_uint64, test_equal )
+
+#define TEST_OBJECT_COUNT 300
+
+void hash_table_run_tests() {
+    static test_object_t objects[TEST_OBJECT_COUNT], replacement;
+    test_table_t table;
+    test_table_init( &table );
+    if( NULL != test_table_find( &table, 0 ) ) panic( "hash_table_run_tests: found a key in an empty table" );
+
+    // insert enough objects to force a few resizes
+    for( size_t i = 0; i < TEST_OBJECT_COUNT; i++ ) {
+        objects[i].key = i * 4096; // page-aligned keys, which collide badly w/o a good hash
+        if( NULL != test_table_insert( &table, &objects[i] ) ) panic( "hash_table_run_tests: fresh key replaced an object" );
+    }
+    if( TEST_OBJECT_COUNT != table.count ) panic( "hash_table_run_tests: wrong count after inserting" );
+    for( size_t i = 0; i < TEST_OBJECT_COUNT; i++ ) {
+        if( &objects[i] != test_table_find( &table, i * 4096 ) ) panic( "hash_table_run_tests: find failed" );
+    }
+    if( NULL != test_table_find( &table, 1 ) ) panic( "hash_table_run_tests: found a missing key" );
+
+    // inserting an existing key replaces the object
+    replacement.key = 0;
+    if( &objects[0] != test_table_insert( &table, &replacement ) ) panic( "hash_table_run_tests: insert didn't replace" );
+    if( &replacement != test_table_find( &table, 0 ) ) panic( "hash_table_run_tests: replacement not found" );
+
+    // remove every other object, then make sure the rest can still be found past the tombstones
+    for( size_t i = 1; i < TEST_OBJECT_COUNT; i+= 2 ) {
+        if( &objects[i] != test_table_remove( &table, i * 4096 ) ) panic( "hash_table_run_tests: remove failed" );
+    }
+    for( size_t i = 0; i < TEST_OBJECT_COUNT; i++ ) {
+        test_object_t *found = test_table_find( &table, i * 4096 );
+        if( (i & 1) ? NULL != found : NULL == found ) panic( "hash_table_run_tests: wrong object after removing" );
+    }
+    if( NULL != test_table_remove( &table, 4096 ) ) panic( "hash_table_run_tests: removed a key twice" );
+
+    // reinserting reuses tombstones
+    for( size_t i = 1; i < TEST_OBJECT_COUNT; i+= 2 ) test_table_insert( &table, &objects[i] );
+    if( TEST_OBJECT_COUNT != table.count ) panic( "hash_table_run_tests: wrong count after reinserting" );
+    test_table_destroy( &table );
+}
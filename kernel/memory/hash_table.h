@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "kernel_heap.h"
+#include "../main.h" // for panic
+
+// intrusive open-addressing hash table: slots hold pointers to objects, which carry their own keys
+// collisions use linear probing, and removed slots become tombstones until the next resize
+// the table is generated per type by HASH_TABLE_DEFINE, so hashing & key comparison get inlined into the probe loop
+#define HASH_TABLE_TOMBSTONE ((void*)1)
+#define HASH_TABLE_MIN_CAPACITY 16
+
+// a cheap, well-mixed hash for integer & pointer keys (the 64-bit murmur3 finalizer)
+static inline uint64_t hash_table_hash_uint64( uint64_t x ) {
+    x^= x >> 33;
+    x*= 0xff51afd7ed558ccdUL;
+    x^= x >> 33;
+    x*= 0xc4ceb9fe1a85ec53UL;
+    x^= x >> 33;
+    return x;
+}
+
+void hash_table_run_tests();
+
+// generates name_t along w/ name_init, name_destroy, name_find, name_insert & name_remove
+// get_key( object ) returns an object's key, hash( key ) returns a uint64_t, and equal( a, b ) compares 2 keys
+// capacity is always a power of 2, and the table resizes once live + tombstone slots reach 3/4 of it
+#define HASH_TABLE_DEFINE( name, type, key_type, get_key, hash, equal ) \
+    typedef struct name { \
+        type **slots; \
+        size_t capacity, count, used; /* count = live objects, used = live objects + tombstones */ \
+    } name##_t; \
+    \
+    static inline void name##_init( name##_t *table ) { \
+        table->slots = NULL; \
+        table->capacity = table->count = table->used = 0; \
+    } \
+    \
+    static inline void name##_destroy( name##_t *table ) { \
+        if( NULL != table->slots ) kernel_heap_free( table->slots ); \
+        name##_init( table ); \
+    } \
+    \
+    static inline type *name##_find( name##_t *table, key_type key ) { \
+        if( 0 == table->count ) return NULL; \
+        size_t mask = table->capacity - 1; \
+        for( size_t i = hash( key ) & mask;; i = (i + 1) & mask ) { \
+            type *object = table->slots[i]; \
+            if( NULL == object ) return NULL; \
+            if( HASH_TABLE_TOMBSTONE != (void*)object && equal( get_key( object ), key ) ) return object; \
+        } \
+    } \
+    \
+    /* slow path: rehashes every live object into a fresh array, which also discards tombstones */ \
+    static void name##_resize( name##_t *table ) { \
+        size_t capacity = HASH_TABLE_MIN_CAPACITY; \
+        while( capacity < (table->count + 1) * 2 ) capacity*= 2; \
+        type **slots = kernel_heap_alloc_zeroed( capacity * sizeof( type* ) ); \
+        if( NULL == slots ) panic( #name "_resize: out of memory" ); \
+        for( size_t i = 0; i < table->capacity; i++ ) { \
+            type *object = table->slots[i]; \
+            if( NULL == object || HASH_TABLE_TOMBSTONE == (void*)object ) continue; \
+            size_t j = hash( get_key( object ) ) & (capacity - 1); \
+            while( NULL != slots[j] ) j = (j + 1) & (capacity - 1); \
+            slots[j] = object; \
+        } \
+        if( NULL != table->slots ) kernel_heap_free( table->slots ); \
+        table->slots = slots; \
+        table->capacity = capacity; \
+        table->used = table->count; \
+    } \
+    \
+    /* returns the object that had the same key (which gets replaced), or NULL */ \
+    static inline type *name##_insert( name##_t *table, type *object ) { \
+        if( (table->used + 1) * 4 > table->capacity * 3 ) name##_resize( table ); \
+        size_t mask = table->capacity - 1; \
+        type **tombstone = NULL; \
+        for( size_t i = hash( get_key( object ) ) & mask;; i = (i + 1) & mask ) { \
+            type **slot = &table->slots[i]; \
+            if( NULL == *slot ) { \
+                if( NULL != tombstone ) slot = tombstone; \
+                else table->used++; \
+                *slot = object; \
+                table->count++; \
+                return NULL; \
+            } \
+            if( HASH_TABLE_TOMBSTONE == (void*)*slot ) { \
+                if( NULL == tombstone ) tombstone = slot; \
+            } else if( equal( get_key( *slot ), get_key( object ) ) ) { \
+                type *replaced = *slot; \
+                *slot = object; \
+                return replaced; \
+            } \
+        } \
+    } \
+    \
+    /* returns the removed object, or NULL */ \
+    static inline type *name##_remove( name##_t *table, key_type key ) { \
+        if( 0 == table->count ) return NULL; \
+        size_t mask = table->capacity - 1; \
+        for( size_t i = hash( key ) & mask;; i = (i + 1) & mask ) { \
+            type *object = table->slots[i]; \
+            if( NULL == object ) return NULL; \
+            if( HASH_TABLE_TOMBSTONE != (void*)object && equal( get_key( object ), key ) ) { \
+                table->slots[i] = HASH_TABLE_TOMBSTONE; \
+                table->count--; \
+                return object; \
+            } \
+        } \
+    }
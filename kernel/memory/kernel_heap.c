@@ -1,9 +1,39 @@
 #include <stdint.h>
 #include "kernel_heap.h"
 #include "freelist_heap.h"
+#include "../buffer/buffer.h"
 #include "../buffer/string.h" // for error messages
 #include "../drivers/vga_text.h" // for error messages
+#include "../interrupt/interrupt_table.h"
+#include "../process/cpu.h" // for per-CPU caches
+#include "../process/task_pool.h" // for the benchmark
 #include "../main.h" // for panic
+#include "../sync/spinlock.h"
+
+// small objects are rounded up to a power of 2 (16 bytes to 1 KB), & each CPU keeps a magazine (a stack) of free objects per size
+// class in front of the shared heap. a CPU only takes the lock to refill an empty magazine, or to drain a full one, half at a time
+#define CACHE_MIN_OBJECT_BITS 4
+#define CACHE_MIN_OBJECT_SIZE (1 << CACHE_MIN_OBJECT_BITS)
+#define CACHE_CLASSES 7
+#define CACHE_MAX_OBJECT_SIZE (CACHE_MIN_OBJECT_SIZE << (CACHE_CLASSES - 1))
+#define MAGAZINE_SIZE 32
+#define MAGAZINE_BATCH (MAGAZINE_SIZE / 2)
+
+typedef struct magazine {
+    size_t count;
+    void *objects[MAGAZINE_SIZE]; // the newest (i.e. the most likely to be in the cache) is on top
+} magazine_t;
+
+// padded to a cache line, so CPUs don't contend on each other's magazines
+typedef struct cpu_cache {
+    magazine_t magazines[CACHE_CLASSES];
+} __attribute__((aligned(64))) cpu_cache_t;
+
+// irqsave, since interrupt handlers may allocate (e.g. page tables from the page fault handler)
+static ticket_lock_t lock;
+
+static cpu_cache_t caches[CPU_MAX_COUNT];
+static volatile bool caches_enabled; // off while the self-tests check the shared heap's exact layout & stats
 
 static void print_heap() {
     freelist_heap_print( (void*)KERNEL_HEAP_START );
@@ -129,18 +159,291 @@ static void test() {
     }
 }
 
+static void test_extended_api() {
+    // aligned objects must be aligned, and must not leak their padding when freed
+    void *obj1 = kernel_heap_alloc( 8 );
+    void *obj2 = kernel_heap_alloc_aligned( 100, 4096 );
+    if( 0 != ((size_t)obj2 & 4095) ) panic( "kernel_heap_init: aligned object is not aligned" );
+    void *obj3 = kernel_heap_alloc_aligned( 8, 64 );
+    if( 0 != ((size_t)obj3 & 63) ) panic( "kernel_heap_init: cache-line aligned object is not aligned" );
+    kernel_heap_free( obj3 );
+    kernel_heap_free( obj2 );
+    kernel_heap_free( obj1 );
+    if( 1 != free_block_count() ) panic( "kernel_heap_init: after freeing aligned objects, expect free_block_count to be 1" );
+
+    // growing an object that's followed by free space should happen in place, and so should shrinking it
+    obj1 = kernel_heap_alloc( 16 );
+    *(uint64_t*)obj1 = 0x1234;
+    obj2 = kernel_heap_realloc( obj1, 1000 );
+    if( obj2 != obj1 ) panic( "kernel_heap_init: realloc did not grow in place" );
+    obj2 = kernel_heap_realloc( obj1, 8 );
+    if( obj2 != obj1 ) panic( "kernel_heap_init: realloc did not shrink in place" );
+    if( 1 != free_block_count() ) panic( "kernel_heap_init: after shrinking, expect free_block_count to be 1" );
+
+    // growing an object that's followed by a used block must move it (along w/ its contents)
+    obj3 = kernel_heap_alloc( 8 );
+    obj2 = kernel_heap_realloc( obj1, 1000 );
+    if( obj2 == obj1 ) panic( "kernel_heap_init: realloc grew into a used block" );
+    if( 0x1234 != *(uint64_t*)obj2 ) panic( "kernel_heap_init: realloc did not move the object's contents" );
+    kernel_heap_free( obj2 );
+    kernel_heap_free( obj3 );
+    if( 1 != free_block_count() ) panic( "kernel_heap_init: after freeing reallocated objects, expect free_block_count to be 1" );
+
+    // zeroed objects must be zeroed, even when they reuse dirty memory
+    uint64_t *dirty = kernel_heap_alloc( 256 );
+    for( size_t i = 0; i < 32; i++ ) dirty[i] = (uint64_t)-1;
+    kernel_heap_free( dirty );
+    uint64_t *zeroed = kernel_heap_alloc_zeroed( 256 );
+    for( size_t i = 0; i < 32; i++ ) {
+        if( 0 != zeroed[i] ) panic( "kernel_heap_init: zeroed object is not zeroed" );
+    }
+    kernel_heap_free( zeroed );
+}
+
+static void test_stats() {
+    // allocating & freeing must be reflected in the stats
+    const freelist_heap_stats_t *stats = kernel_heap_get_stats();
+    size_t bytes_in_use = stats->bytes_in_use, live_objects = stats->live_objects, free_bytes = stats->free_bytes;
+    void *obj1 = kernel_heap_alloc( 100 );
+    if( bytes_in_use + 112 != stats->bytes_in_use ) panic( "kernel_heap_init: bytes in use is wrong after allocating" );
+    if( live_objects + 1 != stats->live_objects ) panic( "kernel_heap_init: live objects is wrong after allocating" );
+    if( free_bytes - 112 != stats->free_bytes ) panic( "kernel_heap_init: free bytes is wrong after allocating" );
+    if( stats->peak_bytes_in_use < stats->bytes_in_use ) panic( "kernel_heap_init: peak bytes in use is below bytes in use" );
+
+    // tagging moves an object's bytes to the tag, and realloc keeps the tag
+    kernel_heap_tag( obj1, KERNEL_HEAP_TAG_PROCESS );
+    void *obj2 = kernel_heap_alloc( 8 );
+    obj1 = kernel_heap_realloc( obj1, 200 );
+    if( 1 != stats->tag_live_objects[KERNEL_HEAP_TAG_PROCESS] || 208 != stats->tag_bytes_in_use[KERNEL_HEAP_TAG_PROCESS] ) panic( "kernel_heap_init: tag stats are wrong after realloc" );
+    kernel_heap_free( obj1 );
+    kernel_heap_free( obj2 );
+    if( 0 != stats->tag_live_objects[KERNEL_HEAP_TAG_PROCESS] || 0 != stats->tag_bytes_in_use[KERNEL_HEAP_TAG_PROCESS] ) panic( "kernel_heap_init: tag stats are wrong after free" );
+
+    // everything's freed, so we're back to a single free block, which is the largest block & isn't fragmented
+    stats = kernel_heap_get_stats();
+    if( bytes_in_use != stats->bytes_in_use || live_objects != stats->live_objects || free_bytes != stats->free_bytes ) panic( "kernel_heap_init: stats are wrong after freeing everything" );
+    if( 1 != stats->free_blocks || stats->largest_free_block != stats->free_bytes || 0 != stats->fragmentation_permille ) panic( "kernel_heap_init: free block stats are wrong after freeing everything" );
+}
+
 void kernel_heap_init() {
     // initialize the heap
+    ticket_lock_init( &lock, "kernel_heap" );
     freelist_heap_init( (void*)KERNEL_HEAP_START, KERNEL_HEAP_SIZE );
 
     // run self-tests
     test();
+    test_extended_api();
+    test_stats();
+}
+
+// the smallest size class that holds object_size bytes
+static size_t get_alloc_class( size_t object_size ) {
+    return object_size <= CACHE_MIN_OBJECT_SIZE ? 0 : 64 - __builtin_clzll( object_size - 1 ) - CACHE_MIN_OBJECT_BITS;
+}
+
+// the largest size class that a freed object can hold, or CACHE_CLASSES if it's too big to cache
+static size_t get_free_class( void *object ) {
+    size_t object_size = freelist_heap_get_object_size( object );
+    if( object_size < CACHE_MIN_OBJECT_SIZE || object_size >= CACHE_MAX_OBJECT_SIZE * 2 ) return CACHE_CLASSES;
+    return 63 - __builtin_clzll( object_size ) - CACHE_MIN_OBJECT_BITS;
+}
+
+// interrupts must be disabled (so we stay on this CPU)
+static void refill( magazine_t *magazine, size_t size_class ) {
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    while( magazine->count < MAGAZINE_BATCH ) {
+        void *object = freelist_heap_alloc( (void*)KERNEL_HEAP_START, CACHE_MIN_OBJECT_SIZE << size_class );
+        if( NULL == object ) break;
+        magazine->objects[magazine->count++] = object;
+    }
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+}
+
+// interrupts must be disabled. frees the oldest half of the magazine
+static void drain( magazine_t *magazine ) {
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    for( size_t i = 0; i < MAGAZINE_BATCH; i++ ) freelist_heap_free( (void*)KERNEL_HEAP_START, magazine->objects[i] );
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+    magazine->count-= MAGAZINE_BATCH;
+    for( size_t i = 0; i < magazine->count; i++ ) magazine->objects[i] = magazine->objects[i + MAGAZINE_BATCH];
+}
+
+// interrupts are only disabled while we touch the CPU's own magazine, so this is safe from interrupt handlers
+static void *alloc_cached( size_t object_size ) {
+    size_t size_class = get_alloc_class( object_size );
+    bool interrupts_were_enabled = interrupt_table_disable_interrupts();
+    magazine_t *magazine = &caches[cpu_get_index()].magazines[size_class];
+    if( 0 == magazine->count ) refill( magazine, size_class );
+    void *object = 0 != magazine->count ? magazine->objects[--magazine->count] : NULL;
+    interrupt_table_restore_interrupts( interrupts_were_enabled );
+    return object;
+}
+
+// returns false if the object is too big to cache
+static bool free_cached( void *object ) {
+    size_t size_class = get_free_class( object );
+    if( CACHE_CLASSES == size_class ) return false;
+    bool interrupts_were_enabled = interrupt_table_disable_interrupts();
+    magazine_t *magazine = &caches[cpu_get_index()].magazines[size_class];
+    if( MAGAZINE_SIZE == magazine->count ) drain( magazine );
+    magazine->objects[magazine->count++] = object;
+    interrupt_table_restore_interrupts( interrupts_were_enabled );
+    return true;
+}
+
+static size_t get_cached_object_count( size_t size_class ) {
+    size_t count = 0;
+    for( size_t i = 0; i < CPU_MAX_COUNT; i++ ) count+= caches[i].magazines[size_class].count;
+    return count;
+}
+
+static void test_caches() {
+    // a freed object is the next one to be handed out (while it's still in the cache)
+    void *obj1 = kernel_heap_alloc( 24 );
+    kernel_heap_free( obj1 );
+    if( obj1 != kernel_heap_alloc( 24 ) ) panic( "kernel_heap_init_caches: freed object wasn't reused\n" );
+    kernel_heap_free( obj1 );
+
+    // small objects are rounded up to their size class, & big ones bypass the caches
+    obj1 = kernel_heap_alloc( CACHE_MIN_OBJECT_SIZE * 2 + 1 );
+    if( freelist_heap_get_object_size( obj1 ) < CACHE_MIN_OBJECT_SIZE * 4 ) panic( "kernel_heap_init_caches: object wasn't rounded up to its size class\n" );
+    kernel_heap_free( obj1 );
+    const freelist_heap_stats_t *stats = kernel_heap_get_stats();
+    size_t live_objects = stats->live_objects;
+    void *big = kernel_heap_alloc( CACHE_MAX_OBJECT_SIZE * 2 );
+    kernel_heap_free( big );
+    if( live_objects != stats->live_objects ) panic( "kernel_heap_init_caches: big object was cached\n" );
+
+    // a full magazine drains half of its objects back to the heap, so every freed object ends up either in the magazine or in the heap
+    size_t size_class = get_alloc_class( 64 );
+    void *objects[MAGAZINE_SIZE * 2];
+    for( size_t i = 0; i < MAGAZINE_SIZE * 2; i++ ) objects[i] = kernel_heap_alloc( 64 );
+    size_t cached = get_cached_object_count( size_class );
+    live_objects = stats->live_objects;
+    for( size_t i = 0; i < MAGAZINE_SIZE * 2; i++ ) kernel_heap_free( objects[i] );
+    if( get_cached_object_count( size_class ) > MAGAZINE_SIZE ) panic( "kernel_heap_init_caches: magazine overflowed\n" );
+    if( live_objects - stats->live_objects + get_cached_object_count( size_class ) - cached != MAGAZINE_SIZE * 2 ) panic( "kernel_heap_init_caches: drained objects were lost\n" );
+
+    // zeroed objects are zeroed, even when they come out of a magazine dirty
+    uint64_t *dirty = kernel_heap_alloc( 256 );
+    for( size_t i = 0; i < 32; i++ ) dirty[i] = (uint64_t)-1;
+    kernel_heap_free( dirty );
+    uint64_t *zeroed = kernel_heap_alloc_zeroed( 256 );
+    if( zeroed != dirty ) panic( "kernel_heap_init_caches: zeroed object didn't come from the cache\n" );
+    for( size_t i = 0; i < 32; i++ ) {
+        if( 0 != zeroed[i] ) panic( "kernel_heap_init_caches: zeroed object is not zeroed\n" );
+    }
+    kernel_heap_free( zeroed );
+}
+
+// call after the tests that check the shared heap's stats (e.g. arena_run_tests). from then on, the stats count objects sitting in the
+// caches as in use (& under the tag of whoever last used them)
+void kernel_heap_init_caches() {
+    caches_enabled = true;
+    test_caches();
 }
 
 void *kernel_heap_alloc( size_t object_size ) {
-    return freelist_heap_alloc( (void*)KERNEL_HEAP_START, object_size );
+    if( caches_enabled && object_size <= CACHE_MAX_OBJECT_SIZE ) return alloc_cached( object_size );
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    void* result = freelist_heap_alloc( (void*)KERNEL_HEAP_START, object_size );
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+    return result;
+}
+
+void *kernel_heap_alloc_aligned( size_t object_size, size_t alignment ) {
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    void* result = freelist_heap_alloc_aligned( (void*)KERNEL_HEAP_START, object_size, alignment );
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+    return result;
+}
+
+void *kernel_heap_alloc_zeroed( size_t object_size ) {
+    if( caches_enabled && object_size <= CACHE_MAX_OBJECT_SIZE ) {
+        void *result = alloc_cached( object_size );
+        if( NULL != result ) buffer_clear_qwords( (uint64_t*)result, (object_size + sizeof( uint64_t ) - 1) / sizeof( uint64_t ) );
+        return result;
+    }
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    void* result = freelist_heap_alloc_zeroed( (void*)KERNEL_HEAP_START, object_size );
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+    return result;
+}
+
+void *kernel_heap_realloc( void *object, size_t object_size ) {
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    void* result = freelist_heap_realloc( (void*)KERNEL_HEAP_START, object, object_size );
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+    return result;
 }
 
 void kernel_heap_free( void *object ) {
+    if( caches_enabled && free_cached( object ) ) return;
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
     freelist_heap_free( (void*)KERNEL_HEAP_START, object );
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+}
+
+void kernel_heap_tag( void *object, size_t tag ) {
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    freelist_heap_tag( (void*)KERNEL_HEAP_START, object, tag );
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+}
+
+const freelist_heap_stats_t *kernel_heap_get_stats() {
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    const freelist_heap_stats_t* result = freelist_heap_get_stats( (void*)KERNEL_HEAP_START );
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+    return result;
+}
+
+void kernel_heap_print_stats() {
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    freelist_heap_print_stats( (void*)KERNEL_HEAP_START );
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+    lock_stats_print( &lock.stats );
+}
+
+#define BENCHMARK_OPERATIONS 0x100000 // alloc/free pairs per run
+#define BENCHMARK_BATCH 16 // objects each task holds at once
+#define BENCHMARK_GRAIN 64 // batches per task
+
+// allocates a batch of objects from 16 to 512 bytes, & then frees them
+static void alloc_and_free( size_t begin, size_t end, void *argument ) {
+    void *objects[BENCHMARK_BATCH];
+    for( size_t i = begin; i < end; i++ ) {
+        for( size_t j = 0; j < BENCHMARK_BATCH; j++ ) objects[j] = kernel_heap_alloc( CACHE_MIN_OBJECT_SIZE << ((i + j) % 6) );
+        for( size_t j = 0; j < BENCHMARK_BATCH; j++ ) kernel_heap_free( objects[j] );
+    }
+}
+
+static uint64_t time_alloc_and_free( bool cached ) {
+    caches_enabled = cached;
+    uint64_t start = cpu_read_timestamp();
+    task_pool_parallel_for( 0, BENCHMARK_OPERATIONS / BENCHMARK_BATCH, BENCHMARK_GRAIN, alloc_and_free, NULL );
+    return cpu_read_timestamp() - start;
+}
+
+// alloc/free throughput as CPUs are added, w/ & w/o the per-CPU caches (speedups are vs. 1 CPU in the same mode)
+// each result line is "kernel_heap_benchmark cpus=<n> cached_cycles=<tsc cycles> cached_speedup_x100=<n> shared_cycles=<tsc cycles>
+// shared_speedup_x100=<n>"
+void kernel_heap_run_benchmark() {
+    bool were_enabled = caches_enabled;
+    uint64_t cached_baseline = 0, shared_baseline = 0;
+    for( size_t workers = 1; workers <= cpu_get_count(); workers++ ) {
+        task_pool_set_worker_limit( workers );
+        uint64_t cached = time_alloc_and_free( true ), shared = time_alloc_and_free( false );
+        if( 1 == workers ) {
+            cached_baseline = cached;
+            shared_baseline = shared;
+        }
+        vga_text_print_stat( "kernel_heap_benchmark cpus=", workers );
+        vga_text_print_stat( " cached_cycles=", cached );
+        vga_text_print_stat( " cached_speedup_x100=", cached_baseline * 100 / (0 == cached ? 1 : cached) );
+        vga_text_print_stat( " shared_cycles=", shared );
+        vga_text_print_stat( " shared_speedup_x100=", shared_baseline * 100 / (0 == shared ? 1 : shared) );
+        vga_text_print( "\n", 0x17 );
+    }
+    task_pool_set_worker_limit( CPU_MAX_COUNT );
+    caches_enabled = were_enabled;
 }
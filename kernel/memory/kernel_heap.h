@@ -1,11 +1,31 @@
 #pragma once
 
 #include <stddef.h>
+#include "freelist_heap.h"
 
 #define KERNEL_HEAP_START 0x200000 // 2 MB (i.e. the heap starts right at the top of the stack)
-#define KERNEL_HEAP_END 0x40000000 // 1 GB (max physical memory)
+#define KERNEL_HEAP_END 0x10000000 // 256 MB (physical memory above this belongs to the page allocator)
 #define KERNEL_HEAP_SIZE (KERNEL_HEAP_END - KERNEL_HEAP_START)
 
+// allocation-site tags (see kernel_heap_tag)
+#define KERNEL_HEAP_TAG_UNTAGGED 0
+#define KERNEL_HEAP_TAG_PAGING 1
+#define KERNEL_HEAP_TAG_PAGE_ALLOCATOR 2
+#define KERNEL_HEAP_TAG_PROCESS 3
+#define KERNEL_HEAP_TAG_ARENA 4
+#define KERNEL_HEAP_TAG_CPU 5
+#define KERNEL_HEAP_TAG_FRAMEBUFFER 6
+#define KERNEL_HEAP_TAG_NET 7
+
+// objects up to 1 KB come from per-CPU caches once kernel_heap_init_caches has been called (see kernel_heap.c)
 void kernel_heap_init();
+void kernel_heap_init_caches();
 void *kernel_heap_alloc( size_t object_size );
+void *kernel_heap_alloc_aligned( size_t object_size, size_t alignment );
+void *kernel_heap_alloc_zeroed( size_t object_size );
+void *kernel_heap_realloc( void *object, size_t object_size );
 void kernel_heap_free( void *object );
+void kernel_heap_tag( void *object, size_t tag );
+const freelist_heap_stats_t *kernel_heap_get_stats();
+void kernel_heap_print_stats();
+void kernel_heap_run_benchmark();
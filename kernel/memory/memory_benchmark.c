@@ -0,0 +1,194 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include "memory_benchmark.h"
+#include "kernel_heap.h"
+#include "paging.h"
+#include "../buffer/buffer.h"
+#include "../drivers/vga_text.h" // for printing
+#include "../interrupt/interrupt_table.h" // the SIMD primitives need interrupts off
+#include "../interrupt/timer.h" // for the TSC frequency
+#include "../process/cpu.h"
+#include "../main.h" // for panic
+
+#define CACHE_LINE_SIZE 64
+#define WORKING_SET_STEP 4
+#define LATENCY_STEPS (1 << 20)
+#define BANDWIDTH_BYTES 0x4000000 // each bandwidth measurement moves at least 64 MB
+#define WINDOW_COUNT 3
+
+// the buffer gets mapped into 1 window per page size. each window is 1 GB-aligned, & maps the buffer at its physical address within
+// the window, so it's as aligned in every window as it is in physical memory (which is what lets 2 MB & 1 GB pages map it)
+static const size_t page_sizes[WINDOW_COUNT] = { PAGE_SIZE, PAGE_SIZE_2MB, PAGE_SIZE_1GB };
+
+typedef struct operation {
+    const char *name; // table column, including the leading space & trailing '='
+    void (*function)( uint8_t *buffer, size_t size );
+    bool copies; // copies the 1st half of the working set into the 2nd half, so only half of it counts as bytes moved
+} operation_t;
+
+static volatile uint64_t read_sum; // so the reads can't be optimized away
+
+// 4 independent chains of adds, so the loads (rather than the adds) are the bottleneck. size must be a multiple of 64
+static void read_buffer( uint8_t *buffer, size_t size ) {
+    uint64_t sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+    asm volatile(
+        "1: add (%[buffer]), %[sum0]\n\t"
+        "add 8(%[buffer]), %[sum1]\n\t"
+        "add 16(%[buffer]), %[sum2]\n\t"
+        "add 24(%[buffer]), %[sum3]\n\t"
+        "add 32(%[buffer]), %[sum0]\n\t"
+        "add 40(%[buffer]), %[sum1]\n\t"
+        "add 48(%[buffer]), %[sum2]\n\t"
+        "add 56(%[buffer]), %[sum3]\n\t"
+        "add $64, %[buffer]\n\t"
+        "sub $64, %[size]\n\t"
+        "jnz 1b"
+        : [buffer] "+r" (buffer), [size] "+r" (size), [sum0] "+r" (sum0), [sum1] "+r" (sum1), [sum2] "+r" (sum2), [sum3] "+r" (sum3)
+        :: "memory" );
+    read_sum = sum0 + sum1 + sum2 + sum3;
+}
+
+static void set_buffer( uint8_t *buffer, size_t size ) {
+    buffer_set_qwords( (uint64_t*)buffer, 0, size / sizeof( uint64_t ) );
+}
+
+static void stream_clear_buffer( uint8_t *buffer, size_t size ) {
+    buffer_stream_clear_qwords( (uint64_t*)buffer, size / sizeof( uint64_t ) );
+}
+
+static void simd_fill_buffer( uint8_t *buffer, size_t size ) {
+    bool interrupts_were_enabled = interrupt_table_disable_interrupts();
+    buffer_simd_fill_rectangle( buffer, 0, 0, size, 1 );
+    interrupt_table_restore_interrupts( interrupts_were_enabled );
+}
+
+static void copy_buffer( uint8_t *buffer, size_t size ) {
+    buffer_copy_qwords( (uint64_t*)(buffer + size / 2), (uint64_t*)buffer, size / 2 / sizeof( uint64_t ) );
+}
+
+static void simd_copy_buffer( uint8_t *buffer, size_t size ) {
+    bool interrupts_were_enabled = interrupt_table_disable_interrupts();
+    buffer_simd_copy_rectangle( buffer + size / 2, 0, buffer, 0, size / 2, 1 );
+    interrupt_table_restore_interrupts( interrupts_were_enabled );
+}
+
+static void simd_stream_copy_buffer( uint8_t *buffer, size_t size ) {
+    bool interrupts_were_enabled = interrupt_table_disable_interrupts();
+    buffer_simd_stream_rectangle( buffer + size / 2, 0, buffer, 0, size / 2, 1 );
+    interrupt_table_restore_interrupts( interrupts_were_enabled );
+}
+
+static const operation_t operations[] = {
+    { " read=", read_buffer, false },
+    { " set=", set_buffer, false },
+    { " stream_clear=", stream_clear_buffer, false },
+    { " simd_fill=", simd_fill_buffer, false },
+    { " copy=", copy_buffer, true },
+    { " simd_copy=", simd_copy_buffer, true },
+    { " simd_stream_copy=", simd_stream_copy_buffer, true },
+};
+
+static uint64_t next_random( uint64_t *state ) {
+    *state^= *state << 13;
+    *state^= *state >> 7;
+    *state^= *state << 17;
+    return *state;
+}
+
+// links the working set's cache lines into a single random cycle (Sattolo's algorithm), where each line's 1st qword points at the next
+static void build_chain( uint8_t *buffer, size_t size, uint64_t *random ) {
+    size_t count = size / CACHE_LINE_SIZE;
+    for( size_t i = 0; i < count; i++ ) *(uint64_t*)(buffer + i * CACHE_LINE_SIZE) = i;
+    for( size_t i = count - 1; i > 0; i-- ) {
+        uint64_t *a = (uint64_t*)(buffer + i * CACHE_LINE_SIZE), *b = (uint64_t*)(buffer + next_random( random ) % i * CACHE_LINE_SIZE);
+        uint64_t swap = *a;
+        *a = *b;
+        *b = swap;
+    }
+    for( size_t i = 0; i < count; i++ ) {
+        uint64_t *line = (uint64_t*)(buffer + i * CACHE_LINE_SIZE);
+        *line = (uint64_t)(buffer + *line * CACHE_LINE_SIZE);
+    }
+}
+
+// cycles per load, when every load's address comes from the one before
+static uint64_t measure_latency( uint8_t *buffer, size_t size, uint64_t *random ) {
+    build_chain( buffer, size, random );
+    void *line = buffer;
+    size_t steps = LATENCY_STEPS;
+    uint64_t start = cpu_read_timestamp();
+    asm volatile(
+        "1: mov (%[line]), %[line]\n\t"
+        "dec %[steps]\n\t"
+        "jnz 1b"
+        : [line] "+r" (line), [steps] "+r" (steps) :: "memory" );
+    return (cpu_read_timestamp() - start) / LATENCY_STEPS;
+}
+
+// MB/s, after 1 pass to warm up the caches & TLB
+static uint64_t measure_bandwidth( const operation_t *operation, uint8_t *buffer, size_t size ) {
+    size_t passes = size < BANDWIDTH_BYTES ? BANDWIDTH_BYTES / size : 1;
+    operation->function( buffer, size );
+    uint64_t start = cpu_read_timestamp();
+    for( size_t i = 0; i < passes; i++ ) operation->function( buffer, size );
+    uint64_t cycles = cpu_read_timestamp() - start, bytes = passes * (operation->copies ? size / 2 : size);
+    return bytes * (timer_get_frequency() / 1000000) / (0 == cycles ? 1 : cycles);
+}
+
+static uint8_t *map_window( pagemap_t *pagemap, size_t index, uint8_t *buffer, size_t size ) {
+    uint8_t *window = (uint8_t*)PAGING_USER_START + index * PAGE_SIZE_1GB;
+    size_t page_size = page_sizes[index];
+    uint64_t start = (uint64_t)buffer & ~(uint64_t)(page_size - 1), end = (uint64_t)buffer + size;
+    for( uint64_t address = start; address < end; address+= page_size ) {
+        if( PAGE_SIZE == page_size ) paging_map_page( pagemap, window + address, (void*)address, PAGE_FLAG_WRITE );
+        else paging_map_huge_page( pagemap, window + address, (void*)address, page_size, PAGE_FLAG_WRITE );
+    }
+    return window + (uint64_t)buffer;
+}
+
+// working set sizes must be powers of 2, & at least 4 KB
+void memory_benchmark_run( size_t min_working_set, size_t max_working_set ) {
+    if( min_working_set < PAGE_SIZE || min_working_set > max_working_set ) panic( "memory_benchmark_run: invalid working sets\n" );
+
+    // the buffer is physically contiguous (the kernel heap is identity mapped), & 2 MB-aligned so it takes as few 2 MB pages as possible
+    uint8_t *buffer = kernel_heap_alloc_aligned( max_working_set, PAGE_SIZE_2MB );
+    if( NULL == buffer ) panic( "memory_benchmark_run: not enough memory for the buffer\n" );
+    pagemap_t *pagemap = paging_create_pagemap(), *previous = paging_get_current_pagemap();
+    size_t window_count = paging_supports_1gb_pages() ? WINDOW_COUNT : WINDOW_COUNT - 1;
+    uint8_t *windows[WINDOW_COUNT];
+    for( size_t i = 0; i < window_count; i++ ) windows[i] = map_window( pagemap, i, buffer, max_working_set );
+    paging_switch_pagemap( pagemap );
+
+    // every window must really be the buffer
+    for( size_t i = 0; i < window_count; i++ ) {
+        *(volatile uint64_t*)(buffer + max_working_set - sizeof( uint64_t )) = i;
+        if( i != *(volatile uint64_t*)(windows[i] + max_working_set - sizeof( uint64_t )) ) panic( "memory_benchmark_run: window doesn't map the buffer\n" );
+    }
+
+    uint64_t random = 0x9E3779B97F4A7C15;
+    for( size_t i = 0; i < window_count; i++ ) {
+        for( size_t size = min_working_set; size <= max_working_set; size*= WORKING_SET_STEP ) {
+            vga_text_print_stat( "memory_benchmark page_size=", page_sizes[i] );
+            vga_text_print_stat( " working_set=", size );
+            vga_text_print_stat( " latency_cycles=", measure_latency( windows[i], size, &random ) );
+            for( size_t j = 0; j < sizeof( operations ) / sizeof( operations[0] ); j++ ) {
+                vga_text_print_stat( operations[j].name, measure_bandwidth( &operations[j], windows[i], size ) );
+            }
+            vga_text_print( "\n", 0x17 );
+        }
+    }
+
+    // the buffer is contiguous, so promotion turns the 4 KB window into the 2 MB window in place (w/o a PMU, TLB misses show up as latency)
+    uint64_t before = measure_latency( windows[0], max_working_set, &random );
+    size_t promotions = paging_promote_huge_pages( pagemap );
+    uint64_t after = measure_latency( windows[0], max_working_set, &random );
+    vga_text_print_stat( "memory_benchmark_promotion working_set=", max_working_set );
+    vga_text_print_stat( " promotions=", promotions );
+    vga_text_print_stat( " latency_cycles_before=", before );
+    vga_text_print_stat( " latency_cycles_after=", after );
+    vga_text_print( "\n", 0x17 );
+
+    paging_switch_pagemap( previous );
+    paging_destroy_pagemap( pagemap );
+    kernel_heap_free( buffer );
+}
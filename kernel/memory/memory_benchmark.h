@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+
+// microbenchmarks for the memory hierarchy, to help pick page sizes & memory primitives: dependent-load latency (a pointer chase in
+// random order, so the prefetchers can't help) & streaming bandwidth for each of the primitives in buffer.h, over working sets from
+// min to max (x4 each step), w/ the same memory mapped by 4 KB, 2 MB & 1 GB pages (if the CPU has them)
+// each result is 1 line of a table: "memory_benchmark page_size=<bytes> working_set=<bytes> latency_cycles=<n> read=<n> set=<n>
+// stream_clear=<n> simd_fill=<n> copy=<n> simd_copy=<n> simd_stream_copy=<n>", w/ bandwidths in MB/s (copies count the bytes copied)
+// then the 4 KB window is promoted to 2 MB pages (see paging_promote_huge_pages), & the largest working set's latency is measured again:
+// "memory_benchmark_promotion working_set=<bytes> promotions=<n> latency_cycles_before=<n> latency_cycles_after=<n>"
+#define MEMORY_BENCHMARK_MIN_WORKING_SET 0x1000 // 4 KB
+#define MEMORY_BENCHMARK_MAX_WORKING_SET 0x4000000 // 64 MB, which is past any last-level cache & any TLB's reach w/ 4 KB pages
+
+void memory_benchmark_run( size_t min_working_set, size_t max_working_set );
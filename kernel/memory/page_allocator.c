@@ -0,0 +1,406 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include "page_allocator.h"
+#include "paging.h"
+#include "kernel_heap.h"
+#include "../buffer/buffer.h"
+#include "../buffer/string.h" // for printing
+#include "../drivers/vga_text.h" // "
+#include "../drivers/acpi.h" // for the NUMA topology
+#include "../process/cpu.h"
+#include "../main.h" // for panic
+#include "../sync/spinlock.h"
+
+#define PANIC_ON_OUT_OF_MEMORY
+#define PAGE_COUNT ((PAGE_ALLOCATOR_END - PAGE_ALLOCATOR_START) >> PAGE_BITS)
+#define ZEROED_POOL_TARGET 256 // 1 MB of pre-zeroed pages per node, which the idle loop tops up
+
+// free pages form a stack, linked through their first 8 bytes (physical memory is identity mapped, so we can just write to them)
+typedef struct free_page {
+    struct free_page *next;
+} free_page_t;
+
+// a run of pages on 1 NUMA node. ranges are sorted by address, & don't overlap
+typedef struct page_range {
+    uint64_t start, end;
+    size_t node;
+} page_range_t;
+
+// each NUMA node has its own pools (& lock), so CPUs take memory that's close to them, & CPUs on different nodes don't contend
+// pages always go back to the node they came from
+typedef struct node_pool {
+    ticket_lock_t lock; // irqsave, since the page fault handler allocates pages
+    free_page_t *free_pages;
+    size_t free_page_count; // includes the zeroed pool
+    size_t range_index; // the node's ranges before this have been handed out entirely
+    uint64_t next_unused_page; // pages in ranges[range_index] from here up have never been allocated, so they aren't on the free stack yet
+    free_page_t *zeroed_pages; // pre-zeroed pages (also a stack, so each is zero except for its link)
+    size_t zeroed_page_count;
+    size_t fallbacks[ACPI_MAX_NODES]; // every node, nearest first (starting w/ this one), for when this one runs out
+} node_pool_t;
+
+static page_range_t ranges[ACPI_MAX_MEMORY_RANGES];
+static size_t range_count;
+static node_pool_t pools[ACPI_MAX_NODES];
+static size_t node_count;
+
+// pages can be shared between pagemaps (e.g. copy-on-write), so each page has a reference count (which its node's lock protects)
+static uint16_t *reference_counts;
+
+static bool is_owned( void *page ) {
+    return (size_t)page >= PAGE_ALLOCATOR_START && (size_t)page < PAGE_ALLOCATOR_END;
+}
+
+static size_t page_index( void *page ) {
+    return ((size_t)page - PAGE_ALLOCATOR_START) >> PAGE_BITS;
+}
+
+static void add_range( uint64_t start, uint64_t end, size_t node ) {
+    start = start < PAGE_ALLOCATOR_START ? PAGE_ALLOCATOR_START : (start + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    end = end > PAGE_ALLOCATOR_END ? PAGE_ALLOCATOR_END : end & ~(uint64_t)(PAGE_SIZE - 1);
+    if( start >= end ) return;
+
+    // insertion sort
+    size_t i = range_count++;
+    for( ; i > 0 && ranges[i - 1].start > start; i-- ) ranges[i] = ranges[i - 1];
+    ranges[i] = (page_range_t){ .start = start, .end = end, .node = node };
+}
+
+// the node that owns a page (pages outside of every range are never handed out, so they don't need one)
+static size_t get_page_node( void *page ) {
+    for( size_t i = 0; i < range_count; i++ ) {
+        if( (uint64_t)page >= ranges[i].start && (uint64_t)page < ranges[i].end ) return ranges[i].node;
+    }
+    return 0;
+}
+
+static size_t get_current_node() {
+    return acpi_get_cpu_node( cpu_get_apic_id( cpu_get_index() ) );
+}
+
+// call after acpi_init
+// w/ an SRAT, memory belongs to the node it lists it under (& memory it doesn't list isn't used). otherwise, it's all on node 0
+void page_allocator_init() {
+    node_count = acpi_get_node_count();
+    range_count = 0;
+    for( size_t i = 0; i < acpi_get_memory_range_count(); i++ ) {
+        const acpi_memory_range_t *range = acpi_get_memory_range( i );
+        add_range( range->start, range->end, range->node );
+    }
+    if( 0 == range_count ) add_range( PAGE_ALLOCATOR_START, PAGE_ALLOCATOR_END, 0 );
+
+    for( size_t node = 0; node < node_count; node++ ) {
+        node_pool_t *pool = &pools[node];
+        ticket_lock_init( &pool->lock, "page_allocator" );
+        pool->free_pages = NULL;
+        pool->zeroed_pages = NULL;
+        pool->zeroed_page_count = 0;
+        pool->range_index = 0;
+        pool->next_unused_page = 0;
+        pool->free_page_count = 0;
+        for( size_t i = 0; i < range_count; i++ ) {
+            if( ranges[i].node == node ) pool->free_page_count+= (ranges[i].end - ranges[i].start) >> PAGE_BITS;
+        }
+
+        // fallbacks by distance (insertion sort, so nodes at the same distance stay in order, & this node comes 1st)
+        for( size_t i = 0; i < node_count; i++ ) {
+            size_t other = (node + i) % node_count, j = i;
+            for( ; j > 0 && acpi_get_distance( node, pool->fallbacks[j - 1] ) > acpi_get_distance( node, other ); j-- ) {
+                pool->fallbacks[j] = pool->fallbacks[j - 1];
+            }
+            pool->fallbacks[j] = other;
+        }
+    }
+
+    // reference counts start at zero
+    reference_counts = kernel_heap_alloc_zeroed( PAGE_COUNT * sizeof( uint16_t ) );
+    kernel_heap_tag( reference_counts, KERNEL_HEAP_TAG_PAGE_ALLOCATOR );
+}
+
+// lock must be held. returns NULL once the node's ranges have all been handed out
+static void *take_unused_page( node_pool_t *pool ) {
+    size_t node = pool - pools;
+    for( ; pool->range_index < range_count; pool->range_index++ ) {
+        page_range_t *range = &ranges[pool->range_index];
+        if( range->node != node ) continue;
+        if( pool->next_unused_page < range->start ) pool->next_unused_page = range->start;
+        if( pool->next_unused_page < range->end ) {
+            void *page = (void*)pool->next_unused_page;
+            pool->next_unused_page+= PAGE_SIZE;
+            return page;
+        }
+    }
+    return NULL;
+}
+
+// lock must be held. returns a 2 MB-aligned run of 512 pages that have never been allocated, or NULL if the node's current range
+// doesn't have one left. the pages skipped to get to the alignment go onto the free stack
+static void *take_unused_huge_page( node_pool_t *pool ) {
+    size_t node = pool - pools;
+    for( ; pool->range_index < range_count; pool->range_index++ ) {
+        page_range_t *range = &ranges[pool->range_index];
+        if( range->node != node ) continue;
+        if( pool->next_unused_page < range->start ) pool->next_unused_page = range->start;
+        if( pool->next_unused_page < range->end ) break;
+    }
+    if( pool->range_index == range_count ) return NULL;
+
+    uint64_t huge_page = (pool->next_unused_page + PAGE_SIZE_2MB - 1) & ~(uint64_t)(PAGE_SIZE_2MB - 1);
+    if( huge_page + PAGE_SIZE_2MB > ranges[pool->range_index].end ) return NULL;
+    for( ; pool->next_unused_page < huge_page; pool->next_unused_page+= PAGE_SIZE ) {
+        free_page_t *page = (free_page_t*)pool->next_unused_page;
+        page->next = pool->free_pages;
+        pool->free_pages = page;
+    }
+    pool->next_unused_page = huge_page + PAGE_SIZE_2MB;
+    return (void*)huge_page;
+}
+
+// lock must be held
+static free_page_t *take_zeroed_page( node_pool_t *pool ) {
+    free_page_t *page = pool->zeroed_pages;
+    if( NULL == page ) return NULL;
+    pool->zeroed_pages = page->next;
+    pool->zeroed_page_count--;
+    pool->free_page_count--;
+    return page;
+}
+
+// lock must be held. takes a page that isn't zeroed (if there is one), or else a zeroed one (unless dirty_only), or NULL if the node
+// is out of memory
+static void *take_page( node_pool_t *pool, bool dirty_only ) {
+    free_page_t *page = pool->free_pages;
+    if( NULL != page ) {
+        pool->free_pages = page->next;
+    } else if( NULL == (page = take_unused_page( pool )) ) {
+        return dirty_only ? NULL : take_zeroed_page( pool );
+    }
+    pool->free_page_count--;
+    return page;
+}
+
+static void *out_of_memory() {
+    #ifdef PANIC_ON_OUT_OF_MEMORY
+    panic( "page_allocator_alloc: out of physical pages\n" );
+    #endif
+    return NULL;
+}
+
+// returns an uninitialized page w/ a reference count of 1, from the nearest node that has one (starting w/ the executing CPU's)
+// (pre-zeroed pages are only handed out once a node's other pages run out, since it'd be a waste to zero them for this)
+void *page_allocator_alloc() {
+    size_t *fallbacks = pools[get_current_node()].fallbacks;
+    for( size_t i = 0; i < node_count; i++ ) {
+        node_pool_t *pool = &pools[fallbacks[i]];
+        bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &pool->lock );
+        void *page = take_page( pool, false );
+        if( NULL != page ) reference_counts[page_index( page )] = 1;
+        ticket_lock_release_irqrestore( &pool->lock, interrupts_were_enabled );
+        if( NULL != page ) return page;
+    }
+    return out_of_memory();
+}
+
+// returns a zeroed page w/ a reference count of 1. if the idle loop has kept the pool topped up, this is just a pop off the pool,
+// or else we have to clear the page ourselves. either way, a nearer node's page wins (clearing it is cheaper than every access to a
+// remote page would be)
+void *page_allocator_alloc_zeroed() {
+    size_t *fallbacks = pools[get_current_node()].fallbacks;
+    for( size_t i = 0; i < node_count; i++ ) {
+        node_pool_t *pool = &pools[fallbacks[i]];
+        bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &pool->lock );
+        free_page_t *page = take_zeroed_page( pool );
+        bool zeroed = NULL != page;
+        if( !zeroed ) page = take_page( pool, true );
+        if( NULL != page ) reference_counts[page_index( page )] = 1;
+        ticket_lock_release_irqrestore( &pool->lock, interrupts_were_enabled );
+        if( NULL == page ) continue;
+
+        if( zeroed ) page->next = NULL; // the link was the only non-zero qword
+        else buffer_clear_qwords( (uint64_t*)page, PAGE_SIZE / sizeof( uint64_t ) );
+        return page;
+    }
+    return out_of_memory();
+}
+
+// returns 512 physically contiguous, uninitialized pages (2 MB-aligned), each w/ a reference count of 1 (so they're freed 1 by 1, like
+// any other page), or NULL if no node has that much contiguous memory. freed pages go back onto the free stacks, so huge pages only come
+// from memory that has never been handed out
+void *page_allocator_alloc_huge() {
+    size_t *fallbacks = pools[get_current_node()].fallbacks;
+    for( size_t i = 0; i < node_count; i++ ) {
+        node_pool_t *pool = &pools[fallbacks[i]];
+        bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &pool->lock );
+        void *huge_page = take_unused_huge_page( pool );
+        if( NULL != huge_page ) {
+            for( size_t j = 0; j < PAGE_SIZE_2MB / PAGE_SIZE; j++ ) reference_counts[page_index( huge_page ) + j] = 1;
+            pool->free_page_count-= PAGE_SIZE_2MB / PAGE_SIZE;
+        }
+        ticket_lock_release_irqrestore( &pool->lock, interrupts_were_enabled );
+        if( NULL != huge_page ) return huge_page;
+    }
+    return NULL;
+}
+
+// lock isn't held. moves dirty pages into the pool until it's full, or until the node runs out of them
+static void fill_pool( node_pool_t *pool ) {
+    while( __atomic_load_n( &pool->zeroed_page_count, __ATOMIC_RELAXED ) < ZEROED_POOL_TARGET ) {
+        // take a page that isn't zeroed (but don't dip into the pool itself)
+        bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &pool->lock );
+        free_page_t *page = take_page( pool, true );
+        ticket_lock_release_irqrestore( &pool->lock, interrupts_were_enabled );
+        if( NULL == page ) return;
+
+        buffer_stream_clear_qwords( (uint64_t*)page, PAGE_SIZE / sizeof( uint64_t ) );
+
+        interrupts_were_enabled = ticket_lock_acquire_irqsave( &pool->lock );
+        page->next = pool->zeroed_pages;
+        pool->zeroed_pages = page;
+        pool->zeroed_page_count++;
+        pool->free_page_count++;
+        ticket_lock_release_irqrestore( &pool->lock, interrupts_were_enabled );
+    }
+}
+
+// called from the idle loop: zeroes free pages (w/ non-temporal stores, so the cache keeps whatever was using it) until every node's
+// pool is full, nearest node first. interrupts stay enabled, so this doesn't delay anything, and the lock is only held to move a page
+// between stacks
+void page_allocator_fill_zeroed_pool() {
+    size_t *fallbacks = pools[get_current_node()].fallbacks;
+    for( size_t i = 0; i < node_count; i++ ) fill_pool( &pools[fallbacks[i]] );
+}
+
+// note: pages that the allocator doesn't own (e.g. the kernel image) are never reference counted, so sharing & freeing them does nothing
+void page_allocator_share( void *page ) {
+    if( !is_owned( page ) ) return;
+    node_pool_t *pool = &pools[get_page_node( page )];
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &pool->lock );
+    reference_counts[page_index( page )]++;
+    ticket_lock_release_irqrestore( &pool->lock, interrupts_were_enabled );
+}
+
+void page_allocator_free( void *page ) {
+    if( !is_owned( page ) ) return;
+    node_pool_t *pool = &pools[get_page_node( page )];
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &pool->lock );
+    if( 0 == --reference_counts[page_index( page )] ) {
+        // push onto the free stack of the node it came from
+        free_page_t *free_page = (free_page_t*)page;
+        free_page->next = pool->free_pages;
+        pool->free_pages = free_page;
+        pool->free_page_count++;
+    }
+    ticket_lock_release_irqrestore( &pool->lock, interrupts_were_enabled );
+}
+
+size_t page_allocator_reference_count( void *page ) {
+    return is_owned( page ) ? reference_counts[page_index( page )] : 0;
+}
+
+// the NUMA node whose memory holds the page
+size_t page_allocator_get_node( void *page ) {
+    return get_page_node( page );
+}
+
+size_t page_allocator_node_free_page_count( size_t node ) {
+    return pools[node].free_page_count;
+}
+
+size_t page_allocator_free_page_count() {
+    size_t count = 0;
+    for( size_t node = 0; node < node_count; node++ ) count+= pools[node].free_page_count;
+    return count;
+}
+
+size_t page_allocator_zeroed_page_count() {
+    size_t count = 0;
+    for( size_t node = 0; node < node_count; node++ ) count+= pools[node].zeroed_page_count;
+    return count;
+}
+
+static bool is_zeroed( uint64_t *page ) {
+    for( size_t i = 0; i < PAGE_SIZE / sizeof( uint64_t ); i++ ) {
+        if( 0 != page[i] ) return false;
+    }
+    return true;
+}
+
+#define TEST_PAGE_COUNT 8
+
+void page_allocator_run_tests() {
+    // zeroed pages come from the pool when it has them, & are cleared on the spot when it doesn't
+    node_pool_t *pool = &pools[get_current_node()];
+    page_allocator_fill_zeroed_pool();
+    if( ZEROED_POOL_TARGET != pool->zeroed_page_count ) panic( "page_allocator_run_tests: pool didn't fill up\n" );
+    size_t free_pages = pool->free_page_count;
+    void *pages[ZEROED_POOL_TARGET + TEST_PAGE_COUNT];
+    for( size_t i = 0; i < ZEROED_POOL_TARGET + TEST_PAGE_COUNT; i++ ) {
+        pages[i] = page_allocator_alloc_zeroed();
+        if( !is_zeroed( pages[i] ) ) panic( "page_allocator_run_tests: zeroed page isn't zero\n" );
+        buffer_set_qwords( pages[i], 0xDEADBEEF, PAGE_SIZE / sizeof( uint64_t ) );
+    }
+    if( 0 != pool->zeroed_page_count ) panic( "page_allocator_run_tests: zeroed allocations didn't use the pool\n" );
+
+    // ...and they all came from this CPU's node
+    for( size_t i = 0; i < ZEROED_POOL_TARGET + TEST_PAGE_COUNT; i++ ) {
+        if( pool - pools != page_allocator_get_node( pages[i] ) ) panic( "page_allocator_run_tests: page came from a remote node\n" );
+    }
+
+    // dirty pages that are freed go back to their node, & get zeroed again when the pool is refilled
+    for( size_t i = 0; i < ZEROED_POOL_TARGET + TEST_PAGE_COUNT; i++ ) page_allocator_free( pages[i] );
+    if( free_pages != pool->free_page_count ) panic( "page_allocator_run_tests: zeroed allocations leaked pages\n" );
+    page_allocator_fill_zeroed_pool();
+    for( free_page_t *page = pool->zeroed_pages; NULL != page; page = page->next ) {
+        uint64_t next = (uint64_t)page->next;
+        page->next = NULL;
+        bool zeroed = is_zeroed( (uint64_t*)page );
+        page->next = (free_page_t*)next;
+        if( !zeroed ) panic( "page_allocator_run_tests: pool holds a page that isn't zero\n" );
+    }
+
+    // plain allocations leave the pool alone while there are other pages
+    void *page = page_allocator_alloc();
+    if( ZEROED_POOL_TARGET != pool->zeroed_page_count ) panic( "page_allocator_run_tests: plain allocation took a zeroed page\n" );
+    page_allocator_free( page );
+
+    // every node falls back to itself 1st, & then to the others in order of distance
+    for( size_t node = 0; node < node_count; node++ ) {
+        size_t *fallbacks = pools[node].fallbacks;
+        if( node != fallbacks[0] ) panic( "page_allocator_run_tests: node doesn't allocate from itself first\n" );
+        for( size_t i = 1; i < node_count; i++ ) {
+            if( acpi_get_distance( node, fallbacks[i - 1] ) > acpi_get_distance( node, fallbacks[i] ) ) panic( "page_allocator_run_tests: fallbacks are out of order\n" );
+        }
+    }
+}
+
+#define BENCHMARK_PAGES 128 // at most the pool's size
+
+static uint64_t time_zeroed_allocations( void **pages ) {
+    uint64_t start = cpu_read_timestamp();
+    for( size_t i = 0; i < BENCHMARK_PAGES; i++ ) pages[i] = page_allocator_alloc_zeroed();
+    uint64_t cycles = cpu_read_timestamp() - start;
+    for( size_t i = 0; i < BENCHMARK_PAGES; i++ ) page_allocator_free( pages[i] );
+    return cycles / BENCHMARK_PAGES;
+}
+
+// zeroed-page allocation latency, from a full pool & then from an empty one (which has to clear each page)
+// the result line is "page_allocator_benchmark pooled_cycles=<tsc cycles per page> synchronous_cycles=<tsc cycles per page>"
+void page_allocator_run_benchmark() {
+    void *pages[BENCHMARK_PAGES];
+    page_allocator_fill_zeroed_pool();
+    uint64_t pooled = time_zeroed_allocations( pages );
+
+    // drain the pool (freed pages go back on the dirty stack, so they don't refill it)
+    void *pool[ZEROED_POOL_TARGET];
+    size_t drained = 0;
+    while( 0 != pools[get_current_node()].zeroed_page_count && drained < ZEROED_POOL_TARGET ) pool[drained++] = page_allocator_alloc_zeroed();
+    uint64_t synchronous = time_zeroed_allocations( pages );
+    for( size_t i = 0; i < drained; i++ ) page_allocator_free( pool[i] );
+
+    vga_text_print( "page_allocator_benchmark pooled_cycles=", 0x17 );
+    vga_text_print( string_from_int64( (int64_t)pooled ), 0x17 );
+    vga_text_print( " synchronous_cycles=", 0x17 );
+    vga_text_print( string_from_int64( (int64_t)synchronous ), 0x17 );
+    vga_text_print( "\n", 0x17 );
+    page_allocator_fill_zeroed_pool();
+}
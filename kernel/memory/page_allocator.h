@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kernel_heap.h"
+
+// physical memory above the kernel heap is handed out one 4 KB page at a time, from per-NUMA node pools (see acpi.h)
+#define PAGE_ALLOCATOR_START KERNEL_HEAP_END
+#define PAGE_ALLOCATOR_END 0x40000000 // 1 GB (max physical memory)
+
+void page_allocator_init();
+void *page_allocator_alloc();
+void *page_allocator_alloc_zeroed();
+void *page_allocator_alloc_huge();
+void page_allocator_fill_zeroed_pool();
+void page_allocator_share( void *page );
+void page_allocator_free( void *page );
+size_t page_allocator_reference_count( void *page );
+size_t page_allocator_get_node( void *page );
+size_t page_allocator_node_free_page_count( size_t node );
+size_t page_allocator_free_page_count();
+size_t page_allocator_zeroed_page_count();
+void page_allocator_run_tests();
+void page_allocator_run_benchmark();
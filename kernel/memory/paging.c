@@ -1,21 +1,73 @@
 #include <stdint.h>
 #include "paging.h"
+#include "kernel_heap.h"
+#include "page_allocator.h"
+#include "tlb.h"
+#include "../buffer/buffer.h"
 #include "../buffer/string.h"
 #include "../drivers/vga_text.h"
+#include "../interrupt/interrupt_table.h"
+#include "../process/cpu.h"
+#include "../main.h" // for panic
+
+//#define TRACE
 
-#define PAGE_FLAG_PRESENT (1 << 0)
-#define PAGE_FLAG_WRITE (1 << 1)
-#define PAGE_FLAG_HUGE (1 << 7)
-#define PAGE_BITS 12
-#define PAGE_SIZE (1 << PAGE_BITS)
-#define PAGETABLE_BITS 9
-#define PAGETABLE_ENTRIES (1 << PAGETABLE_BITS)
 #define PAGEMAP_LEVELS 4
 #define PAGEMAP_MAX_MEMORY 0x40000000 // 1GB
+#define PAGEMAP_USER_PML4_START (PAGING_USER_START >> (PAGE_BITS + 3 * PAGETABLE_BITS))
+#define PAGEMAP_USER_PML4_END (PAGING_USER_END >> (PAGE_BITS + 3 * PAGETABLE_BITS))
+#define PAGE_TABLE_FLAGS (PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_USER) // non-leaf entries allow everything, so the leaf entries decide
+#define CR0_WRITE_PROTECT (1 << 16)
+#define CR3_NO_FLUSH ((uint64_t)1 << 63)
+#define CR4_PCID_ENABLE (1 << 17)
+#define PCID_COUNT 4096
+#define PROMOTION_IGNORED_FLAGS (PAGE_FLAG_ACCESSED | PAGE_FLAG_DIRTY) // the CPU sets these page by page, so they needn't match
+#define PROMOTION_KERNEL_START PAGE_SIZE_2MB // the 1st 2 MB holds legacy memory (VGA, BIOS ROMs) w/ other MTRR memory types, & a huge page mustn't straddle memory types
+
+// the power-on PAT (0x0007040600070406), except entry 1 (selected by PWT alone) is write-combining (0x01) instead of write-through (0x04)
+// this leaves PWT|PCD (entry 3) as uncached for MMIO registers, while PWT alone gives us write-combining for framebuffers
+#define PAT_VALUE 0x0007040600070106
 
-typedef struct pagetable {
-    uint64_t entries[PAGETABLE_ENTRIES];
-} pagetable_t;
+static pagemap_t kernel_pagemap;
+static pagemap_t *current_pagemaps[CPU_MAX_COUNT]; // each CPU has its own CR3
+#define current_pagemap current_pagemaps[cpu_get_index()]
+static bool pcid_enabled;
+static uint64_t pcids_in_use[PCID_COUNT / 64];
+static uint64_t promotion_count;
+
+static void write_cr3( uint64_t value ) {
+    asm volatile( "mov %[value], %%cr3" :: [value] "r" (value) : "memory" );
+}
+
+static uint64_t read_cr0() {
+    uint64_t value;
+    asm volatile( "mov %%cr0, %[value]" : [value] "=r" (value) );
+    return value;
+}
+
+static void write_cr0( uint64_t value ) {
+    asm volatile( "mov %[value], %%cr0" :: [value] "r" (value) : "memory" );
+}
+
+static uint64_t read_cr4() {
+    uint64_t value;
+    asm volatile( "mov %%cr4, %[value]" : [value] "=r" (value) );
+    return value;
+}
+
+static void write_cr4( uint64_t value ) {
+    asm volatile( "mov %[value], %%cr4" :: [value] "r" (value) : "memory" );
+}
+
+static void invalidate_page( void *address ) {
+    asm volatile( "invlpg (%[address])" :: [address] "r" (address) : "memory" );
+}
+
+static void init_pat() {
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid( 1, &eax, &ebx, &ecx, &edx );
+    if( edx & CPU_CPUID_1_EDX_PAT ) cpu_write_msr( CPU_MSR_PAT, PAT_VALUE );
+}
 
 static size_t shift_right_round_up( size_t x, size_t shift ) {
     size_t mask = (1 << shift) - 1, remainder = x & mask;
@@ -64,30 +116,524 @@ void paging_init_kernel_pagemap() {
            pagemap_size = get_pagemap_dimensions( PAGEMAP_MAX_MEMORY, &num_pages, num_pagetables_per_level );
 
     // print this data out to the user
+    #ifdef TRACE
     paging_print_pagemap_dimensions( num_pages, num_pagetables_per_level, pagemap_size );
+    #endif
 
-    // the initial pagemap 
-    /* TODO: test to make sure entire address space is accessible
-    // test accessing last byte of memory (1GB)
-    char *p = (char*)0x40000000 - 1;
-    vga_text_print( "reading last byte of memory (address 1GB - 1): ", 0x17 );
-    vga_text_print( string_int64_to_temp( (int64_t)*p ), 0x17 );
-    vga_text_print( "\n", 0x17 );
-    */
+    // allocate the pagemap
+    // the tables are laid out level by level: all of the pagetables first, then the page directories, etc., with the PML4 last
+    pagetable_t *tables = kernel_heap_alloc_aligned( pagemap_size, PAGE_SIZE );
+    kernel_heap_tag( tables, KERNEL_HEAP_TAG_PAGING );
+
+    // populate the lowest level w/ an identity map of physical memory
+    // pages are global, so they stay in the TLB when we switch CR3 between pagemaps that share the kernel's mappings
+    uint64_t *entries = (uint64_t*)tables;
+    size_t num_entries = num_pagetables_per_level[0] * PAGETABLE_ENTRIES;
+    for( size_t i = 0; i < num_entries; i++ ) {
+        entries[i] = i < num_pages ? (i << PAGE_BITS) | PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_GLOBAL : 0;
+    }
+
+    // populate each higher level to point at the tables in the level below it
+    pagetable_t *level = tables;
+    for( size_t i = 1; i < PAGEMAP_LEVELS; i++ ) {
+        pagetable_t *next_level = level + num_pagetables_per_level[i - 1];
+        entries = (uint64_t*)next_level;
+        num_entries = num_pagetables_per_level[i] * PAGETABLE_ENTRIES;
+        for( size_t j = 0; j < num_entries; j++ ) {
+            entries[j] = j < num_pagetables_per_level[i - 1] ? (uint64_t)&level[j] | PAGE_TABLE_FLAGS : 0;
+        }
+        level = next_level;
+    }
+
+    // switch the CR3 register to point to the pagemap (the PML4 is the last table), which also flushes the TLB
+    kernel_pagemap.pml4 = level;
+    kernel_pagemap.pcid = 0;
+    kernel_pagemap.active_cpus = (uint64_t)1 << cpu_get_index();
+    kernel_pagemap.stale_cpus = 0;
+    current_pagemap = &kernel_pagemap;
+    write_cr3( (uint64_t)kernel_pagemap.pml4 );
+
+    // make ring 0 respect read-only pages too, otherwise kernel writes would go straight through copy-on-write pages
+    write_cr0( read_cr0() | CR0_WRITE_PROTECT );
+
+    // if the CPU supports PCIDs, enable them so that switching pagemaps doesn't have to flush the TLB (pcid 0 belongs to the kernel pagemap)
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid( 1, &eax, &ebx, &ecx, &edx );
+    pcid_enabled = 0 != (ecx & CPU_CPUID_1_ECX_PCID);
+    if( pcid_enabled ) write_cr4( read_cr4() | CR4_PCID_ENABLE );
+    pcids_in_use[0] = 1;
+
+    // every CPU must agree on memory types, so the APs do this too
+    init_pat();
+}
+
+// called by each application processor, which arrives w/ CR3 pointing at the kernel pagemap (see smp_trampoline.asm)
+void paging_init_ap() {
+    current_pagemap = &kernel_pagemap;
+    __atomic_fetch_or( &kernel_pagemap.active_cpus, (uint64_t)1 << cpu_get_index(), __ATOMIC_SEQ_CST );
+    write_cr0( read_cr0() | CR0_WRITE_PROTECT );
+    if( pcid_enabled ) write_cr4( read_cr4() | CR4_PCID_ENABLE );
+    init_pat();
+}
+
+pagemap_t *paging_get_kernel_pagemap() {
+    return &kernel_pagemap;
+}
+
+pagemap_t *paging_get_current_pagemap() {
+    return current_pagemap;
+}
+
+static uint16_t allocate_pcid() {
+    if( !pcid_enabled ) return 0;
+    for( size_t i = 0; i < PCID_COUNT / 64; i++ ) {
+        if( ~pcids_in_use[i] ) {
+            size_t bit = __builtin_ctzll( ~pcids_in_use[i] );
+            pcids_in_use[i]|= (uint64_t)1 << bit;
+            return (uint16_t)(i * 64 + bit);
+        }
+    }
+    panic( "allocate_pcid: out of PCIDs\n" );
+    return 0;
+}
+
+static void free_pcid( uint16_t pcid ) {
+    if( 0 == pcid ) return;
+    pcids_in_use[pcid / 64]&= ~((uint64_t)1 << (pcid % 64));
+}
+
+static pagetable_t *alloc_table() {
+    return page_allocator_alloc_zeroed();
+}
+
+static pagetable_t *entry_to_table( uint64_t entry ) {
+    return (pagetable_t*)(entry & PAGE_ADDRESS_MASK);
+}
+
+static size_t table_index( void *address, size_t level ) {
+    return ((uint64_t)address >> (PAGE_BITS + level * PAGETABLE_BITS)) & (PAGETABLE_ENTRIES - 1);
+}
+
+// splits a promoted 2 MB page back into the 4 KB pages it's made of, & returns the page directory entry for their new table
+// the translation doesn't change, so stale TLB entries for the 2 MB page are harmless until one of the 4 KB entries does (a process's
+// changes get shot down anyway, but kernel mappings are only invalidated on the CPU that maps them, see get_entry_at_level)
+static uint64_t demote( uint64_t entry ) {
+    pagetable_t *table = alloc_table();
+    uint64_t page = entry & PAGE_ADDRESS_MASK, flags = entry & ~PAGE_ADDRESS_MASK & ~(PAGE_FLAG_HUGE | PAGE_FLAG_PROMOTED);
+    for( size_t i = 0; i < PAGETABLE_ENTRIES; i++ ) table->entries[i] = (page + i * PAGE_SIZE) | flags;
+    return (uint64_t)table | PAGE_TABLE_FLAGS;
+}
+
+// returns the entry for an address at a level (0 for 4 KB pages, 1 for 2 MB pages, 2 for 1 GB pages), or a huge-page entry above
+// that level, optionally creating any missing tables along the way (which also splits a promoted page that's in the way, while
+// any other huge page in the way is an error)
+static uint64_t *get_entry_at_level( pagetable_t *pml4, void *address, size_t leaf_level, bool create ) {
+    pagetable_t *table = pml4;
+    for( size_t level = PAGEMAP_LEVELS - 1; level > leaf_level; level-- ) {
+        uint64_t *entry = &table->entries[table_index( address, level )];
+        if( !(*entry & PAGE_FLAG_PRESENT) ) {
+            if( !create ) return NULL;
+            *entry = (uint64_t)alloc_table() | PAGE_TABLE_FLAGS;
+        }
+        if( create && (*entry & PAGE_FLAG_PROMOTED) ) {
+            *entry = demote( *entry );
+            if( (size_t)address < PAGING_USER_START || (size_t)address >= PAGING_USER_END ) tlb_shootdown_kernel();
+        }
+        if( create && (*entry & PAGE_FLAG_HUGE) ) panic( "get_entry_at_level: a huge page is in the way\n" );
+        if( *entry & PAGE_FLAG_HUGE ) return entry;
+        table = entry_to_table( *entry );
+    }
+    return &table->entries[table_index( address, leaf_level )];
+}
+
+// returns the leaf entry (or huge-page entry) for an address
+static uint64_t *get_entry( pagetable_t *pml4, void *address, bool create ) {
+    return get_entry_at_level( pml4, address, 0, create );
+}
+
+// returns the present entry that maps an address (4 KB or huge), & the size of its page, or NULL if the address isn't mapped
+static uint64_t *get_mapping( pagetable_t *pml4, void *address, size_t *page_size ) {
+    pagetable_t *table = pml4;
+    for( size_t level = PAGEMAP_LEVELS - 1; ; level-- ) {
+        uint64_t *entry = &table->entries[table_index( address, level )];
+        if( !(*entry & PAGE_FLAG_PRESENT) ) return NULL;
+        if( 0 == level || (*entry & PAGE_FLAG_HUGE) ) {
+            *page_size = (size_t)PAGE_SIZE << (level * PAGETABLE_BITS);
+            return entry;
+        }
+        table = entry_to_table( *entry );
+    }
+}
+
+pagemap_t *paging_create_pagemap() {
+    pagemap_t *pagemap = kernel_heap_alloc( sizeof( pagemap_t ) );
+    kernel_heap_tag( pagemap, KERNEL_HEAP_TAG_PAGING );
+    pagemap->pml4 = alloc_table();
+    pagemap->pcid = allocate_pcid();
+    pagemap->active_cpus = 0;
+    pagemap->stale_cpus = ~(uint64_t)0; // the pcid may have been used by a destroyed pagemap
+
+    // share the kernel's entries
+    for( size_t i = 0; i < PAGETABLE_ENTRIES; i++ ) {
+        if( i < PAGEMAP_USER_PML4_START || i >= PAGEMAP_USER_PML4_END ) pagemap->pml4->entries[i] = kernel_pagemap.pml4->entries[i];
+    }
+    return pagemap;
+}
+
+// copies the tables, but shares the pages: writable pages become read-only & copy-on-write in both the original & the clone
+// (except for shared memory, which stays writable in both)
+static pagetable_t *clone_table( pagetable_t *table, size_t level ) {
+    pagetable_t *clone = alloc_table();
+    for( size_t i = 0; i < PAGETABLE_ENTRIES; i++ ) {
+        uint64_t entry = table->entries[i];
+        if( !(entry & PAGE_FLAG_PRESENT) ) continue;
+        if( entry & PAGE_FLAG_PROMOTED ) table->entries[i] = entry = demote( entry ); // so its pages can be copy-on-write 1 by 1
+        if( entry & PAGE_FLAG_HUGE ) {
+            clone->entries[i] = entry; // huge pages aren't reference counted (see paging_map_huge_page), so they're just shared
+        } else if( level > 0 ) {
+            clone->entries[i] = (uint64_t)clone_table( entry_to_table( entry ), level - 1 ) | (entry & ~PAGE_ADDRESS_MASK);
+        } else {
+            if( (entry & PAGE_FLAG_WRITE) && !(entry & PAGE_FLAG_SHARED) ) table->entries[i] = entry = (entry & ~PAGE_FLAG_WRITE) | PAGE_FLAG_COPY_ON_WRITE;
+            page_allocator_share( (void*)(entry & PAGE_ADDRESS_MASK) );
+            clone->entries[i] = entry;
+        }
+    }
+    return clone;
+}
+
+// cost is proportional to the # of mapped pages (only present entries are visited), not to the size of the address space
+pagemap_t *paging_clone_pagemap( pagemap_t *pagemap ) {
+    pagemap_t *clone = paging_create_pagemap();
+    for( size_t i = PAGEMAP_USER_PML4_START; i < PAGEMAP_USER_PML4_END; i++ ) {
+        uint64_t entry = pagemap->pml4->entries[i];
+        if( entry & PAGE_FLAG_PRESENT ) clone->pml4->entries[i] = (uint64_t)clone_table( entry_to_table( entry ), PAGEMAP_LEVELS - 2 ) | (entry & ~PAGE_ADDRESS_MASK);
+    }
+
+    // the original lost write access to its pages
+    tlb_shootdown_all( pagemap );
+    return clone;
+}
+
+static void destroy_table( pagetable_t *table, size_t level ) {
+    for( size_t i = 0; i < PAGETABLE_ENTRIES; i++ ) {
+        uint64_t entry = table->entries[i];
+        if( !(entry & PAGE_FLAG_PRESENT) ) continue;
+        if( entry & PAGE_FLAG_HUGE ) {
+            // promoted pages are still reference counted 1 by 1, if the allocator owns them (other huge pages aren't at all)
+            if( !(entry & PAGE_FLAG_PROMOTED) ) continue;
+            for( size_t j = 0; j < PAGETABLE_ENTRIES; j++ ) page_allocator_free( (void*)((entry & PAGE_ADDRESS_MASK) + j * PAGE_SIZE) );
+        } else if( level > 0 ) destroy_table( entry_to_table( entry ), level - 1 );
+        else page_allocator_free( (void*)(entry & PAGE_ADDRESS_MASK) );
+    }
+    page_allocator_free( table );
+}
+
+void paging_destroy_pagemap( pagemap_t *pagemap ) {
+    if( pagemap == &kernel_pagemap ) panic( "paging_destroy_pagemap: cannot destroy the kernel pagemap\n" );
+    if( pagemap == current_pagemap ) paging_switch_pagemap( &kernel_pagemap );
+    if( 0 != pagemap->active_cpus ) panic( "paging_destroy_pagemap: pagemap is still running on another CPU\n" );
+    tlb_commit(); // our batch may still refer to the pagemap
+
+    // free the user half (the kernel half is shared)
+    for( size_t i = PAGEMAP_USER_PML4_START; i < PAGEMAP_USER_PML4_END; i++ ) {
+        uint64_t entry = pagemap->pml4->entries[i];
+        if( entry & PAGE_FLAG_PRESENT ) destroy_table( entry_to_table( entry ), PAGEMAP_LEVELS - 2 );
+    }
+    page_allocator_free( pagemap->pml4 );
+    free_pcid( pagemap->pcid );
+    kernel_heap_free( pagemap );
+}
+
+void paging_switch_pagemap( pagemap_t *pagemap ) {
+    // interrupts stay off until CR3 holds the pagemap, otherwise a shootdown could reach us in between & find it isn't current yet
+    bool interrupts_were_enabled = interrupt_table_disable_interrupts();
+    uint64_t self = (uint64_t)1 << cpu_get_index();
+    __atomic_fetch_and( &current_pagemap->active_cpus, ~self, __ATOMIC_SEQ_CST );
+
+    // announce that we're running the pagemap before we check whether we're stale (shootdowns do the opposite, see tlb.c)
+    __atomic_fetch_or( &pagemap->active_cpus, self, __ATOMIC_SEQ_CST );
+    bool stale = 0 != (__atomic_fetch_and( &pagemap->stale_cpus, ~self, __ATOMIC_SEQ_CST ) & self);
+
+    // w/ PCIDs, the TLB keeps entries for every pagemap, so we only flush if this pagemap's entries may be stale
+    uint64_t cr3 = (uint64_t)pagemap->pml4 | pagemap->pcid;
+    if( pcid_enabled && !stale ) cr3|= CR3_NO_FLUSH;
+    current_pagemap = pagemap;
+    write_cr3( cr3 );
+    interrupt_table_restore_interrupts( interrupts_were_enabled );
+}
+
+// the TLB never caches non-present entries, so only replacing a mapping needs invalidating (kernel mappings are only ever added)
+void paging_map_page( pagemap_t *pagemap, void *virtual_address, void *physical_address, uint64_t flags ) {
+    uint64_t *entry = get_entry( pagemap->pml4, virtual_address, true ), previous = *entry;
+    *entry = ((uint64_t)physical_address & PAGE_ADDRESS_MASK) | flags | PAGE_FLAG_PRESENT;
+    if( pagemap == &kernel_pagemap ) invalidate_page( virtual_address );
+    else if( previous & PAGE_FLAG_PRESENT ) tlb_shootdown_page( pagemap, virtual_address );
+}
+
+// page_size is PAGE_SIZE_2MB or PAGE_SIZE_1GB, and both addresses must be aligned to it. the memory isn't reference counted (it's not
+// handed out page by page), so destroying the pagemap leaves it alone. there mustn't be any smaller pages mapped there already
+void paging_map_huge_page( pagemap_t *pagemap, void *virtual_address, void *physical_address, size_t page_size, uint64_t flags ) {
+    if( PAGE_SIZE_1GB == page_size && !paging_supports_1gb_pages() ) panic( "paging_map_huge_page: CPU doesn't support 1 GB pages\n" );
+    if( PAGE_SIZE_2MB != page_size && PAGE_SIZE_1GB != page_size ) panic( "paging_map_huge_page: invalid page size\n" );
+    if( 0 != (((uint64_t)virtual_address | (uint64_t)physical_address) & (page_size - 1)) ) panic( "paging_map_huge_page: misaligned page\n" );
+    uint64_t *entry = get_entry_at_level( pagemap->pml4, virtual_address, PAGE_SIZE_2MB == page_size ? 1 : 2, true ), previous = *entry;
+    if( (previous & PAGE_FLAG_PRESENT) && (!(previous & PAGE_FLAG_HUGE) || (previous & PAGE_FLAG_PROMOTED)) ) panic( "paging_map_huge_page: smaller pages are in the way\n" );
+    *entry = (uint64_t)physical_address | flags | PAGE_FLAG_PRESENT | PAGE_FLAG_HUGE;
+    if( pagemap == &kernel_pagemap ) invalidate_page( virtual_address );
+    else if( previous & PAGE_FLAG_PRESENT ) tlb_shootdown_page( pagemap, virtual_address );
+}
+
+bool paging_supports_1gb_pages() {
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid( 0x80000001, &eax, &ebx, &ecx, &edx );
+    return 0 != (edx & CPU_CPUID_80000001_EDX_1GB_PAGES);
+}
+
+// the page is freed once no CPU can reach it anymore, i.e. after the caller's tlb_commit (see tlb.h), so unmapping many pages costs
+// 1 shootdown. the (now empty) tables stay. returns false if the address wasn't mapped
+bool paging_unmap_page( pagemap_t *pagemap, void *virtual_address ) {
+    if( pagemap == &kernel_pagemap ) panic( "paging_unmap_page: kernel mappings are permanent\n" );
+    uint64_t *entry = get_entry( pagemap->pml4, virtual_address, false );
+    if( NULL == entry || !(*entry & PAGE_FLAG_PRESENT) ) return false;
+    if( *entry & PAGE_FLAG_PROMOTED ) entry = get_entry( pagemap->pml4, virtual_address, true ); // splits it
+    if( *entry & PAGE_FLAG_HUGE ) panic( "paging_unmap_page: can't unmap part of a huge page\n" );
+    void *page = (void*)(*entry & PAGE_ADDRESS_MASK);
+    *entry = 0;
+    tlb_queue( pagemap, virtual_address, page );
+    return true;
+}
+
+void paging_unmap_range( pagemap_t *pagemap, void *virtual_address, size_t size ) {
+    for( size_t offset = 0; offset < size; offset+= PAGE_SIZE ) paging_unmap_page( pagemap, (uint8_t*)virtual_address + offset );
+    tlb_commit();
+}
+
+// the mapping goes into the kernel's half, which every pagemap shares
+static void map_identity( void *physical_address, size_t size, uint64_t flags ) {
+    size_t start = (size_t)physical_address & ~(size_t)(PAGE_SIZE - 1), end = (size_t)physical_address + size;
+    for( size_t address = start; address < end; address+= PAGE_SIZE ) {
+        paging_map_page( &kernel_pagemap, (void*)address, (void*)address, flags | PAGE_FLAG_WRITE | PAGE_FLAG_GLOBAL );
+    }
+}
+
+// identity-maps device registers above the RAM identity map (e.g. the local APIC), uncached
+void paging_map_mmio( void *physical_address, size_t size ) {
+    map_identity( physical_address, size, PAGE_FLAG_WRITE_THROUGH | PAGE_FLAG_CACHE_DISABLE );
+}
+
+// identity-maps device memory that is only written in bulk (e.g. a framebuffer), so the CPU may combine writes into burst transfers
+// (falls back to write-through if the CPU has no PAT)
+void paging_map_write_combining( void *physical_address, size_t size ) {
+    map_identity( physical_address, size, PAGE_FLAG_WRITE_THROUGH );
+}
+
+// returns NULL if the address isn't mapped
+void *paging_get_physical_address( pagemap_t *pagemap, void *virtual_address ) {
+    size_t page_size;
+    uint64_t *entry = get_mapping( pagemap->pml4, virtual_address, &page_size );
+    if( NULL == entry ) return NULL;
+    return (void*)((*entry & PAGE_ADDRESS_MASK & ~(uint64_t)(page_size - 1)) | ((uint64_t)virtual_address & (page_size - 1)));
+}
+
+// called by the page fault handler on a write to a present page
+// returns false if the page isn't copy-on-write (i.e. the write really was illegal)
+bool paging_handle_copy_on_write( pagemap_t *pagemap, void *virtual_address ) {
+    uint64_t *entry = get_entry( pagemap->pml4, virtual_address, false );
+    if( NULL == entry || !(*entry & PAGE_FLAG_PRESENT) || !(*entry & PAGE_FLAG_COPY_ON_WRITE) ) return false;
+
+    // if nobody else shares the page, just take it back. otherwise, make a private copy
+    void *page = (void*)(*entry & PAGE_ADDRESS_MASK);
+    uint64_t flags = (*entry & ~PAGE_ADDRESS_MASK & ~PAGE_FLAG_COPY_ON_WRITE) | PAGE_FLAG_WRITE;
+    bool copied = 1 != page_allocator_reference_count( page );
+    if( !copied ) {
+        *entry = (uint64_t)page | flags;
+    } else {
+        void *copy = page_allocator_alloc();
+        buffer_copy_qwords( copy, page, PAGE_SIZE / sizeof( uint64_t ) );
+        *entry = (uint64_t)copy | flags;
+    }
+
+    // we only drop our reference to the original once no CPU can still reach it through this pagemap
+    tlb_shootdown_page( pagemap, virtual_address );
+    if( copied ) page_allocator_free( page );
+    return true;
+}
 
-    // TODO: allocate the pagemap
+// replaces the page table under a page directory entry w/ a single 2 MB page, if its 512 pages are all present w/ the same flags
+// (aside from the accessed & dirty bits). pages the allocator owns must be private to the pagemap (so not copy-on-write or shared),
+// & get copied into a contiguous 2 MB frame if they aren't in one already. anything else (e.g. an identity map) has to be contiguous
+// already. the result is always marked promoted, so it can be split again when a 4 KB page inside it changes. returns true if the
+// range was promoted
+static bool promote( pagemap_t *pagemap, uint64_t *directory_entry ) {
+    pagetable_t *table = entry_to_table( *directory_entry );
+    uint64_t *entries = table->entries;
 
-    // TODO: populate the pagemap
+    // ranges tend to fill up from 1 end (e.g. the stack from the top), so check both ends before scanning the rest
+    // (bit 7 of a 4 KB entry is its PAT bit, which a 2 MB entry keeps elsewhere, so those pages stay small)
+    uint64_t flags = entries[0] & ~PAGE_ADDRESS_MASK & ~PROMOTION_IGNORED_FLAGS;
+    if( !(flags & PAGE_FLAG_PRESENT) || !(entries[PAGETABLE_ENTRIES - 1] & PAGE_FLAG_PRESENT) ) return false;
+    if( flags & (PAGE_FLAG_HUGE | PAGE_FLAG_COPY_ON_WRITE | PAGE_FLAG_SHARED) ) return false;
 
-    // TODO: switch the CR3 register to point to the pagemap
+    // the kernel's pages are mapped where they are, so they're never reference counted (or moved), even if the allocator owns them
+    bool managed = pagemap != &kernel_pagemap, contiguous = true;
+    uint64_t first = entries[0] & PAGE_ADDRESS_MASK;
+    size_t references = managed ? page_allocator_reference_count( (void*)first ) : 0;
+    if( references > 1 ) return false;
+    for( size_t i = 0; i < PAGETABLE_ENTRIES; i++ ) {
+        uint64_t page = entries[i] & PAGE_ADDRESS_MASK;
+        if( flags != (entries[i] & ~PAGE_ADDRESS_MASK & ~PROMOTION_IGNORED_FLAGS) ) return false;
+        if( managed && references != page_allocator_reference_count( (void*)page ) ) return false;
+        contiguous = contiguous && page == first + i * PAGE_SIZE;
+    }
+    contiguous = contiguous && 0 == (first & (PAGE_SIZE_2MB - 1));
+
+    // migrate
+    uint8_t *frame = (uint8_t*)first;
+    if( !contiguous ) {
+        if( 0 == references || NULL == (frame = page_allocator_alloc_huge()) ) return false;
+        for( size_t i = 0; i < PAGETABLE_ENTRIES; i++ ) {
+            buffer_copy_qwords( (uint64_t*)(frame + i * PAGE_SIZE), (uint64_t*)(entries[i] & PAGE_ADDRESS_MASK), PAGE_SIZE / sizeof( uint64_t ) );
+        }
+    }
+    *directory_entry = (uint64_t)frame | flags | PAGE_FLAG_HUGE | PAGE_FLAG_PROMOTED;
+    __atomic_fetch_add( &promotion_count, 1, __ATOMIC_RELAXED );
+
+    // every CPU drops its entries for the range, since its cached translations & paging-structure entries may still lead to the old
+    // table (the kernel's are global & in every pagemap, so that's every CPU). then the old table (& pages, if they moved) can be
+    // freed: the identity map's original tables are part of its heap allocation, which page_allocator_free leaves alone
+    if( managed ) tlb_shootdown_all( pagemap );
+    else tlb_shootdown_kernel();
+    for( size_t i = 0; !contiguous && i < PAGETABLE_ENTRIES; i++ ) page_allocator_free( (void*)(entries[i] & PAGE_ADDRESS_MASK) );
+    page_allocator_free( table );
+    return true;
+}
+
+// promotion may move a process's pages, so nothing else may be using the pagemap (the kernel pagemap's pages never move)
+static void check_promotable( pagemap_t *pagemap, const char *message ) {
+    uint64_t others = pagemap->active_cpus & ~((uint64_t)1 << cpu_get_index());
+    if( pagemap != &kernel_pagemap && 0 != others ) panic( message );
+}
+
+// promotes the 2 MB range around an address (see promote), e.g. right after a fault fills it in. for the kernel pagemap, only the
+// identity map of RAM is eligible, & for the others, only the user half. returns true if the range was promoted
+bool paging_promote_huge_page( pagemap_t *pagemap, void *virtual_address ) {
+    check_promotable( pagemap, "paging_promote_huge_page: pagemap is running on another CPU\n" );
+    size_t address = (size_t)virtual_address;
+    if( pagemap == &kernel_pagemap ? address < PROMOTION_KERNEL_START || address >= PAGEMAP_MAX_MEMORY : address < PAGING_USER_START || address >= PAGING_USER_END ) return false;
+    uint64_t *entry = get_entry_at_level( pagemap->pml4, virtual_address, 1, false );
+    if( NULL == entry || PAGE_FLAG_PRESENT != (*entry & (PAGE_FLAG_PRESENT | PAGE_FLAG_HUGE)) ) return false;
+    return promote( pagemap, entry );
+}
+
+// the background pass: promotes every eligible 2 MB range in a pagemap (the idle loop runs it over the kernel pagemap). only present
+// tables are visited, so the cost is proportional to the # of page tables, not to the size of the address space. returns the # of
+// ranges that were promoted
+size_t paging_promote_huge_pages( pagemap_t *pagemap ) {
+    check_promotable( pagemap, "paging_promote_huge_pages: pagemap is running on another CPU\n" );
+    size_t count = 0;
+    if( pagemap == &kernel_pagemap ) {
+        for( size_t address = PROMOTION_KERNEL_START; address < PAGEMAP_MAX_MEMORY; address+= PAGE_SIZE_2MB ) count+= paging_promote_huge_page( pagemap, (void*)address );
+        return count;
+    }
+    for( size_t i = PAGEMAP_USER_PML4_START; i < PAGEMAP_USER_PML4_END; i++ ) {
+        uint64_t pml4_entry = pagemap->pml4->entries[i];
+        if( !(pml4_entry & PAGE_FLAG_PRESENT) ) continue;
+        pagetable_t *pdpt = entry_to_table( pml4_entry );
+        for( size_t j = 0; j < PAGETABLE_ENTRIES; j++ ) {
+            if( PAGE_FLAG_PRESENT != (pdpt->entries[j] & (PAGE_FLAG_PRESENT | PAGE_FLAG_HUGE)) ) continue;
+            pagetable_t *directory = entry_to_table( pdpt->entries[j] );
+            for( size_t k = 0; k < PAGETABLE_ENTRIES; k++ ) {
+                if( PAGE_FLAG_PRESENT == (directory->entries[k] & (PAGE_FLAG_PRESENT | PAGE_FLAG_HUGE)) ) count+= promote( pagemap, &directory->entries[k] );
+            }
+        }
+    }
+    return count;
+}
+
+// # of 2 MB ranges promoted since boot
+uint64_t paging_get_promotion_count() {
+    return __atomic_load_n( &promotion_count, __ATOMIC_RELAXED );
+}
+
+void *paging_get_fault_address() {
+    void *address;
+    asm volatile( "mov %%cr2, %[address]" : [address] "=r" (address) );
+    return address;
+}
 
-    // TODO: flush the TLB
-    //cli
-    //static inline void __native_flush_tlb_single(unsigned long addr) {
-    //   asm volatile("invlpg (%0)" ::"r" (addr) : "memory");
-    //}
-	//	sti
+#define TEST_ADDRESS ((uint8_t*)PAGING_USER_START + PAGE_SIZE_2MB)
 
-    // return the # of bytes needed for the entire pagemap
-    //return pagemap_size;
+static bool is_huge( pagemap_t *pagemap, void *virtual_address ) {
+    size_t page_size;
+    uint64_t *entry = get_mapping( pagemap->pml4, virtual_address, &page_size );
+    return NULL != entry && PAGE_SIZE_2MB == page_size;
+}
+
+// maps a 2 MB range w/ pages that each hold their index, 1 of which may have different flags
+static void map_test_pages( pagemap_t *pagemap, size_t odd_page, uint64_t odd_flags ) {
+    for( size_t i = 0; i < PAGETABLE_ENTRIES; i++ ) {
+        uint64_t *page = page_allocator_alloc();
+        *page = i;
+        paging_map_page( pagemap, TEST_ADDRESS + i * PAGE_SIZE, page, odd_page == i ? odd_flags : PAGE_FLAG_WRITE );
+    }
+}
+
+static void check_test_pages( pagemap_t *pagemap, const char *message ) {
+    for( size_t i = 0; i < PAGETABLE_ENTRIES; i++ ) {
+        if( i != *(uint64_t*)paging_get_physical_address( pagemap, TEST_ADDRESS + i * PAGE_SIZE ) ) panic( message );
+    }
+}
+
+// call after tlb_init
+void paging_run_tests() {
+    size_t free_pages = page_allocator_free_page_count();
+
+    // scattered private pages get moved into a 2 MB frame, & keep their contents
+    pagemap_t *pagemap = paging_create_pagemap();
+    map_test_pages( pagemap, PAGETABLE_ENTRIES, 0 );
+    if( !paging_promote_huge_page( pagemap, TEST_ADDRESS + PAGE_SIZE ) ) panic( "paging_run_tests: full range wasn't promoted\n" );
+    if( !is_huge( pagemap, TEST_ADDRESS ) ) panic( "paging_run_tests: promoted range isn't a huge page\n" );
+    check_test_pages( pagemap, "paging_run_tests: promotion lost a page's contents\n" );
+    if( 0 != paging_promote_huge_pages( pagemap ) ) panic( "paging_run_tests: range was promoted twice\n" );
+
+    // cloning splits the huge page, so both copies share its pages copy-on-write
+    pagemap_t *clone = paging_clone_pagemap( pagemap );
+    if( is_huge( pagemap, TEST_ADDRESS ) || is_huge( clone, TEST_ADDRESS ) ) panic( "paging_run_tests: clone kept a promoted page\n" );
+    check_test_pages( clone, "paging_run_tests: clone doesn't see the promoted pages\n" );
+    if( 0 != paging_promote_huge_pages( clone ) ) panic( "paging_run_tests: promoted copy-on-write pages\n" );
+    paging_destroy_pagemap( clone );
+
+    // once the clone is gone, the pages are private again, & already contiguous, so they're promoted where they are
+    void *frame = paging_get_physical_address( pagemap, TEST_ADDRESS );
+    for( size_t i = 0; i < PAGETABLE_ENTRIES; i++ ) paging_handle_copy_on_write( pagemap, TEST_ADDRESS + i * PAGE_SIZE );
+    if( 1 != paging_promote_huge_pages( pagemap ) ) panic( "paging_run_tests: range wasn't promoted again\n" );
+    if( frame != paging_get_physical_address( pagemap, TEST_ADDRESS ) ) panic( "paging_run_tests: contiguous pages were moved\n" );
+
+    // unmapping a page splits the huge page, & then the range isn't full anymore
+    if( !paging_unmap_page( pagemap, TEST_ADDRESS ) ) panic( "paging_run_tests: couldn't unmap part of a promoted page\n" );
+    tlb_commit();
+    if( is_huge( pagemap, TEST_ADDRESS + PAGE_SIZE ) || NULL != paging_get_physical_address( pagemap, TEST_ADDRESS ) ) panic( "paging_run_tests: unmapping didn't split the huge page\n" );
+    if( 0 != paging_promote_huge_pages( pagemap ) ) panic( "paging_run_tests: promoted a range w/ a hole\n" );
+    paging_destroy_pagemap( pagemap );
+
+    // pages w/ different flags stay small
+    pagemap = paging_create_pagemap();
+    map_test_pages( pagemap, PAGETABLE_ENTRIES / 2, 0 );
+    if( 0 != paging_promote_huge_pages( pagemap ) ) panic( "paging_run_tests: promoted pages w/ different flags\n" );
+    paging_destroy_pagemap( pagemap );
+    if( free_pages != page_allocator_free_page_count() ) panic( "paging_run_tests: promotion leaked pages\n" );
+
+    // the kernel's identity map of RAM gets promoted where it is, except for the legacy memory in the 1st 2 MB
+    paging_promote_huge_pages( &kernel_pagemap );
+    if( is_huge( &kernel_pagemap, (void*)0 ) || !is_huge( &kernel_pagemap, (void*)KERNEL_HEAP_END ) ) panic( "paging_run_tests: kernel identity map wasn't promoted\n" );
+    if( (void*)KERNEL_HEAP_END != paging_get_physical_address( &kernel_pagemap, (void*)KERNEL_HEAP_END ) ) panic( "paging_run_tests: kernel identity map moved\n" );
+
+    // mapping a 4 KB page inside a promoted kernel range splits it, & the idle loop can promote it again afterwards
+    void *kernel_page = (void*)(KERNEL_HEAP_END + PAGE_SIZE);
+    paging_map_page( &kernel_pagemap, kernel_page, kernel_page, PAGE_FLAG_WRITE | PAGE_FLAG_GLOBAL );
+    if( is_huge( &kernel_pagemap, kernel_page ) ) panic( "paging_run_tests: mapping a 4 KB page didn't split the kernel's huge page\n" );
+    if( kernel_page != paging_get_physical_address( &kernel_pagemap, kernel_page ) || (void*)KERNEL_HEAP_END != paging_get_physical_address( &kernel_pagemap, (void*)KERNEL_HEAP_END ) ) {
+        panic( "paging_run_tests: splitting the kernel's huge page moved it\n" );
+    }
+    if( !paging_promote_huge_page( &kernel_pagemap, kernel_page ) ) panic( "paging_run_tests: split kernel range wasn't promoted again\n" );
 }
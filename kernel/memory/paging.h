@@ -1,5 +1,69 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PAGE_FLAG_PRESENT (1 << 0)
+#define PAGE_FLAG_WRITE (1 << 1)
+#define PAGE_FLAG_USER (1 << 2)
+#define PAGE_FLAG_WRITE_THROUGH (1 << 3) // w/ our PAT, this alone selects write-combining (see paging.c)
+#define PAGE_FLAG_CACHE_DISABLE (1 << 4) // for MMIO, which must not be cached
+#define PAGE_FLAG_ACCESSED (1 << 5) // set by the CPU
+#define PAGE_FLAG_DIRTY (1 << 6) // set by the CPU
+#define PAGE_FLAG_HUGE (1 << 7)
+#define PAGE_FLAG_GLOBAL (1 << 8)
+#define PAGE_FLAG_COPY_ON_WRITE (1 << 9) // ignored by the CPU: page is shared & read-only until the next write
+#define PAGE_FLAG_SHARED (1 << 10) // ignored by the CPU: page is deliberately shared memory, so clones keep writing to the same page
+#define PAGE_FLAG_PROMOTED (1 << 11) // ignored by the CPU: 2 MB page that's really 512 4 KB pages (reference counted, if the allocator owns them), so it can be split (see paging_promote_huge_pages)
+#define PAGE_ADDRESS_MASK 0x000FFFFFFFFFF000
+#define PAGE_BITS 12
+#define PAGE_SIZE (1 << PAGE_BITS)
+#define PAGE_SIZE_2MB (1 << 21) // huge page, mapped by a page directory entry
+#define PAGE_SIZE_1GB (1 << 30) // huge page, mapped by a PDPT entry (only if paging_supports_1gb_pages)
+#define PAGETABLE_BITS 9
+#define PAGETABLE_ENTRIES (1 << PAGETABLE_BITS)
+
+// user space is PML4 entries 1 to 255. the 1st entry holds the kernel's identity map, and the upper half is reserved for the kernel
+// every pagemap shares the kernel's PML4 entries, so the kernel is mapped the same way in every address space
+#define PAGING_USER_START 0x8000000000 // 512 GB
+#define PAGING_USER_END 0x800000000000 // 128 TB
+
+// page fault error code bits
+#define PAGE_FAULT_PRESENT (1 << 0) // fault was a protection violation (as opposed to a non-present page)
+#define PAGE_FAULT_WRITE (1 << 1)
+#define PAGE_FAULT_USER (1 << 2) // fault happened in ring 3
+
+typedef struct pagetable {
+    uint64_t entries[PAGETABLE_ENTRIES];
+} pagetable_t;
+
+typedef struct pagemap {
+    pagetable_t *pml4;
+    uint16_t pcid; // process-context identifier, which tags this pagemap's TLB entries (always 0 if the CPU doesn't support PCIDs)
+    volatile uint64_t active_cpus; // bit per CPU that has this pagemap in CR3 right now
+    volatile uint64_t stale_cpus; // bit per CPU whose TLB may hold stale entries for this pcid, so its next switch here must flush them
+} pagemap_t;
 
 void paging_init_kernel_pagemap();
+void paging_init_ap();
+pagemap_t *paging_get_kernel_pagemap();
+pagemap_t *paging_get_current_pagemap();
+pagemap_t *paging_create_pagemap();
+pagemap_t *paging_clone_pagemap( pagemap_t *pagemap );
+void paging_destroy_pagemap( pagemap_t *pagemap );
+void paging_switch_pagemap( pagemap_t *pagemap );
+void paging_map_page( pagemap_t *pagemap, void *virtual_address, void *physical_address, uint64_t flags );
+void paging_map_huge_page( pagemap_t *pagemap, void *virtual_address, void *physical_address, size_t page_size, uint64_t flags );
+bool paging_supports_1gb_pages();
+void paging_map_mmio( void *physical_address, size_t size );
+void paging_map_write_combining( void *physical_address, size_t size );
+bool paging_unmap_page( pagemap_t *pagemap, void *virtual_address );
+void paging_unmap_range( pagemap_t *pagemap, void *virtual_address, size_t size );
+void *paging_get_physical_address( pagemap_t *pagemap, void *virtual_address );
+bool paging_handle_copy_on_write( pagemap_t *pagemap, void *virtual_address );
+bool paging_promote_huge_page( pagemap_t *pagemap, void *virtual_address );
+size_t paging_promote_huge_pages( pagemap_t *pagemap );
+uint64_t paging_get_promotion_count();
+void *paging_get_fault_address();
+void paging_run_tests();
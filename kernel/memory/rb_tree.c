@@ -0,0 +1,249 @@
+#include <stdint.h>
+#include "rb_tree.h"
+#include "../main.h" // for panic
+
+typedef rb_tree_node_t node_t;
+
+void rb_tree_init( rb_tree_t *tree ) {
+    tree->root = NULL;
+}
+
+static bool is_red( node_t *node ) {
+    return NULL != node && node->red;
+}
+
+// replaces the subtree at old_node w/ the subtree at new_node (which may be NULL)
+static void transplant( rb_tree_t *tree, node_t *old_node, node_t *new_node ) {
+    node_t *parent = old_node->parent;
+    if( NULL == parent ) tree->root = new_node;
+    else if( old_node == parent->left ) parent->left = new_node;
+    else parent->right = new_node;
+    if( NULL != new_node ) new_node->parent = parent;
+}
+
+static void rotate_left( rb_tree_t *tree, node_t *node ) {
+    node_t *right = node->right;
+    node->right = right->left;
+    if( NULL != right->left ) right->left->parent = node;
+    transplant( tree, node, right );
+    right->left = node;
+    node->parent = right;
+}
+
+static void rotate_right( rb_tree_t *tree, node_t *node ) {
+    node_t *left = node->left;
+    node->left = left->right;
+    if( NULL != left->right ) left->right->parent = node;
+    transplant( tree, node, left );
+    left->right = node;
+    node->parent = left;
+}
+
+// call after linking a new leaf into the tree
+void rb_tree_insert_fixup( rb_tree_t *tree, node_t *node ) {
+    node->red = true;
+    while( is_red( node->parent ) ) {
+        // the parent is red, so it isn't the root, so the grandparent exists
+        node_t *parent = node->parent, *grandparent = parent->parent;
+        if( parent == grandparent->left ) {
+            node_t *uncle = grandparent->right;
+            if( is_red( uncle ) ) {
+                parent->red = uncle->red = false;
+                grandparent->red = true;
+                node = grandparent;
+            } else {
+                if( node == parent->right ) {
+                    node = parent;
+                    rotate_left( tree, node );
+                    parent = node->parent;
+                }
+                parent->red = false;
+                grandparent->red = true;
+                rotate_right( tree, grandparent );
+            }
+        } else {
+            node_t *uncle = grandparent->left;
+            if( is_red( uncle ) ) {
+                parent->red = uncle->red = false;
+                grandparent->red = true;
+                node = grandparent;
+            } else {
+                if( node == parent->left ) {
+                    node = parent;
+                    rotate_right( tree, node );
+                    parent = node->parent;
+                }
+                parent->red = false;
+                grandparent->red = true;
+                rotate_left( tree, grandparent );
+            }
+        }
+    }
+    tree->root->red = false;
+}
+
+// node may be NULL, so its parent is passed separately
+static void remove_fixup( rb_tree_t *tree, node_t *node, node_t *parent ) {
+    while( node != tree->root && !is_red( node ) ) {
+        if( node == parent->left ) {
+            node_t *sibling = parent->right;
+            if( is_red( sibling ) ) {
+                sibling->red = false;
+                parent->red = true;
+                rotate_left( tree, parent );
+                sibling = parent->right;
+            }
+            if( !is_red( sibling->left ) && !is_red( sibling->right ) ) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+            } else {
+                if( !is_red( sibling->right ) ) {
+                    sibling->left->red = false;
+                    sibling->red = true;
+                    rotate_right( tree, sibling );
+                    sibling = parent->right;
+                }
+                sibling->red = parent->red;
+                parent->red = false;
+                sibling->right->red = false;
+                rotate_left( tree, parent );
+                node = tree->root;
+            }
+        } else {
+            node_t *sibling = parent->left;
+            if( is_red( sibling ) ) {
+                sibling->red = false;
+                parent->red = true;
+                rotate_right( tree, parent );
+                sibling = parent->left;
+            }
+            if( !is_red( sibling->left ) && !is_red( sibling->right ) ) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+            } else {
+                if( !is_red( sibling->left ) ) {
+                    sibling->right->red = false;
+                    sibling->red = true;
+                    rotate_left( tree, sibling );
+                    sibling = parent->left;
+                }
+                sibling->red = parent->red;
+                parent->red = false;
+                sibling->left->red = false;
+                rotate_right( tree, parent );
+                node = tree->root;
+            }
+        }
+    }
+    if( NULL != node ) node->red = false;
+}
+
+static node_t *leftmost( node_t *node ) {
+    while( NULL != node->left ) node = node->left;
+    return node;
+}
+
+void rb_tree_remove( rb_tree_t *tree, node_t *node ) {
+    node_t *child, *child_parent;
+    bool removed_red;
+    if( NULL == node->left || NULL == node->right ) {
+        // at most 1 child: splice the node out
+        child = NULL == node->left ? node->right : node->left;
+        child_parent = node->parent;
+        removed_red = node->red;
+        transplant( tree, node, child );
+    } else {
+        // 2 children: the successor (which has no left child) takes the node's place
+        node_t *successor = leftmost( node->right );
+        removed_red = successor->red;
+        child = successor->right;
+        if( successor->parent == node ) {
+            child_parent = successor;
+        } else {
+            child_parent = successor->parent;
+            transplant( tree, successor, successor->right );
+            successor->right = node->right;
+            successor->right->parent = successor;
+        }
+        transplant( tree, node, successor );
+        successor->left = node->left;
+        successor->left->parent = successor;
+        successor->red = node->red;
+    }
+    if( !removed_red ) remove_fixup( tree, child, child_parent );
+}
+
+rb_tree_node_t *rb_tree_first( rb_tree_t *tree ) {
+    return NULL == tree->root ? NULL : leftmost( tree->root );
+}
+
+// in-order successor
+rb_tree_node_t *rb_tree_next( node_t *node ) {
+    if( NULL != node->right ) return leftmost( node->right );
+    while( NULL != node->parent && node == node->parent->right ) node = node->parent;
+    return node->parent;
+}
+
+typedef struct test_object {
+    uint64_t key;
+    rb_tree_node_t node;
+} test_object_t;
+
+#define test_object_key( object ) ((object)->key)
+#define test_compare( a, b ) ((a) < (b) ? -1 : (a) > (b))
+RB_TREE_DEFINE( test_tree, test_object_t, node, uint64_t, test_object_key, test_compare )
+
+// returns the black height of the subtree, and panics if any red-black invariant is broken
+static size_t validate( node_t *node, node_t *parent ) {
+    if( NULL == node ) return 1;
+    if( node->parent != parent ) panic( "rb_tree_run_tests: bad parent pointer" );
+    if( node->red && (is_red( node->left ) || is_red( node->right )) ) panic( "rb_tree_run_tests: red node has a red child" );
+    size_t left_height = validate( node->left, node ), right_height = validate( node->right, node );
+    if( left_height != right_height ) panic( "rb_tree_run_tests: black heights differ" );
+    return left_height + !node->red;
+}
+
+#define TEST_OBJECT_COUNT 200
+
+void rb_tree_run_tests() {
+    static test_object_t objects[TEST_OBJECT_COUNT];
+    rb_tree_t tree;
+    rb_tree_init( &tree );
+
+    // insert keys in a scrambled order (multiplying by an odd number is a permutation mod a power of 2)
+    for( size_t i = 0; i < TEST_OBJECT_COUNT; i++ ) {
+        objects[i].key = (i * 77) % 256;
+        test_tree_insert( &tree, &objects[i] );
+    }
+    if( tree.root->red ) panic( "rb_tree_run_tests: root is red" );
+    validate( tree.root, NULL );
+
+    // in-order traversal must be sorted, and every key must be findable
+    size_t count = 0;
+    uint64_t prior_key = 0;
+    for( node_t *node = rb_tree_first( &tree ); NULL != node; node = rb_tree_next( node ) ) {
+        test_object_t *object = rb_tree_entry( node, test_object_t, node );
+        if( count > 0 && object->key <= prior_key ) panic( "rb_tree_run_tests: traversal is out of order" );
+        if( object != test_tree_find( &tree, object->key ) ) panic( "rb_tree_run_tests: find failed" );
+        prior_key = object->key;
+        count++;
+    }
+    if( TEST_OBJECT_COUNT != count ) panic( "rb_tree_run_tests: traversal missed objects" );
+
+    // remove every other object
+    for( size_t i = 0; i < TEST_OBJECT_COUNT; i+= 2 ) {
+        rb_tree_remove( &tree, &objects[i].node );
+        validate( tree.root, NULL );
+        if( NULL != test_tree_find( &tree, objects[i].key ) ) panic( "rb_tree_run_tests: found a removed object" );
+    }
+
+    // the lower bound of a removed key is the next key that's still in the tree
+    test_object_t *lower_bound = test_tree_lower_bound( &tree, objects[0].key );
+    if( NULL == lower_bound || lower_bound->key <= objects[0].key ) panic( "rb_tree_run_tests: bad lower bound" );
+
+    // remove the rest
+    for( size_t i = 1; i < TEST_OBJECT_COUNT; i+= 2 ) rb_tree_remove( &tree, &objects[i].node );
+    if( NULL != tree.root ) panic( "rb_tree_run_tests: tree isn't empty after removing everything" );
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// intrusive red-black tree: objects embed an rb_tree_node_t, and the tree never allocates
+// rebalancing doesn't depend on the key, so it lives in rb_tree.c, while searching & inserting are generated per type by RB_TREE_DEFINE
+typedef struct rb_tree_node {
+    struct rb_tree_node *parent, *left, *right;
+    bool red;
+} rb_tree_node_t;
+
+typedef struct rb_tree {
+    rb_tree_node_t *root;
+} rb_tree_t;
+
+#define rb_tree_entry( node, type, member ) ((type*)((char*)(node) - offsetof( type, member )))
+
+void rb_tree_init( rb_tree_t *tree );
+void rb_tree_insert_fixup( rb_tree_t *tree, rb_tree_node_t *node );
+void rb_tree_remove( rb_tree_t *tree, rb_tree_node_t *node );
+rb_tree_node_t *rb_tree_first( rb_tree_t *tree );
+rb_tree_node_t *rb_tree_next( rb_tree_node_t *node );
+void rb_tree_run_tests();
+
+// generates name_find, name_lower_bound & name_insert for a type that embeds an rb_tree_node_t called member
+// get_key( object ) returns an object's key, and compare( a, b ) returns < 0, 0 or > 0
+// both should be macros or inline functions, so that the whole search is inlined w/o any indirect calls
+// objects w/ equal keys are allowed: they're inserted after the existing ones
+#define RB_TREE_DEFINE( name, type, member, key_type, get_key, compare ) \
+    static inline type *name##_find( rb_tree_t *tree, key_type key ) { \
+        rb_tree_node_t *node = tree->root; \
+        while( NULL != node ) { \
+            type *object = rb_tree_entry( node, type, member ); \
+            int order = compare( key, get_key( object ) ); \
+            if( 0 == order ) return object; \
+            node = order < 0 ? node->left : node->right; \
+        } \
+        return NULL; \
+    } \
+    \
+    /* returns the first object whose key is >= key */ \
+    static inline type *name##_lower_bound( rb_tree_t *tree, key_type key ) { \
+        rb_tree_node_t *node = tree->root; \
+        type *result = NULL; \
+        while( NULL != node ) { \
+            type *object = rb_tree_entry( node, type, member ); \
+            if( compare( get_key( object ), key ) >= 0 ) { \
+                result = object; \
+                node = node->left; \
+            } else { \
+                node = node->right; \
+            } \
+        } \
+        return result; \
+    } \
+    \
+    static inline void name##_insert( rb_tree_t *tree, type *object ) { \
+        rb_tree_node_t **link = &tree->root, *parent = NULL; \
+        while( NULL != *link ) { \
+            parent = *link; \
+            link = compare( get_key( object ), get_key( rb_tree_entry( parent, type, member ) ) ) < 0 ? &parent->left : &parent->right; \
+        } \
+        object->member.parent = parent; \
+        object->member.left = object->member.right = NULL; \
+        *link = &object->member; \
+        rb_tree_insert_fixup( tree, &object->member ); \
+    }
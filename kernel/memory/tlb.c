@@ -0,0 +1,319 @@
+#include "tlb.h"
+#include "page_allocator.h"
+#include "../drivers/vga_text.h" // for printing
+#include "../interrupt/interrupt_table.h"
+#include "../process/apic.h"
+#include "../process/cpu.h"
+#include "../process/task_pool.h" // for the tests & benchmark
+#include "../main.h" // for panic
+
+#define CR4_PAGE_GLOBAL_ENABLE (1 << 7)
+
+// what a shootdown asks of each target. it stays put (on the initiator's stack) until every target has acked it
+typedef struct request {
+    pagemap_t *pagemap;
+    void *const *addresses;
+    size_t page_count; // 0 means flush the whole pcid
+    volatile size_t unacked;
+} request_t;
+
+// a CPU's queued invalidations, which all belong to 1 pagemap
+typedef struct batch {
+    pagemap_t *pagemap; // NULL if the batch is empty
+    size_t page_count;
+    bool full_flush; // too many pages to invalidate 1 by 1
+    void *addresses[TLB_BATCH_PAGES];
+    size_t free_count;
+    void *frees[TLB_BATCH_FREES];
+} batch_t;
+
+static batch_t batches[CPU_MAX_COUNT];
+static request_t *volatile requests[CPU_MAX_COUNT]; // each CPU's outstanding shootdown, if any
+static volatile uint64_t pending[CPU_MAX_COUNT]; // per target: a bit for each CPU whose request it hasn't handled yet
+static volatile uint64_t ipi_count, pages_flushed, full_flush_count;
+
+static void write_cr3( uint64_t value ) {
+    asm volatile( "mov %[value], %%cr3" :: [value] "r" (value) : "memory" );
+}
+
+static void invalidate_page( void *address ) {
+    asm volatile( "invlpg (%[address])" :: [address] "r" (address) : "memory" );
+}
+
+// toggling CR4.PGE flushes every entry, including global ones (i.e. the kernel's) & those of every pcid
+static void flush_global() {
+    uint64_t cr4;
+    asm volatile( "mov %%cr4, %[cr4]" : [cr4] "=r" (cr4) );
+    asm volatile( "mov %[cr4], %%cr4" :: [cr4] "r" (cr4 & ~CR4_PAGE_GLOBAL_ENABLE) : "memory" );
+    asm volatile( "mov %[cr4], %%cr4" :: [cr4] "r" (cr4) : "memory" );
+}
+
+// invlpg & CR3 writes only reach the current pcid, so there's nothing to do here unless the pagemap is current (if it isn't, we
+// were marked stale & will flush when we switch back to it). while it's current, every change gets here by IPI, so the stale bit
+// is redundant & can go
+static void apply( request_t *request ) {
+    pagemap_t *pagemap = request->pagemap;
+    if( pagemap == paging_get_kernel_pagemap() ) {
+        flush_global(); // every pagemap shares the kernel's entries, so it doesn't matter which one is current
+        __atomic_fetch_add( &full_flush_count, 1, __ATOMIC_RELAXED );
+        return;
+    }
+    if( pagemap != paging_get_current_pagemap() ) return;
+    if( 0 == request->page_count ) {
+        write_cr3( (uint64_t)pagemap->pml4 | pagemap->pcid ); // no CR3_NO_FLUSH, so this flushes the pcid's (non-global) entries
+        __atomic_fetch_add( &full_flush_count, 1, __ATOMIC_RELAXED );
+    } else {
+        for( size_t i = 0; i < request->page_count; i++ ) invalidate_page( request->addresses[i] );
+        __atomic_fetch_add( &pages_flushed, request->page_count, __ATOMIC_RELAXED );
+    }
+    __atomic_fetch_and( &pagemap->stale_cpus, ~((uint64_t)1 << cpu_get_index()), __ATOMIC_SEQ_CST );
+}
+
+// handles every request that's been sent to us (called w/ interrupts disabled)
+static void handle_requests() {
+    uint64_t initiators = __atomic_exchange_n( &pending[cpu_get_index()], 0, __ATOMIC_ACQUIRE );
+    while( 0 != initiators ) {
+        request_t *request = requests[__builtin_ctzll( initiators )];
+        initiators&= initiators - 1;
+        apply( request );
+        __atomic_fetch_sub( &request->unacked, 1, __ATOMIC_RELEASE );
+    }
+}
+
+static void shootdown_handler( uint64_t interrupt ) {
+    handle_requests();
+    apic_send_eoi();
+}
+
+// call after the pagemap's entries were changed
+static void shoot_down( request_t *request ) {
+    pagemap_t *pagemap = request->pagemap;
+    bool interrupts_were_enabled = interrupt_table_disable_interrupts();
+    size_t self = cpu_get_index();
+
+    // mark every CPU stale before looking for the ones running the pagemap (paging_switch_pagemap does the opposite), so a CPU that
+    // switches to it concurrently either shows up in active_cpus & gets an IPI, or sees that it's stale when it switches
+    // the kernel's entries are in every pagemap, so every CPU gets the IPI
+    uint64_t targets = 0;
+    if( pagemap == paging_get_kernel_pagemap() ) {
+        for( size_t i = 0; i < CPU_MAX_COUNT; i++ ) targets|= (uint64_t)cpu_is_online( i ) << i;
+    } else {
+        __atomic_fetch_or( &pagemap->stale_cpus, ~(uint64_t)0, __ATOMIC_SEQ_CST );
+        targets = __atomic_load_n( &pagemap->active_cpus, __ATOMIC_SEQ_CST );
+    }
+    apply( request );
+    targets&= ~((uint64_t)1 << self);
+    if( 0 != targets ) {
+        request->unacked = __builtin_popcountll( targets );
+        requests[self] = request;
+        for( uint64_t remaining = targets; 0 != remaining; remaining&= remaining - 1 ) {
+            size_t target = __builtin_ctzll( remaining );
+            __atomic_fetch_or( &pending[target], (uint64_t)1 << self, __ATOMIC_SEQ_CST );
+            apic_send_ipi( cpu_get_apic_id( target ), INTERRUPT_INDEX_TLB_SHOOTDOWN );
+        }
+        __atomic_fetch_add( &ipi_count, __builtin_popcountll( targets ), __ATOMIC_RELAXED );
+
+        // a target may be stuck in here too, waiting on us w/ interrupts off, so we handle its request while we wait for ours
+        while( 0 != __atomic_load_n( &request->unacked, __ATOMIC_ACQUIRE ) ) {
+            handle_requests();
+            cpu_pause();
+        }
+        requests[self] = NULL;
+    }
+    interrupt_table_restore_interrupts( interrupts_were_enabled );
+}
+
+void tlb_init() {
+    interrupt_table_set_handler( INTERRUPT_INDEX_TLB_SHOOTDOWN, (interrupt_handler*)shootdown_handler );
+}
+
+// queues an invalidation for a mapping that was just changed, plus the page it mapped (or NULL), which gets freed after the commit,
+// since no CPU can reach it through a stale entry by then
+// queueing a different pagemap's change, or too many pages, commits the batch first
+void tlb_queue( pagemap_t *pagemap, void *virtual_address, void *page ) {
+    batch_t *batch = &batches[cpu_get_index()];
+    if( pagemap != batch->pagemap || TLB_BATCH_FREES == batch->free_count ) tlb_commit();
+    batch->pagemap = pagemap;
+    if( batch->page_count < TLB_BATCH_PAGES ) batch->addresses[batch->page_count++] = virtual_address;
+    else batch->full_flush = true;
+    if( NULL != page ) batch->frees[batch->free_count++] = page;
+}
+
+// 1 shootdown for the whole batch, then frees its pages
+void tlb_commit() {
+    batch_t *batch = &batches[cpu_get_index()];
+    if( NULL == batch->pagemap ) return;
+    request_t request = { batch->pagemap, batch->addresses, batch->full_flush ? 0 : batch->page_count, 0 };
+    shoot_down( &request );
+    for( size_t i = 0; i < batch->free_count; i++ ) page_allocator_free( batch->frees[i] );
+    batch->pagemap = NULL;
+    batch->page_count = 0;
+    batch->full_flush = false;
+    batch->free_count = 0;
+}
+
+// invalidates 1 page right away, w/o touching this CPU's batch (so it's safe in the page fault handler)
+void tlb_shootdown_page( pagemap_t *pagemap, void *virtual_address ) {
+    request_t request = { pagemap, &virtual_address, 1, 0 };
+    shoot_down( &request );
+}
+
+// flushes all of a pagemap's entries right away (e.g. after cloning it write-protected every page)
+void tlb_shootdown_all( pagemap_t *pagemap ) {
+    if( pagemap == paging_get_kernel_pagemap() ) panic( "tlb_shootdown_all: use tlb_shootdown_kernel for the kernel pagemap\n" );
+    request_t request = { pagemap, NULL, 0, 0 };
+    shoot_down( &request );
+}
+
+// flushes every CPU's whole TLB, global entries included. kernel mappings are only ever added, so this is only needed when one of
+// them changes page size (i.e. when a 2 MB range of the identity map is promoted or split, see paging.c)
+void tlb_shootdown_kernel() {
+    request_t request = { paging_get_kernel_pagemap(), NULL, 0, 0 };
+    shoot_down( &request );
+}
+
+uint64_t tlb_get_ipi_count() {
+    return __atomic_load_n( &ipi_count, __ATOMIC_RELAXED );
+}
+
+// counts each CPU that invalidated a page (full flushes are counted separately)
+uint64_t tlb_get_pages_flushed() {
+    return __atomic_load_n( &pages_flushed, __ATOMIC_RELAXED );
+}
+
+uint64_t tlb_get_full_flush_count() {
+    return __atomic_load_n( &full_flush_count, __ATOMIC_RELAXED );
+}
+
+#define TEST_ADDRESS ((uint8_t*)PAGING_USER_START)
+#define TEST_PAGES 64 // more than TLB_BATCH_PAGES, so unmapping them all takes a full flush
+
+static pagemap_t *test_pagemap;
+static volatile size_t test_phase;
+static volatile uint64_t test_seen[2];
+
+// maps pages (w/o PAGE_FLAG_USER, since only the kernel touches them) right after TEST_ADDRESS's page
+static void map_pages( size_t count ) {
+    for( size_t i = 1; i <= count; i++ ) {
+        paging_map_page( test_pagemap, TEST_ADDRESS + i * PAGE_SIZE, page_allocator_alloc_zeroed(), PAGE_FLAG_WRITE );
+    }
+}
+
+// runs on another CPU, w/ the test pagemap loaded until we're told to let go. reads TEST_ADDRESS on the way in & out
+static void hold_pagemap( void *argument ) {
+    paging_switch_pagemap( test_pagemap );
+    test_seen[0] = *(volatile uint64_t*)TEST_ADDRESS; // caches the translation
+    __atomic_store_n( &test_phase, 1, __ATOMIC_RELEASE );
+    while( 1 == __atomic_load_n( &test_phase, __ATOMIC_ACQUIRE ) ) cpu_pause();
+    test_seen[1] = *(volatile uint64_t*)TEST_ADDRESS;
+    paging_switch_pagemap( paging_get_kernel_pagemap() );
+}
+
+// we spin (rather than join) until the task has started, so another CPU must have stolen it
+static void start_holding( task_t *task ) {
+    test_phase = 0;
+    task_pool_spawn( task, hold_pagemap, NULL );
+    while( 0 == __atomic_load_n( &test_phase, __ATOMIC_ACQUIRE ) ) cpu_pause();
+}
+
+static void stop_holding( task_t *task ) {
+    __atomic_store_n( &test_phase, 2, __ATOMIC_RELEASE );
+    task_pool_join( task );
+}
+
+// call after smp_init & tlb_init
+void tlb_run_tests() {
+    test_pagemap = paging_create_pagemap();
+    uint64_t *first = page_allocator_alloc_zeroed(), *second = page_allocator_alloc_zeroed();
+    *first = 1;
+    *second = 2;
+    paging_map_page( test_pagemap, TEST_ADDRESS, first, PAGE_FLAG_WRITE );
+
+    // an unmapped page isn't freed until the commit, and nobody's running the pagemap, so there are no IPIs (just stale bits)
+    map_pages( 1 );
+    void *page = paging_get_physical_address( test_pagemap, TEST_ADDRESS + PAGE_SIZE );
+    uint64_t ipis = tlb_get_ipi_count();
+    if( !paging_unmap_page( test_pagemap, TEST_ADDRESS + PAGE_SIZE ) ) panic( "tlb_run_tests: mapped page wasn't unmapped\n" );
+    if( NULL != paging_get_physical_address( test_pagemap, TEST_ADDRESS + PAGE_SIZE ) ) panic( "tlb_run_tests: unmapped page is still mapped\n" );
+    if( 1 != page_allocator_reference_count( page ) ) panic( "tlb_run_tests: page was freed before the commit\n" );
+    tlb_commit();
+    if( 0 != page_allocator_reference_count( page ) ) panic( "tlb_run_tests: page wasn't freed by the commit\n" );
+    if( paging_unmap_page( test_pagemap, TEST_ADDRESS + PAGE_SIZE ) ) panic( "tlb_run_tests: unmapped a page that wasn't mapped\n" );
+    if( ipis != tlb_get_ipi_count() ) panic( "tlb_run_tests: sent IPIs even though no CPU runs the pagemap\n" );
+    if( ~(uint64_t)0 != test_pagemap->stale_cpus ) panic( "tlb_run_tests: CPUs weren't marked stale\n" );
+
+    // another CPU caches TEST_ADDRESS's translation, we remap it, & the other CPU must see the new page
+    task_t task;
+    bool holding = cpu_get_count() > 1;
+    if( holding ) start_holding( &task );
+    ipis = tlb_get_ipi_count();
+    paging_map_page( test_pagemap, TEST_ADDRESS, second, PAGE_FLAG_WRITE );
+    if( holding ) {
+        if( ipis + 1 != tlb_get_ipi_count() ) panic( "tlb_run_tests: remapping didn't send exactly 1 IPI\n" );
+        stop_holding( &task );
+        if( 1 != test_seen[0] || 2 != test_seen[1] ) panic( "tlb_run_tests: other CPU kept using a stale translation\n" );
+
+        // unmapping a range costs 1 IPI, whether the other CPU invalidates it page by page or flushes everything
+        start_holding( &task );
+        map_pages( TLB_BATCH_PAGES / 2 );
+        ipis = tlb_get_ipi_count();
+        uint64_t flushed = tlb_get_pages_flushed(), full_flushes = tlb_get_full_flush_count();
+        paging_unmap_range( test_pagemap, TEST_ADDRESS + PAGE_SIZE, TLB_BATCH_PAGES / 2 * PAGE_SIZE );
+        if( ipis + 1 != tlb_get_ipi_count() ) panic( "tlb_run_tests: small unmap didn't send exactly 1 IPI\n" );
+        if( flushed + TLB_BATCH_PAGES / 2 != tlb_get_pages_flushed() ) panic( "tlb_run_tests: small unmap didn't invalidate its pages\n" );
+        map_pages( TEST_PAGES );
+        paging_unmap_range( test_pagemap, TEST_ADDRESS + PAGE_SIZE, TEST_PAGES * PAGE_SIZE );
+        if( ipis + 2 != tlb_get_ipi_count() ) panic( "tlb_run_tests: big unmap didn't send exactly 1 IPI\n" );
+        if( full_flushes + 1 != tlb_get_full_flush_count() ) panic( "tlb_run_tests: big unmap didn't flush the pagemap\n" );
+        stop_holding( &task );
+
+        // once the other CPU has switched away, it's lazily marked stale instead
+        map_pages( 1 );
+        ipis = tlb_get_ipi_count();
+        paging_unmap_range( test_pagemap, TEST_ADDRESS + PAGE_SIZE, PAGE_SIZE );
+        if( ipis != tlb_get_ipi_count() ) panic( "tlb_run_tests: sent an IPI to a CPU that switched away\n" );
+    }
+
+    paging_destroy_pagemap( test_pagemap ); // frees 2nd (1st was only ever ours)
+    page_allocator_free( first );
+}
+
+#define BENCHMARK_PAGES 4096
+
+// cycles per unmapped page while another CPU runs the pagemap: w/ a shootdown per page, and then batched
+// the result line is "tlb_benchmark pages=<n> unbatched_cycles=<n> unbatched_ipis=<n> batched_cycles=<n> batched_ipis=<n> pages_flushed=<n>
+// full_flushes=<n>" (the last 2 are totals for both runs)
+void tlb_run_benchmark() {
+    test_pagemap = paging_create_pagemap();
+    paging_map_page( test_pagemap, TEST_ADDRESS, page_allocator_alloc_zeroed(), PAGE_FLAG_WRITE );
+    task_t task;
+    bool holding = cpu_get_count() > 1;
+    if( holding ) start_holding( &task );
+
+    map_pages( BENCHMARK_PAGES );
+    uint64_t flushed = tlb_get_pages_flushed(), full_flushes = tlb_get_full_flush_count();
+    uint64_t ipis = tlb_get_ipi_count(), start = cpu_read_timestamp();
+    for( size_t i = 1; i <= BENCHMARK_PAGES; i++ ) {
+        paging_unmap_page( test_pagemap, TEST_ADDRESS + i * PAGE_SIZE );
+        tlb_commit();
+    }
+    uint64_t unbatched = (cpu_read_timestamp() - start) / BENCHMARK_PAGES, unbatched_ipis = tlb_get_ipi_count() - ipis;
+
+    map_pages( BENCHMARK_PAGES );
+    ipis = tlb_get_ipi_count();
+    start = cpu_read_timestamp();
+    paging_unmap_range( test_pagemap, TEST_ADDRESS + PAGE_SIZE, BENCHMARK_PAGES * PAGE_SIZE );
+    uint64_t batched = (cpu_read_timestamp() - start) / BENCHMARK_PAGES, batched_ipis = tlb_get_ipi_count() - ipis;
+
+    if( holding ) stop_holding( &task );
+    paging_destroy_pagemap( test_pagemap );
+
+    vga_text_print_stat( "tlb_benchmark pages=", BENCHMARK_PAGES );
+    vga_text_print_stat( " unbatched_cycles=", unbatched );
+    vga_text_print_stat( " unbatched_ipis=", unbatched_ipis );
+    vga_text_print_stat( " batched_cycles=", batched );
+    vga_text_print_stat( " batched_ipis=", batched_ipis );
+    vga_text_print_stat( " pages_flushed=", tlb_get_pages_flushed() - flushed );
+    vga_text_print_stat( " full_flushes=", tlb_get_full_flush_count() - full_flushes );
+    vga_text_print( "\n", 0x17 );
+}
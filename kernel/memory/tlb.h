@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "paging.h"
+
+// cross-CPU TLB shootdown: when a mapping changes, every CPU that may have cached the old translation has to drop it
+// changes are batched per CPU, and committing a batch sends 1 IPI to each CPU that's running the pagemap (i.e. has it in CR3), which
+// either invalidates the batch's pages or, for big batches, flushes the pagemap's whole pcid. CPUs that aren't running it (idle CPUs
+// sit in the kernel pagemap) don't get an IPI: they're marked stale instead, and flush when they next switch to it (lazy TLB)
+// kernel mappings are global & permanent, so they're only shot down (everywhere, w/ tlb_shootdown_kernel) when they change page size
+// tlb_queue & tlb_commit use this CPU's batch, so they must not be called from interrupt handlers (which could interrupt a batch in
+// progress). tlb_shootdown_page, tlb_shootdown_all & tlb_shootdown_kernel don't touch the batch, so they may be called from the page fault handler
+#define TLB_BATCH_PAGES 32 // past this, flushing the whole pcid is cheaper than invalidating page by page
+#define TLB_BATCH_FREES 512 // unmapped pages that wait for the commit before they're freed (a pagetable's worth)
+
+void tlb_init();
+void tlb_queue( pagemap_t *pagemap, void *virtual_address, void *page );
+void tlb_commit();
+void tlb_shootdown_page( pagemap_t *pagemap, void *virtual_address );
+void tlb_shootdown_all( pagemap_t *pagemap );
+void tlb_shootdown_kernel();
+uint64_t tlb_get_ipi_count();
+uint64_t tlb_get_pages_flushed();
+uint64_t tlb_get_full_flush_count();
+void tlb_run_tests();
+void tlb_run_benchmark();
@@ -0,0 +1,530 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../drivers/vga_text.h"
+#include "../drivers/virtio_net.h"
+#include "../interrupt/softirq.h"
+#include "../interrupt/timer.h"
+#include "../process/cpu.h"
+#include "../sync/spinlock.h"
+#include "../main.h" // for panic
+#include "net.h"
+
+#define MAC_LENGTH VIRTIO_NET_MAC_LENGTH
+#define ETHERNET_TYPE_IPV4 0x0800
+#define ETHERNET_TYPE_ARP 0x0806
+#define ARP_HARDWARE_ETHERNET 1
+#define ARP_REQUEST 1
+#define ARP_REPLY 2
+#define ARP_CACHE_LENGTH 16
+#define IPV4_VERSION_IHL 0x45 // version 4, 5 dwords of header (i.e. no options)
+#define IPV4_DONT_FRAGMENT 0x4000
+#define IPV4_FRAGMENT_MASK 0x3FFF // more-fragments flag & fragment offset
+#define IPV4_TTL 64
+#define IPV4_PROTOCOL_UDP 17
+#define IPV4_BROADCAST 0xFFFFFFFF
+
+// wire formats (big-endian)
+typedef struct ethernet_header {
+    uint8_t destination[MAC_LENGTH], source[MAC_LENGTH];
+    uint16_t type;
+} __attribute__((packed)) ethernet_header_t;
+
+typedef struct arp_packet {
+    uint16_t hardware_type, protocol_type;
+    uint8_t hardware_length, protocol_length;
+    uint16_t operation;
+    uint8_t sender_mac[MAC_LENGTH];
+    uint32_t sender_address;
+    uint8_t target_mac[MAC_LENGTH];
+    uint32_t target_address;
+} __attribute__((packed)) arp_packet_t;
+
+typedef struct ipv4_header {
+    uint8_t version_ihl, type_of_service;
+    uint16_t total_length, id, fragment;
+    uint8_t ttl, protocol;
+    uint16_t checksum;
+    uint32_t source, destination;
+} __attribute__((packed)) ipv4_header_t;
+
+typedef struct udp_header {
+    uint16_t source_port, destination_port, length, checksum;
+} __attribute__((packed)) udp_header_t;
+
+typedef struct arp_entry {
+    uint32_t address; // 0 = unused
+    uint8_t mac[MAC_LENGTH];
+    bool resolved;
+    packet_buffer_t *pending; // the latest IPv4 packet (w/o its ethernet header) that's waiting for the reply
+} arp_entry_t;
+
+typedef struct udp_binding {
+    uint16_t port; // 0 = unused
+    net_udp_handler *handler;
+    void *argument;
+} udp_binding_t;
+
+// globals
+static uint8_t mac[MAC_LENGTH] = { 0x02 }; // locally administered, until the device gives us a real one
+static const uint8_t broadcast_mac[MAC_LENGTH] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+static arp_entry_t arp_cache[ARP_CACHE_LENGTH];
+static size_t arp_next_victim;
+static udp_binding_t udp_bindings[NET_UDP_PORT_COUNT];
+static uint16_t next_id;
+static volatile uint64_t dropped;
+static ticket_lock_t lock; // irqsave: protects the ARP cache, the bindings & next_id
+
+static uint16_t swap16( uint16_t x ) {
+    return (x >> 8) | (x << 8);
+}
+
+static uint32_t swap32( uint32_t x ) {
+    return __builtin_bswap32( x );
+}
+
+static void copy_mac( uint8_t *destination, const uint8_t *source ) {
+    for( size_t i = 0; i < MAC_LENGTH; i++ ) destination[i] = source[i];
+}
+
+static bool macs_equal( const uint8_t *a, const uint8_t *b ) {
+    for( size_t i = 0; i < MAC_LENGTH; i++ ) if( a[i] != b[i] ) return false;
+    return true;
+}
+
+static void drop( packet_buffer_t *packet ) {
+    __atomic_fetch_add( &dropped, 1, __ATOMIC_RELAXED );
+    packet_buffer_free( packet );
+}
+
+// internet checksum (RFC 1071): one's complement sum of big-endian 16-bit words
+static uint32_t checksum_add( uint32_t sum, const void *data, size_t length ) {
+    const uint8_t *bytes = data;
+    for( ; length > 1; length-= 2, bytes+= 2 ) sum+= (bytes[0] << 8) | bytes[1];
+    if( length > 0 ) sum+= bytes[0] << 8;
+    return sum;
+}
+
+static uint16_t checksum_finish( uint32_t sum ) {
+    while( sum >> 16 ) sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum;
+}
+
+// returns 0 when run over data that includes a correct checksum
+static uint16_t checksum( const void *data, size_t length ) {
+    return checksum_finish( checksum_add( 0, data, length ) );
+}
+
+// covers the UDP header & payload, plus a pseudo-header of the IPv4 fields that identify the datagram
+static uint16_t udp_checksum( const void *udp, size_t length, uint32_t source, uint32_t destination ) {
+    uint32_t sum = (source >> 16) + (source & 0xFFFF) + (destination >> 16) + (destination & 0xFFFF) + IPV4_PROTOCOL_UDP + length;
+    return checksum_finish( checksum_add( sum, udp, length ) );
+}
+
+// call w/ the lock held
+static arp_entry_t *arp_find( uint32_t address ) {
+    for( size_t i = 0; i < ARP_CACHE_LENGTH; i++ ) if( address == arp_cache[i].address ) return &arp_cache[i];
+    return NULL;
+}
+
+// call w/ the lock held. evicts round-robin, & returns the evicted entry's pending packet (if any) for the caller to free
+static arp_entry_t *arp_insert( uint32_t address, packet_buffer_t **evicted ) {
+    arp_entry_t *entry = &arp_cache[arp_next_victim++ % ARP_CACHE_LENGTH];
+    *evicted = entry->pending;
+    entry->address = address;
+    entry->resolved = false;
+    entry->pending = NULL;
+    return entry;
+}
+
+// prepends the ethernet header, & hands the frame to the device (which frees it once it's sent)
+static bool transmit_frame( packet_buffer_t *packet, const uint8_t *destination_mac, uint16_t type ) {
+    ethernet_header_t *ethernet = (ethernet_header_t*)packet_buffer_push( packet, sizeof( ethernet_header_t ) );
+    copy_mac( ethernet->destination, destination_mac );
+    copy_mac( ethernet->source, mac );
+    ethernet->type = swap16( type );
+    if( !virtio_net_is_present() ) { drop( packet ); return false; }
+    return virtio_net_transmit( packet );
+}
+
+static void send_arp( uint16_t operation, const uint8_t *target_mac, uint32_t target_address ) {
+    packet_buffer_t *packet = packet_buffer_alloc();
+    if( NULL == packet ) return;
+    arp_packet_t *arp = (arp_packet_t*)packet_buffer_push( packet, sizeof( arp_packet_t ) );
+    arp->hardware_type = swap16( ARP_HARDWARE_ETHERNET );
+    arp->protocol_type = swap16( ETHERNET_TYPE_IPV4 );
+    arp->hardware_length = MAC_LENGTH;
+    arp->protocol_length = sizeof( uint32_t );
+    arp->operation = swap16( operation );
+    copy_mac( arp->sender_mac, mac );
+    arp->sender_address = swap32( NET_ADDRESS );
+    copy_mac( arp->target_mac, target_mac );
+    arp->target_address = swap32( target_address );
+    transmit_frame( packet, ARP_REQUEST == operation ? broadcast_mac : target_mac, ETHERNET_TYPE_ARP );
+}
+
+// sends an IPv4 packet to the next hop, or parks it while we ask for the next hop's MAC
+static bool transmit_ipv4( packet_buffer_t *packet, uint32_t destination ) {
+    if( IPV4_BROADCAST == destination ) return transmit_frame( packet, broadcast_mac, ETHERNET_TYPE_IPV4 );
+    uint32_t next_hop = (destination & NET_NETMASK) == (NET_ADDRESS & NET_NETMASK) ? destination : NET_GATEWAY;
+
+    // resolved
+    uint8_t destination_mac[MAC_LENGTH];
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    arp_entry_t *entry = arp_find( next_hop );
+    if( NULL != entry && entry->resolved ) {
+        copy_mac( destination_mac, entry->mac );
+        ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+        return transmit_frame( packet, destination_mac, ETHERNET_TYPE_IPV4 );
+    }
+
+    // unresolved: park the packet (replacing any older one), & ask who has the address
+    packet_buffer_t *evicted = NULL;
+    if( NULL == entry ) entry = arp_insert( next_hop, &evicted );
+    packet_buffer_t *replaced = entry->pending;
+    entry->pending = packet;
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+    if( NULL != evicted ) drop( evicted );
+    if( NULL != replaced ) drop( replaced );
+    send_arp( ARP_REQUEST, broadcast_mac, next_hop );
+    return true;
+}
+
+static void receive_arp( packet_buffer_t *packet ) {
+    arp_packet_t *arp = (arp_packet_t*)packet_buffer_pull( packet, sizeof( arp_packet_t ) );
+    if( NULL == arp || ARP_HARDWARE_ETHERNET != swap16( arp->hardware_type ) || ETHERNET_TYPE_IPV4 != swap16( arp->protocol_type ) ) { drop( packet ); return; }
+    uint16_t operation = swap16( arp->operation );
+    uint32_t sender_address = swap32( arp->sender_address ), target_address = swap32( arp->target_address );
+    uint8_t sender_mac[MAC_LENGTH];
+    copy_mac( sender_mac, arp->sender_mac );
+    packet_buffer_free( packet );
+
+    // learn the sender's MAC if we asked for it, or if it's asking for us (since it's likely about to talk to us), & release its parked packet
+    packet_buffer_t *pending = NULL, *evicted = NULL;
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    arp_entry_t *entry = arp_find( sender_address );
+    if( NULL == entry && NET_ADDRESS == target_address ) entry = arp_insert( sender_address, &evicted );
+    if( NULL != entry ) {
+        copy_mac( entry->mac, sender_mac );
+        entry->resolved = true;
+        pending = entry->pending;
+        entry->pending = NULL;
+    }
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+    if( NULL != evicted ) drop( evicted );
+    if( NULL != pending ) transmit_frame( pending, sender_mac, ETHERNET_TYPE_IPV4 );
+
+    // answer requests for our address
+    if( ARP_REQUEST == operation && NET_ADDRESS == target_address ) send_arp( ARP_REPLY, sender_mac, sender_address );
+}
+
+static void receive_udp( packet_buffer_t *packet, uint32_t source, uint32_t destination ) {
+    // validate (a 0 checksum means the sender didn't compute one)
+    udp_header_t *udp = (udp_header_t*)packet->data;
+    if( packet->length < sizeof( udp_header_t ) ) { drop( packet ); return; }
+    size_t length = swap16( udp->length );
+    if( length < sizeof( udp_header_t ) || length > packet->length ) { drop( packet ); return; }
+    packet->length = length;
+    if( 0 != udp->checksum && 0 != udp_checksum( udp, length, source, destination ) ) { drop( packet ); return; }
+
+    // find the port's handler
+    uint16_t port = swap16( udp->destination_port );
+    net_udp_handler *handler = NULL;
+    void *argument = NULL;
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    for( size_t i = 0; i < NET_UDP_PORT_COUNT; i++ ) {
+        if( port != udp_bindings[i].port ) continue;
+        handler = udp_bindings[i].handler;
+        argument = udp_bindings[i].argument;
+        break;
+    }
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+    if( NULL == handler ) { drop( packet ); return; }
+
+    // hand over the payload, in place
+    packet_buffer_pull( packet, sizeof( udp_header_t ) );
+    handler( packet, source, swap16( udp->source_port ), argument );
+}
+
+static void receive_ipv4( packet_buffer_t *packet ) {
+    // validate the header (we don't do options or fragments)
+    ipv4_header_t *ip = (ipv4_header_t*)packet->data;
+    if( packet->length < sizeof( ipv4_header_t ) ) { drop( packet ); return; }
+    size_t header_length = (ip->version_ihl & 0xF) * sizeof( uint32_t );
+    if( 4 != (ip->version_ihl >> 4) || header_length < sizeof( ipv4_header_t ) || header_length > packet->length ) { drop( packet ); return; }
+    if( 0 != checksum( ip, header_length ) ) { drop( packet ); return; }
+    size_t total_length = swap16( ip->total_length );
+    if( total_length < header_length || total_length > packet->length ) { drop( packet ); return; }
+    if( swap16( ip->fragment ) & IPV4_FRAGMENT_MASK ) { drop( packet ); return; }
+    uint32_t source = swap32( ip->source ), destination = swap32( ip->destination );
+    if( NET_ADDRESS != destination && IPV4_BROADCAST != destination ) { drop( packet ); return; }
+
+    // strip the header, & any ethernet padding after the packet
+    packet->length = total_length;
+    packet_buffer_pull( packet, header_length );
+    if( IPV4_PROTOCOL_UDP == ip->protocol ) receive_udp( packet, source, destination );
+    else drop( packet );
+}
+
+static void loopback_work( uint64_t packet ) {
+    net_receive( (packet_buffer_t*)packet );
+}
+
+// delivers a frame to ourselves, on a later softirq (so a handler that replies to itself can't recurse)
+static bool loopback( packet_buffer_t *packet ) {
+    ethernet_header_t *ethernet = (ethernet_header_t*)packet_buffer_push( packet, sizeof( ethernet_header_t ) );
+    copy_mac( ethernet->destination, mac );
+    copy_mac( ethernet->source, mac );
+    ethernet->type = swap16( ETHERNET_TYPE_IPV4 );
+    if( softirq_queue( loopback_work, (uint64_t)packet ) ) return true;
+    drop( packet );
+    return false;
+}
+
+void net_init() {
+    ticket_lock_init( &lock, "net" );
+    packet_buffer_init();
+    if( !virtio_net_init() ) {
+        vga_text_print( "net: no network device (loopback only)\n", 0x17 );
+        return;
+    }
+    virtio_net_get_mac( mac );
+    vga_text_print( "net: virtio-net up\n", 0x17 );
+}
+
+// takes ownership of a received ethernet frame
+void net_receive( packet_buffer_t *packet ) {
+    ethernet_header_t *ethernet = (ethernet_header_t*)packet_buffer_pull( packet, sizeof( ethernet_header_t ) );
+    if( NULL == ethernet ) { drop( packet ); return; }
+    if( !macs_equal( ethernet->destination, mac ) && !macs_equal( ethernet->destination, broadcast_mac ) ) { drop( packet ); return; }
+    switch( swap16( ethernet->type ) ) {
+        case ETHERNET_TYPE_IPV4: receive_ipv4( packet ); break;
+        case ETHERNET_TYPE_ARP: receive_arp( packet ); break;
+        default: drop( packet ); break;
+    }
+}
+
+void net_udp_bind( uint16_t port, net_udp_handler *handler, void *argument ) {
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    udp_binding_t *binding = NULL;
+    for( size_t i = 0; i < NET_UDP_PORT_COUNT; i++ ) {
+        if( port == udp_bindings[i].port ) { binding = &udp_bindings[i]; break; }
+        if( 0 == udp_bindings[i].port && NULL == binding ) binding = &udp_bindings[i];
+    }
+    if( NULL == binding ) panic( "net_udp_bind: too many bound ports\n" );
+    binding->port = port;
+    binding->handler = handler;
+    binding->argument = argument;
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+}
+
+void net_udp_unbind( uint16_t port ) {
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    for( size_t i = 0; i < NET_UDP_PORT_COUNT; i++ ) if( port == udp_bindings[i].port ) udp_bindings[i].port = 0;
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+}
+
+// sends the payload at packet->data, w/o copying it: the headers go into the packet's headroom
+// takes ownership of the packet. returns false if it was dropped (note that true doesn't mean it arrived, since this is UDP)
+bool net_udp_send( packet_buffer_t *packet, uint16_t source_port, uint32_t destination_address, uint16_t destination_port ) {
+    if( packet->length > NET_UDP_MAX_PAYLOAD ) { drop( packet ); return false; }
+
+    // UDP header (a computed checksum of 0 is sent as 0xFFFF, since 0 means "none")
+    udp_header_t *udp = (udp_header_t*)packet_buffer_push( packet, sizeof( udp_header_t ) );
+    udp->source_port = swap16( source_port );
+    udp->destination_port = swap16( destination_port );
+    udp->length = swap16( packet->length );
+    udp->checksum = 0;
+    uint16_t udp_sum = udp_checksum( udp, packet->length, NET_ADDRESS, destination_address );
+    udp->checksum = swap16( 0 == udp_sum ? 0xFFFF : udp_sum );
+
+    // IPv4 header
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    uint16_t id = next_id++;
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+    ipv4_header_t *ip = (ipv4_header_t*)packet_buffer_push( packet, sizeof( ipv4_header_t ) );
+    ip->version_ihl = IPV4_VERSION_IHL;
+    ip->type_of_service = 0;
+    ip->total_length = swap16( packet->length );
+    ip->id = swap16( id );
+    ip->fragment = swap16( IPV4_DONT_FRAGMENT );
+    ip->ttl = IPV4_TTL;
+    ip->protocol = IPV4_PROTOCOL_UDP;
+    ip->checksum = 0;
+    ip->source = swap32( NET_ADDRESS );
+    ip->destination = swap32( destination_address );
+    ip->checksum = swap16( checksum( ip, sizeof( ipv4_header_t ) ) );
+
+    // send it
+    if( NET_ADDRESS == destination_address ) return loopback( packet );
+    return transmit_ipv4( packet, destination_address );
+}
+
+uint64_t net_get_dropped_count() {
+    return dropped;
+}
+
+// tests
+#define TEST_PORT 9
+#define TEST_SOURCE_PORT 1234
+#define TEST_PAYLOAD_LENGTH 100
+#define TEST_ARP_ADDRESS NET_IPV4( 10, 0, 2, 99 )
+
+typedef struct test_result {
+    size_t received;
+    bool payload_ok;
+    uint16_t source_port;
+} test_result_t;
+
+static void test_handler( packet_buffer_t *packet, uint32_t source_address, uint16_t source_port, void *argument ) {
+    test_result_t *result = argument;
+    result->received++;
+    result->source_port = source_port;
+    result->payload_ok = TEST_PAYLOAD_LENGTH == packet->length && NET_ADDRESS == source_address;
+    for( size_t i = 0; i < packet->length; i++ ) result->payload_ok&= packet->data[i] == (uint8_t)i;
+    packet_buffer_free( packet );
+}
+
+static packet_buffer_t *make_test_packet() {
+    packet_buffer_t *packet = packet_buffer_alloc();
+    if( NULL == packet ) panic( "net_run_tests: packet pool is empty\n" );
+    for( size_t i = 0; i < TEST_PAYLOAD_LENGTH; i++ ) packet->data[i] = (uint8_t)i;
+    packet->length = TEST_PAYLOAD_LENGTH;
+    return packet;
+}
+
+void net_run_tests() {
+    // the IPv4 header checksum example from https://en.wikipedia.org/wiki/Internet_checksum
+    uint8_t header[] = { 0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11, 0x00, 0x00, 0xC0, 0xA8, 0x00, 0x01, 0xC0, 0xA8, 0x00, 0xC7 };
+    if( 0xB861 != checksum( header, sizeof( header ) ) ) panic( "net_run_tests: wrong checksum\n" );
+    header[10] = 0xB8;
+    header[11] = 0x61;
+    if( 0 != checksum( header, sizeof( header ) ) ) panic( "net_run_tests: checksum doesn't verify\n" );
+
+    // a datagram to ourselves goes down the whole send path, & back up the whole receive path (on the next softirq run)
+    size_t free_count = packet_buffer_get_free_count();
+    test_result_t result = { 0 };
+    net_udp_bind( TEST_PORT, test_handler, &result );
+    if( !net_udp_send( make_test_packet(), TEST_SOURCE_PORT, NET_ADDRESS, TEST_PORT ) ) panic( "net_run_tests: loopback send failed\n" );
+    softirq_run();
+    if( 1 != result.received || !result.payload_ok || TEST_SOURCE_PORT != result.source_port ) panic( "net_run_tests: loopback datagram is wrong\n" );
+
+    // a datagram that gets corrupted on the way fails its checksum
+    packet_buffer_t *packet = make_test_packet();
+    uint8_t *payload = packet->data;
+    uint64_t dropped_before = net_get_dropped_count();
+    net_udp_send( packet, TEST_SOURCE_PORT, NET_ADDRESS, TEST_PORT );
+    payload[0]^= 0xFF;
+    softirq_run();
+    if( 1 != result.received || dropped_before + 1 != net_get_dropped_count() ) panic( "net_run_tests: corrupt datagram was delivered\n" );
+
+    // a datagram to an unbound port is dropped
+    net_udp_unbind( TEST_PORT );
+    net_udp_send( make_test_packet(), TEST_SOURCE_PORT, NET_ADDRESS, TEST_PORT );
+    softirq_run();
+    if( 1 != result.received || dropped_before + 2 != net_get_dropped_count() ) panic( "net_run_tests: datagram to unbound port was delivered\n" );
+    if( free_count != packet_buffer_get_free_count() ) panic( "net_run_tests: leaked packet buffers\n" );
+
+    // an ARP request for our address teaches us the sender's MAC (& the reply goes out if there's a device)
+    uint8_t test_mac[MAC_LENGTH] = { 0x02, 0x11, 0x22, 0x33, 0x44, 0x55 };
+    packet = packet_buffer_alloc();
+    arp_packet_t *arp = (arp_packet_t*)packet_buffer_push( packet, sizeof( arp_packet_t ) );
+    arp->hardware_type = swap16( ARP_HARDWARE_ETHERNET );
+    arp->protocol_type = swap16( ETHERNET_TYPE_IPV4 );
+    arp->hardware_length = MAC_LENGTH;
+    arp->protocol_length = sizeof( uint32_t );
+    arp->operation = swap16( ARP_REQUEST );
+    copy_mac( arp->sender_mac, test_mac );
+    arp->sender_address = swap32( TEST_ARP_ADDRESS );
+    copy_mac( arp->target_mac, broadcast_mac );
+    arp->target_address = swap32( NET_ADDRESS );
+    ethernet_header_t *ethernet = (ethernet_header_t*)packet_buffer_push( packet, sizeof( ethernet_header_t ) );
+    copy_mac( ethernet->destination, broadcast_mac );
+    copy_mac( ethernet->source, test_mac );
+    ethernet->type = swap16( ETHERNET_TYPE_ARP );
+    net_receive( packet );
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    arp_entry_t *entry = arp_find( TEST_ARP_ADDRESS );
+    bool learned = NULL != entry && entry->resolved && macs_equal( entry->mac, test_mac );
+    if( NULL != entry ) entry->address = 0;
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+    if( !learned ) panic( "net_run_tests: ARP request didn't teach us the sender's MAC\n" );
+}
+
+// benchmark: UDP round trips to the echo peer, 1 at a time (latency), then w/ a window of requests in flight (throughput)
+#define BENCHMARK_PORT 40000
+#define BENCHMARK_PAYLOAD_LENGTH 64
+#define BENCHMARK_ROUND_TRIPS 1000
+#define BENCHMARK_PACKETS 10000
+#define BENCHMARK_WINDOW 32
+#define BENCHMARK_TIMEOUT_MICROSECONDS 100000
+
+static volatile uint64_t echo_replies, echo_last_sequence;
+
+static void echo_reply_handler( packet_buffer_t *packet, uint32_t source_address, uint16_t source_port, void *argument ) {
+    if( packet->length >= sizeof( uint64_t ) ) echo_last_sequence = *(uint64_t*)packet->data;
+    echo_replies++;
+    packet_buffer_free( packet );
+}
+
+static bool send_echo_request( uint64_t sequence ) {
+    packet_buffer_t *packet = packet_buffer_alloc();
+    if( NULL == packet ) return false;
+    for( size_t i = 0; i < BENCHMARK_PAYLOAD_LENGTH; i++ ) packet->data[i] = 0;
+    *(uint64_t*)packet->data = sequence;
+    packet->length = BENCHMARK_PAYLOAD_LENGTH;
+    return net_udp_send( packet, BENCHMARK_PORT, NET_ECHO_PEER_ADDRESS, NET_ECHO_PEER_PORT );
+}
+
+void net_run_benchmark() {
+    if( !virtio_net_is_present() ) {
+        vga_text_print( "net_benchmark: no network device\n", 0x17 );
+        return;
+    }
+    net_udp_bind( BENCHMARK_PORT, echo_reply_handler, NULL );
+    uint64_t timeout = timer_from_microseconds( BENCHMARK_TIMEOUT_MICROSECONDS );
+
+    // latency (the 1st request also waits for the gateway's ARP reply). replies arrive via the net softirq, so we just spin
+    // start w/ a sequence # that never gets sent, so sequence 0 (which waits for ARP) isn't counted as answered before its reply arrives
+    uint64_t round_trips = 0, round_trip_ticks = 0, lost = 0;
+    echo_last_sequence = UINT64_MAX;
+    for( uint64_t sequence = 0; sequence < BENCHMARK_ROUND_TRIPS; sequence++ ) {
+        uint64_t start = timer_now();
+        if( !send_echo_request( sequence ) ) { lost++; continue; }
+        while( sequence != echo_last_sequence && timer_now() - start < timeout ) cpu_pause();
+        if( sequence != echo_last_sequence ) { lost++; continue; }
+        round_trip_ticks+= timer_now() - start;
+        round_trips++;
+    }
+
+    // throughput: keep a window of requests in flight (a window that makes no progress for a whole timeout counts as lost)
+    uint64_t replies_before = echo_replies, sent = 0, window_lost = 0;
+    uint64_t start = timer_now(), last_progress = start, last_replies = replies_before;
+    while( true ) {
+        uint64_t done = echo_replies - replies_before + window_lost, in_flight = sent > done ? sent - done : 0; // (late replies from above can make done > sent)
+        if( sent == BENCHMARK_PACKETS && 0 == in_flight ) break;
+        if( echo_replies != last_replies ) { last_replies = echo_replies; last_progress = timer_now(); }
+        if( sent < BENCHMARK_PACKETS && in_flight < BENCHMARK_WINDOW ) {
+            if( !send_echo_request( BENCHMARK_ROUND_TRIPS + sent ) ) window_lost++;
+            sent++;
+        } else if( timer_now() - last_progress > timeout ) {
+            window_lost+= in_flight;
+            last_progress = timer_now();
+        } else {
+            cpu_pause();
+        }
+    }
+    uint64_t ticks = timer_now() - start, replies = echo_replies - replies_before;
+    net_udp_unbind( BENCHMARK_PORT );
+
+    // report
+    uint64_t frequency = timer_get_frequency();
+    vga_text_print_stat( "net_benchmark round_trips=", round_trips );
+    vga_text_print_stat( " lost=", lost );
+    vga_text_print_stat( " latency_us=", 0 == round_trips ? 0 : round_trip_ticks * 1000000 / frequency / round_trips );
+    vga_text_print_stat( " window=", BENCHMARK_WINDOW );
+    vga_text_print_stat( " replies=", replies );
+    vga_text_print_stat( " window_lost=", window_lost );
+    vga_text_print_stat( " packets_per_second=", replies * frequency / (0 == ticks ? 1 : ticks) );
+    vga_text_print( "\n", 0x17 );
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "packet_buffer.h"
+
+// a minimal ethernet/ARP/IPv4/UDP stack, on the virtio network device
+// the address is static, & matches what qemu's "user" network hands out (so no DHCP). datagrams to our own address loop back in software
+// addresses & ports are in host byte order
+#define NET_IPV4( a, b, c, d ) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+#define NET_ADDRESS NET_IPV4( 10, 0, 2, 15 )
+#define NET_NETMASK NET_IPV4( 255, 255, 255, 0 )
+#define NET_GATEWAY NET_IPV4( 10, 0, 2, 2 )
+#define NET_UDP_MAX_PAYLOAD (1500 - 20 - 8) // no fragmentation: the ethernet MTU minus the IPv4 & UDP headers
+#define NET_UDP_PORT_COUNT 16 // max # of bound ports
+
+// the benchmark's UDP echo peer (qemu's user network forwards the gateway's address to the host, see "make echo_peer")
+#define NET_ECHO_PEER_ADDRESS NET_GATEWAY
+#define NET_ECHO_PEER_PORT 7777
+
+// runs in the net softirq, w/ the payload at packet->data. the handler owns the packet, so it must free it (or send it)
+typedef void (net_udp_handler)( packet_buffer_t *packet, uint32_t source_address, uint16_t source_port, void *argument );
+
+void net_init();
+void net_receive( packet_buffer_t *packet );
+void net_udp_bind( uint16_t port, net_udp_handler *handler, void *argument );
+void net_udp_unbind( uint16_t port );
+bool net_udp_send( packet_buffer_t *packet, uint16_t source_port, uint32_t destination_address, uint16_t destination_port );
+uint64_t net_get_dropped_count();
+void net_run_tests();
+void net_run_benchmark();
@@ -0,0 +1,78 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../memory/kernel_heap.h"
+#include "../sync/spinlock.h"
+#include "../main.h" // for panic
+#include "packet_buffer.h"
+
+// globals
+static packet_buffer_t *packets;
+static uint8_t *buffers;
+static packet_buffer_t *free_list;
+static size_t free_count;
+static ticket_lock_t lock; // irqsave, since drivers refill their receive rings from interrupt context
+
+void packet_buffer_init() {
+    ticket_lock_init( &lock, "packet_buffer" );
+    packets = kernel_heap_alloc( PACKET_BUFFER_COUNT * sizeof( packet_buffer_t ) );
+    buffers = kernel_heap_alloc_aligned( PACKET_BUFFER_COUNT * PACKET_BUFFER_SIZE, PACKET_BUFFER_SIZE );
+    kernel_heap_tag( packets, KERNEL_HEAP_TAG_NET );
+    kernel_heap_tag( buffers, KERNEL_HEAP_TAG_NET );
+    for( size_t i = 0; i < PACKET_BUFFER_COUNT; i++ ) {
+        packets[i].start = &buffers[i * PACKET_BUFFER_SIZE];
+        packets[i].next = i + 1 < PACKET_BUFFER_COUNT ? &packets[i + 1] : NULL;
+    }
+    free_list = packets;
+    free_count = PACKET_BUFFER_COUNT;
+}
+
+// returns an empty packet w/ full headroom, or NULL if the pool is empty
+packet_buffer_t *packet_buffer_alloc() {
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    packet_buffer_t *packet = free_list;
+    if( NULL != packet ) {
+        free_list = packet->next;
+        free_count--;
+    }
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+    if( NULL == packet ) return NULL;
+
+    packet->data = packet->start + PACKET_BUFFER_HEADROOM;
+    packet->length = 0;
+    return packet;
+}
+
+void packet_buffer_free( packet_buffer_t *packet ) {
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &lock );
+    packet->next = free_list;
+    free_list = packet;
+    free_count++;
+    ticket_lock_release_irqrestore( &lock, interrupts_were_enabled );
+}
+
+// prepends a header, & returns a pointer to it
+uint8_t *packet_buffer_push( packet_buffer_t *packet, size_t size ) {
+    if( (size_t)(packet->data - packet->start) < size ) panic( "packet_buffer_push: out of headroom\n" );
+    packet->data-= size;
+    packet->length+= size;
+    return packet->data;
+}
+
+// removes a header, & returns a pointer to it (or NULL if the packet is too short to have one)
+uint8_t *packet_buffer_pull( packet_buffer_t *packet, size_t size ) {
+    if( packet->length < size ) return NULL;
+    uint8_t *header = packet->data;
+    packet->data+= size;
+    packet->length-= size;
+    return header;
+}
+
+// # of bytes that fit from data to the end of the buffer
+size_t packet_buffer_get_capacity( packet_buffer_t *packet ) {
+    return packet->start + PACKET_BUFFER_SIZE - packet->data;
+}
+
+size_t packet_buffer_get_free_count() {
+    return free_count;
+}
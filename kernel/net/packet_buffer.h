@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// fixed-size packet buffers, from a dedicated pool (so the network never competes w/ the kernel heap, & its memory is physically contiguous)
+// a packet's bytes go straight from the device into the buffer & back out again: protocol layers peel headers off the front w/ pull on the
+// way up, & prepend them into the headroom w/ push on the way down, so the payload is never copied
+#define PACKET_BUFFER_COUNT 512
+#define PACKET_BUFFER_SIZE 2048
+#define PACKET_BUFFER_HEADROOM 64 // enough for ethernet + IPv4 + UDP headers
+
+typedef struct packet_buffer {
+    uint8_t *data; // start of the packet
+    size_t length;
+    uint8_t *start; // start of the buffer (data - start is the remaining headroom)
+    struct packet_buffer *next; // free list
+} packet_buffer_t;
+
+void packet_buffer_init();
+packet_buffer_t *packet_buffer_alloc();
+void packet_buffer_free( packet_buffer_t *packet );
+uint8_t *packet_buffer_push( packet_buffer_t *packet, size_t size );
+uint8_t *packet_buffer_pull( packet_buffer_t *packet, size_t size );
+size_t packet_buffer_get_capacity( packet_buffer_t *packet );
+size_t packet_buffer_get_free_count();
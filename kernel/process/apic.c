@@ -0,0 +1,124 @@
+#include <stddef.h>
+#include "apic.h"
+#include "cpu.h"
+#include "../interrupt/interrupt_table.h" // for the spurious vector
+#include "../memory/paging.h" // for mapping the registers
+#include "../main.h" // for panic
+
+#define APIC_BASE_MSR 0x1B
+#define APIC_BASE_MSR_ENABLE (1 << 11)
+#define APIC_BASE_ADDRESS_MASK 0xFFFFFF000
+
+// register offsets
+#define APIC_ID 0x20
+#define APIC_TASK_PRIORITY 0x80
+#define APIC_EOI 0xB0
+#define APIC_SPURIOUS 0xF0
+#define APIC_INTERRUPT_COMMAND_LOW 0x300
+#define APIC_INTERRUPT_COMMAND_HIGH 0x310
+#define APIC_TIMER_VECTOR 0x320 // LVT (local vector table) timer entry
+#define APIC_TIMER_INITIAL_COUNT 0x380
+#define APIC_TIMER_CURRENT_COUNT 0x390
+#define APIC_TIMER_DIVIDE 0x3E0
+
+#define APIC_LVT_MASKED (1 << 16)
+#define APIC_TIMER_DIVIDE_BY_16 0x3
+
+#define APIC_SPURIOUS_ENABLE (1 << 8)
+
+// interrupt command register bits
+#define APIC_ICR_FIXED 0x000
+#define APIC_ICR_INIT 0x500
+#define APIC_ICR_STARTUP 0x600
+#define APIC_ICR_DELIVERY_PENDING (1 << 12)
+#define APIC_ICR_ASSERT (1 << 14)
+#define APIC_ICR_ALL_EXCLUDING_SELF (3 << 18)
+
+static volatile uint32_t *apic;
+
+static uint32_t read_register( size_t offset ) {
+    return apic[offset / sizeof( uint32_t )];
+}
+
+static void write_register( size_t offset, uint32_t value ) {
+    apic[offset / sizeof( uint32_t )] = value;
+}
+
+static void spurious_handler( uint64_t interrupt ) {} // spurious interrupts must not be acknowledged
+
+static void enable() {
+    write_register( APIC_TASK_PRIORITY, 0 ); // accept every interrupt
+    write_register( APIC_SPURIOUS, APIC_SPURIOUS_ENABLE | INTERRUPT_INDEX_SPURIOUS );
+}
+
+// call after paging_init_kernel_pagemap & interrupt_table_init
+void apic_init() {
+    uint64_t base = cpu_read_msr( APIC_BASE_MSR );
+    if( !(base & APIC_BASE_MSR_ENABLE) ) panic( "apic_init: local APIC is disabled\n" );
+    paging_map_mmio( (void*)(base & APIC_BASE_ADDRESS_MASK), PAGE_SIZE );
+    interrupt_table_set_handler( INTERRUPT_INDEX_SPURIOUS, (interrupt_handler*)spurious_handler );
+    apic = (volatile uint32_t*)(base & APIC_BASE_ADDRESS_MASK);
+    enable();
+}
+
+// application processors share the mapping (every CPU's local APIC is at the same address), so they only need to enable theirs
+void apic_init_ap() {
+    enable();
+}
+
+bool apic_is_enabled() {
+    return NULL != apic;
+}
+
+uint32_t apic_get_id() {
+    return read_register( APIC_ID ) >> 24;
+}
+
+void apic_send_eoi() {
+    write_register( APIC_EOI, 0 );
+}
+
+static void send_command( uint32_t destination, uint32_t command ) {
+    write_register( APIC_INTERRUPT_COMMAND_HIGH, destination << 24 );
+    write_register( APIC_INTERRUPT_COMMAND_LOW, command ); // writing the low half sends it
+    while( read_register( APIC_INTERRUPT_COMMAND_LOW ) & APIC_ICR_DELIVERY_PENDING ) cpu_pause();
+}
+
+// note: the command register is per-CPU, but an interrupt handler could still interleave w/ a send, so interrupts are disabled
+void apic_send_ipi( uint32_t apic_id, uint8_t vector ) {
+    bool interrupts_were_enabled = interrupt_table_disable_interrupts();
+    send_command( apic_id, APIC_ICR_FIXED | APIC_ICR_ASSERT | vector );
+    interrupt_table_restore_interrupts( interrupts_were_enabled );
+}
+
+// resets every other CPU (the 1st half of the INIT-SIPI-SIPI startup sequence)
+void apic_broadcast_init() {
+    send_command( 0, APIC_ICR_ALL_EXCLUDING_SELF | APIC_ICR_INIT | APIC_ICR_ASSERT );
+}
+
+// starts every other CPU in real mode @ trampoline_address, which must be a page-aligned address below 1 MB
+void apic_broadcast_startup( uint32_t trampoline_address ) {
+    send_command( 0, APIC_ICR_ALL_EXCLUDING_SELF | APIC_ICR_STARTUP | APIC_ICR_ASSERT | (trampoline_address >> 12) );
+}
+
+// the timer counts down at the bus clock / 16. it starts masked & stopped
+void apic_timer_init( uint8_t vector ) {
+    write_register( APIC_TIMER_DIVIDE, APIC_TIMER_DIVIDE_BY_16 );
+    write_register( APIC_TIMER_VECTOR, APIC_LVT_MASKED | vector );
+    write_register( APIC_TIMER_INITIAL_COUNT, 0 );
+}
+
+// one-shot: fires once, after count ticks (a count of 0 stops the timer)
+void apic_timer_start( uint32_t count, bool interrupt ) {
+    uint32_t vector = read_register( APIC_TIMER_VECTOR ) & 0xFF;
+    write_register( APIC_TIMER_VECTOR, vector | (interrupt ? 0 : APIC_LVT_MASKED) );
+    write_register( APIC_TIMER_INITIAL_COUNT, count );
+}
+
+void apic_timer_stop() {
+    write_register( APIC_TIMER_INITIAL_COUNT, 0 );
+}
+
+uint32_t apic_timer_read() {
+    return read_register( APIC_TIMER_CURRENT_COUNT );
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// local APIC (xAPIC mode, i.e. MMIO registers), used for inter-processor interrupts, per-CPU timers & for identifying the current CPU
+// note: IRQs still come from the 8259 PIC, which only delivers to the bootstrap processor
+#define APIC_DEFAULT_ADDRESS 0xFEE00000
+
+void apic_init();
+void apic_init_ap();
+bool apic_is_enabled();
+uint32_t apic_get_id();
+void apic_send_eoi();
+void apic_send_ipi( uint32_t apic_id, uint8_t vector );
+void apic_broadcast_init();
+void apic_broadcast_startup( uint32_t trampoline_address );
+void apic_timer_init( uint8_t vector );
+void apic_timer_start( uint32_t count, bool interrupt );
+void apic_timer_stop();
+uint32_t apic_timer_read();
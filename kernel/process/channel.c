@@ -0,0 +1,253 @@
+#include <stdint.h>
+#include "channel.h"
+#include "apic.h"
+#include "cpu.h"
+#include "syscall.h"
+#include "task_pool.h" // for the benchmark
+#include "../buffer/buffer.h"
+#include "../drivers/vga_text.h" // for printing
+#include "../interrupt/interrupt_table.h"
+#include "../interrupt/timer.h" // for the benchmark
+#include "../memory/kernel_heap.h"
+#include "../memory/page_allocator.h"
+#include "../sync/spinlock.h"
+#include "../main.h" // for panic
+
+#define NO_CPU SIZE_MAX
+
+// test programs (see user_programs.asm)
+extern void user_program_channel_producer();
+extern void user_program_channel_consumer();
+
+struct channel {
+    size_t id;
+    size_t page_count; // including the control page
+    void **pages;
+    channel_control_t *control; // same as pages[0], since the kernel identity maps physical memory
+    process_t *endpoints[2];
+    volatile bool wakeup_pending[2]; // a notification that the endpoint hasn't consumed yet
+    volatile size_t waiting_cpu[2]; // CPU where the endpoint is asleep in SYSCALL_CHANNEL_WAIT (or NO_CPU)
+    volatile uint64_t notify_count;
+};
+
+static channel_t *channels[CHANNEL_MAX_COUNT];
+static ticket_lock_t lock; // protects channels[] (lookups from syscalls don't take it, since a channel outlives its processes)
+
+// finds which end of the channel the current process is on
+static channel_t *find_endpoint( uint64_t id, size_t *endpoint ) {
+    channel_t *channel = id < CHANNEL_MAX_COUNT ? channels[id] : NULL;
+    if( NULL == channel ) return NULL;
+    process_t *process = process_get_current();
+    for( size_t i = 0; i < 2; i++ ) {
+        if( process == channel->endpoints[i] ) {
+            *endpoint = i;
+            return channel;
+        }
+    }
+    return NULL;
+}
+
+// rdi = channel id. sleeps until the other end notifies us (or returns right away, if it already has)
+static uint64_t wait_syscall_handler( uint64_t id, uint64_t b, uint64_t c, uint64_t d, uint64_t e, uint64_t f ) {
+    size_t endpoint;
+    channel_t *channel = find_endpoint( id, &endpoint );
+    if( NULL == channel ) return (uint64_t)-1;
+
+    // there's no scheduler to switch to, so we halt this CPU. syscalls run w/ interrupts disabled, and sti only takes effect after
+    // the next instruction, so a wakeup IPI that arrives after the last check still gets us out of hlt
+    __atomic_store_n( &channel->waiting_cpu[endpoint], cpu_get_index(), __ATOMIC_SEQ_CST );
+    while( !__atomic_exchange_n( &channel->wakeup_pending[endpoint], false, __ATOMIC_SEQ_CST ) ) {
+        asm volatile( "sti; hlt; cli" ::: "memory" );
+    }
+    __atomic_store_n( &channel->waiting_cpu[endpoint], NO_CPU, __ATOMIC_SEQ_CST );
+    return 0;
+}
+
+// rdi = channel id. wakes the other end (user code only calls this if the other end's waiting flag is set)
+static uint64_t notify_syscall_handler( uint64_t id, uint64_t b, uint64_t c, uint64_t d, uint64_t e, uint64_t f ) {
+    size_t endpoint;
+    channel_t *channel = find_endpoint( id, &endpoint );
+    if( NULL == channel ) return (uint64_t)-1;
+    size_t peer = 1 - endpoint;
+    __atomic_fetch_add( &channel->notify_count, 1, __ATOMIC_RELAXED );
+
+    // the mirror image of wait: set the token, then check for a sleeper (so either it sees the token, or we see it)
+    __atomic_store_n( &channel->wakeup_pending[peer], true, __ATOMIC_SEQ_CST );
+    size_t cpu = __atomic_load_n( &channel->waiting_cpu[peer], __ATOMIC_SEQ_CST );
+    if( NO_CPU != cpu && cpu != cpu_get_index() ) apic_send_ipi( cpu_get_apic_id( cpu ), INTERRUPT_INDEX_WAKEUP );
+    return 0;
+}
+
+void channel_init() {
+    ticket_lock_init( &lock, "channel" );
+    syscall_set_handler( SYSCALL_CHANNEL_WAIT, wait_syscall_handler );
+    syscall_set_handler( SYSCALL_CHANNEL_NOTIFY, notify_syscall_handler );
+}
+
+// capacity must be a power of 2 & a multiple of the page size
+channel_t *channel_create( size_t capacity ) {
+    if( capacity < PAGE_SIZE || capacity > CHANNEL_MAX_CAPACITY || 0 != (capacity & (capacity - 1)) ) panic( "channel_create: invalid capacity\n" );
+    channel_t *channel = kernel_heap_alloc( sizeof( channel_t ) );
+    kernel_heap_tag( channel, KERNEL_HEAP_TAG_PROCESS );
+    channel->page_count = 1 + capacity / PAGE_SIZE;
+    channel->pages = kernel_heap_alloc( channel->page_count * sizeof( void* ) );
+    kernel_heap_tag( channel->pages, KERNEL_HEAP_TAG_PROCESS );
+    for( size_t i = 0; i < channel->page_count; i++ ) {
+        channel->pages[i] = page_allocator_alloc_zeroed();
+    }
+    for( size_t i = 0; i < 2; i++ ) {
+        channel->endpoints[i] = NULL;
+        channel->wakeup_pending[i] = false;
+        channel->waiting_cpu[i] = NO_CPU;
+    }
+    channel->notify_count = 0;
+
+    // take an id
+    ticket_lock_acquire( &lock );
+    channel->id = CHANNEL_MAX_COUNT;
+    for( size_t i = 0; i < CHANNEL_MAX_COUNT; i++ ) {
+        if( NULL == channels[i] ) {
+            channel->id = i;
+            channels[i] = channel;
+            break;
+        }
+    }
+    ticket_lock_release( &lock );
+    if( CHANNEL_MAX_COUNT == channel->id ) panic( "channel_create: too many channels\n" );
+
+    channel->control = channel->pages[0];
+    channel->control->id = channel->id;
+    channel->control->capacity = capacity;
+    return channel;
+}
+
+// the processes keep their own references to the pages, so this can come before or after they're destroyed (but not while they run)
+void channel_destroy( channel_t *channel ) {
+    ticket_lock_acquire( &lock );
+    channels[channel->id] = NULL;
+    ticket_lock_release( &lock );
+    for( size_t i = 0; i < channel->page_count; i++ ) page_allocator_free( channel->pages[i] );
+    kernel_heap_free( channel->pages );
+    kernel_heap_free( channel );
+}
+
+// maps the channel into the process at PROCESS_CHANNEL_ADDRESS. the pages are marked shared, so they stay shared in clones
+void channel_attach( channel_t *channel, process_t *process, size_t endpoint ) {
+    if( endpoint > CHANNEL_ENDPOINT_CONSUMER || NULL != channel->endpoints[endpoint] ) panic( "channel_attach: endpoint is taken\n" );
+    for( size_t i = 0; i < channel->page_count; i++ ) {
+        page_allocator_share( channel->pages[i] ); // the pagemap's reference, which paging_destroy_pagemap drops
+        paging_map_page( process->pagemap, (void*)PROCESS_CHANNEL_ADDRESS + i * PAGE_SIZE, channel->pages[i], PAGE_FLAG_USER | PAGE_FLAG_WRITE | PAGE_FLAG_SHARED );
+    }
+    channel->endpoints[endpoint] = process;
+}
+
+channel_control_t *channel_get_control( channel_t *channel ) {
+    return channel->control;
+}
+
+uint64_t channel_get_notify_count( channel_t *channel ) {
+    return __atomic_load_n( &channel->notify_count, __ATOMIC_RELAXED );
+}
+
+#define TEST_CAPACITY 0x10000 // 64 KB, which holds all of each test's messages, so the producer can finish before the consumer starts
+
+// runs the producer to completion, then the consumer, & checks that every message arrived intact (works on a single CPU)
+static void test_transfer( channel_t *channel, process_t *producer, process_t *consumer, uint64_t message_count, uint64_t message_size ) {
+    channel_control_t *control = channel_get_control( channel );
+    control->message_count = message_count;
+    control->message_size = message_size;
+    if( 0 != process_run( producer ) ) panic( "channel_run_tests: producer failed\n" );
+    if( (int64_t)message_count != process_run( consumer ) ) panic( "channel_run_tests: consumer didn't receive every message intact\n" );
+    if( control->head != control->tail ) panic( "channel_run_tests: consumer didn't drain the ring\n" );
+}
+
+// call after process_init
+void channel_run_tests() {
+    size_t free_pages = page_allocator_free_page_count();
+    channel_t *channel = channel_create( TEST_CAPACITY );
+    process_t *producer = process_create_builtin( user_program_channel_producer );
+    process_t *consumer = process_create_builtin( user_program_channel_consumer );
+    channel_attach( channel, producer, CHANNEL_ENDPOINT_PRODUCER );
+    channel_attach( channel, consumer, CHANNEL_ENDPOINT_CONSUMER );
+
+    // small messages, then large ones, which start partway into the ring & so have to wrap around its end
+    test_transfer( channel, producer, consumer, 500, 64 );
+    test_transfer( channel, producer, consumer, 60, 1024 );
+    if( channel_get_control( channel )->head <= TEST_CAPACITY ) panic( "channel_run_tests: messages didn't wrap around the ring\n" );
+
+    // the consumer never had to wait, so nobody needed a wakeup
+    if( 0 != channel_get_notify_count( channel ) ) panic( "channel_run_tests: producer notified a consumer that wasn't waiting\n" );
+
+    // a clone of the producer writes to the same ring, rather than to a copy-on-write copy
+    process_t *clone = process_clone( producer );
+    uint64_t head = channel_get_control( channel )->head;
+    channel_get_control( channel )->message_count = 1;
+    if( 0 != process_run( clone ) || head == channel_get_control( channel )->head ) panic( "channel_run_tests: cloned producer didn't write to the shared ring\n" );
+    process_destroy( clone );
+
+    // the channel's pages are freed once the channel & both processes are gone
+    process_destroy( producer );
+    process_destroy( consumer );
+    channel_destroy( channel );
+    if( free_pages != page_allocator_free_page_count() ) panic( "channel_run_tests: channel leaked pages\n" );
+}
+
+#define BENCHMARK_CAPACITY 0x100000 // 1 MB ring
+
+typedef struct consumer_run {
+    process_t *process;
+    volatile bool started;
+    int64_t exit_code;
+} consumer_run_t;
+
+static void run_consumer( void *argument ) {
+    consumer_run_t *run = argument;
+    __atomic_store_n( &run->started, true, __ATOMIC_RELEASE );
+    run->exit_code = process_run( run->process );
+}
+
+// the consumer runs on another CPU (as a task), while the producer runs on this one
+static void benchmark( uint64_t message_count, uint64_t message_size ) {
+    channel_t *channel = channel_create( BENCHMARK_CAPACITY );
+    process_t *producer = process_create_builtin( user_program_channel_producer );
+    consumer_run_t run = { process_create_builtin( user_program_channel_consumer ), false, 0 };
+    channel_attach( channel, producer, CHANNEL_ENDPOINT_PRODUCER );
+    channel_attach( channel, run.process, CHANNEL_ENDPOINT_CONSUMER );
+    channel_get_control( channel )->message_count = message_count;
+    channel_get_control( channel )->message_size = message_size;
+
+    // wait for a worker to pick up the consumer, since the producer would block forever if the consumer ran after it on this CPU
+    task_t task;
+    uint64_t start = timer_now();
+    task_pool_spawn( &task, run_consumer, &run );
+    while( !__atomic_load_n( &run.started, __ATOMIC_ACQUIRE ) ) cpu_pause();
+    if( 0 != process_run( producer ) ) panic( "channel_run_benchmark: producer failed\n" );
+    task_pool_join( &task );
+    uint64_t ticks = timer_now() - start;
+    if( (int64_t)message_count != run.exit_code ) panic( "channel_run_benchmark: consumer didn't receive every message intact\n" );
+
+    // report
+    uint64_t frequency = timer_get_frequency();
+    ticks = 0 == ticks ? 1 : ticks;
+    vga_text_print_stat( "channel_benchmark message_size=", message_size );
+    vga_text_print_stat( " messages=", message_count );
+    vga_text_print_stat( " notifies=", channel_get_notify_count( channel ) );
+    vga_text_print_stat( " messages_per_second=", message_count * frequency / ticks );
+    vga_text_print_stat( " bytes_per_second=", message_count * message_size * frequency / ticks );
+    vga_text_print( "\n", 0x17 );
+
+    process_destroy( producer );
+    process_destroy( run.process );
+    channel_destroy( channel );
+}
+
+// streams small & large messages between 2 processes on different CPUs (needs qemu's -smp 2 or more)
+// each result line is "channel_benchmark message_size=<bytes> messages=<n> notifies=<wakeup syscalls> messages_per_second=<n> bytes_per_second=<n>"
+void channel_run_benchmark() {
+    if( cpu_get_count() < 2 ) {
+        vga_text_print( "channel_benchmark skipped (needs 2 CPUs)\n", 0x17 );
+        return;
+    }
+    benchmark( 200000, 64 );
+    benchmark( 2000, 65536 );
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "process.h"
+
+// zero-copy IPC: a channel is a set of physical pages mapped into 2 processes (at PROCESS_CHANNEL_ADDRESS), which hold a lock-free
+// single-producer/single-consumer ring of messages. the producer writes each message in place & the consumer reads it in place,
+// so data never passes through the kernel. the kernel only gets involved when a side has to sleep (ring empty, or ring full):
+// the sleeper sets its waiting flag, fences, rechecks the ring, & then calls SYSCALL_CHANNEL_WAIT, and the other side only calls
+// SYSCALL_CHANNEL_NOTIFY (once, clearing the flag) if it sees the flag set after publishing, i.e. when the ring just went from empty or from full
+#define CHANNEL_MAX_COUNT 16
+#define CHANNEL_MAX_CAPACITY 0x1000000 // 16 MB of ring
+#define CHANNEL_ENDPOINT_PRODUCER 0
+#define CHANNEL_ENDPOINT_CONSUMER 1
+#define CHANNEL_RECORD_WRAP UINT64_MAX // record length that means "skip to the start of the ring"
+
+// the 1st page of a channel (the ring's data starts on the next page). the offsets must match user_programs.asm
+// messages are records of an 8-byte length followed by the payload, padded to 8 bytes, and never straddle the end of the ring
+// head & tail are byte counts that only ever grow (the ring offset is count & (capacity - 1)), and each side writes only its own
+// cache line, so the two sides don't false-share
+typedef struct channel_control {
+    // set by the kernel
+    uint64_t id; // for the channel syscalls
+    uint64_t capacity; // bytes in the ring (a power of 2)
+    uint64_t message_count, message_size; // parameters for the test programs (message_size is a nonzero multiple of 8)
+    // written by the producer
+    volatile uint64_t head __attribute__((aligned(64))); // bytes published
+    volatile uint64_t producer_waiting; // producer is (about to be) asleep because the ring is full
+    // written by the consumer
+    volatile uint64_t tail __attribute__((aligned(64))); // bytes consumed
+    volatile uint64_t consumer_waiting; // consumer is (about to be) asleep because the ring is empty
+} channel_control_t;
+
+typedef struct channel channel_t;
+
+void channel_init();
+channel_t *channel_create( size_t capacity );
+void channel_destroy( channel_t *channel );
+void channel_attach( channel_t *channel, process_t *process, size_t endpoint );
+channel_control_t *channel_get_control( channel_t *channel );
+uint64_t channel_get_notify_count( channel_t *channel );
+void channel_run_tests();
+void channel_run_benchmark();
@@ -0,0 +1,298 @@
+#include <stdint.h>
+#include "coroutine.h"
+#include "apic.h"
+#include "cpu.h"
+#include "task_pool.h" // for the tests & the thread-per-request benchmark
+#include "../drivers/vga_text.h" // for printing
+#include "../interrupt/interrupt_table.h"
+#include "../interrupt/softirq.h"
+#include "../memory/kernel_heap.h"
+#include "../sync/spinlock.h"
+#include "../main.h" // for panic
+
+// a FIFO of ready coroutines, which any CPU can push to, but only its own CPU takes from (in the coroutine softirq)
+typedef struct executor {
+    ticket_lock_t lock __attribute__((aligned(64))); // irqsave, since coroutines get woken from interrupt handlers
+    coroutine_t *head, *tail;
+    uint64_t resumes; // only touched by its own CPU
+} executor_t;
+
+static executor_t executors[CPU_MAX_COUNT];
+
+// the coroutine softirq: resumes every coroutine that was ready when it started. coroutines woken meanwhile (including ones that
+// yield) re-raise the softirq, so they run in the next pass, after other softirqs have had a turn
+static void run_ready() {
+    executor_t *executor = &executors[cpu_get_index()];
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &executor->lock );
+    coroutine_t *ready = executor->head;
+    executor->head = executor->tail = NULL;
+    ticket_lock_release_irqrestore( &executor->lock, interrupts_were_enabled );
+
+    while( NULL != ready ) {
+        coroutine_t *coroutine = ready;
+        ready = coroutine->next; // before resuming it, since it may get woken again (& re-queued) before it returns
+        executor->resumes++;
+        if( coroutine->function( coroutine ) ) __atomic_store_n( &coroutine->done, true, __ATOMIC_RELEASE );
+    }
+}
+
+// another CPU woke 1 of our coroutines
+static void wakeup_handler( uint64_t interrupt ) {
+    apic_send_eoi();
+    softirq_raise( SOFTIRQ_INDEX_COROUTINE );
+}
+
+// call after smp_init
+void coroutine_init() {
+    for( size_t i = 0; i < CPU_MAX_COUNT; i++ ) ticket_lock_init( &executors[i].lock, "coroutine_executor" );
+    softirq_set_handler( SOFTIRQ_INDEX_COROUTINE, run_ready );
+    interrupt_table_set_handler( INTERRUPT_INDEX_COROUTINE_WAKEUP, (interrupt_handler*)wakeup_handler );
+}
+
+// starts a coroutine on this CPU. it 1st runs in the next coroutine softirq, so the caller can finish setting up before then
+void coroutine_spawn( coroutine_t *coroutine, coroutine_function *function, void *argument ) {
+    coroutine->function = function;
+    coroutine->argument = argument;
+    coroutine->resume_point = 0;
+    coroutine->cpu = cpu_get_index();
+    coroutine->done = false;
+    coroutine->timer.pending = false;
+    coroutine_wake( coroutine );
+}
+
+// queues a waiting coroutine on its executor. safe from any CPU & from interrupt handlers
+// only an empty queue needs an IPI, since a non-empty one already has a softirq on the way
+void coroutine_wake( coroutine_t *coroutine ) {
+    size_t cpu = coroutine->cpu; // once it's queued, the coroutine may run (& be freed) before we're done here
+    executor_t *executor = &executors[cpu];
+    coroutine->next = NULL;
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &executor->lock );
+    bool was_empty = NULL == executor->head;
+    if( was_empty ) executor->head = coroutine;
+    else executor->tail->next = coroutine;
+    executor->tail = coroutine;
+    ticket_lock_release_irqrestore( &executor->lock, interrupts_were_enabled );
+
+    if( cpu == cpu_get_index() ) softirq_raise( SOFTIRQ_INDEX_COROUTINE );
+    else if( was_empty ) apic_send_ipi( cpu_get_apic_id( cpu ), INTERRUPT_INDEX_COROUTINE_WAKEUP );
+}
+
+static void wake_after_sleep( void *argument ) {
+    coroutine_wake( argument );
+}
+
+// for COROUTINE_SLEEP. the coroutine is running, so we're on its CPU, which is where its timer must run
+void coroutine_sleep( coroutine_t *coroutine, uint64_t microseconds ) {
+    timer_start( &coroutine->timer, timer_now() + timer_from_microseconds( microseconds ), wake_after_sleep, coroutine );
+}
+
+// waits for a coroutine to finish. call from kernel code (not from a coroutine or an interrupt handler), w/ softirqs enabled
+// like task_pool_join, we keep running the executor rather than wait idly, since it's most likely running the coroutine we want
+void coroutine_join( coroutine_t *coroutine ) {
+    while( !__atomic_load_n( &coroutine->done, __ATOMIC_ACQUIRE ) ) {
+        softirq_run();
+        cpu_pause();
+    }
+}
+
+void coroutine_completion_init( coroutine_completion_t *completion ) {
+    completion->waiter = NULL;
+    completion->result = 0;
+}
+
+// for COROUTINE_AWAIT. returns true if the completion is already complete, or else registers the coroutine to be woken by it
+bool coroutine_completion_await( coroutine_completion_t *completion, coroutine_t *coroutine ) {
+    coroutine_t *expected = NULL;
+    if( __atomic_compare_exchange_n( &completion->waiter, &expected, coroutine, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) ) return false;
+    if( COROUTINE_COMPLETION_COMPLETE != expected ) panic( "coroutine_completion_await: completion already has a waiter\n" );
+    return true;
+}
+
+// called by the device (usually from its interrupt handler). the result must be written before the waiter can see the completion
+void coroutine_complete( coroutine_completion_t *completion, int64_t result ) {
+    completion->result = result;
+    coroutine_t *waiter = __atomic_exchange_n( &completion->waiter, COROUTINE_COMPLETION_COMPLETE, __ATOMIC_ACQ_REL );
+    if( COROUTINE_COMPLETION_COMPLETE == waiter ) panic( "coroutine_complete: completion was already complete\n" );
+    if( NULL != waiter ) coroutine_wake( waiter );
+}
+
+bool coroutine_completion_is_complete( coroutine_completion_t *completion ) {
+    return COROUTINE_COMPLETION_COMPLETE == __atomic_load_n( &completion->waiter, __ATOMIC_ACQUIRE );
+}
+
+uint64_t coroutine_get_resume_count( size_t cpu_index ) {
+    return executors[cpu_index].resumes;
+}
+
+#define TEST_YIELDS 3
+#define TEST_SLEEPS 2
+#define TEST_SLEEP_MICROSECONDS 1000
+#define TEST_COROUTINE_COUNT 1000
+
+typedef struct test_state {
+    coroutine_t coroutine;
+    coroutine_completion_t completion;
+    uint64_t steps, result, finished_at;
+} test_state_t;
+
+static bool test_yielder( coroutine_t *coroutine ) {
+    test_state_t *state = coroutine->argument;
+    COROUTINE_BEGIN( coroutine );
+    for( state->steps = 0; state->steps < TEST_YIELDS; state->steps++ ) COROUTINE_YIELD( coroutine );
+    COROUTINE_END( coroutine );
+}
+
+static bool test_awaiter( coroutine_t *coroutine ) {
+    test_state_t *state = coroutine->argument;
+    COROUTINE_BEGIN( coroutine );
+    COROUTINE_AWAIT( coroutine, &state->completion );
+    state->result = (uint64_t)state->completion.result;
+    COROUTINE_END( coroutine );
+}
+
+static bool test_sleeper( coroutine_t *coroutine ) {
+    test_state_t *state = coroutine->argument;
+    COROUTINE_BEGIN( coroutine );
+    for( state->steps = 0; state->steps < TEST_SLEEPS; state->steps++ ) COROUTINE_SLEEP( coroutine, TEST_SLEEP_MICROSECONDS );
+    state->finished_at = timer_now();
+    COROUTINE_END( coroutine );
+}
+
+// a stand-in for a device's completion interrupt
+static void test_complete_from_timer( void *argument ) {
+    coroutine_complete( argument, 42 );
+}
+
+static void test_complete_from_task( void *argument ) {
+    coroutine_complete( argument, 43 );
+}
+
+static test_state_t *test_spawn( test_state_t *state, coroutine_function *function ) {
+    state->steps = state->result = state->finished_at = 0;
+    coroutine_completion_init( &state->completion );
+    coroutine_spawn( &state->coroutine, function, state );
+    return state;
+}
+
+// call after coroutine_init
+void coroutine_run_tests() {
+    // yielding resumes the coroutine after the point where it yielded
+    test_state_t state;
+    coroutine_join( &test_spawn( &state, test_yielder )->coroutine );
+    if( TEST_YIELDS != state.steps ) panic( "coroutine_run_tests: yielding coroutine didn't run to the end\n" );
+
+    // awaiting a completion that's already complete doesn't wait
+    softirq_disable();
+    test_spawn( &state, test_awaiter );
+    coroutine_complete( &state.completion, 41 );
+    softirq_enable();
+    coroutine_join( &state.coroutine );
+    if( 41 != state.result ) panic( "coroutine_run_tests: coroutine got the wrong result from a complete completion\n" );
+
+    // awaiting a completion that an interrupt handler completes later
+    test_spawn( &state, test_awaiter );
+    timer_t timer;
+    timer.pending = false;
+    timer_start( &timer, timer_now() + timer_from_microseconds( TEST_SLEEP_MICROSECONDS ), test_complete_from_timer, &state.completion );
+    coroutine_join( &state.coroutine );
+    if( 42 != state.result ) panic( "coroutine_run_tests: coroutine got the wrong result from an interrupt handler\n" );
+
+    // awaiting a completion that a task completes (which another CPU may steal, so the wakeup may be an IPI)
+    test_spawn( &state, test_awaiter );
+    task_t task;
+    task_pool_spawn( &task, test_complete_from_task, &state.completion );
+    task_pool_join( &task );
+    coroutine_join( &state.coroutine );
+    if( 43 != state.result ) panic( "coroutine_run_tests: coroutine got the wrong result from a task\n" );
+
+    // lots of sleeping coroutines overlap, rather than taking turns
+    test_state_t *states = kernel_heap_alloc( TEST_COROUTINE_COUNT * sizeof( test_state_t ) );
+    uint64_t start = timer_now();
+    for( size_t i = 0; i < TEST_COROUTINE_COUNT; i++ ) test_spawn( &states[i], test_sleeper );
+    for( size_t i = 0; i < TEST_COROUTINE_COUNT; i++ ) {
+        coroutine_join( &states[i].coroutine );
+        if( states[i].finished_at < start + timer_from_microseconds( TEST_SLEEPS * TEST_SLEEP_MICROSECONDS ) ) {
+            panic( "coroutine_run_tests: sleeping coroutine woke up early\n" );
+        }
+    }
+    if( timer_now() - start > timer_from_microseconds( TEST_COROUTINE_COUNT * TEST_SLEEPS * TEST_SLEEP_MICROSECONDS / 10 ) ) {
+        panic( "coroutine_run_tests: sleeping coroutines didn't overlap\n" );
+    }
+    kernel_heap_free( states );
+}
+
+#define BENCHMARK_IOS_PER_REQUEST 4
+#define BENCHMARK_LATENCY_MICROSECONDS 50
+#define BENCHMARK_THREAD_STACK_SIZE 16384 // what a kernel thread would need (the same as a process's kernel stack, see process.c)
+
+static const size_t benchmark_request_counts[] = { 16, 256, 4096 };
+
+// a request to a simulated device, whose I/Os each complete (in the timer interrupt) a fixed time after they're submitted
+typedef struct benchmark_request {
+    coroutine_t coroutine;
+    coroutine_completion_t completion;
+    timer_t device_timer;
+    size_t ios;
+} benchmark_request_t;
+
+static void complete_io( void *argument ) {
+    coroutine_complete( argument, 0 );
+}
+
+static void submit_io( benchmark_request_t *request ) {
+    coroutine_completion_init( &request->completion );
+    timer_start( &request->device_timer, timer_now() + timer_from_microseconds( BENCHMARK_LATENCY_MICROSECONDS ), complete_io, &request->completion );
+}
+
+static bool run_request( coroutine_t *coroutine ) {
+    benchmark_request_t *request = coroutine->argument;
+    COROUTINE_BEGIN( coroutine );
+    for( request->ios = 0; request->ios < BENCHMARK_IOS_PER_REQUEST; request->ios++ ) {
+        submit_io( request );
+        COROUTINE_AWAIT( coroutine, &request->completion );
+    }
+    COROUTINE_END( coroutine );
+}
+
+// there's no scheduler, so a thread that blocks on an I/O holds its CPU until the I/O completes
+static void run_request_threads( size_t begin, size_t end, void *argument ) {
+    benchmark_request_t *requests = argument;
+    for( size_t i = begin; i < end; i++ ) {
+        for( size_t io = 0; io < BENCHMARK_IOS_PER_REQUEST; io++ ) {
+            submit_io( &requests[i] );
+            while( !coroutine_completion_is_complete( &requests[i].completion ) ) cpu_pause();
+        }
+    }
+}
+
+static void print_result( const char *model, size_t requests, uint64_t cycles, size_t bytes_per_request ) {
+    vga_text_print( "coroutine_benchmark model=", 0x17 );
+    vga_text_print( model, 0x17 );
+    vga_text_print_stat( " requests=", requests );
+    vga_text_print_stat( " cycles=", cycles );
+    vga_text_print_stat( " cycles_per_request=", cycles / requests );
+    vga_text_print_stat( " bytes_per_request=", bytes_per_request );
+    vga_text_print( "\n", 0x17 );
+}
+
+// requests that each do a few I/Os in sequence, driven by coroutines on this CPU, & then by a thread per request (i.e. a task per
+// request, across every CPU). the coroutines keep every request's I/O outstanding at once, while the threads can only keep 1 I/O
+// per CPU outstanding. each result line is "coroutine_benchmark model=<coroutine|thread> requests=<n> cycles=<tsc cycles>
+// cycles_per_request=<n> bytes_per_request=<state, plus a stack for threads>"
+void coroutine_run_benchmark() {
+    for( size_t i = 0; i < sizeof( benchmark_request_counts ) / sizeof( benchmark_request_counts[0] ); i++ ) {
+        size_t count = benchmark_request_counts[i];
+        benchmark_request_t *requests = kernel_heap_alloc( count * sizeof( benchmark_request_t ) );
+        for( size_t j = 0; j < count; j++ ) requests[j].device_timer.pending = false;
+
+        uint64_t start = cpu_read_timestamp();
+        for( size_t j = 0; j < count; j++ ) coroutine_spawn( &requests[j].coroutine, run_request, &requests[j] );
+        for( size_t j = 0; j < count; j++ ) coroutine_join( &requests[j].coroutine );
+        print_result( "coroutine", count, cpu_read_timestamp() - start, sizeof( benchmark_request_t ) );
+
+        start = cpu_read_timestamp();
+        task_pool_parallel_for( 0, count, 1, run_request_threads, requests );
+        print_result( "thread", count, cpu_read_timestamp() - start, sizeof( benchmark_request_t ) + BENCHMARK_THREAD_STACK_SIZE );
+        kernel_heap_free( requests );
+    }
+}
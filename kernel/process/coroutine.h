@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "../interrupt/timer.h"
+
+// stackless coroutines for asynchronous driver code: a coroutine is a function that returns at each await point & gets called again
+// (from the top) when it's resumed, so it needs no stack of its own, just a small struct. the macros below turn the function's body
+// into a switch on its resume point (a protothread, see Dunkels et al., 2006), so it reads like straight-line code
+// each CPU has an executor, which runs that CPU's ready coroutines as a softirq. a coroutine always runs on the CPU that spawned it,
+// but it can be woken from any CPU, including from interrupt handlers (e.g. a device's completion interrupt)
+// note: locals don't survive an await point, so keep state in the coroutine's argument. awaits can only appear in the function itself
+// (not in functions it calls), & not inside a switch statement
+#define COROUTINE_RESUME_POINT_DONE UINT32_MAX
+
+typedef struct coroutine coroutine_t;
+typedef bool (coroutine_function)( coroutine_t *coroutine ); // returns true once the coroutine has finished
+
+struct coroutine {
+    coroutine_function *function;
+    void *argument;
+    uint32_t resume_point; // the source line of the last await (0 = the start)
+    size_t cpu; // whose executor runs it
+    volatile bool done;
+    timer_t timer; // for COROUTINE_SLEEP
+    coroutine_t *next; // in the executor's ready queue
+};
+
+// a device operation's result, which 1 coroutine can await. the waiter is NULL (not complete & not awaited), the awaiting coroutine,
+// or COROUTINE_COMPLETION_COMPLETE, so completing & awaiting can race w/o a lock
+#define COROUTINE_COMPLETION_COMPLETE ((coroutine_t*)1)
+
+typedef struct coroutine_completion {
+    coroutine_t *volatile waiter;
+    int64_t result;
+} coroutine_completion_t;
+
+#define COROUTINE_BEGIN( coroutine ) switch( (coroutine)->resume_point ) { case 0:
+#define COROUTINE_END( coroutine ) } (coroutine)->resume_point = COROUTINE_RESUME_POINT_DONE; return true
+
+// gives other ready coroutines (& softirqs) a turn
+#define COROUTINE_YIELD( coroutine ) \
+    do { (coroutine)->resume_point = __LINE__; coroutine_wake( coroutine ); return false; case __LINE__:; } while( 0 )
+
+// resumes once the completion is complete (right away, if it already is), w/ its result in completion->result
+#define COROUTINE_AWAIT( coroutine, completion ) \
+    do { (coroutine)->resume_point = __LINE__; if( !coroutine_completion_await( completion, coroutine ) ) return false; case __LINE__:; } while( 0 )
+
+// resumes once the given # of microseconds have passed
+#define COROUTINE_SLEEP( coroutine, microseconds ) \
+    do { (coroutine)->resume_point = __LINE__; coroutine_sleep( coroutine, microseconds ); return false; case __LINE__:; } while( 0 )
+
+void coroutine_init();
+void coroutine_spawn( coroutine_t *coroutine, coroutine_function *function, void *argument );
+void coroutine_wake( coroutine_t *coroutine );
+void coroutine_sleep( coroutine_t *coroutine, uint64_t microseconds );
+void coroutine_join( coroutine_t *coroutine );
+void coroutine_completion_init( coroutine_completion_t *completion );
+bool coroutine_completion_await( coroutine_completion_t *completion, coroutine_t *coroutine );
+void coroutine_complete( coroutine_completion_t *completion, int64_t result );
+bool coroutine_completion_is_complete( coroutine_completion_t *completion );
+uint64_t coroutine_get_resume_count( size_t cpu_index );
+void coroutine_run_tests();
+void coroutine_run_benchmark();
@@ -0,0 +1,86 @@
+#include <stdbool.h>
+#include "cpu.h"
+#include "apic.h" // for identifying CPUs
+
+#define CR0_MONITOR_COPROCESSOR (1 << 1)
+#define CR0_EMULATION (1 << 2)
+#define CR4_OSFXSR (1 << 9) // OS supports fxsave/fxrstor, which also enables SSE
+#define CR4_OSXMMEXCPT (1 << 10) // OS handles SIMD floating point exceptions
+
+uint64_t cpu_read_msr( uint32_t msr ) {
+    uint32_t low, high;
+    asm volatile( "rdmsr" : "=a" (low), "=d" (high) : "c" (msr) );
+    return ((uint64_t)high << 32) | low;
+}
+
+void cpu_write_msr( uint32_t msr, uint64_t value ) {
+    asm volatile( "wrmsr" :: "c" (msr), "a" ((uint32_t)value), "d" ((uint32_t)(value >> 32)) );
+}
+
+// note: rdtsc is not serializing, so measurements of very short sequences will be slightly off
+uint64_t cpu_read_timestamp() {
+    uint32_t low, high;
+    asm volatile( "rdtsc" : "=a" (low), "=d" (high) );
+    return ((uint64_t)high << 32) | low;
+}
+
+void cpu_cpuid( uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx ) {
+    asm volatile( "cpuid" : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx) : "a" (leaf), "c" (0) );
+}
+
+// spin-wait hint: saves power & avoids a memory-order mis-speculation penalty when the awaited store arrives
+void cpu_pause() {
+    asm volatile( "pause" ::: "memory" );
+}
+
+// lets kernel code use SSE instructions (e.g. the framebuffer's blits)
+// note: C code is compiled w/ -mgeneral-regs-only (see the makefile), so the compiler never emits SSE, and we don't save XMM registers on interrupts or context switches,
+// so SSE code must not be interrupted by other SSE code on the same CPU, & must preserve the XMM registers it uses, which may hold user code's state (see buffer_simd.asm)
+void cpu_enable_sse() {
+    uint64_t cr0, cr4;
+    asm volatile( "mov %%cr0, %0" : "=r" (cr0) );
+    cr0 = (cr0 & ~(uint64_t)CR0_EMULATION) | CR0_MONITOR_COPROCESSOR;
+    asm volatile( "mov %0, %%cr0" :: "r" (cr0) );
+    asm volatile( "mov %%cr4, %0" : "=r" (cr4) );
+    cr4|= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    asm volatile( "mov %0, %%cr4" :: "r" (cr4) );
+}
+
+// CPUs are numbered 0 (the bootstrap processor) to CPU_MAX_COUNT - 1, in the order they came up
+// their local APIC IDs aren't necessarily contiguous, so we map them to indices
+static uint8_t index_by_apic_id[256];
+static uint32_t apic_id_by_index[CPU_MAX_COUNT];
+static volatile bool online[CPU_MAX_COUNT] = { true };
+static volatile size_t online_count = 1;
+
+// index of the executing CPU, for indexing per-CPU arrays
+// before the local APIC is enabled, only the bootstrap processor is running
+size_t cpu_get_index() {
+    return apic_is_enabled() ? index_by_apic_id[apic_get_id()] : 0;
+}
+
+size_t cpu_get_count() {
+    return online_count;
+}
+
+bool cpu_is_online( size_t index ) {
+    return index < CPU_MAX_COUNT && online[index];
+}
+
+uint32_t cpu_get_apic_id( size_t index ) {
+    return apic_id_by_index[index];
+}
+
+// must be the 1st thing a CPU does (before anything calls cpu_get_index)
+void cpu_register( size_t index ) {
+    uint32_t apic_id = apic_get_id();
+    index_by_apic_id[apic_id] = index;
+    apic_id_by_index[index] = apic_id;
+}
+
+// the CPU is done initializing, so other CPUs may send it work
+void cpu_set_online( size_t index ) {
+    if( online[index] ) return;
+    online[index] = true;
+    __atomic_fetch_add( &online_count, 1, __ATOMIC_RELEASE );
+}
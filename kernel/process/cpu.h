@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// model-specific registers
+#define CPU_MSR_PAT 0x277 // page attribute table (memory types selected by a page's PAT/PCD/PWT bits)
+#define CPU_MSR_EFER 0xC0000080 // extended feature enable register
+#define CPU_MSR_STAR 0xC0000081 // syscall/sysret segment selectors
+#define CPU_MSR_LSTAR 0xC0000082 // syscall entry point (64-bit mode)
+#define CPU_MSR_FMASK 0xC0000084 // rflags bits cleared on syscall
+#define CPU_MSR_KERNEL_GS_BASE 0xC0000102 // gs base that swapgs swaps in
+
+#define CPU_EFER_SYSCALL_ENABLE (1 << 0)
+
+// upper bound on the # of CPUs, for sizing per-CPU arrays
+#define CPU_MAX_COUNT 16
+
+// cpuid feature bits
+#define CPU_CPUID_1_ECX_PCID (1 << 17)
+#define CPU_CPUID_1_EDX_PAT (1 << 16)
+#define CPU_CPUID_80000001_EDX_1GB_PAGES (1 << 26)
+
+uint64_t cpu_read_msr( uint32_t msr );
+void cpu_write_msr( uint32_t msr, uint64_t value );
+uint64_t cpu_read_timestamp();
+void cpu_cpuid( uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx );
+void cpu_pause();
+void cpu_enable_sse();
+size_t cpu_get_index();
+size_t cpu_get_count();
+bool cpu_is_online( size_t index );
+uint32_t cpu_get_apic_id( size_t index );
+void cpu_register( size_t index );
+void cpu_set_online( size_t index );
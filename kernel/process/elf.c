@@ -0,0 +1,151 @@
+#include <stdint.h>
+#include "elf.h"
+#include "cpu.h" // for the benchmark
+#include "../buffer/buffer.h"
+#include "../drivers/vga_text.h" // for printing
+#include "../memory/kernel_heap.h"
+#include "../memory/page_allocator.h"
+#include "../memory/paging.h"
+#include "../main.h" // for panic
+
+#define PAGE_ROUND_UP( size ) (((size) + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1))
+
+// segments must fit between the start of user space & the channel mapping (which keeps them clear of the stack, too)
+static bool is_valid_segment( const elf_program_header_t *segment, size_t image_size ) {
+    uint64_t start = segment->virtual_address, end = start + segment->memory_size;
+    return segment->file_size <= segment->memory_size
+        && segment->offset <= image_size && segment->file_size <= image_size - segment->offset
+        && (segment->offset & (PAGE_SIZE - 1)) == (start & (PAGE_SIZE - 1))
+        && start >= PAGING_USER_START && end >= start && end <= PROCESS_CHANNEL_ADDRESS;
+}
+
+static const elf_program_header_t *get_program_headers( const void *image, size_t image_size ) {
+    const elf_header_t *header = image;
+    if( image_size < sizeof( elf_header_t ) ) return NULL;
+    if( ELF_MAGIC != header->magic || ELF_CLASS_64 != header->class || ELF_DATA_LITTLE_ENDIAN != header->data ) return NULL;
+    if( ELF_TYPE_EXECUTABLE != header->type || ELF_MACHINE_X86_64 != header->machine ) return NULL;
+    if( sizeof( elf_program_header_t ) != header->program_header_size || header->program_header_offset > image_size ) return NULL;
+    if( header->program_header_count > (image_size - header->program_header_offset) / sizeof( elf_program_header_t ) ) return NULL;
+    return image + header->program_header_offset;
+}
+
+// image must be page-aligned, and must outlive every process loaded from it, since their pages map it directly
+// only the headers are read here: the segments get mapped a page at a time as the process touches them, so loading costs the same
+// no matter how big the program is. returns NULL if the image isn't a valid x86-64 ELF executable
+process_t *elf_load( const void *image, size_t image_size ) {
+    if( 0 != ((size_t)image & (PAGE_SIZE - 1)) ) return NULL;
+    const elf_program_header_t *segments = get_program_headers( image, image_size );
+    if( NULL == segments ) return NULL;
+    const elf_header_t *header = image;
+
+    // check everything before creating the process, so there's nothing to undo. the entry point must be in an executable segment
+    bool has_entry = false;
+    for( size_t i = 0; i < header->program_header_count; i++ ) {
+        const elf_program_header_t *segment = &segments[i];
+        if( ELF_SEGMENT_LOAD != segment->type ) continue;
+        if( !is_valid_segment( segment, image_size ) ) return NULL;
+        if( (segment->flags & ELF_SEGMENT_FLAG_EXECUTE) && header->entry >= segment->virtual_address && header->entry < segment->virtual_address + segment->memory_size ) has_entry = true;
+    }
+    if( !has_entry ) return NULL;
+
+    process_t *process = process_create_empty( (void*)header->entry );
+    for( size_t i = 0; i < header->program_header_count; i++ ) {
+        const elf_program_header_t *segment = &segments[i];
+        if( ELF_SEGMENT_LOAD != segment->type ) continue;
+        size_t misalignment = segment->virtual_address & (PAGE_SIZE - 1), offset = segment->offset - misalignment;
+        size_t size = PAGE_ROUND_UP( misalignment + segment->memory_size ), source_size = misalignment + segment->file_size;
+        bool writable = segment->flags & ELF_SEGMENT_FLAG_WRITE;
+
+        // a read-only segment w/o bss can share its last partial page too (the rest of that page is just more of the image, like w/ other loaders)
+        if( !writable && segment->file_size == segment->memory_size && offset + size <= image_size ) source_size = size;
+        process_add_segment( process, (void*)(segment->virtual_address - misalignment), size, image + offset, source_size, writable );
+    }
+    return process;
+}
+
+// the data segment, which the benchmark resizes
+static elf_program_header_t *find_writable_segment( void *image, size_t image_size ) {
+    elf_program_header_t *segments = (elf_program_header_t*)get_program_headers( image, image_size );
+    for( size_t i = 0; NULL != segments && i < ((elf_header_t*)image)->program_header_count; i++ ) {
+        if( ELF_SEGMENT_LOAD == segments[i].type && (segments[i].flags & ELF_SEGMENT_FLAG_WRITE) ) return &segments[i];
+    }
+    panic( "elf: test program has no data segment\n" );
+    return NULL; // unreachable
+}
+
+// copies the 1st copy_size bytes of the test program into a page-aligned buffer of image_size bytes, & zeroes the rest
+static void *copy_test_program( size_t image_size, size_t copy_size ) {
+    void *image = kernel_heap_alloc_aligned( image_size, PAGE_SIZE );
+    buffer_clear_qwords( image, image_size / sizeof( uint64_t ) );
+    buffer_copy_qwords( image, (uint64_t*)elf_program_test, copy_size / sizeof( uint64_t ) );
+    return image;
+}
+
+// call after process_init
+void elf_run_tests() {
+    size_t image_size = elf_program_test_end - elf_program_test, free_pages = page_allocator_free_page_count();
+
+    // loading only reads the headers, so nothing is mapped until the program runs
+    process_t *a = elf_load( elf_program_test, image_size ), *b = elf_load( elf_program_test, image_size );
+    if( NULL == a || NULL == b ) panic( "elf_run_tests: couldn't load the test program\n" );
+    if( NULL != paging_get_physical_address( a->pagemap, a->entry ) ) panic( "elf_run_tests: loading mapped the program eagerly\n" );
+
+    // the program increments the counter in its data segment, adds the bss & the bytes after the data (which must be zero), & exits w/ 42
+    // the 2nd instance gets 42 as well, since the 1st instance's write went to its own copy of the data page
+    if( 42 != process_run( a ) ) panic( "elf_run_tests: test program returned the wrong exit code\n" );
+    if( 42 != process_run( b ) ) panic( "elf_run_tests: 2nd instance of the test program saw the 1st one's write\n" );
+
+    // both instances map their text straight from the image
+    void *text = paging_get_physical_address( a->pagemap, a->entry );
+    if( text != paging_get_physical_address( b->pagemap, b->entry ) || text < (void*)elf_program_test || text >= (void*)elf_program_test_end ) {
+        panic( "elf_run_tests: instances don't share the image's text\n" );
+    }
+    process_destroy( a );
+    process_destroy( b );
+    if( free_pages != page_allocator_free_page_count() ) panic( "elf_run_tests: destroying ELF processes leaked pages\n" );
+
+    // malformed images are rejected
+    uint8_t *image = copy_test_program( image_size, image_size );
+    image[0] = 0;
+    if( NULL != elf_load( image, image_size ) ) panic( "elf_run_tests: loaded an image w/o the ELF magic\n" );
+    buffer_copy_qwords( (uint64_t*)image, (uint64_t*)elf_program_test, 1 );
+    elf_program_header_t *data = find_writable_segment( image, image_size );
+    data->file_size = data->memory_size = image_size;
+    if( NULL != elf_load( image, image_size ) ) panic( "elf_run_tests: loaded a segment that runs past the end of the image\n" );
+    if( NULL != elf_load( image + 1, image_size - 1 ) ) panic( "elf_run_tests: loaded an unaligned image\n" );
+    kernel_heap_free( image );
+}
+
+#define BENCHMARK_ITERATIONS 20
+
+// loads & runs copies of the test program w/ 64 KB, 1 MB & 16 MB of initialized data (of which the program only touches the 1st page)
+// each result line is "elf_benchmark image_size=<bytes> load_cycles=<tsc cycles per load> run_cycles=<tsc cycles from start to exit>"
+void elf_run_benchmark() {
+    static const size_t data_sizes[] = { 0x10000, 0x100000, 0x1000000 };
+    for( size_t i = 0; i < sizeof( data_sizes ) / sizeof( data_sizes[0] ); i++ ) {
+        // the data is all zero after the test program's counter, which is what the program expects
+        size_t data_offset = find_writable_segment( elf_program_test, elf_program_test_end - elf_program_test )->offset;
+        size_t image_size = data_offset + data_sizes[i];
+        uint8_t *image = copy_test_program( image_size, data_offset + sizeof( uint64_t ) );
+        elf_program_header_t *data = find_writable_segment( image, image_size );
+        data->file_size = data_sizes[i];
+        if( data->memory_size < data->file_size ) data->memory_size = data->file_size;
+
+        uint64_t load_cycles = 0, run_cycles = 0;
+        for( size_t j = 0; j < BENCHMARK_ITERATIONS; j++ ) {
+            uint64_t start = cpu_read_timestamp();
+            process_t *process = elf_load( image, image_size );
+            uint64_t loaded = cpu_read_timestamp();
+            if( NULL == process || 42 != process_run( process ) ) panic( "elf_run_benchmark: test program failed\n" );
+            run_cycles+= cpu_read_timestamp() - loaded;
+            load_cycles+= loaded - start;
+            process_destroy( process );
+        }
+        kernel_heap_free( image );
+
+        vga_text_print_stat( "elf_benchmark image_size=", image_size );
+        vga_text_print_stat( " load_cycles=", load_cycles / BENCHMARK_ITERATIONS );
+        vga_text_print_stat( " run_cycles=", run_cycles / BENCHMARK_ITERATIONS );
+        vga_text_print( "\n", 0x17 );
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "process.h"
+
+// ELF64 executables, see https://refspecs.linuxfoundation.org/elf/gabi4+/ch4.eheader.html & ch5.pheader.html
+#define ELF_MAGIC 0x464C457F // "\x7FELF", as a little-endian uint32
+#define ELF_CLASS_64 2
+#define ELF_DATA_LITTLE_ENDIAN 1
+#define ELF_TYPE_EXECUTABLE 2
+#define ELF_MACHINE_X86_64 0x3E
+#define ELF_SEGMENT_LOAD 1 // PT_LOAD
+#define ELF_SEGMENT_FLAG_EXECUTE (1 << 0)
+#define ELF_SEGMENT_FLAG_WRITE (1 << 1)
+#define ELF_SEGMENT_FLAG_READ (1 << 2)
+
+typedef struct elf_header {
+    uint32_t magic;
+    uint8_t class, data, version, abi;
+    uint8_t padding[8];
+    uint16_t type, machine;
+    uint32_t version2;
+    uint64_t entry;
+    uint64_t program_header_offset, section_header_offset;
+    uint32_t flags;
+    uint16_t header_size;
+    uint16_t program_header_size, program_header_count;
+    uint16_t section_header_size, section_header_count, section_name_index;
+} __attribute__((packed)) elf_header_t;
+
+typedef struct elf_program_header {
+    uint32_t type, flags;
+    uint64_t offset;
+    uint64_t virtual_address, physical_address;
+    uint64_t file_size, memory_size;
+    uint64_t alignment;
+} __attribute__((packed)) elf_program_header_t;
+
+// built-in ELF programs (see elf_programs.asm)
+extern char elf_program_test[], elf_program_test_end[];
+
+process_t *elf_load( const void *image, size_t image_size );
+void elf_run_tests();
+void elf_run_benchmark();
@@ -0,0 +1,83 @@
+; tell linker to put this into the programs section, which holds whole ELF images (headers & all) for elf_load
+; each image is page-aligned, so processes can map its pages directly
+section .programs progbits alloc noexec nowrite align=4096
+
+; 64-bit code
+[BITS 64]
+
+; exports
+global elf_program_test
+global elf_program_test_end
+
+; must match syscall.h
+%define SYSCALL_EXIT 1
+
+; must match elf.h
+%define ELF_SEGMENT_LOAD 1
+%define ELF_SEGMENT_FLAG_EXECUTE (1 << 0)
+%define ELF_SEGMENT_FLAG_WRITE (1 << 1)
+%define ELF_SEGMENT_FLAG_READ (1 << 2)
+
+; where the test program's segments go (user addresses, see process.h)
+%define TEST_TEXT_ADDRESS 0x8000001000
+%define TEST_DATA_ADDRESS 0x8000200000
+%define TEST_DATA_MEMORY_SIZE 0x100000 ; 1 MB, of which all but the counter is bss
+
+; an ELF64 executable w/ a text segment & a data segment (1 initialized qword, then bss), laid out by hand
+; the program increments the counter (41, from the image), adds the qword right after it (which is past the segment's file data) &
+; the last qword of bss (both of which must be zero), then exits w/ the sum
+align 4096
+elf_program_test:
+    ; ELF header
+    db 0x7F, "ELF", 2, 1, 1, 0 ; magic, 64-bit, little-endian, version 1, System V ABI
+    times 8 db 0
+    dw 2 ; executable
+    dw 0x3E ; x86-64
+    dd 1 ; version 1
+    dq TEST_TEXT_ADDRESS ; entry point
+    dq .program_headers - elf_program_test ; program header offset
+    dq 0 ; no section headers
+    dd 0 ; flags
+    dw 64 ; ELF header size
+    dw 56 ; program header size
+    dw 2 ; program header count
+    dw 0, 0, 0 ; section header size, count & name index
+
+.program_headers:
+    ; text
+    dd ELF_SEGMENT_LOAD, ELF_SEGMENT_FLAG_READ | ELF_SEGMENT_FLAG_EXECUTE
+    dq .code - elf_program_test ; file offset
+    dq TEST_TEXT_ADDRESS, TEST_TEXT_ADDRESS ; virtual & physical address
+    dq .code_end - .code, .code_end - .code ; file & memory size
+    dq 0x1000 ; alignment
+
+    ; data
+    dd ELF_SEGMENT_LOAD, ELF_SEGMENT_FLAG_READ | ELF_SEGMENT_FLAG_WRITE
+    dq .counter - elf_program_test
+    dq TEST_DATA_ADDRESS, TEST_DATA_ADDRESS
+    dq .counter_end - .counter, TEST_DATA_MEMORY_SIZE
+    dq 0x1000
+
+align 4096
+.code:
+    mov rbx, TEST_DATA_ADDRESS
+    mov rdi, [rbx]
+    inc rdi
+    mov [rbx], rdi
+    add rdi, [rbx + 8]
+    mov rcx, TEST_DATA_ADDRESS + TEST_DATA_MEMORY_SIZE - 8
+    add rdi, [rcx]
+    mov qword [rcx], 1 ; bss is writable
+    mov rax, SYSCALL_EXIT
+    syscall
+    ud2 ; exit never returns
+.code_end:
+
+align 4096
+.counter:
+    dq 41 ; counter
+.counter_end:
+    dq 0xDEADBEEF ; in the image, but not in the segment's file data, so the program must see zero here
+
+align 4096
+elf_program_test_end:
@@ -0,0 +1,97 @@
+#include <stddef.h>
+#include "gdt.h"
+#include "cpu.h" // for per-CPU TSSes
+
+// the 64-bit TSS (task state segment) no longer holds any task state, but the CPU still reads it to find the stack to use when switching from ring 3 to ring 0
+typedef struct task_state_segment {
+    uint32_t reserved0;
+    uint64_t rsp[3]; // stack pointers for ring 0, 1 and 2
+    uint64_t reserved1;
+    uint64_t ist[7]; // interrupt stack table
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t io_map_base;
+} __attribute__((packed)) task_state_segment_t;
+
+typedef struct gdt_descriptor {
+    uint16_t gdt_size_minus_1;
+    uint64_t gdt_location;
+} __attribute__((packed)) gdt_descriptor_t;
+
+// segment descriptors, see https://wiki.osdev.org/Global_Descriptor_Table
+// in long mode, base & limit are ignored for code/data segments, so only the access byte & long-mode flag matter
+#define GDT_KERNEL_CODE 0x00209A0000000000 // present, ring 0, code (exec/read), long mode
+#define GDT_KERNEL_DATA 0x0000920000000000 // present, ring 0, data (read/write)
+#define GDT_USER_DATA 0x0000F20000000000 // present, ring 3, data (read/write)
+#define GDT_USER_CODE 0x0020FA0000000000 // present, ring 3, code (exec/read), long mode
+#define GDT_TASK_STATE_ACCESS 0x89 // present, ring 0, available 64-bit TSS
+#define GDT_LENGTH (5 + 2 * CPU_MAX_COUNT) // null, kernel code, kernel data, user data, user code, then a TSS per CPU (each takes up 2 entries)
+
+// every CPU needs its own TSS: each has its own ring 0 stack, and ltr marks a TSS busy, so it can't be loaded twice
+static task_state_segment_t task_state_segments[CPU_MAX_COUNT];
+static uint64_t gdt[GDT_LENGTH];
+static gdt_descriptor_t gdt_descriptor;
+
+static void set_task_state_descriptor( uint64_t *entry, task_state_segment_t *tss ) {
+    uint64_t base = (uint64_t)tss, limit = sizeof( task_state_segment_t ) - 1;
+    entry[0] = (limit & 0xFFFF) | ((base & 0xFFFFFF) << 16) | ((uint64_t)GDT_TASK_STATE_ACCESS << 40) | (((limit >> 16) & 0xF) << 48) | (((base >> 24) & 0xFF) << 56);
+    entry[1] = base >> 32;
+}
+
+static void load_gdt( gdt_descriptor_t *descriptor ) {
+    asm volatile( "lgdt %[descriptor]" :: [descriptor] "m" (*descriptor) );
+
+    // reload CS via a far return, then reload the data segment registers
+    asm volatile( "\
+        pushq %[code]           \n\t\
+        leaq 1f(%%rip), %%rax   \n\t\
+        pushq %%rax             \n\t\
+        lretq                   \n\t\
+        1:                      \n\t\
+        movw %[data], %%ax     \n\t\
+        movw %%ax, %%ds         \n\t\
+        movw %%ax, %%es         \n\t\
+        movw %%ax, %%fs         \n\t\
+        movw %%ax, %%gs         \n\t\
+        movw %%ax, %%ss         \n\t\
+    " :: [code] "i" (GDT_KERNEL_CODE_SELECTOR), [data] "i" (GDT_KERNEL_DATA_SELECTOR) : "rax", "memory" );
+}
+
+static void load_task_register( uint16_t selector ) {
+    asm volatile( "ltr %[selector]" :: [selector] "r" (selector) );
+}
+
+static uint16_t task_state_selector( size_t cpu_index ) {
+    return GDT_TASK_STATE_SELECTOR + cpu_index * 2 * sizeof( uint64_t );
+}
+
+// replaces the minimal GDT from start.asm w/ one that has ring 3 segments & a TSS per CPU
+void gdt_init() {
+    // build the table
+    gdt[0] = 0;
+    gdt[GDT_KERNEL_CODE_SELECTOR >> 3] = GDT_KERNEL_CODE;
+    gdt[GDT_KERNEL_DATA_SELECTOR >> 3] = GDT_KERNEL_DATA;
+    gdt[GDT_USER_DATA_SELECTOR >> 3] = GDT_USER_DATA;
+    gdt[GDT_USER_CODE_SELECTOR >> 3] = GDT_USER_CODE;
+    for( size_t i = 0; i < CPU_MAX_COUNT; i++ ) {
+        // no I/O permission bitmap: an offset past the TSS limit means ring 3 gets no port access
+        task_state_segments[i].io_map_base = sizeof( task_state_segment_t );
+        set_task_state_descriptor( &gdt[task_state_selector( i ) >> 3], &task_state_segments[i] );
+    }
+
+    // load it
+    gdt_descriptor.gdt_size_minus_1 = sizeof( gdt ) - 1;
+    gdt_descriptor.gdt_location = (uint64_t)&gdt;
+    gdt_init_ap( 0 );
+}
+
+// loads the (already built) GDT & the CPU's own TSS
+void gdt_init_ap( size_t cpu_index ) {
+    load_gdt( &gdt_descriptor );
+    load_task_register( task_state_selector( cpu_index ) );
+}
+
+// sets the stack the CPU switches to when an interrupt arrives while running in ring 3
+void gdt_set_kernel_stack( void *stack_top ) {
+    task_state_segments[cpu_get_index()].rsp[0] = (uint64_t)stack_top;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// segment selectors (note: the user selectors have their requested privilege level set to ring 3)
+// the user data segment must come right before the user code segment, b/c that's the order sysret expects
+#define GDT_KERNEL_CODE_SELECTOR 0x08
+#define GDT_KERNEL_DATA_SELECTOR 0x10
+#define GDT_USER_DATA_SELECTOR 0x1B
+#define GDT_USER_CODE_SELECTOR 0x23
+#define GDT_TASK_STATE_SELECTOR 0x28 // CPU 0's TSS, followed by the other CPUs' TSSes
+
+void gdt_init();
+void gdt_init_ap( size_t cpu_index );
+void gdt_set_kernel_stack( void *stack_top );
@@ -1,2 +1,252 @@
+#include <stdint.h>
 #include "process.h"
+#include "cpu.h"
+#include "gdt.h"
+#include "syscall.h"
+#include "../buffer/buffer.h"
+#include "../buffer/string.h" // for printing integers
+#include "../drivers/vga_text.h" // for printing
+#include "../interrupt/clock.h" // every process maps the clock page
+#include "../interrupt/interrupt_table.h"
+#include "../memory/kernel_heap.h"
+#include "../memory/page_allocator.h"
+#include "../memory/paging.h"
+#include "../main.h" // for panic
 
+#define PROCESS_KERNEL_STACK_SIZE 16384
+
+// defined in user_mode.asm
+extern int64_t process_enter_user_mode( void *entry, void *user_stack, uint64_t *saved_kernel_stack );
+extern void process_exit_user_mode( uint64_t saved_kernel_stack, int64_t exit_code );
+
+// test programs (see user_programs.asm)
+extern void user_program_test();
+extern void user_program_counter();
+extern void user_program_segfault();
+extern void user_program_fake_page_fault();
+
+// no scheduler yet, so a process runs to completion once it's started (but each CPU can be running its own process)
+static process_t *current_processes[CPU_MAX_COUNT];
+#define current_process current_processes[cpu_get_index()]
+
+static uint64_t exit_syscall_handler( uint64_t exit_code, uint64_t b, uint64_t c, uint64_t d, uint64_t e, uint64_t f ) {
+    process_exit_user_mode( current_process->saved_kernel_stack, (int64_t)exit_code );
+    return 0; // unreachable
+}
+
+static bool is_in_stack( void *address ) {
+    return (size_t)address < PROCESS_STACK_TOP && (size_t)address >= PROCESS_STACK_TOP - PROCESS_STACK_SIZE;
+}
+
+// maps the page of a lazy segment that contains address. returns false if address isn't in a segment
+static bool map_segment_page( process_t *process, void *address ) {
+    for( process_segment_t *segment = process->segments; NULL != segment; segment = segment->next ) {
+        if( address < segment->start || address >= segment->end ) continue;
+        void *page_address = (void*)((size_t)address & ~(size_t)(PAGE_SIZE - 1));
+        size_t offset = page_address - segment->start;
+
+        // whole source pages are mapped as they are: read-only ones are shared, & writable ones are copy-on-write
+        if( offset + PAGE_SIZE <= segment->source_size ) {
+            paging_map_page( process->pagemap, page_address, (void*)segment->source + offset, PAGE_FLAG_USER | (segment->writable ? PAGE_FLAG_COPY_ON_WRITE : 0) );
+            return true;
+        }
+
+        // otherwise the page gets a private copy of whatever part of the source it covers, and zeroes for the rest
+        uint8_t *page = page_allocator_alloc_zeroed();
+        if( offset < segment->source_size ) {
+            const uint8_t *source = segment->source + offset;
+            size_t size = segment->source_size - offset;
+            buffer_copy_qwords( (uint64_t*)page, (const uint64_t*)source, size / sizeof( uint64_t ) );
+            for( size_t i = size & ~(sizeof( uint64_t ) - 1); i < size; i++ ) page[i] = source[i];
+        }
+        paging_map_page( process->pagemap, page_address, page, PAGE_FLAG_USER | (segment->writable ? PAGE_FLAG_WRITE : 0) );
+        return true;
+    }
+    return false;
+}
+
+static void page_fault_handler( uint64_t interrupt, uint64_t error_code ) {
+    void *address = paging_get_fault_address();
+
+    // faults on user addresses are expected: pages are shared copy-on-write, segments are mapped lazily, and the stack is allocated on demand
+    // each of these can complete a 2 MB range, which then gets promoted to a huge page (the process only runs on this CPU, so that's safe)
+    if( NULL != current_process && (size_t)address >= PAGING_USER_START && (size_t)address < PAGING_USER_END ) {
+        bool handled = false;
+        if( (error_code & PAGE_FAULT_PRESENT) && (error_code & PAGE_FAULT_WRITE) ) {
+            handled = paging_handle_copy_on_write( current_process->pagemap, address );
+        } else if( !(error_code & PAGE_FAULT_PRESENT) ) {
+            handled = map_segment_page( current_process, address );
+        }
+        if( !handled && !(error_code & PAGE_FAULT_PRESENT) && is_in_stack( address ) ) {
+            void *page = page_allocator_alloc_zeroed();
+            paging_map_page( current_process->pagemap, address, page, PAGE_FLAG_USER | PAGE_FLAG_WRITE );
+            handled = true;
+        }
+        if( handled ) {
+            paging_promote_huge_page( current_process->pagemap, address );
+            return;
+        }
+    }
+
+    // anything else is an illegal access: kill the process if it came from ring 3
+    if( NULL != current_process && (error_code & PAGE_FAULT_USER) ) {
+        process_exit_user_mode( current_process->saved_kernel_stack, PROCESS_EXIT_CODE_SEGFAULT );
+    }
+
+    // or panic if it came from the kernel
+    vga_text_print( "page fault @ ", 0x4F );
+    vga_text_print( string_from_int64( (int64_t)address ), 0x4F );
+    vga_text_print( "\n", 0x4F );
+    panic( "page fault in kernel\n" );
+}
+
+// ring 3 can't run privileged instructions, or raise any interrupt but the syscall interrupt (see interrupt_table_allow_user), so a #GP
+// from ring 3 kills the process
+static void general_protection_handler( uint64_t interrupt, uint64_t error_code, uint64_t code_segment ) {
+    if( NULL != current_process && 3 == (code_segment & 3) ) {
+        process_exit_user_mode( current_process->saved_kernel_stack, PROCESS_EXIT_CODE_SEGFAULT );
+    }
+    panic( "general protection fault in kernel\n" );
+}
+
+static void test() {
+    // the test program makes a null syscall, then exits w/ its result + 42
+    process_t *process = process_create_builtin( user_program_test );
+    if( 42 != process_run( process ) ) panic( "process_init: test program returned the wrong exit code\n" );
+    process_destroy( process );
+
+    // the counter program increments a counter in its image & exits w/ the new value
+    // a clone sees the counter as it was when cloned, but after that, the two copies are independent
+    size_t free_pages = page_allocator_free_page_count();
+    process_t *parent = process_create_builtin( user_program_counter );
+    if( 1 != process_run( parent ) ) panic( "process_init: counter program returned the wrong exit code\n" );
+    process_t *child = process_clone( parent );
+    if( 2 != process_run( child ) ) panic( "process_init: cloned counter program didn't see the parent's counter\n" );
+    if( 2 != process_run( parent ) ) panic( "process_init: parent counter program saw the clone's write\n" );
+    process_destroy( child );
+    process_destroy( parent );
+    if( free_pages != page_allocator_free_page_count() ) panic( "process_init: destroying processes leaked pages\n" );
+
+    // the segfault program reads kernel memory, which kills it
+    process = process_create_builtin( user_program_segfault );
+    if( PROCESS_EXIT_CODE_SEGFAULT != process_run( process ) ) panic( "process_init: segfault program wasn't killed\n" );
+    process_destroy( process );
+
+    // raising the page fault interrupt w/ "int 14" kills it too (it must never reach the page fault handler, which expects an error code)
+    process = process_create_builtin( user_program_fake_page_fault );
+    if( PROCESS_EXIT_CODE_SEGFAULT != process_run( process ) ) panic( "process_init: fake page fault program wasn't killed\n" );
+    process_destroy( process );
+}
+
+void process_init() {
+    interrupt_table_set_handler( INTERRUPT_INDEX_PAGE_FAULT, (interrupt_handler*)page_fault_handler );
+    interrupt_table_set_handler( INTERRUPT_INDEX_GENERAL_PROTECTION, (interrupt_handler*)general_protection_handler );
+
+    // register process syscalls
+    syscall_set_handler( SYSCALL_EXIT, exit_syscall_handler );
+
+    // run self-tests
+    test();
+}
+
+// every process can read the clock page (but not write it), so reading the time doesn't take a syscall
+static pagemap_t *create_pagemap() {
+    pagemap_t *pagemap = paging_create_pagemap();
+    paging_map_page( pagemap, (void*)PROCESS_CLOCK_ADDRESS, clock_get_page(), PAGE_FLAG_USER );
+    return pagemap;
+}
+
+static process_t *alloc_process( pagemap_t *pagemap, void *entry ) {
+    process_t *process = kernel_heap_alloc( sizeof( process_t ) );
+    kernel_heap_tag( process, KERNEL_HEAP_TAG_PROCESS );
+    process->pagemap = pagemap;
+    process->entry = entry;
+    process->user_stack = (void*)PROCESS_STACK_TOP;
+
+    // the stack must be 16-byte aligned
+    process->kernel_stack_bottom = kernel_heap_alloc_aligned( PROCESS_KERNEL_STACK_SIZE, 16 );
+    kernel_heap_tag( process->kernel_stack_bottom, KERNEL_HEAP_TAG_PROCESS );
+    process->kernel_stack = process->kernel_stack_bottom + PROCESS_KERNEL_STACK_SIZE;
+    process->saved_kernel_stack = 0;
+    process->exit_code = 0;
+    process->segments = NULL;
+    return process;
+}
+
+// image must be page-aligned. it's mapped copy-on-write, so processes share its pages until they write to them
+process_t *process_create( void *image, size_t image_size, void *entry ) {
+    pagemap_t *pagemap = create_pagemap();
+    for( size_t offset = 0; offset < image_size; offset+= PAGE_SIZE ) {
+        paging_map_page( pagemap, (void*)PROCESS_IMAGE_ADDRESS + offset, image + offset, PAGE_FLAG_USER | PAGE_FLAG_COPY_ON_WRITE );
+    }
+    return alloc_process( pagemap, (void*)PROCESS_IMAGE_ADDRESS + (entry - image) );
+}
+
+// a process running 1 of the built-in user programs (they share the .user image), starting at its label in user_programs.asm
+process_t *process_create_builtin( void *entry ) {
+    return process_create( user_start, user_end - user_start, entry );
+}
+
+// a process w/ nothing mapped, for loaders to fill in w/ segments
+process_t *process_create_empty( void *entry ) {
+    return alloc_process( create_pagemap(), entry );
+}
+
+// start & size must be page-aligned, as must source (which has to stay valid until every process that maps it is destroyed)
+// nothing gets mapped until the process touches it, so this costs the same no matter how big the segment is
+void process_add_segment( process_t *process, void *start, size_t size, const void *source, size_t source_size, bool writable ) {
+    process_segment_t *segment = kernel_heap_alloc( sizeof( process_segment_t ) );
+    kernel_heap_tag( segment, KERNEL_HEAP_TAG_PROCESS );
+    segment->start = start;
+    segment->end = start + size;
+    segment->source = source;
+    segment->source_size = source_size;
+    segment->writable = writable;
+    segment->next = process->segments;
+    process->segments = segment;
+}
+
+// the clone starts again from the entry point, w/ a copy-on-write copy of the original's memory
+// (pages that the original hasn't touched yet are still in its segments, which the clone gets too)
+process_t *process_clone( process_t *process ) {
+    process_t *clone = alloc_process( paging_clone_pagemap( process->pagemap ), process->entry );
+    for( process_segment_t *segment = process->segments; NULL != segment; segment = segment->next ) {
+        process_add_segment( clone, segment->start, segment->end - segment->start, segment->source, segment->source_size, segment->writable );
+    }
+    return clone;
+}
+
+void process_destroy( process_t *process ) {
+    while( NULL != process->segments ) {
+        process_segment_t *next = process->segments->next;
+        kernel_heap_free( process->segments );
+        process->segments = next;
+    }
+    paging_destroy_pagemap( process->pagemap );
+    kernel_heap_free( process->kernel_stack_bottom );
+    kernel_heap_free( process );
+}
+
+int64_t process_run( process_t *process ) {
+    // interrupts (via the TSS) & syscalls (via syscall_entry) arriving from ring 3 both switch to the process's kernel stack
+    gdt_set_kernel_stack( process->kernel_stack );
+    syscall_set_kernel_stack( process->kernel_stack );
+
+    // drop to ring 3 in the process's address space, and come back here when the process exits
+    current_process = process;
+    paging_switch_pagemap( process->pagemap );
+    process->exit_code = process_enter_user_mode( process->entry, process->user_stack, &process->saved_kernel_stack );
+    paging_switch_pagemap( paging_get_kernel_pagemap() );
+    current_process = NULL;
+    return process->exit_code;
+}
+
+// the process running on this CPU (NULL if we're not running one)
+process_t *process_get_current() {
+    return current_process;
+}
+
+// returns a kernel pointer to the process's copy of something in its image (which may be a private copy, if the process wrote to it)
+void *process_get_image_data( process_t *process, void *image_address ) {
+    return paging_get_physical_address( process->pagemap, (void*)PROCESS_IMAGE_ADDRESS + (image_address - (void*)user_start) );
+}
@@ -1,8 +1,50 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "../memory/paging.h"
+
+// user address space layout
+#define PROCESS_IMAGE_ADDRESS PAGING_USER_START // where the program image is mapped
+#define PROCESS_CHANNEL_ADDRESS (PAGING_USER_START + 0x40000000) // where an IPC channel gets mapped (1 GB above the image)
+#define PROCESS_CLOCK_ADDRESS (PAGING_USER_START + 0x80000000) // where the read-only clock page is mapped (see clock.h)
+#define PROCESS_STACK_TOP (PAGING_USER_END - PAGE_SIZE) // leave an unmapped guard page at the very top
+#define PROCESS_STACK_SIZE 0x100000 // 1 MB, which is allocated on demand as the stack grows
+#define PROCESS_EXIT_CODE_SEGFAULT -1 // exit code for processes that are killed by an illegal memory access
+
+// the .user section of the kernel image, which holds the built-in user programs (see linker.ld & user_programs.asm)
+extern char user_start[], user_end[];
+
+// a lazily mapped region of user memory: each page gets mapped on its 1st fault, from the source if the page lies within source_size,
+// or else zero-filled. whole source pages are mapped directly (shared by every process w/ the same source, & copy-on-write if writable)
+typedef struct process_segment {
+    void *start, *end; // page-aligned user addresses
+    const void *source; // page-aligned kernel address of the data at start (e.g. inside a program image)
+    size_t source_size; // bytes of data from the source (the rest of the segment is zero-filled)
+    bool writable;
+    struct process_segment *next;
+} process_segment_t;
+
 typedef struct process {
-    // TODO: pointer to process code
-    // TODO: pointer to static memory
-    // TODO: pointer to process stack
+    pagemap_t *pagemap;
+    void *entry; // ring 3 address where the process starts executing
+    void *user_stack; // top of the process's ring 3 stack
+    void *kernel_stack; // top of the ring 0 stack used for interrupts & syscalls while the process runs
+    void *kernel_stack_bottom; // so we can free the kernel stack
+    uint64_t saved_kernel_stack; // kernel context to return to when the process exits
+    int64_t exit_code;
+    process_segment_t *segments; // lazily mapped memory (see process_add_segment)
     // TODO: keyboard buffer
 } process_t;
+
+void process_init();
+process_t *process_create( void *image, size_t image_size, void *entry );
+process_t *process_create_builtin( void *entry );
+process_t *process_create_empty( void *entry );
+void process_add_segment( process_t *process, void *start, size_t size, const void *source, size_t source_size, bool writable );
+process_t *process_clone( process_t *process );
+void process_destroy( process_t *process );
+int64_t process_run( process_t *process );
+process_t *process_get_current();
+void *process_get_image_data( process_t *process, void *image_address );
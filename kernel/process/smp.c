@@ -0,0 +1,97 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "smp.h"
+#include "apic.h"
+#include "cpu.h"
+#include "gdt.h"
+#include "syscall.h"
+#include "task_pool.h"
+#include "../buffer/string.h" // for printing
+#include "../drivers/vga_text.h" // "
+#include "../drivers/acpi.h" // for the # of CPUs
+#include "../interrupt/interrupt_table.h"
+#include "../interrupt/timer.h"
+#include "../memory/kernel_heap.h"
+#include "../memory/paging.h"
+#include "../main.h" // for panic
+
+#define SMP_TRAMPOLINE_ADDRESS 0x8000 // must match smp_trampoline.asm (this page is free once the boot sector is done w/ it)
+#define SMP_AP_STACK_SIZE 0x4000 // 16 KB
+#define SMP_STARTUP_TIMEOUT_MICROSECONDS 1000000 // how long to wait for the CPUs in the MADT
+
+extern char smp_trampoline_start[], smp_trampoline_end[];
+extern char smp_trampoline_cr3[], smp_trampoline_entry[], smp_trampoline_stacks[], smp_trampoline_next_index[], smp_trampoline_max_index[];
+
+static uint64_t ap_stack_tops[CPU_MAX_COUNT];
+
+// the trampoline's variables live in the copy, not in the original
+static void *trampoline_variable( char *variable ) {
+    return (void*)(SMP_TRAMPOLINE_ADDRESS + (variable - smp_trampoline_start));
+}
+
+// application processors arrive here from the trampoline, running on the kernel pagemap, w/ interrupts disabled
+static void ap_main( uint32_t index ) {
+    cpu_register( index );
+    gdt_init_ap( index );
+    interrupt_table_init_ap();
+    paging_init_ap();
+    cpu_enable_sse();
+    apic_init_ap();
+    syscall_init_ap();
+    interrupt_table_restore_interrupts( true );
+    timer_init_ap();
+    cpu_set_online( index );
+    task_pool_run_worker();
+}
+
+// call after apic_init & timer_init (we use the timer to time the startup sequence)
+void smp_init() {
+    cpu_register( 0 );
+    task_pool_init();
+
+    // every AP gets a stack up front, since we don't know how many there are until they show up
+    for( size_t i = 1; i < CPU_MAX_COUNT; i++ ) {
+        void *stack = kernel_heap_alloc_aligned( SMP_AP_STACK_SIZE, 16 );
+        kernel_heap_tag( stack, KERNEL_HEAP_TAG_CPU );
+        ap_stack_tops[i] = (uint64_t)stack + SMP_AP_STACK_SIZE;
+    }
+
+    // install the trampoline
+    char *trampoline = (char*)SMP_TRAMPOLINE_ADDRESS;
+    for( size_t i = 0; i < smp_trampoline_end - smp_trampoline_start; i++ ) trampoline[i] = smp_trampoline_start[i];
+    *(uint64_t*)trampoline_variable( smp_trampoline_cr3 ) = (uint64_t)paging_get_kernel_pagemap()->pml4;
+    *(uint64_t*)trampoline_variable( smp_trampoline_entry ) = (uint64_t)ap_main;
+    *(uint64_t*)trampoline_variable( smp_trampoline_stacks ) = (uint64_t)ap_stack_tops;
+    *(uint32_t*)trampoline_variable( smp_trampoline_next_index ) = 1;
+    *(uint32_t*)trampoline_variable( smp_trampoline_max_index ) = CPU_MAX_COUNT;
+
+    // INIT-SIPI-SIPI (CPUs that already started ignore the 2nd SIPI)
+    apic_broadcast_init();
+    timer_delay_microseconds( 10000 );
+    apic_broadcast_startup( SMP_TRAMPOLINE_ADDRESS );
+    timer_delay_microseconds( 200 );
+    apic_broadcast_startup( SMP_TRAMPOLINE_ADDRESS );
+
+    // the MADT tells us how many CPUs to expect, so we can stop as soon as they're all online
+    size_t expected = acpi_get_cpu_count() < CPU_MAX_COUNT ? acpi_get_cpu_count() : CPU_MAX_COUNT;
+    uint64_t deadline = timer_now() + timer_get_frequency() * SMP_STARTUP_TIMEOUT_MICROSECONDS / 1000000;
+    while( 0 != expected && cpu_get_count() < expected && timer_now() < deadline ) cpu_pause();
+
+    // w/o ACPI (or if some of them didn't make it), we don't know how many CPUs to expect, so we wait until every CPU that took an
+    // index is online, & no more show up
+    if( cpu_get_count() < expected || 0 == expected ) {
+        volatile uint32_t *next_index = trampoline_variable( smp_trampoline_next_index );
+        size_t arrived;
+        do {
+            arrived = *next_index;
+            timer_delay_microseconds( 50000 );
+        } while( arrived != *next_index || cpu_get_count() < (arrived < CPU_MAX_COUNT ? arrived : CPU_MAX_COUNT) );
+    }
+
+    // free the stacks that nobody took
+    for( size_t i = cpu_get_count(); i < CPU_MAX_COUNT; i++ ) kernel_heap_free( (void*)(ap_stack_tops[i] - SMP_AP_STACK_SIZE) );
+
+    vga_text_print( "smp: ", 0x17 );
+    vga_text_print( string_from_int64( (int64_t)cpu_get_count() ), 0x17 );
+    vga_text_print( " CPUs online\n", 0x17 );
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+// starts the application processors, which then run task pool workers (see task_pool.c)
+void smp_init();
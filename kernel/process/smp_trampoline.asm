@@ -0,0 +1,99 @@
+; application processors (APs) start here, in real mode, after the bootstrap processor sends them a startup IPI (see smp.c)
+; smp_init copies this code to SMP_TRAMPOLINE_ADDRESS (below 1 MB, b/c the startup IPI only carries a page #) & fills in the
+; variables at the end. every AP then goes real mode -> protected mode -> long mode, takes a CPU index & a stack, and calls
+; the entry point w/ its index as the only argument
+; it's position-dependent, so every absolute address is computed relative to where the copy will live
+
+section .asm
+
+%define SMP_TRAMPOLINE_ADDRESS 0x8000 ; must match smp.c
+%define TRAMPOLINE_ADDRESS_OF(label) (SMP_TRAMPOLINE_ADDRESS + (label - smp_trampoline_start))
+%define CODE32_SEG 0x08
+%define DATA32_SEG 0x10
+%define CODE64_SEG 0x18
+%define EFER_MSR 0xC0000080
+%define EFER_LONG_MODE_ENABLE (1 << 8)
+%define CR0_PROTECTION_ENABLE (1 << 0)
+%define CR0_PAGING (1 << 31)
+%define CR4_PAE (1 << 5)
+%define CR4_PGE (1 << 7)
+
+global smp_trampoline_start
+global smp_trampoline_end
+global smp_trampoline_cr3
+global smp_trampoline_entry
+global smp_trampoline_stacks
+global smp_trampoline_next_index
+global smp_trampoline_max_index
+
+ALIGN 16
+[BITS 16]
+smp_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    lgdt [TRAMPOLINE_ADDRESS_OF(trampoline_gdt_pointer)]
+    mov eax, cr0
+    or eax, CR0_PROTECTION_ENABLE
+    mov cr0, eax
+    jmp dword CODE32_SEG:TRAMPOLINE_ADDRESS_OF(trampoline32)
+
+[BITS 32]
+trampoline32:
+    mov ax, DATA32_SEG
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    ; same sequence as start.asm's enter_long_mode, but straight onto the kernel's pagemap
+    mov eax, cr4
+    or eax, CR4_PAE | CR4_PGE
+    mov cr4, eax
+    mov eax, [TRAMPOLINE_ADDRESS_OF(smp_trampoline_cr3)]
+    mov cr3, eax
+    mov ecx, EFER_MSR
+    rdmsr
+    or eax, EFER_LONG_MODE_ENABLE
+    wrmsr
+    mov eax, cr0
+    or eax, CR0_PAGING | CR0_PROTECTION_ENABLE
+    mov cr0, eax
+    jmp CODE64_SEG:TRAMPOLINE_ADDRESS_OF(trampoline64)
+
+[BITS 64]
+trampoline64:
+    ; APs all arrive at once, so each atomically takes the next index, which also picks its stack
+    mov eax, 1
+    lock xadd [TRAMPOLINE_ADDRESS_OF(smp_trampoline_next_index)], eax
+    cmp eax, [TRAMPOLINE_ADDRESS_OF(smp_trampoline_max_index)]
+    jae .halt ; more CPUs than we have room for
+    mov rsp, [TRAMPOLINE_ADDRESS_OF(smp_trampoline_stacks)]
+    mov rsp, [rsp + rax * 8]
+    mov edi, eax ; CPU index as 1st arg
+    mov rax, [TRAMPOLINE_ADDRESS_OF(smp_trampoline_entry)]
+    call rax ; doesn't return
+.halt:
+    cli
+    hlt
+    jmp .halt
+
+; flat 32-bit segments to get through protected mode, plus a 64-bit code segment (the entry point loads the kernel's real GDT)
+ALIGN 8
+trampoline_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF ; 32-bit code, base 0, limit 4 GB
+    dq 0x00CF92000000FFFF ; 32-bit data, base 0, limit 4 GB
+    dq 0x00209A0000000000 ; 64-bit code
+trampoline_gdt_pointer:
+    dw trampoline_gdt_pointer - trampoline_gdt - 1
+    dd TRAMPOLINE_ADDRESS_OF(trampoline_gdt)
+
+; filled in by smp_init
+ALIGN 8
+smp_trampoline_cr3: dq 0 ; kernel pagemap (must be below 4 GB, since it's loaded from 32-bit code)
+smp_trampoline_entry: dq 0 ; void entry( uint32_t cpu_index )
+smp_trampoline_stacks: dq 0 ; array of stack tops, indexed by CPU index
+smp_trampoline_next_index: dd 0
+smp_trampoline_max_index: dd 0
+smp_trampoline_end:
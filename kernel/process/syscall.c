@@ -0,0 +1,96 @@
+#include <stdint.h>
+#include "cpu.h"
+#include "gdt.h"
+#include "process.h"
+#include "syscall.h"
+#include "../interrupt/interrupt_table.h"
+#include "../buffer/string.h" // for printing integers
+#include "../drivers/vga_text.h" // for printing
+#include "../main.h" // for panic
+
+#define RFLAGS_TRAP (1 << 8)
+#define RFLAGS_INTERRUPT_ENABLE (1 << 9)
+#define RFLAGS_DIRECTION (1 << 10)
+#define RFLAGS_ALIGNMENT_CHECK (1 << 18)
+#define SYSCALL_BENCHMARK_ITERATIONS 100000 // must match user_programs.asm
+
+// per-CPU state for syscall_entry.asm, which finds it via swapgs (so processes can make syscalls on several CPUs at once)
+// the layout must match syscall_entry.asm
+typedef struct syscall_cpu {
+    void *kernel_stack; // stack that syscall_entry switches to
+    uint64_t user_stack; // scratch space for the user's stack pointer while syscall_entry switches stacks
+} syscall_cpu_t;
+
+// used by syscall_entry.asm
+syscall_handler *syscall_handlers[SYSCALL_TABLE_LENGTH];
+static syscall_cpu_t syscall_cpus[CPU_MAX_COUNT];
+extern void syscall_entry();
+
+// user programs for the benchmark (see user_programs.asm)
+extern void user_program_syscall_benchmark();
+extern uint64_t user_syscall_benchmark_results[2];
+
+static uint64_t invalid_syscall_handler( uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e, uint64_t f ) {
+    return (uint64_t)-1;
+}
+
+static uint64_t null_syscall_handler( uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e, uint64_t f ) {
+    return 0;
+}
+
+static void syscall_interrupt_handler( uint64_t interrupt ) {
+    syscall_handlers[SYSCALL_NULL]( 0, 0, 0, 0, 0, 0 );
+}
+
+void syscall_init() {
+    // unused syscall numbers return -1
+    for( size_t i = 0; i < SYSCALL_TABLE_LENGTH; i++ ) syscall_set_handler( i, invalid_syscall_handler );
+    syscall_set_handler( SYSCALL_NULL, null_syscall_handler );
+    interrupt_table_set_handler( SYSCALL_INTERRUPT, (interrupt_handler*)syscall_interrupt_handler );
+    interrupt_table_allow_user( SYSCALL_INTERRUPT );
+    syscall_init_ap();
+}
+
+// the syscall MSRs are per-CPU, so each CPU has to set them
+void syscall_init_ap() {
+    // syscall loads CS = STAR[47:32] & SS = STAR[47:32] + 8
+    // sysret loads SS = STAR[63:48] + 8 & CS = STAR[63:48] + 16 (w/ the privilege level forced to ring 3)
+    uint64_t star = ((uint64_t)(GDT_USER_DATA_SELECTOR - 8) << 48) | ((uint64_t)GDT_KERNEL_CODE_SELECTOR << 32);
+    cpu_write_msr( CPU_MSR_STAR, star );
+    cpu_write_msr( CPU_MSR_LSTAR, (uint64_t)syscall_entry );
+
+    // enter the kernel w/ interrupts disabled (at least until syscall_entry has switched stacks), and w/ a clean direction flag
+    cpu_write_msr( CPU_MSR_FMASK, RFLAGS_TRAP | RFLAGS_INTERRUPT_ENABLE | RFLAGS_DIRECTION | RFLAGS_ALIGNMENT_CHECK );
+
+    // swapgs in syscall_entry swaps this in as the gs base
+    cpu_write_msr( CPU_MSR_KERNEL_GS_BASE, (uint64_t)&syscall_cpus[cpu_get_index()] );
+
+    // enable the syscall & sysret instructions
+    cpu_write_msr( CPU_MSR_EFER, cpu_read_msr( CPU_MSR_EFER ) | CPU_EFER_SYSCALL_ENABLE );
+}
+
+void syscall_set_handler( size_t i, syscall_handler *handler ) {
+    if( i >= SYSCALL_TABLE_LENGTH ) panic( "syscall_set_handler: invalid syscall number\n" );
+    syscall_handlers[i] = handler;
+}
+
+// sets the stack for syscalls on this CPU
+void syscall_set_kernel_stack( void *stack_top ) {
+    syscall_cpus[cpu_get_index()].kernel_stack = stack_top;
+}
+
+static void print_cycles_per_call( const char *name, uint64_t cycles ) {
+    vga_text_print( name, 0x17 );
+    vga_text_print( string_from_int64( (int64_t)cycles ), 0x17 );
+    vga_text_print( " cycles\n", 0x17 );
+}
+
+// the benchmark runs in ring 3, and times SYSCALL_BENCHMARK_ITERATIONS null syscalls w/ each mechanism (see user_programs.asm)
+void syscall_run_benchmark() {
+    process_t *process = process_create_builtin( user_program_syscall_benchmark );
+    if( 0 != process_run( process ) ) panic( "syscall_run_benchmark: benchmark process failed\n" );
+    uint64_t *results = process_get_image_data( process, user_syscall_benchmark_results );
+    print_cycles_per_call( "syscall/sysret round trip: ", results[0] / SYSCALL_BENCHMARK_ITERATIONS );
+    print_cycles_per_call( "int/iretq round trip: ", results[1] / SYSCALL_BENCHMARK_ITERATIONS );
+    process_destroy( process );
+}
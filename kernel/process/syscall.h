@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// system call numbers
+#define SYSCALL_NULL 0 // does nothing (useful for measuring syscall overhead)
+#define SYSCALL_EXIT 1 // terminates the calling process, rdi = exit code
+#define SYSCALL_CHANNEL_WAIT 2 // sleeps until the other end of a channel notifies us, rdi = channel id (see channel.h)
+#define SYSCALL_CHANNEL_NOTIFY 3 // wakes the other end of a channel, rdi = channel id
+#define SYSCALL_FUTEX_WAIT 4 // sleeps if the 32-bit word at rdi equals esi (see futex.h)
+#define SYSCALL_FUTEX_WAKE 5 // wakes up to rsi waiters on the word at rdi
+#define SYSCALL_CLOCK_GETTIME 6 // returns clock rdi's time in nanoseconds (see clock.h, though reading the clock page is much faster)
+
+// system calls enter via the syscall instruction: rax holds the syscall number, and rdi, rsi, rdx, r10, r8, r9 hold up to 6 arguments
+// the result is returned in rax. rcx & r11 are clobbered by the CPU, and the other caller-saved registers are clobbered by the C handler
+#define SYSCALL_TABLE_LENGTH 64
+typedef uint64_t (syscall_handler)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
+extern syscall_handler *syscall_handlers[SYSCALL_TABLE_LENGTH];
+
+// the same null syscall, but through the regular interrupt wrappers (only used as a baseline for benchmarking)
+#define SYSCALL_INTERRUPT 0x80
+
+void syscall_init();
+void syscall_init_ap();
+void syscall_set_handler( size_t i, syscall_handler *handler );
+void syscall_set_kernel_stack( void *stack_top );
+void syscall_run_benchmark();
@@ -0,0 +1,52 @@
+; tell linker to put this into the assembly section
+section .asm
+
+; 64-bit code
+[BITS 64]
+
+; imports
+extern syscall_handlers
+
+; exports
+global syscall_entry
+
+; must match syscall.h
+%define SYSCALL_TABLE_LENGTH 64
+
+; must match syscall_cpu_t in syscall.c
+%define SYSCALL_CPU_KERNEL_STACK 0
+%define SYSCALL_CPU_USER_STACK 8
+
+; the CPU jumps here (via the LSTAR MSR) when ring 3 executes 'syscall'
+; on entry: rcx = user return address, r11 = user rflags, rax = syscall number, rdi/rsi/rdx/r10/r8/r9 = arguments
+; interrupts are disabled (via the FMASK MSR), and we're still on the user's stack
+syscall_entry:
+    ; switch to this CPU's kernel stack (swapgs makes gs point at this CPU's syscall_cpu_t), saving the user's stack pointer, return address & flags on it
+    swapgs
+    mov [gs:SYSCALL_CPU_USER_STACK], rsp
+    mov rsp, [gs:SYSCALL_CPU_KERNEL_STACK]
+    push qword [gs:SYSCALL_CPU_USER_STACK]
+    swapgs
+    push rcx
+    push r11
+    sub rsp, 8 ; keep the stack 16-byte aligned for the C handler
+
+    ; bounds-check the syscall number
+    cmp rax, SYSCALL_TABLE_LENGTH
+    jae .invalid
+
+    ; 4th argument goes in rcx for C, but syscall uses rcx for the return address, so it arrives in r10 instead
+    mov rcx, r10
+    call [syscall_handlers + rax * 8]
+
+.return:
+    ; restore the user's flags, return address & stack, then return to ring 3 (rax holds the result)
+    add rsp, 8
+    pop r11
+    pop rcx
+    pop rsp
+    o64 sysret
+
+.invalid:
+    mov rax, -1
+    jmp .return
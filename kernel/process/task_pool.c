@@ -0,0 +1,267 @@
+#include <stdint.h>
+#include "task_pool.h"
+#include "apic.h"
+#include "cpu.h"
+#include "../buffer/buffer.h" // for the benchmark
+#include "../buffer/string.h" // for printing
+#include "../drivers/vga_text.h" // "
+#include "../interrupt/interrupt_table.h"
+#include "../interrupt/timer.h" // for tickless idle
+#include "../memory/kernel_heap.h"
+#include "../sync/rcu.h" // idle CPUs are quiescent
+#include "../main.h" // for panic
+
+#define DEQUE_CAPACITY 1024 // must be a power of 2
+
+// Chase-Lev deque, w/ the memory orderings from "Correct and Efficient Work-Stealing for Weak Memory Models" (Le et al., 2013)
+// top & bottom get their own cache lines, since thieves hammer top while the owner works at the bottom
+typedef struct deque {
+    volatile int64_t top __attribute__((aligned(64)));
+    volatile int64_t bottom __attribute__((aligned(64)));
+    task_t *volatile tasks[DEQUE_CAPACITY];
+} deque_t;
+
+static deque_t deques[CPU_MAX_COUNT];
+static volatile bool sleeping[CPU_MAX_COUNT];
+static volatile size_t sleeping_count;
+static volatile size_t worker_limit = CPU_MAX_COUNT; // CPUs w/ an index >= this don't take tasks (for measuring scaling)
+
+// owner only. returns false if the deque is full
+static bool push( deque_t *deque, task_t *task ) {
+    int64_t bottom = __atomic_load_n( &deque->bottom, __ATOMIC_RELAXED ), top = __atomic_load_n( &deque->top, __ATOMIC_ACQUIRE );
+    if( bottom - top >= DEQUE_CAPACITY ) return false;
+    __atomic_store_n( &deque->tasks[bottom & (DEQUE_CAPACITY - 1)], task, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    __atomic_store_n( &deque->bottom, bottom + 1, __ATOMIC_RELAXED );
+    return true;
+}
+
+// owner only. pops the newest task, racing thieves for the last one
+static task_t *take( deque_t *deque ) {
+    int64_t bottom = __atomic_load_n( &deque->bottom, __ATOMIC_RELAXED ) - 1;
+    __atomic_store_n( &deque->bottom, bottom, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    int64_t top = __atomic_load_n( &deque->top, __ATOMIC_RELAXED );
+    if( top > bottom ) {
+        __atomic_store_n( &deque->bottom, bottom + 1, __ATOMIC_RELAXED ); // empty
+        return NULL;
+    }
+    task_t *task = __atomic_load_n( &deque->tasks[bottom & (DEQUE_CAPACITY - 1)], __ATOMIC_RELAXED );
+    if( top == bottom ) {
+        if( !__atomic_compare_exchange_n( &deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED ) ) task = NULL; // a thief won
+        __atomic_store_n( &deque->bottom, bottom + 1, __ATOMIC_RELAXED );
+    }
+    return task;
+}
+
+// any CPU. takes the oldest task, or returns NULL if the deque is empty or we lost a race
+static task_t *steal( deque_t *deque ) {
+    int64_t top = __atomic_load_n( &deque->top, __ATOMIC_ACQUIRE );
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    int64_t bottom = __atomic_load_n( &deque->bottom, __ATOMIC_ACQUIRE );
+    if( top >= bottom ) return NULL;
+    task_t *task = __atomic_load_n( &deque->tasks[top & (DEQUE_CAPACITY - 1)], __ATOMIC_RELAXED );
+    if( !__atomic_compare_exchange_n( &deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED ) ) return NULL;
+    return task;
+}
+
+static bool is_empty( deque_t *deque ) {
+    return __atomic_load_n( &deque->top, __ATOMIC_ACQUIRE ) >= __atomic_load_n( &deque->bottom, __ATOMIC_ACQUIRE );
+}
+
+static void run( task_t *task ) {
+    task->function( task->argument );
+    __atomic_store_n( &task->done, true, __ATOMIC_RELEASE );
+}
+
+// runs 1 task: our own newest, or else another CPU's oldest. returns false if there was nothing to do
+static bool run_one( size_t self ) {
+    task_t *task = take( &deques[self] );
+    for( size_t i = 1; NULL == task && i < CPU_MAX_COUNT; i++ ) {
+        size_t victim = (self + i) % CPU_MAX_COUNT;
+        if( cpu_is_online( victim ) ) task = steal( &deques[victim] );
+    }
+    if( NULL == task ) return false;
+    run( task );
+    return true;
+}
+
+static bool any_work() {
+    for( size_t i = 0; i < CPU_MAX_COUNT; i++ ) {
+        if( !is_empty( &deques[i] ) ) return true;
+    }
+    return false;
+}
+
+static void wakeup_handler( uint64_t interrupt ) {
+    apic_send_eoi();
+}
+
+// wakes 1 halted CPU (more get woken as more tasks get spawned)
+static void wake_one() {
+    if( 0 == __atomic_load_n( &sleeping_count, __ATOMIC_SEQ_CST ) ) return;
+    for( size_t i = 0; i < worker_limit && i < CPU_MAX_COUNT; i++ ) {
+        if( __atomic_load_n( &sleeping[i], __ATOMIC_SEQ_CST ) ) {
+            apic_send_ipi( cpu_get_apic_id( i ), INTERRUPT_INDEX_WAKEUP );
+            return;
+        }
+    }
+}
+
+void task_pool_init() {
+    interrupt_table_set_handler( INTERRUPT_INDEX_WAKEUP, (interrupt_handler*)wakeup_handler );
+}
+
+// if the deque is full, the task just runs right away
+void task_pool_spawn( task_t *task, task_function *function, void *argument ) {
+    task->function = function;
+    task->argument = argument;
+    task->done = false;
+    if( !push( &deques[cpu_get_index()], task ) ) {
+        run( task );
+        return;
+    }
+
+    // the push must be visible before we check for sleepers (the sleeper does the mirror image: flag, fence, check for work)
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    wake_one();
+}
+
+// rather than wait idly, we run other tasks (starting w/ our own, which is most likely the task we're waiting for)
+void task_pool_join( task_t *task ) {
+    size_t self = cpu_get_index();
+    while( !__atomic_load_n( &task->done, __ATOMIC_ACQUIRE ) ) {
+        if( !run_one( self ) ) cpu_pause();
+    }
+}
+
+typedef struct range {
+    size_t begin, end, grain;
+    task_range_function *function;
+    void *argument;
+} range_t;
+
+// splits the range in half until it's down to the grain size: the right half becomes a task (for thieves), & we keep the left half
+static void run_range( void *argument ) {
+    range_t *range = argument;
+    if( range->end - range->begin <= range->grain ) {
+        range->function( range->begin, range->end, range->argument );
+        return;
+    }
+    range_t left = *range, right = *range;
+    left.end = right.begin = range->begin + (range->end - range->begin) / 2;
+    task_t task;
+    task_pool_spawn( &task, run_range, &right );
+    run_range( &left );
+    task_pool_join( &task );
+}
+
+// calls function on disjoint subranges (of at most grain elements) that cover [begin, end), in parallel
+void task_pool_parallel_for( size_t begin, size_t end, size_t grain, task_range_function *function, void *argument ) {
+    if( begin >= end ) return;
+    range_t range = { begin, end, 0 == grain ? 1 : grain, function, argument };
+    run_range( &range );
+}
+
+void task_pool_set_worker_limit( size_t count ) {
+    worker_limit = 0 == count ? 1 : count;
+}
+
+// the idle loop of application processors: run tasks, & halt when there aren't any
+void task_pool_run_worker() {
+    size_t self = cpu_get_index();
+    while( true ) {
+        if( self < worker_limit && run_one( self ) ) {
+            rcu_quiescent_state(); // tasks don't hold RCU references across their boundaries
+            continue;
+        }
+
+        // announce that we're going to sleep, then check for work one last time, so a concurrent spawn can't be missed
+        interrupt_table_disable_interrupts();
+        __atomic_store_n( &sleeping[self], true, __ATOMIC_SEQ_CST );
+        __atomic_fetch_add( &sleeping_count, 1, __ATOMIC_SEQ_CST );
+        if( self >= worker_limit || !any_work() ) {
+            timer_enter_idle();
+            rcu_enter_idle();
+            asm volatile( "sti; hlt" ::: "memory" ); // sti only takes effect after the next instruction, so a wakeup can't slip in before hlt
+            rcu_exit_idle();
+            timer_exit_idle();
+        }
+        __atomic_fetch_sub( &sleeping_count, 1, __ATOMIC_SEQ_CST );
+        __atomic_store_n( &sleeping[self], false, __ATOMIC_SEQ_CST );
+        interrupt_table_restore_interrupts( true );
+    }
+}
+
+#define TEST_ELEMENT_COUNT 1000
+
+static void increment_range( size_t begin, size_t end, void *argument ) {
+    for( size_t i = begin; i < end; i++ ) __atomic_fetch_add( &((uint8_t*)argument)[i], 1, __ATOMIC_RELAXED );
+}
+
+typedef struct fibonacci {
+    uint64_t n, result;
+} fibonacci_t;
+
+static void fibonacci( void *argument ) {
+    fibonacci_t *f = argument;
+    if( f->n < 2 ) {
+        f->result = f->n;
+        return;
+    }
+    fibonacci_t a = { f->n - 1, 0 }, b = { f->n - 2, 0 };
+    task_t task;
+    task_pool_spawn( &task, fibonacci, &a );
+    fibonacci( &b );
+    task_pool_join( &task );
+    f->result = a.result + b.result;
+}
+
+// call after smp_init
+void task_pool_run_tests() {
+    // parallel_for covers every element exactly once
+    static uint8_t counts[TEST_ELEMENT_COUNT];
+    task_pool_parallel_for( 0, TEST_ELEMENT_COUNT, 7, increment_range, counts );
+    for( size_t i = 0; i < TEST_ELEMENT_COUNT; i++ ) {
+        if( 1 != counts[i] ) panic( "task_pool_run_tests: parallel_for didn't visit every element exactly once\n" );
+    }
+
+    // nested spawn & join
+    fibonacci_t f = { 20, 0 };
+    fibonacci( &f );
+    if( 6765 != f.result ) panic( "task_pool_run_tests: wrong fibonacci result\n" );
+}
+
+#define BENCHMARK_BUFFER_SIZE (64 * 1024 * 1024)
+#define BENCHMARK_GRAIN (256 * 1024)
+
+static void clear_range( size_t begin, size_t end, void *argument ) {
+    buffer_clear_qwords( (uint64_t*)argument + begin, end - begin );
+}
+
+// clears 64 MB w/ 1, 2, ... up to all online CPUs. run under QEMU w/ -smp 1 to 8 (see the makefile's QEMU_SMP)
+// each result line is "task_pool_benchmark cpus=<n> cycles=<tsc cycles> speedup_x100=<speedup vs 1 CPU, times 100>"
+void task_pool_run_benchmark() {
+    uint64_t *buffer = kernel_heap_alloc_aligned( BENCHMARK_BUFFER_SIZE, 4096 );
+    size_t qwords = BENCHMARK_BUFFER_SIZE / sizeof( uint64_t );
+    clear_range( 0, qwords, buffer ); // warm up, so no run pays for the 1st touch
+
+    uint64_t baseline = 0;
+    for( size_t workers = 1; workers <= cpu_get_count(); workers++ ) {
+        task_pool_set_worker_limit( workers );
+        uint64_t start = cpu_read_timestamp();
+        task_pool_parallel_for( 0, qwords, BENCHMARK_GRAIN / sizeof( uint64_t ), clear_range, buffer );
+        uint64_t cycles = cpu_read_timestamp() - start;
+        if( 1 == workers ) baseline = cycles;
+
+        vga_text_print( "task_pool_benchmark cpus=", 0x17 );
+        vga_text_print( string_from_int64( (int64_t)workers ), 0x17 );
+        vga_text_print( " cycles=", 0x17 );
+        vga_text_print( string_from_int64( (int64_t)cycles ), 0x17 );
+        vga_text_print( " speedup_x100=", 0x17 );
+        vga_text_print( string_from_int64( (int64_t)(baseline * 100 / (0 == cycles ? 1 : cycles)) ), 0x17 );
+        vga_text_print( "\n", 0x17 );
+    }
+    task_pool_set_worker_limit( CPU_MAX_COUNT );
+    kernel_heap_free( buffer );
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// fork-join parallelism for kernel work: each CPU has a work-stealing deque (Chase-Lev), pushes & pops its own tasks at the bottom,
+// and idle CPUs steal from the top of other CPUs' deques before halting
+// tasks are owned by the caller (usually on its stack), so spawning never allocates. they must not be spawned from interrupt handlers
+typedef void (task_function)( void *argument );
+typedef void (task_range_function)( size_t begin, size_t end, void *argument );
+
+typedef struct task {
+    task_function *function;
+    void *argument;
+    volatile bool done;
+} task_t;
+
+void task_pool_init();
+void task_pool_spawn( task_t *task, task_function *function, void *argument );
+void task_pool_join( task_t *task );
+void task_pool_parallel_for( size_t begin, size_t end, size_t grain, task_range_function *function, void *argument );
+void task_pool_set_worker_limit( size_t count );
+void task_pool_run_worker();
+void task_pool_run_tests();
+void task_pool_run_benchmark();
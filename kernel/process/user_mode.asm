@@ -0,0 +1,49 @@
+; tell linker to put this into the assembly section
+section .asm
+
+; 64-bit code
+[BITS 64]
+
+; exports
+global process_enter_user_mode
+global process_exit_user_mode
+
+; must match gdt.h
+%define USER_CODE_SELECTOR 0x23
+%define USER_DATA_SELECTOR 0x1B
+
+; ring 3 starts w/ interrupts enabled (bit 1 is reserved, and must always be set)
+%define USER_RFLAGS 0x202
+
+; rdi = user entry point, rsi = top of the user stack, rdx = where to save the kernel stack pointer
+; saves the kernel's callee-saved registers & flags, then drops to ring 3 via iretq
+; returns (in rax) the exit code that was passed to process_exit_user_mode
+process_enter_user_mode:
+    pushfq
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [rdx], rsp
+    push USER_DATA_SELECTOR ; ss
+    push rsi ; rsp
+    push USER_RFLAGS ; rflags
+    push USER_CODE_SELECTOR ; cs
+    push rdi ; rip
+    iretq
+
+; rdi = kernel stack pointer that was saved by process_enter_user_mode, rsi = exit code
+; abandons whatever is on the current kernel stack, and returns from process_enter_user_mode
+process_exit_user_mode:
+    mov rsp, rdi
+    mov rax, rsi
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    popfq
+    ret
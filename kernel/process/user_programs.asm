@@ -0,0 +1,517 @@
+; tell linker to put this into the user section, which gets mapped (copy-on-write) into each process's address space
+; everything in here must be position-independent, since it runs at PROCESS_IMAGE_ADDRESS rather than where the kernel was linked
+section .user progbits alloc exec write align=16
+
+; 64-bit code
+[BITS 64]
+
+; exports
+global user_program_test
+global user_program_counter
+global user_program_segfault
+global user_program_fake_page_fault
+global user_program_syscall_benchmark
+global user_program_channel_producer
+global user_program_channel_consumer
+global user_program_futex
+global user_program_futex_benchmark
+global user_futex_benchmark_result
+global user_syscall_benchmark_results
+global user_program_clock
+global user_program_clock_write
+global user_program_clock_benchmark
+global user_clock_results
+global user_clock_benchmark_results
+
+; must match syscall.h
+%define SYSCALL_NULL 0
+%define SYSCALL_EXIT 1
+%define SYSCALL_CHANNEL_WAIT 2
+%define SYSCALL_CHANNEL_NOTIFY 3
+%define SYSCALL_FUTEX_WAIT 4
+%define SYSCALL_FUTEX_WAKE 5
+%define SYSCALL_CLOCK_GETTIME 6
+%define SYSCALL_INTERRUPT 0x80
+
+; must match syscall.c
+%define SYSCALL_BENCHMARK_ITERATIONS 100000
+
+; must match process.h (PROCESS_CHANNEL_ADDRESS) & channel_control_t in channel.h
+%define CHANNEL_ADDRESS 0x8040000000
+%define CHANNEL_ID 0
+%define CHANNEL_CAPACITY 8
+%define CHANNEL_MESSAGE_COUNT 16
+%define CHANNEL_MESSAGE_SIZE 24
+%define CHANNEL_HEAD 64
+%define CHANNEL_PRODUCER_WAITING 72
+%define CHANNEL_TAIL 128
+%define CHANNEL_CONSUMER_WAITING 136
+%define CHANNEL_DATA 4096
+%define CHANNEL_RECORD_WRAP -1
+
+; must match process.h (PROCESS_CLOCK_ADDRESS) & clock_page_t in clock.h
+%define CLOCK_ADDRESS 0x8080000000
+%define CLOCK_SEQUENCE 0
+%define CLOCK_SHIFT 4
+%define CLOCK_MULTIPLIER 8
+%define CLOCK_BASE_TSC 16
+%define CLOCK_BASE_NANOSECONDS 24
+%define CLOCK_BASE_FRACTION 32
+%define CLOCK_REALTIME_OFFSET 40
+%define CLOCK_MONOTONIC 0
+%define CLOCK_REALTIME 1
+
+; rax = timestamp counter (clobbers rdx)
+%macro read_timestamp 0
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+%endmacro
+
+; makes a null syscall, and exits w/ its result + 42 (so the kernel can check that we got to ring 3 & back)
+user_program_test:
+    mov rax, SYSCALL_NULL
+    syscall
+    lea rdi, [rax + 42]
+    mov rax, SYSCALL_EXIT
+    syscall
+    ud2 ; exit never returns
+
+; increments user_counter (via the stack, which is allocated on demand) & exits w/ its new value
+user_program_counter:
+    push qword [rel user_counter]
+    pop rdi
+    inc rdi
+    mov [rel user_counter], rdi
+    mov rax, SYSCALL_EXIT
+    syscall
+    ud2 ; exit never returns
+
+; reads kernel memory, which should get the process killed
+user_program_segfault:
+    mov rax, [0]
+    ud2 ; unreachable
+
+; raises the page fault interrupt itself, which only ring 0 may do, so this is a #GP that should get the process killed
+user_program_fake_page_fault:
+    int 14
+    ud2 ; unreachable
+
+; times SYSCALL_BENCHMARK_ITERATIONS null syscalls via syscall/sysret, and then via int/iretq
+; total cycles for each go into user_syscall_benchmark_results
+; note that rbx & r12 are callee-saved, so the C syscall handlers preserve them
+user_program_syscall_benchmark:
+    read_timestamp
+    mov r12, rax
+    mov rbx, SYSCALL_BENCHMARK_ITERATIONS
+.syscall_loop:
+    mov rax, SYSCALL_NULL
+    syscall
+    dec rbx
+    jnz .syscall_loop
+    read_timestamp
+    sub rax, r12
+    mov [rel user_syscall_benchmark_results], rax
+
+    read_timestamp
+    mov r12, rax
+    mov rbx, SYSCALL_BENCHMARK_ITERATIONS
+.interrupt_loop:
+    int SYSCALL_INTERRUPT
+    dec rbx
+    jnz .interrupt_loop
+    read_timestamp
+    sub rax, r12
+    mov [rel user_syscall_benchmark_results + 8], rax
+
+    xor rdi, rdi
+    mov rax, SYSCALL_EXIT
+    syscall
+    ud2 ; exit never returns
+
+; must match futex.c
+%define FUTEX_BENCHMARK_ITERATIONS 100000
+
+; must match mutex.h
+%define MUTEX_FREE 0
+%define MUTEX_HELD 1
+%define MUTEX_HELD_WITH_WAITERS 2
+ (see channel.h): the kernel maps the channel at CHANNEL_ADDRESS & puts the message count & size in its control page
+; registers that have to survive syscalls are callee-saved: rbx = control page, rbp = capacity, r12 = sequence #, r14 = capacity - 1,
+; r15 = ring data
+;
+
+; sends message_count messages, where message i is message_size bytes of the qword i, written straight into the ring
+user_program_channel_producer:
+    mov rbx, CHANNEL_ADDRESS
+    mov rbp, [rbx + CHANNEL_CAPACITY]
+    lea r14, [rbp - 1]
+    lea r15, [rbx + CHANNEL_DATA]
+    mov r13, [rbx + CHANNEL_MESSAGE_SIZE]
+    add r13, 8 ; r13 = record size
+    xor r12, r12
+.next_message:
+    cmp r12, [rbx + CHANNEL_MESSAGE_COUNT]
+    jae .done
+
+.reserve:
+    ; r9 = head, rcx = its offset in the ring, & rsi = padding, if the record doesn't fit before the end of the ring
+    mov r9, [rbx + CHANNEL_HEAD]
+    mov rcx, r9
+    and rcx, r14
+    mov rdx, rbp
+    sub rdx, rcx
+    xor rsi, rsi
+    cmp rdx, r13
+    jae .check_space
+    mov rsi, rdx
+.check_space:
+    ; the padding & the record have to fit in the free space (head + padding + record - tail <= capacity)
+    lea rdi, [r9 + rsi]
+    add rdi, r13
+    sub rdi, [rbx + CHANNEL_TAIL]
+    cmp rdi, rbp
+    jbe .write
+
+    ; ring is full: announce that we're going to sleep, then check one last time, so the consumer can't miss the flag
+    mov qword [rbx + CHANNEL_PRODUCER_WAITING], 1
+    mfence
+    lea rdi, [r9 + rsi]
+    add rdi, r13
+    sub rdi, [rbx + CHANNEL_TAIL]
+    cmp rdi, rbp
+    jbe .woken
+    mov rdi, [rbx + CHANNEL_ID]
+    mov rax, SYSCALL_CHANNEL_WAIT
+    syscall
+.woken:
+    mov qword [rbx + CHANNEL_PRODUCER_WAITING], 0
+    jmp .reserve
+
+.write:
+    ; if the record doesn't fit, mark the rest of the ring as skipped & start at the beginning
+    test rsi, rsi
+    jz .write_record
+    mov qword [r15 + rcx], CHANNEL_RECORD_WRAP
+    add r9, rsi
+    xor rcx, rcx
+.write_record:
+    ; length, then the payload
+    lea rdi, [r15 + rcx + 8]
+    mov rcx, [rbx + CHANNEL_MESSAGE_SIZE]
+    mov [rdi - 8], rcx
+    shr rcx, 3
+    mov rax, r12
+    rep stosq
+
+    ; publish (x86 doesn't reorder stores, so the record is visible before the new head)
+    add r9, r13
+    mov [rbx + CHANNEL_HEAD], r9
+
+    ; wake the consumer if it went to sleep on an empty ring (the fence orders our head store before the flag load)
+    mfence
+    cmp qword [rbx + CHANNEL_CONSUMER_WAITING], 0
+    je .notified
+    mov qword [rbx + CHANNEL_CONSUMER_WAITING], 0 ; claim the wakeup, so the messages we send before it wakes up don't notify it again
+    mov rdi, [rbx + CHANNEL_ID]
+    mov rax, SYSCALL_CHANNEL_NOTIFY
+    syscall
+.notified:
+    inc r12
+    jmp .next_message
+
+.done:
+    xor rdi, rdi
+    mov rax, SYSCALL_EXIT
+    syscall
+    ud2 ; exit never returns
+
+; receives message_count messages, reading each one in place, & exits w/ the # of them that had the expected contents
+; r13 = # of intact messages
+user_program_channel_consumer:
+    mov rbx, CHANNEL_ADDRESS
+    mov rbp, [rbx + CHANNEL_CAPACITY]
+    lea r14, [rbp - 1]
+    lea r15, [rbx + CHANNEL_DATA]
+    xor r12, r12
+    xor r13, r13
+.next_message:
+    cmp r12, [rbx + CHANNEL_MESSAGE_COUNT]
+    jae .done
+
+.wait_for_data:
+    mov r9, [rbx + CHANNEL_TAIL]
+    cmp r9, [rbx + CHANNEL_HEAD]
+    jne .read
+
+    ; ring is empty: announce that we're going to sleep, then check one last time, so the producer can't miss the flag
+    mov qword [rbx + CHANNEL_CONSUMER_WAITING], 1
+    mfence
+    cmp r9, [rbx + CHANNEL_HEAD]
+    jne .woken
+    mov rdi, [rbx + CHANNEL_ID]
+    mov rax, SYSCALL_CHANNEL_WAIT
+    syscall
+.woken:
+    mov qword [rbx + CHANNEL_CONSUMER_WAITING], 0
+    jmp .wait_for_data
+
+.read:
+    ; rdx = record length (a wrap marker means the record is at the start of the ring, which the producer published along w/ it)
+    mov rcx, r9
+    and rcx, r14
+    mov rdx, [r15 + rcx]
+    cmp rdx, CHANNEL_RECORD_WRAP
+    jne .sum
+    add r9, rbp
+    sub r9, rcx
+    xor rcx, rcx
+    mov rdx, [r15]
+.sum:
+    ; add up the payload's qwords, which should come to sequence # * qword count
+    lea rsi, [r15 + rcx + 8]
+    mov rcx, rdx
+    shr rcx, 3
+    mov r8, rcx
+    imul r8, r12
+    xor rax, rax
+.sum_loop:
+    add rax, [rsi]
+    add rsi, 8
+    dec rcx
+    jnz .sum_loop
+    cmp rax, r8
+    jne .release
+    inc r13
+.release:
+    ; hand the space back to the producer
+    lea r9, [r9 + rdx + 8]
+    mov [rbx + CHANNEL_TAIL], r9
+
+    ; wake the producer if it went to sleep on a full ring
+    mfence
+    cmp qword [rbx + CHANNEL_PRODUCER_WAITING], 0
+    je .notified
+    mov qword [rbx + CHANNEL_PRODUCER_WAITING], 0 ; claim the wakeup, so the messages we send before it wakes up don't notify it again
+    mov rdi, [rbx + CHANNEL_ID]
+    mov rax, SYSCALL_CHANNEL_NOTIFY
+    syscall
+.notified:
+    inc r12
+    jmp .next_message
+
+.done:
+    mov rdi, r13
+    mov rax, SYSCALL_EXIT
+    syscall
+    ud2 ; exit never returns
+
+;
+; futex programs (see futex.h & mutex.h)
+;
+
+; rdi = address of a mutex word. the uncontended case is a single atomic, & only contention leads to syscalls (same as mutex.c)
+; clobbers rax, rcx, rdx, rsi, rdi & r8-r11
+user_mutex_lock:
+    xor eax, eax
+    mov ecx, MUTEX_HELD
+    lock cmpxchg [rdi], ecx
+    jnz .contended
+    ret
+.contended:
+    push rbx
+    mov rbx, rdi
+.retry:
+    mov eax, MUTEX_HELD_WITH_WAITERS
+    xchg [rbx], eax
+    test eax, eax
+    jz .locked
+    mov rdi, rbx
+    mov rsi, MUTEX_HELD_WITH_WAITERS
+    mov rax, SYSCALL_FUTEX_WAIT
+    syscall
+    jmp .retry
+.locked:
+    pop rbx
+    ret
+
+; rdi = address of a mutex word. clobbers the same registers as user_mutex_lock
+user_mutex_unlock:
+    lock dec dword [rdi]
+    jnz .wake
+    ret
+.wake:
+    mov dword [rdi], MUTEX_FREE ; there may be waiters, so wake one
+    mov rsi, 1
+    mov rax, SYSCALL_FUTEX_WAKE
+    syscall
+    ret
+
+; exits w/ 100 * (mismatched wait's result) + 10 * (result of a wake w/o waiters) - (result of a wait on a kernel address) + mutex word
+; after an uncontended lock & unlock, which should come to 100 + 0 + 1 + 0
+user_program_futex:
+    lea rdi, [rel user_futex_word]
+    mov rsi, 1
+    mov rax, SYSCALL_FUTEX_WAIT
+    syscall
+    imul r12, rax, 100
+
+    lea rdi, [rel user_futex_word]
+    mov rsi, 1
+    mov rax, SYSCALL_FUTEX_WAKE
+    syscall
+    imul rax, rax, 10
+    add r12, rax
+
+    mov rdi, 0x1000
+    xor rsi, rsi
+    mov rax, SYSCALL_FUTEX_WAIT
+    syscall
+    sub r12, rax
+
+    lea rdi, [rel user_futex_word]
+    call user_mutex_lock
+    lea rdi, [rel user_futex_word]
+    call user_mutex_unlock
+    mov eax, [rel user_futex_word]
+    add r12, rax
+
+    mov rdi, r12
+    mov rax, SYSCALL_EXIT
+    syscall
+    ud2 ; exit never returns
+
+; times FUTEX_BENCHMARK_ITERATIONS uncontended lock/unlock pairs, & puts the total cycles in user_futex_benchmark_result
+user_program_futex_benchmark:
+    read_timestamp
+    mov r12, rax
+    mov rbx, FUTEX_BENCHMARK_ITERATIONS
+.loop:
+    lea rdi, [rel user_futex_word]
+    call user_mutex_lock
+    lea rdi, [rel user_futex_word]
+    call user_mutex_unlock
+    dec rbx
+    jnz .loop
+    read_timestamp
+    sub rax, r12
+    mov [rel user_futex_benchmark_result], rax
+
+    xor rdi, rdi
+    mov rax, SYSCALL_EXIT
+    syscall
+    ud2 ; exit never returns
+
+;
+; clock programs (see clock.h)
+;
+
+; must match clock.c
+%define CLOCK_BENCHMARK_ITERATIONS 100000
+
+; rdi = CLOCK_MONOTONIC or CLOCK_REALTIME. returns the time in nanoseconds in rax, read from the clock page w/o entering the kernel
+; the page is protected by a seqlock, so we retry if the kernel was updating it (odd sequence #) or updated it while we were reading
+; x86 doesn't reorder loads w/ other loads, so the only fence we need is the lfence that keeps rdtsc after the 1st sequence # load
+; clobbers rcx, rdx, rsi & r8
+user_clock_gettime:
+    mov rsi, CLOCK_ADDRESS
+.retry:
+    mov r8d, [rsi + CLOCK_SEQUENCE]
+    test r8d, 1
+    jnz .busy
+    lfence
+    read_timestamp
+    sub rax, [rsi + CLOCK_BASE_TSC]
+    mul qword [rsi + CLOCK_MULTIPLIER] ; rdx:rax = 128-bit product, so it can't overflow
+    add rax, [rsi + CLOCK_BASE_FRACTION]
+    adc rdx, 0
+    mov ecx, [rsi + CLOCK_SHIFT]
+    shrd rax, rdx, cl
+    add rax, [rsi + CLOCK_BASE_NANOSECONDS]
+    cmp rdi, CLOCK_REALTIME
+    jne .validate
+    add rax, [rsi + CLOCK_REALTIME_OFFSET]
+.validate:
+    cmp r8d, [rsi + CLOCK_SEQUENCE]
+    jne .retry
+    ret
+.busy:
+    pause
+    jmp .retry
+
+; reads the monotonic clock from the page, then via the syscall, then from the page again, and then reads the realtime clock
+; puts all 4 in user_clock_results (so the kernel can check that they're in order) & exits w/ 0
+user_program_clock:
+    mov rdi, CLOCK_MONOTONIC
+    call user_clock_gettime
+    mov [rel user_clock_results], rax
+    mov rdi, CLOCK_MONOTONIC
+    mov rax, SYSCALL_CLOCK_GETTIME
+    syscall
+    mov [rel user_clock_results + 8], rax
+    mov rdi, CLOCK_MONOTONIC
+    call user_clock_gettime
+    mov [rel user_clock_results + 16], rax
+    mov rdi, CLOCK_REALTIME
+    call user_clock_gettime
+    mov [rel user_clock_results + 24], rax
+
+    xor rdi, rdi
+    mov rax, SYSCALL_EXIT
+    syscall
+    ud2 ; exit never returns
+
+; tries to set the realtime clock by writing to the clock page, which should get the process killed
+user_program_clock_write:
+    mov rax, CLOCK_ADDRESS
+    mov qword [rax + CLOCK_REALTIME_OFFSET], 0
+    ud2 ; unreachable
+
+; times CLOCK_BENCHMARK_ITERATIONS monotonic clock reads from the page, and then via the syscall
+; total cycles for each go into user_clock_benchmark_results
+user_program_clock_benchmark:
+    read_timestamp
+    mov r12, rax
+    mov rbx, CLOCK_BENCHMARK_ITERATIONS
+.page_loop:
+    mov rdi, CLOCK_MONOTONIC
+    call user_clock_gettime
+    dec rbx
+    jnz .page_loop
+    read_timestamp
+    sub rax, r12
+    mov [rel user_clock_benchmark_results], rax
+
+    read_timestamp
+    mov r12, rax
+    mov rbx, CLOCK_BENCHMARK_ITERATIONS
+.syscall_loop:
+    mov rdi, CLOCK_MONOTONIC
+    mov rax, SYSCALL_CLOCK_GETTIME
+    syscall
+    dec rbx
+    jnz .syscall_loop
+    read_timestamp
+    sub rax, r12
+    mov [rel user_clock_benchmark_results + 8], rax
+
+    xor rdi, rdi
+    mov rax, SYSCALL_EXIT
+    syscall
+    ud2 ; exit never returns
+
+; data
+align 8
+user_counter:
+    dq 0
+user_syscall_benchmark_results:
+    dq 0, 0
+user_futex_benchmark_result:
+    dq 0
+user_futex_word:
+    dd 0
+align 8
+user_clock_results:
+    dq 0, 0, 0, 0
+user_clock_benchmark_results:
+    dq 0, 0
@@ -8,6 +8,18 @@
 %define KERNEL_STACK_SIZE 4096
 %define LONG_MODE_PAGE_MAP_ADDRESS 0xA000
 
+; boot timeline (must match kernel/boot_timeline.h)
+%define BOOT_TIMELINE_ADDRESS 0x600
+%define BOOT_PHASE_KERNEL_ENTRY 4
+%define BOOT_PHASE_LONG_MODE 5
+
+; stores the TSC in a phase's slot (clobbers eax & edx)
+%macro record_boot_phase 1
+    rdtsc
+    mov [BOOT_TIMELINE_ADDRESS + (%1) * 8], eax
+    mov [BOOT_TIMELINE_ADDRESS + (%1) * 8 + 4], edx
+%endmacro
+
 global start32 ; tell linker where to find this entry point
 extern main ; allows start.asm to call into main.c
 
@@ -15,6 +27,7 @@ extern main ; allows start.asm to call into main.c
 start32:
     ; note that stack has the KERNEL_SECTORS 32-bit int from the bootloader on the stack
     ; we'll retrieve this later in start64
+    record_boot_phase BOOT_PHASE_KERNEL_ENTRY
 
     ; print 'K' character, so we know we've entered the kernel OK
     mov ebx,0xb8000    ; The video address
@@ -151,6 +164,7 @@ start64:
     mov fs, ax
     mov gs, ax
     mov ss, ax
+    record_boot_phase BOOT_PHASE_LONG_MODE
 
     ; Blank out the screen to a blue color, to indicate that we're in long mode and about to enter the kernel's main C function
     mov edi, 0xB8000                  ; address of vga text mode buffer
@@ -0,0 +1,215 @@
+#include "futex.h"
+#include "mutex.h"
+#include "spinlock.h"
+#include "../drivers/vga_text.h" // for printing
+#include "../interrupt/interrupt_table.h"
+#include "../memory/hash_table.h" // for hashing keys
+#include "../memory/paging.h"
+#include "../process/apic.h"
+#include "../process/cpu.h"
+#include "../process/process.h"
+#include "../process/syscall.h"
+#include "../process/task_pool.h" // for the tests & benchmark
+#include "../interrupt/timer.h" // "
+#include "../main.h" // for panic
+
+// lives on the waiter's stack, & stays in its bucket's queue until a waker takes it out
+typedef struct waiter {
+    uint64_t key; // physical address of the futex word
+    size_t cpu;
+    volatile bool woken;
+    struct waiter *next;
+} waiter_t;
+
+// irqsave, since the lock is held while a waiter goes to sleep w/ interrupts off
+typedef struct bucket {
+    ticket_lock_t lock;
+    waiter_t *waiters; // FIFO
+} bucket_t;
+
+static bucket_t buckets[FUTEX_BUCKET_COUNT];
+static volatile uint64_t wait_count; // # of times anyone actually slept
+
+// test programs (see user_programs.asm)
+extern void user_program_futex();
+extern void user_program_futex_benchmark();
+extern uint64_t user_futex_benchmark_result;
+
+static bucket_t *get_bucket( uint64_t key ) {
+    return &buckets[hash_table_hash_uint64( key ) % FUTEX_BUCKET_COUNT];
+}
+
+// value is where the kernel reads the futex word (kernel memory is identity mapped, so it's the same as the key)
+static bool wait( uint64_t key, volatile uint32_t *value, uint32_t expected ) {
+    bucket_t *bucket = get_bucket( key );
+    waiter_t waiter = { key, cpu_get_index(), false, NULL };
+
+    // wakers change the value before they take the bucket lock, so checking it & queueing under the lock means no wakeup can be lost
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &bucket->lock );
+    if( expected != *value ) {
+        ticket_lock_release_irqrestore( &bucket->lock, interrupts_were_enabled );
+        return false;
+    }
+    waiter_t **link = &bucket->waiters;
+    while( NULL != *link ) link = &(*link)->next;
+    *link = &waiter;
+    ticket_lock_release_irqrestore( &bucket->lock, false ); // interrupts stay off until we're halted
+    __atomic_fetch_add( &wait_count, 1, __ATOMIC_RELAXED );
+
+    // sti only takes effect after the next instruction, so the wakeup IPI can't slip in between the check & hlt
+    while( !__atomic_load_n( &waiter.woken, __ATOMIC_ACQUIRE ) ) asm volatile( "sti; hlt; cli" ::: "memory" );
+    interrupt_table_restore_interrupts( interrupts_were_enabled );
+    return true;
+}
+
+static size_t wake( uint64_t key, size_t count ) {
+    bucket_t *bucket = get_bucket( key );
+    size_t woken = 0, self = cpu_get_index();
+    bool interrupts_were_enabled = ticket_lock_acquire_irqsave( &bucket->lock );
+    waiter_t **link = &bucket->waiters;
+    while( NULL != *link && woken < count ) {
+        waiter_t *waiter = *link;
+        if( key != waiter->key ) {
+            link = &waiter->next;
+            continue;
+        }
+        *link = waiter->next;
+
+        // once woken is set, the waiter may return & take its stack frame w/ it, so read everything we need 1st
+        size_t cpu = waiter->cpu;
+        __atomic_store_n( &waiter->woken, true, __ATOMIC_RELEASE );
+        if( cpu != self ) apic_send_ipi( cpu_get_apic_id( cpu ), INTERRUPT_INDEX_WAKEUP );
+        woken++;
+    }
+    ticket_lock_release_irqrestore( &bucket->lock, interrupts_were_enabled );
+    return woken;
+}
+
+// sleeps until woken, but only if *address still equals expected (otherwise returns false right away, since whatever we'd wait for
+// has already happened). callers must recheck their condition after waking up
+bool futex_wait( volatile uint32_t *address, uint32_t expected ) {
+    return wait( (uint64_t)address, address, expected );
+}
+
+// wakes up to count waiters (oldest first), and returns how many it woke
+size_t futex_wake( volatile uint32_t *address, size_t count ) {
+    return wake( (uint64_t)address, count );
+}
+
+uint64_t futex_get_wait_count() {
+    return __atomic_load_n( &wait_count, __ATOMIC_RELAXED );
+}
+
+// user futex words must be aligned & already mapped (i.e. touched), and are keyed by their physical address
+static volatile uint32_t *get_user_word( uint64_t address ) {
+    process_t *process = process_get_current();
+    if( NULL == process || address < PAGING_USER_START || address >= PAGING_USER_END || 0 != (address & 3) ) return NULL;
+    return paging_get_physical_address( process->pagemap, (void*)address );
+}
+
+// rdi = address, rsi = expected value. returns 0 after being woken, 1 if the value didn't match, or -1 for a bad address
+static uint64_t wait_syscall_handler( uint64_t address, uint64_t expected, uint64_t c, uint64_t d, uint64_t e, uint64_t f ) {
+    volatile uint32_t *word = get_user_word( address );
+    if( NULL == word ) return (uint64_t)-1;
+    return wait( (uint64_t)word, word, (uint32_t)expected ) ? 0 : 1;
+}
+
+// rdi = address, rsi = max # of waiters to wake. returns the # woken, or -1 for a bad address
+static uint64_t wake_syscall_handler( uint64_t address, uint64_t count, uint64_t c, uint64_t d, uint64_t e, uint64_t f ) {
+    volatile uint32_t *word = get_user_word( address );
+    if( NULL == word ) return (uint64_t)-1;
+    return wake( (uint64_t)word, count );
+}
+
+void futex_init() {
+    for( size_t i = 0; i < FUTEX_BUCKET_COUNT; i++ ) {
+        ticket_lock_init( &buckets[i].lock, "futex" );
+        buckets[i].waiters = NULL;
+    }
+    syscall_set_handler( SYSCALL_FUTEX_WAIT, wait_syscall_handler );
+    syscall_set_handler( SYSCALL_FUTEX_WAKE, wake_syscall_handler );
+}
+
+#define TEST_RANGES 64
+#define TEST_INCREMENTS 100
+
+static mutex_t test_mutex;
+static volatile uint64_t test_counter;
+static volatile uint32_t test_word;
+
+static void increment_range( size_t begin, size_t end, void *argument ) {
+    for( size_t i = begin; i < end; i++ ) {
+        for( size_t j = 0; j < TEST_INCREMENTS; j++ ) {
+            mutex_acquire( &test_mutex );
+            test_counter++; // not atomic: the mutex is all that keeps increments from getting lost
+            mutex_release( &test_mutex );
+        }
+    }
+}
+
+static void set_and_wake( void *argument ) {
+    timer_delay_microseconds( 1000 ); // give the waiter time to go to sleep
+    __atomic_store_n( &test_word, 1, __ATOMIC_RELEASE );
+    futex_wake( &test_word, 1 );
+}
+
+// call after process_init & smp_init
+void futex_run_tests() {
+    // a mismatched wait returns right away, & a wake w/o waiters wakes nobody
+    test_word = 0;
+    if( futex_wait( &test_word, 1 ) ) panic( "futex_run_tests: waited even though the value didn't match\n" );
+    if( 0 != futex_wake( &test_word, 1 ) ) panic( "futex_run_tests: woke a waiter that doesn't exist\n" );
+
+    // a real wait, woken from another CPU
+    if( cpu_get_count() > 1 ) {
+        task_t task;
+        task_pool_spawn( &task, set_and_wake, NULL );
+        while( 0 == __atomic_load_n( &test_word, __ATOMIC_ACQUIRE ) ) futex_wait( &test_word, 0 );
+        task_pool_join( &task );
+    }
+
+    // the mutex doesn't lose increments, however much contention there is
+    mutex_init( &test_mutex, "futex_test" );
+    test_counter = 0;
+    task_pool_parallel_for( 0, TEST_RANGES, 1, increment_range, NULL );
+    if( TEST_RANGES * TEST_INCREMENTS != test_counter ) panic( "futex_run_tests: mutex lost increments\n" );
+    if( MUTEX_FREE != test_mutex.state ) panic( "futex_run_tests: mutex isn't free after the last release\n" );
+
+    // user space: a mismatched wait (1), a wake w/o waiters (0) & a kernel address (-1), plus an uncontended lock & unlock in ring 3
+    process_t *process = process_create_builtin( user_program_futex );
+    if( 101 != process_run( process ) ) panic( "futex_run_tests: user program got the wrong futex results\n" );
+    process_destroy( process );
+}
+
+#define BENCHMARK_ITERATIONS 100000 // must match user_programs.asm
+#define BENCHMARK_RANGES 256
+
+// cycles per lock/unlock pair: uncontended in the kernel & in ring 3 (neither of which makes a syscall or touches a wait queue),
+// then contended, w/ every CPU hammering 1 mutex
+// the result line is "futex_benchmark uncontended_cycles=<n> user_uncontended_cycles=<n> cpus=<n> contended_cycles=<n> waits=<n>"
+void futex_run_benchmark() {
+    mutex_init( &test_mutex, "futex_benchmark" );
+    uint64_t start = cpu_read_timestamp();
+    for( size_t i = 0; i < BENCHMARK_ITERATIONS; i++ ) {
+        mutex_acquire( &test_mutex );
+        mutex_release( &test_mutex );
+    }
+    uint64_t uncontended = (cpu_read_timestamp() - start) / BENCHMARK_ITERATIONS;
+
+    process_t *process = process_create_builtin( user_program_futex_benchmark );
+    if( 0 != process_run( process ) ) panic( "futex_run_benchmark: benchmark process failed\n" );
+    uint64_t user_uncontended = *(uint64_t*)process_get_image_data( process, &user_futex_benchmark_result ) / BENCHMARK_ITERATIONS;
+    process_destroy( process );
+
+    uint64_t waits = futex_get_wait_count();
+    start = cpu_read_timestamp();
+    task_pool_parallel_for( 0, BENCHMARK_RANGES, 1, increment_range, NULL );
+    uint64_t contended = (cpu_read_timestamp() - start) / (BENCHMARK_RANGES * TEST_INCREMENTS);
+
+    vga_text_print_stat( "futex_benchmark uncontended_cycles=", uncontended );
+    vga_text_print_stat( " user_uncontended_cycles=", user_uncontended );
+    vga_text_print_stat( " cpus=", cpu_get_count() );
+    vga_text_print_stat( " contended_cycles=", contended );
+    vga_text_print_stat( " waits=", futex_get_wait_count() - waits );
+    vga_text_print( "\n", 0x17 );
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// address-keyed wait queues ("fast userspace mutexes", see Drepper's "Futexes Are Tricky"): a lock or semaphore lives in a plain
+// 32-bit word, which its users update w/ atomics, and they only come here to sleep when the word says they have to wait
+// waiters are kept in hashed buckets, keyed by physical address, so kernel code & processes (even ones sharing a page) meet on the
+// same queue. there's no scheduler, so a waiter halts its CPU until it's woken. neither call may be made from an interrupt handler
+#define FUTEX_BUCKET_COUNT 64
+
+bool futex_wait( volatile uint32_t *address, uint32_t expected );
+size_t futex_wake( volatile uint32_t *address, size_t count );
+uint64_t futex_get_wait_count();
+void futex_init();
+void futex_run_tests();
+void futex_run_benchmark();
@@ -0,0 +1,39 @@
+#include "mutex.h"
+#include "futex.h"
+#include "../main.h" // for panic
+
+void mutex_init( mutex_t *mutex, const char *name ) {
+    mutex->state = MUTEX_FREE;
+    lock_stats_init( &mutex->stats, name );
+}
+
+bool mutex_try_acquire( mutex_t *mutex ) {
+    uint32_t state = MUTEX_FREE;
+    if( !__atomic_compare_exchange_n( &mutex->state, &state, MUTEX_HELD, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) ) return false;
+    lock_stats_on_acquire( &mutex->stats, lock_stats_begin_wait(), false );
+    return true;
+}
+
+void mutex_acquire( mutex_t *mutex ) {
+    uint64_t wait_start = lock_stats_begin_wait();
+    uint32_t state = MUTEX_FREE;
+    bool contended = !__atomic_compare_exchange_n( &mutex->state, &state, MUTEX_HELD, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED );
+
+    // once we've waited, we can't know whether others are still waiting, so we take the lock as "held w/ waiters" (which costs the
+    // next release a wake call that might find nobody, but never loses a waiter)
+    if( contended ) {
+        while( MUTEX_FREE != __atomic_exchange_n( &mutex->state, MUTEX_HELD_WITH_WAITERS, __ATOMIC_ACQUIRE ) ) {
+            futex_wait( &mutex->state, MUTEX_HELD_WITH_WAITERS );
+        }
+    }
+    lock_stats_on_acquire( &mutex->stats, wait_start, contended );
+}
+
+void mutex_release( mutex_t *mutex ) {
+    if( MUTEX_FREE == mutex->state ) panic( "mutex_release: mutex isn't held\n" );
+    lock_stats_on_release( &mutex->stats );
+    if( MUTEX_HELD != __atomic_fetch_sub( &mutex->state, 1, __ATOMIC_RELEASE ) ) {
+        __atomic_store_n( &mutex->state, MUTEX_FREE, __ATOMIC_RELEASE );
+        futex_wake( &mutex->state, 1 );
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "spinlock.h"
+
+// sleeping mutex on a futex word (mutex #3 from "Futexes Are Tricky"): an uncontended lock or unlock is a single atomic, and only
+// contended ones go to the futex wait queues. the same protocol works in user space (see user_programs.asm)
+// like futexes, it can't be used from interrupt handlers
+#define MUTEX_FREE 0
+#define MUTEX_HELD 1
+#define MUTEX_HELD_WITH_WAITERS 2
+
+typedef struct mutex {
+    volatile uint32_t state;
+    lock_stats_t stats;
+} mutex_t;
+
+void mutex_init( mutex_t *mutex, const char *name );
+void mutex_acquire( mutex_t *mutex );
+bool mutex_try_acquire( mutex_t *mutex );
+void mutex_release( mutex_t *mutex );
@@ -0,0 +1,91 @@
+#include <stddef.h>
+#include "rcu.h"
+#include "../process/cpu.h" // for per-CPU state
+#include "../main.h" // for panic
+
+// padded to a cache line, so CPUs don't contend on each other's counters
+typedef struct rcu_cpu {
+    volatile uint64_t quiescent_count;
+    volatile bool idle; // a halted CPU holds no references, so it doesn't hold up grace periods
+    uint32_t read_nesting;
+} __attribute__((aligned(64))) rcu_cpu_t;
+
+static rcu_cpu_t rcu_cpus[CPU_MAX_COUNT];
+
+void rcu_read_lock() {
+    rcu_cpus[cpu_get_index()].read_nesting++;
+    asm volatile( "" ::: "memory" ); // keep reads inside the critical section
+}
+
+void rcu_read_unlock() {
+    asm volatile( "" ::: "memory" );
+    rcu_cpu_t *cpu = &rcu_cpus[cpu_get_index()];
+    if( 0 == cpu->read_nesting ) panic( "rcu_read_unlock: not in a read-side critical section" );
+    cpu->read_nesting--;
+}
+
+void rcu_quiescent_state() {
+    rcu_cpu_t *cpu = &rcu_cpus[cpu_get_index()];
+    if( 0 != cpu->read_nesting ) panic( "rcu_quiescent_state: called inside a read-side critical section" );
+    __atomic_fetch_add( &cpu->quiescent_count, 1, __ATOMIC_RELEASE );
+}
+
+// called from the clock interrupt: the interrupted code is quiescent unless it was inside a read-side critical section
+void rcu_note_clock_tick() {
+    rcu_cpu_t *cpu = &rcu_cpus[cpu_get_index()];
+    if( 0 == cpu->read_nesting ) __atomic_fetch_add( &cpu->quiescent_count, 1, __ATOMIC_RELEASE );
+}
+
+// call before halting (w/ interrupts disabled, so the flag can't go stale before the halt)
+void rcu_enter_idle() {
+    rcu_cpu_t *cpu = &rcu_cpus[cpu_get_index()];
+    if( 0 != cpu->read_nesting ) panic( "rcu_enter_idle: called inside a read-side critical section" );
+    __atomic_store_n( &cpu->idle, true, __ATOMIC_SEQ_CST );
+}
+
+// call after waking, before touching any RCU-protected data
+void rcu_exit_idle() {
+    __atomic_store_n( &rcu_cpus[cpu_get_index()].idle, false, __ATOMIC_SEQ_CST );
+}
+
+void rcu_synchronize() {
+    size_t self = cpu_get_index();
+    if( 0 != rcu_cpus[self].read_nesting ) panic( "rcu_synchronize: called inside a read-side critical section (this would deadlock)" );
+
+    // snapshot every CPU's counter, then wait for each of the others to move past it (we're quiescent ourself, since we're here)
+    uint64_t snapshot[CPU_MAX_COUNT];
+    for( size_t i = 0; i < CPU_MAX_COUNT; i++ ) snapshot[i] = __atomic_load_n( &rcu_cpus[i].quiescent_count, __ATOMIC_ACQUIRE );
+    rcu_quiescent_state();
+    for( size_t i = 0; i < CPU_MAX_COUNT; i++ ) {
+        if( i == self || !cpu_is_online( i ) ) continue;
+        while( snapshot[i] == __atomic_load_n( &rcu_cpus[i].quiescent_count, __ATOMIC_ACQUIRE ) && !__atomic_load_n( &rcu_cpus[i].idle, __ATOMIC_SEQ_CST ) ) cpu_pause();
+    }
+}
+
+void rcu_run_tests() {
+    static int version1 = 1, version2 = 2;
+    static int *current;
+
+    // readers see whatever was last published
+    rcu_assign_pointer( current, &version1 );
+    rcu_read_lock();
+    rcu_read_lock(); // nesting is allowed
+    if( 1 != *rcu_dereference( current ) ) panic( "rcu_run_tests: wrong version" );
+    rcu_read_unlock();
+    rcu_read_unlock();
+
+    // publish a new version, then wait out the old one's readers
+    rcu_cpu_t *cpu = &rcu_cpus[cpu_get_index()];
+    uint64_t quiescent_count = cpu->quiescent_count;
+    rcu_assign_pointer( current, &version2 );
+    rcu_synchronize();
+    if( cpu->quiescent_count == quiescent_count ) panic( "rcu_run_tests: synchronize didn't record a quiescent state" );
+    if( 2 != *rcu_dereference( current ) ) panic( "rcu_run_tests: wrong version after synchronize" );
+
+    // a clock tick inside a read-side critical section is not a quiescent state
+    rcu_read_lock();
+    quiescent_count = cpu->quiescent_count;
+    rcu_note_clock_tick();
+    if( cpu->quiescent_count != quiescent_count ) panic( "rcu_run_tests: clock tick counted as quiescent inside a reader" );
+    rcu_read_unlock();
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+// read-copy-update, for read-mostly data: readers take no locks & never write shared memory
+// a writer publishes a new version w/ rcu_assign_pointer, then rcu_synchronize waits for a grace period (every CPU passing through a
+// quiescent state, i.e. a point where it holds no RCU references), after which the old version can be freed
+// quiescent states: idling (halted CPUs are skipped entirely), clock ticks that land outside a read-side critical section, and explicit rcu_quiescent_state calls
+// note: code that runs w/ interrupts disabled (like interrupt dispatch) is implicitly a read-side critical section
+#define rcu_dereference( pointer ) __atomic_load_n( &(pointer), __ATOMIC_CONSUME )
+#define rcu_assign_pointer( pointer, value ) __atomic_store_n( &(pointer), (value), __ATOMIC_RELEASE )
+
+void rcu_read_lock();
+void rcu_read_unlock();
+void rcu_quiescent_state();
+void rcu_note_clock_tick();
+void rcu_enter_idle();
+void rcu_exit_idle();
+void rcu_synchronize();
+void rcu_run_tests();
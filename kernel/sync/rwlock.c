@@ -0,0 +1,86 @@
+#include "rwlock.h"
+#include "../process/cpu.h" // for pausing
+#include "../main.h" // for panic
+
+#define WRITER_HOLDS (1U << 31)
+#define WRITER_WAITS (1U << 30)
+#define READER_MASK (WRITER_WAITS - 1)
+
+void rwlock_init( rwlock_t *lock, const char *name ) {
+    lock->state = 0;
+    lock_stats_init( &lock->stats, name );
+}
+
+bool rwlock_read_try_acquire( rwlock_t *lock ) {
+    uint32_t state = __atomic_load_n( &lock->state, __ATOMIC_RELAXED );
+    if( state & (WRITER_HOLDS | WRITER_WAITS) ) return false;
+    return __atomic_compare_exchange_n( &lock->state, &state, state + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED );
+}
+
+void rwlock_read_acquire( rwlock_t *lock ) {
+    while( !rwlock_read_try_acquire( lock ) ) cpu_pause();
+}
+
+void rwlock_read_release( rwlock_t *lock ) {
+    if( 0 == (__atomic_fetch_sub( &lock->state, 1, __ATOMIC_RELEASE ) & READER_MASK) ) panic( "rwlock_read_release: lock has no readers" );
+}
+
+// the writer takes the lock only once there are no readers & no other writer (this also clears WRITER_WAITS)
+static bool try_take_for_write( rwlock_t *lock, uint32_t state ) {
+    if( state & (WRITER_HOLDS | READER_MASK) ) return false;
+    return __atomic_compare_exchange_n( &lock->state, &state, WRITER_HOLDS, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED );
+}
+
+bool rwlock_write_try_acquire( rwlock_t *lock ) {
+    if( !try_take_for_write( lock, __atomic_load_n( &lock->state, __ATOMIC_RELAXED ) ) ) return false;
+    lock_stats_on_acquire( &lock->stats, lock_stats_begin_wait(), false );
+    return true;
+}
+
+void rwlock_write_acquire( rwlock_t *lock ) {
+    uint64_t wait_start = lock_stats_begin_wait();
+    bool contended = false;
+    while( true ) {
+        uint32_t state = __atomic_load_n( &lock->state, __ATOMIC_RELAXED );
+        if( try_take_for_write( lock, state ) ) break;
+        contended = true;
+
+        // keep announcing ourself: the flag gets cleared whenever another writer gets in ahead of us
+        if( !(state & WRITER_WAITS) ) __atomic_fetch_or( &lock->state, WRITER_WAITS, __ATOMIC_RELAXED );
+        cpu_pause();
+    }
+    lock_stats_on_acquire( &lock->stats, wait_start, contended );
+}
+
+void rwlock_write_release( rwlock_t *lock ) {
+    if( !(lock->state & WRITER_HOLDS) ) panic( "rwlock_write_release: lock has no writer" );
+    lock_stats_on_release( &lock->stats );
+
+    // keep WRITER_WAITS, in case another writer set it while we held the lock
+    __atomic_fetch_and( &lock->state, ~WRITER_HOLDS, __ATOMIC_RELEASE );
+}
+
+void rwlock_run_tests() {
+    rwlock_t lock;
+    rwlock_init( &lock, "test rwlock" );
+
+    // readers share the lock, and keep writers out
+    rwlock_read_acquire( &lock );
+    if( !rwlock_read_try_acquire( &lock ) ) panic( "rwlock_run_tests: 2nd reader was refused" );
+    if( rwlock_write_try_acquire( &lock ) ) panic( "rwlock_run_tests: writer got in while readers held the lock" );
+    rwlock_read_release( &lock );
+    rwlock_read_release( &lock );
+
+    // a writer excludes everyone
+    rwlock_write_acquire( &lock );
+    if( rwlock_read_try_acquire( &lock ) ) panic( "rwlock_run_tests: reader got in while a writer held the lock" );
+    if( rwlock_write_try_acquire( &lock ) ) panic( "rwlock_run_tests: 2nd writer got in" );
+    rwlock_write_release( &lock );
+
+    // a waiting writer keeps new readers out
+    lock.state = WRITER_WAITS;
+    if( rwlock_read_try_acquire( &lock ) ) panic( "rwlock_run_tests: reader got past a waiting writer" );
+    if( !rwlock_write_try_acquire( &lock ) ) panic( "rwlock_run_tests: waiting writer couldn't get in" );
+    rwlock_write_release( &lock );
+    if( 0 != lock.state ) panic( "rwlock_run_tests: lock isn't free after release" );
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "spinlock.h"
+
+// reader-writer spinlock: any # of readers, or 1 writer
+// it's writer-preferring: once a writer is waiting, new readers wait too, so a steady stream of readers can't starve writers
+// stats only cover writers, since readers hold the lock concurrently
+typedef struct rwlock {
+    volatile uint32_t state; // reader count in the low bits, plus the writer flags
+    lock_stats_t stats;
+} rwlock_t;
+
+void rwlock_init( rwlock_t *lock, const char *name );
+void rwlock_read_acquire( rwlock_t *lock );
+bool rwlock_read_try_acquire( rwlock_t *lock );
+void rwlock_read_release( rwlock_t *lock );
+void rwlock_write_acquire( rwlock_t *lock );
+bool rwlock_write_try_acquire( rwlock_t *lock );
+void rwlock_write_release( rwlock_t *lock );
+void rwlock_run_tests();
@@ -0,0 +1,185 @@
+#include "spinlock.h"
+#include "../drivers/vga_text.h" // for printing stats
+#include "../interrupt/interrupt_table.h" // for irqsave
+#include "../process/cpu.h" // for timestamps & pausing
+#include "../main.h" // for panic
+
+void lock_stats_init( lock_stats_t *stats, const char *name ) {
+    stats->name = name;
+    stats->acquisitions = stats->contentions = 0;
+    stats->wait_cycles = stats->max_wait_cycles = 0;
+    stats->hold_cycles = stats->max_hold_cycles = 0;
+    stats->acquired_at = 0;
+}
+
+uint64_t lock_stats_begin_wait() {
+    #ifdef LOCK_STATS
+    return cpu_read_timestamp();
+    #else
+    return 0;
+    #endif
+}
+
+void lock_stats_on_acquire( lock_stats_t *stats, uint64_t wait_start, bool contended ) {
+    #ifdef LOCK_STATS
+    uint64_t now = cpu_read_timestamp(), wait = now - wait_start;
+    stats->acquisitions++;
+    stats->contentions+= contended;
+    stats->wait_cycles+= wait;
+    if( wait > stats->max_wait_cycles ) stats->max_wait_cycles = wait;
+    stats->acquired_at = now;
+    #endif
+}
+
+void lock_stats_on_release( lock_stats_t *stats ) {
+    #ifdef LOCK_STATS
+    uint64_t hold = cpu_read_timestamp() - stats->acquired_at;
+    stats->hold_cycles+= hold;
+    if( hold > stats->max_hold_cycles ) stats->max_hold_cycles = hold;
+    #endif
+}
+
+void lock_stats_print( const lock_stats_t *stats ) {
+    vga_text_print( NULL != stats->name ? stats->name : "(unnamed lock)", 0x17 );
+    vga_text_print_stat( ": acquisitions ", stats->acquisitions );
+    vga_text_print_stat( " contended ", stats->contentions );
+    if( 0 != stats->acquisitions ) {
+        vga_text_print_stat( " avg wait ", stats->wait_cycles / stats->acquisitions );
+        vga_text_print_stat( " avg hold ", stats->hold_cycles / stats->acquisitions );
+    }
+    vga_text_print_stat( " max wait ", stats->max_wait_cycles );
+    vga_text_print_stat( " max hold ", stats->max_hold_cycles );
+    vga_text_print( " cycles\n", 0x17 );
+}
+
+void ticket_lock_init( ticket_lock_t *lock, const char *name ) {
+    lock->next_ticket = lock->now_serving = 0;
+    lock_stats_init( &lock->stats, name );
+}
+
+void ticket_lock_acquire( ticket_lock_t *lock ) {
+    uint64_t wait_start = lock_stats_begin_wait();
+    uint32_t ticket = __atomic_fetch_add( &lock->next_ticket, 1, __ATOMIC_RELAXED );
+    bool contended = false;
+    while( __atomic_load_n( &lock->now_serving, __ATOMIC_ACQUIRE ) != ticket ) {
+        contended = true;
+        cpu_pause();
+    }
+    lock_stats_on_acquire( &lock->stats, wait_start, contended );
+}
+
+bool ticket_lock_try_acquire( ticket_lock_t *lock ) {
+    // only take a ticket if it would be served immediately
+    uint32_t ticket = __atomic_load_n( &lock->now_serving, __ATOMIC_RELAXED );
+    if( !__atomic_compare_exchange_n( &lock->next_ticket, &ticket, ticket + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) ) return false;
+    lock_stats_on_acquire( &lock->stats, lock_stats_begin_wait(), false );
+    return true;
+}
+
+void ticket_lock_release( ticket_lock_t *lock ) {
+    lock_stats_on_release( &lock->stats );
+
+    // only the holder writes now_serving, so a plain increment + release store suffices
+    __atomic_store_n( &lock->now_serving, lock->now_serving + 1, __ATOMIC_RELEASE );
+}
+
+bool ticket_lock_acquire_irqsave( ticket_lock_t *lock ) {
+    bool interrupts_were_enabled = interrupt_table_disable_interrupts();
+    ticket_lock_acquire( lock );
+    return interrupts_were_enabled;
+}
+
+void ticket_lock_release_irqrestore( ticket_lock_t *lock, bool interrupts_were_enabled ) {
+    ticket_lock_release( lock );
+    interrupt_table_restore_interrupts( interrupts_were_enabled );
+}
+
+void mcs_lock_init( mcs_lock_t *lock, const char *name ) {
+    lock->tail = NULL;
+    lock_stats_init( &lock->stats, name );
+}
+
+void mcs_lock_acquire( mcs_lock_t *lock, mcs_lock_node_t *node ) {
+    uint64_t wait_start = lock_stats_begin_wait();
+    node->next = NULL;
+    node->locked = true;
+
+    // enqueue ourself, then (if anyone was ahead of us) link in behind them & spin on our own node until they hand off
+    mcs_lock_node_t *prior = __atomic_exchange_n( &lock->tail, node, __ATOMIC_ACQ_REL );
+    if( NULL != prior ) {
+        __atomic_store_n( &prior->next, node, __ATOMIC_RELEASE );
+        while( __atomic_load_n( &node->locked, __ATOMIC_ACQUIRE ) ) cpu_pause();
+    }
+    lock_stats_on_acquire( &lock->stats, wait_start, NULL != prior );
+}
+
+void mcs_lock_release( mcs_lock_t *lock, mcs_lock_node_t *node ) {
+    lock_stats_on_release( &lock->stats );
+
+    // if nobody is queued behind us, then just empty the queue
+    mcs_lock_node_t *next = __atomic_load_n( &node->next, __ATOMIC_ACQUIRE );
+    if( NULL == next ) {
+        mcs_lock_node_t *expected = node;
+        if( __atomic_compare_exchange_n( &lock->tail, &expected, NULL, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED ) ) return;
+
+        // someone swapped themselves into the tail, but hasn't linked into our node yet
+        while( NULL == (next = __atomic_load_n( &node->next, __ATOMIC_ACQUIRE )) ) cpu_pause();
+    }
+
+    // hand off
+    __atomic_store_n( &next->locked, false, __ATOMIC_RELEASE );
+}
+
+bool mcs_lock_acquire_irqsave( mcs_lock_t *lock, mcs_lock_node_t *node ) {
+    bool interrupts_were_enabled = interrupt_table_disable_interrupts();
+    mcs_lock_acquire( lock, node );
+    return interrupts_were_enabled;
+}
+
+void mcs_lock_release_irqrestore( mcs_lock_t *lock, mcs_lock_node_t *node, bool interrupts_were_enabled ) {
+    mcs_lock_release( lock, node );
+    interrupt_table_restore_interrupts( interrupts_were_enabled );
+}
+
+static bool interrupts_enabled() {
+    bool were_enabled = interrupt_table_disable_interrupts();
+    interrupt_table_restore_interrupts( were_enabled );
+    return were_enabled;
+}
+
+// must run after interrupt_table_init, since it checks that irqsave restores the interrupt flag
+void spinlock_run_tests() {
+    // ticket lock: a held lock can't be taken again, and tickets are served in order
+    ticket_lock_t ticket_lock;
+    ticket_lock_init( &ticket_lock, "test ticket lock" );
+    ticket_lock_acquire( &ticket_lock );
+    if( ticket_lock_try_acquire( &ticket_lock ) ) panic( "spinlock_run_tests: acquired a held ticket lock" );
+    ticket_lock_release( &ticket_lock );
+    if( !ticket_lock_try_acquire( &ticket_lock ) ) panic( "spinlock_run_tests: failed to acquire a free ticket lock" );
+    ticket_lock_release( &ticket_lock );
+    if( 2 != ticket_lock.now_serving || 2 != ticket_lock.next_ticket ) panic( "spinlock_run_tests: ticket lock lost a ticket" );
+    #ifdef LOCK_STATS
+    if( 2 != ticket_lock.stats.acquisitions || 0 != ticket_lock.stats.contentions ) panic( "spinlock_run_tests: wrong ticket lock stats" );
+    #endif
+
+    // irqsave disables interrupts while held, and nests correctly
+    if( !interrupts_enabled() ) panic( "spinlock_run_tests: expected interrupts to be enabled" );
+    bool outer = ticket_lock_acquire_irqsave( &ticket_lock );
+    if( interrupts_enabled() ) panic( "spinlock_run_tests: irqsave didn't disable interrupts" );
+    mcs_lock_t mcs_lock;
+    mcs_lock_node_t node;
+    mcs_lock_init( &mcs_lock, "test mcs lock" );
+    bool inner = mcs_lock_acquire_irqsave( &mcs_lock, &node );
+    if( inner ) panic( "spinlock_run_tests: nested irqsave saw interrupts enabled" );
+    if( &node != mcs_lock.tail || !node.locked ) panic( "spinlock_run_tests: mcs lock didn't enqueue its node" );
+    mcs_lock_release_irqrestore( &mcs_lock, &node, inner );
+    if( interrupts_enabled() ) panic( "spinlock_run_tests: nested irqrestore enabled interrupts" );
+    if( NULL != mcs_lock.tail ) panic( "spinlock_run_tests: mcs lock queue isn't empty after release" );
+    ticket_lock_release_irqrestore( &ticket_lock, outer );
+    if( !interrupts_enabled() ) panic( "spinlock_run_tests: irqrestore didn't enable interrupts" );
+
+    // mcs lock can be reacquired after release
+    mcs_lock_acquire( &mcs_lock, &node );
+    mcs_lock_release( &mcs_lock, &node );
+    if( NULL != mcs_lock.tail ) panic( "spinlock_run_tests: mcs lock queue isn't empty after reacquiring" );
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// comment out to remove the timestamp reads from every acquire & release
+#define LOCK_STATS
+
+// contention statistics, in TSC cycles. these are only updated while the lock is held, so they need no atomics
+typedef struct lock_stats {
+    const char *name;
+    uint64_t acquisitions, contentions; // contentions = acquisitions that had to wait
+    uint64_t wait_cycles, max_wait_cycles;
+    uint64_t hold_cycles, max_hold_cycles;
+    uint64_t acquired_at;
+} lock_stats_t;
+
+// ticket lock: FIFO-fair, and a single cache line, but every waiter spins on that same line
+typedef struct ticket_lock {
+    volatile uint32_t next_ticket, now_serving;
+    lock_stats_t stats;
+} ticket_lock_t;
+
+// MCS queue lock: FIFO-fair, and each waiter spins on its own node, so a handoff only touches 1 waiter's cache line
+// the caller provides the node (usually on its stack), and must pass the same node to release
+typedef struct mcs_lock_node {
+    struct mcs_lock_node *volatile next;
+    volatile bool locked;
+} mcs_lock_node_t;
+
+typedef struct mcs_lock {
+    mcs_lock_node_t *volatile tail;
+    lock_stats_t stats;
+} mcs_lock_t;
+
+void lock_stats_init( lock_stats_t *stats, const char *name );
+uint64_t lock_stats_begin_wait();
+void lock_stats_on_acquire( lock_stats_t *stats, uint64_t wait_start, bool contended );
+void lock_stats_on_release( lock_stats_t *stats );
+void lock_stats_print( const lock_stats_t *stats );
+
+void ticket_lock_init( ticket_lock_t *lock, const char *name );
+void ticket_lock_acquire( ticket_lock_t *lock );
+bool ticket_lock_try_acquire( ticket_lock_t *lock );
+void ticket_lock_release( ticket_lock_t *lock );
+
+// irqsave variants, for data that's also touched by interrupt handlers (otherwise a handler could spin forever on its own CPU's lock)
+bool ticket_lock_acquire_irqsave( ticket_lock_t *lock );
+void ticket_lock_release_irqrestore( ticket_lock_t *lock, bool interrupts_were_enabled );
+
+void mcs_lock_init( mcs_lock_t *lock, const char *name );
+void mcs_lock_acquire( mcs_lock_t *lock, mcs_lock_node_t *node );
+void mcs_lock_release( mcs_lock_t *lock, mcs_lock_node_t *node );
+bool mcs_lock_acquire_irqsave( mcs_lock_t *lock, mcs_lock_node_t *node );
+void mcs_lock_release_irqrestore( mcs_lock_t *lock, mcs_lock_node_t *node, bool interrupts_were_enabled );
+
+void spinlock_run_tests();